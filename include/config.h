@@ -61,6 +61,13 @@
 # define BACKEND_SELECT
 #endif
 
+/* Use edge-triggered epoll for client and server connections.
+ * Read and write readiness is then registered only once per connection,
+ * rather than changing the interest list every time data is queued.
+ * This only has effect if the epoll backend is used (see above).
+ */
+#undef EPOLL_EDGE_TRIGGERED
+
 /* Define the ircd module suffix, should be .so on UNIX, and .dll on Windows. */
 #ifndef _WIN32
 # define MODULE_SUFFIX	".so"
@@ -207,15 +214,28 @@
 #endif
 
 /*
- * Maximum delay for socket loop (in miliseconds, so 1000 = 1 second). 
- * This means any other events and such may be delayed up to this value
- * when there is no socket data waiting for us (no clients sending anything).
+ * Maximum delay for socket loop (in miliseconds, so 1000 = 1 second)
+ * when client data is waiting to be processed, eg due to fake lag.
  * Was 2000ms in 3.2.x, 1000ms for versions below 3.4-alpha4.
  * 500ms in UnrealIRCd 4 (?)
  * 250ms in UnrealIRCd 5.
  */
 #define SOCKETLOOP_MAX_DELAY 250
 
+/*
+ * Maximum delay for the socket loop when no client data is waiting to be
+ * processed (eg due to fake lag). Events still run on time, see DoEvents(),
+ * this only limits how long we wait when there are no events due.
+ */
+#define SOCKETLOOP_IDLE_MAX_DELAY 1000
+
+/*
+ * The time at which an event runs is rounded up to this many milliseconds,
+ * so events that are due at (almost) the same time run in the same
+ * iteration of the socket loop, rather than waking up for each of them.
+ */
+#define EVENT_TIMER_SLACK 100
+
 /*
  * Max time from the nickname change that still causes KILL
  * automaticly to switch for the current nick of that user. (seconds)
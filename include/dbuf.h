@@ -49,19 +49,35 @@ typedef struct dbuf {
 	struct list_head dbuf_list;
 } dbuf;
 
+/*
+** A shared segment is an immutable, reference counted piece of data
+** that can be queued to many dbuf's without copying it, eg a line
+** that is broadcasted to all members of a channel. Each dbuf that
+** has it queued holds one reference, and the creator holds one.
+*/
+typedef struct dbufshared {
+	int refcount;		/* Number of references */
+	size_t size;		/* Size of data[] */
+	char data[];
+} dbufshared;
+
 /*
 ** And this 'dbufbuf' should never be referenced outside the
 ** implementation of 'dbuf'--would be "hidden" if C had such
 ** keyword...
-** If it was possible, this would compile to be exactly 1 memory
-** page in size. 2048 bytes seems to be the most common size, so
-** as long as a pointer is 4 bytes, we get 2032 bytes for buffer
-** data after we take away a bit for malloc to play with. -avalon
+** A block is either a private block, in which case the data lives
+** in buf[] (DBUF_BLOCK_SIZE bytes, allocated along with the block),
+** or a reference to a shared segment, in which case buf[] is not
+** allocated at all and data points into shared->data.
+** In both cases 'data' and 'size' describe the bytes that are still
+** queued, so partially consuming a block only advances 'data'.
 */
 typedef struct dbufbuf {
 	struct list_head dbuf_node;
-	size_t size;
-	char data[DBUF_BLOCK_SIZE];
+	size_t size;		/* Number of bytes left in this block */
+	char *data;		/* First byte that is left in this block */
+	dbufshared *shared;	/* Shared segment, or NULL for a private block */
+	char buf[];		/* Storage for private blocks */
 } dbufbuf;
 
 /*
@@ -75,9 +91,24 @@ void dbuf_put(dbuf *, char *, size_t);
 					/* Pointer to data to be stored */
 					/* Number of bytes to store */
 
-void dbuf_delete(dbuf *, size_t);
+int dbuf_delete(dbuf *, size_t);
 					/* Dynamic buffer header */
 					/* Number of bytes to delete */
+					/* Returns the number of blocks that were freed */
+
+/*
+** dbuf_shared_new
+**	Create a shared segment with a copy of the data. The caller
+**	holds the initial reference and must release it with
+**	dbuf_shared_release() when done queueing.
+** dbuf_put_shared
+**	Append the shared segment to the buffer, taking a reference
+**	rather than copying the data (unless it is small enough to
+**	fit in the last block, then copying is cheaper).
+*/
+extern dbufshared *dbuf_shared_new(char *, size_t);
+extern void dbuf_shared_release(dbufshared *);
+extern void dbuf_put_shared(dbuf *, dbufshared *);
 
 /*
 ** DBufLength
@@ -27,9 +27,9 @@ struct DNSReq {
 typedef struct DNSCache DNSCache;
 
 struct DNSCache {
-	DNSCache *prev, *next;		/**< Previous and next in linked list */
+	DNSCache *prev, *next;		/**< Previous and next in linked list (most recently used first) */
 	DNSCache *hprev, *hnext;	/**< Previous and next in hash list */
-	char *name;					/**< The hostname */
+	char *name;					/**< The hostname, or NULL if the IP does not resolve (negative entry) */
 	char *ip;					/**< The IP address */
 	time_t expires;				/**< When record expires */
 };
@@ -38,28 +38,18 @@ typedef struct DNSStats DNSStats;
 
 struct DNSStats {
 	unsigned int cache_hits;
+	unsigned int cache_negative_hits;
 	unsigned int cache_misses;
 	unsigned int cache_adds;
+	unsigned int cache_evictions;
+	unsigned int cache_expired;
 };
 
-/** Time to keep cache records. */
-#define DNSCACHE_TTL			600
-
-/** Size of the hash table (prime!).
- * Consumes <this>*4 on ia32 and <this>*4 on 64 bit
- * 241 seems a good bet.. which ~1k on ia32 and ~2k on ia64.
- */
-#define DNS_HASH_SIZE	241
-
-/** Max # of entries we want in our cache.
- * This:
- * a) prevents us from using too much memory, and
- * b) prevents us from keeping useless cache records
- *
- * A dnscache item is roughly ~80 bytes in size (slightly more on x86),
- * so 241*80=~20k, which seems reasonable ;).
+/** Minimum size of the cache hash table (power of 2).
+ * The table grows with the number of entries, which are limited
+ * by set::dns::cache-size.
  */
-#define DNS_MAX_ENTRIES	DNS_HASH_SIZE
+#define DNS_HASH_MIN_SIZE	256
 
 
 extern ares_channel resolver_channel;
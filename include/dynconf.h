@@ -86,8 +86,12 @@ struct Configuration {
 	unsigned allow_part_if_shunned:1;
 	unsigned disable_cap:1;
 	unsigned check_target_nick_bans:1;
+	unsigned profiling:1;
 	unsigned use_egd : 1;
 	char *dns_bindip;
+	int dns_cache_size;
+	long dns_cache_ttl;
+	long dns_negative_cache_ttl;
 	char *link_bindip;
 	long throttle_period;
 	char throttle_count;
@@ -162,6 +166,7 @@ struct Configuration {
 	long handshake_timeout;
 	long sasl_timeout;
 	long handshake_delay;
+	int tls_handshake_threads;
 	BanTarget automatic_ban_target;
 	BanTarget manual_ban_target;
 	char *reject_message_too_many_connections;
@@ -198,6 +203,9 @@ extern MODVAR int ipv6_disabled;
 #define AUTO_JOIN_CHANS			iConf.auto_join_chans
 #define OPER_AUTO_JOIN_CHANS		iConf.oper_auto_join_chans
 #define DNS_BINDIP			iConf.dns_bindip
+#define DNS_CACHE_SIZE			iConf.dns_cache_size
+#define DNS_CACHE_TTL			iConf.dns_cache_ttl
+#define DNS_NEGATIVE_CACHE_TTL		iConf.dns_negative_cache_ttl
 #define LINK_BINDIP			iConf.link_bindip
 #define IDENT_CHECK			iConf.ident_check
 #define FAILOPER_WARN			iConf.fail_oper_warn
@@ -290,6 +298,9 @@ struct SetCheck {
 	unsigned has_tls_server_cipher_list :1;
 	unsigned has_tls_protocols :1;
 	unsigned has_dns_bind_ip:1;
+	unsigned has_dns_cache_size:1;
+	unsigned has_dns_cache_ttl:1;
+	unsigned has_dns_negative_cache_ttl:1;
 	unsigned has_link_bind_ip:1;
 	unsigned has_throttle_period:1;
 	unsigned has_throttle_connections:1;
@@ -302,6 +313,7 @@ struct SetCheck {
 	unsigned has_auto_join:1;
 	unsigned has_oper_auto_join:1;
 	unsigned has_check_target_nick_bans:1;
+	unsigned has_profiling:1;
 	unsigned has_watch_away_notification:1;
 	unsigned has_uhnames:1;
 	unsigned has_allow_user_stats:1;
@@ -19,6 +19,8 @@ typedef struct fd_entry {
 	unsigned char is_open;
 	FDCloseMethod close_method;
 	unsigned int backend_flags;
+	unsigned char edge_triggered;	/* Callbacks are edge-triggered safe, see fd_edge_triggered() */
+	unsigned char backend_pending;	/* FD_SELECT_* events to deliver without waiting (edge-triggered only) */
 } FDEntry;
 
 extern MODVAR FDEntry fd_table[MAXCONNECTIONS + 1];
@@ -35,6 +37,7 @@ extern int fd_fileopen(const char *path, unsigned int flags);
 #define FD_SELECT_WRITE		0x2
 
 extern void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data);
+extern void fd_edge_triggered(int fd);
 extern void fd_select(time_t delay);		/* backend-specific */
 extern void fd_refresh(int fd);			/* backend-specific */
 extern void fd_fork(); /* backend-specific */
@@ -38,6 +38,7 @@ extern MODVAR Member *freemember;
 extern MODVAR Membership *freemembership;
 extern MODVAR Client me;
 extern MODVAR Channel *channels;
+extern MODVAR Channel *channel_directory[CHANNEL_DIRECTORY_BUCKETS];
 extern MODVAR ModData local_variable_moddata[MODDATA_MAX_LOCAL_VARIABLE];
 extern MODVAR ModData global_variable_moddata[MODDATA_MAX_GLOBAL_VARIABLE];
 extern MODVAR IRCStatistics ircstats;
@@ -182,6 +183,10 @@ extern int extban_is_ok_nuh_extban(Client *, Channel *, char *, int, int, int);
 extern char *extban_conv_param_nuh_or_extban(char *);
 extern char *extban_conv_param_nuh(char *);
 extern Ban *is_banned(Client *, Channel *, int, char **, char **);
+extern int is_banned_msg(Client *client, Channel *channel, Membership *mb, char **msg, char **errmsg);
+extern void channel_bans_changed(Channel *channel);
+extern void all_channel_bans_changed(void);
+extern void user_identity_changed(Client *client);
 extern Ban *is_banned_with_nick(Client *, Channel *, int, char *, char **, char **);
 
 extern void ircd_log(int, FORMAT_STRING(const char *), ...) __attribute__((format(printf,2,3)));
@@ -238,6 +243,12 @@ extern void *safe_alloc(size_t size);
 extern void set_socket_buffers(int fd, int rcvbuf, int sndbuf);
 extern int send_queued(Client *);
 extern void send_queued_cb(int fd, int revents, void *data);
+extern void zip_start_out(Client *client);
+extern int zip_start_in(Client *client);
+extern int zip_process_packet(Client *client, char *readbuf, int length);
+extern int zip_send_queued(Client *to);
+extern int zip_link_stats(Client *client, ZipLinkStats *stats);
+extern void zip_free(Client *client);
 extern void sendto_connectnotice(Client *client, int disconnect, char *comment);
 extern void sendto_serv_butone_nickcmd(Client *one, Client *client, char *umodes);
 extern void    sendto_message_one(Client *to, Client *from, char *sender,
@@ -275,6 +286,7 @@ extern void sendto_ops_and_log(FORMAT_STRING(const char *pattern), ...) __attrib
 
 extern MODVAR int writecalls, writeb[];
 extern int deliver_it(Client *cptr, char *str, int len, int *want_read);
+extern int deliver_it_iov(Client *cptr, struct iovec *iov, int iovcnt, int *want_read);
 extern int target_limit_exceeded(Client *client, void *target, const char *name);
 extern char *canonize(char *buffer);
 extern int check_registered(Client *);
@@ -336,6 +348,8 @@ extern void del_queries(char *);
 #define WATCH_HASH_TABLE_SIZE 32768
 #define WHOWAS_HASH_TABLE_SIZE 32768
 #define THROTTLING_HASH_TABLE_SIZE 8192
+#define IPUSERS_HASH_TABLE_SIZE 32768
+#define MEMBERSHIP_HASH_TABLE_MIN_SIZE 4096
 #define hash_find_channel find_channel
 extern uint64_t siphash(const char *in, const char *k);
 extern uint64_t siphash_raw(const char *in, size_t len, const char *k);
@@ -354,6 +368,15 @@ extern int del_from_watch_hash_table(char *, Client *);
 extern int hash_check_watch(Client *, int);
 extern int hash_del_watch_list(Client *);
 extern void count_watch_memory(int *, u_long *);
+extern void add_to_membership_hash_table(Membership *mb);
+extern void del_from_membership_hash_table(Membership *mb);
+extern Membership *hash_find_membership(Client *client, Channel *channel);
+extern void count_membership_memory(int *count, int *buckets, u_long *memory);
+extern uint64_t hash_ban_index_key(const char *key);
+extern IpUsersBucket *find_ip_users(const char *ip);
+extern void add_ip_users(Client *client);
+extern void del_ip_users(Client *client);
+extern void count_ip_users_memory(int *addresses, int *prefixes, u_long *memory);
 extern Watch *hash_get_watch(char *);
 extern Channel *hash_get_chan_bucket(uint64_t);
 extern Client *hash_find_client(const char *, Client *);
@@ -654,6 +677,10 @@ extern void add_user_to_channel(Channel *channel, Client *who, int flags);
 extern int add_banid(Client *, Channel *, char *);
 extern int add_exbanid(Client *cptr, Channel *channel, char *banid);
 extern int sub1_from_channel(Channel *);
+extern int channel_directory_bucket(int users);
+extern void channel_directory_add_cursor(ChannelDirectoryCursor *cursor, int minbucket, int maxbucket);
+extern void channel_directory_del_cursor(ChannelDirectoryCursor *cursor);
+extern Channel *channel_directory_next(ChannelDirectoryCursor *cursor);
 extern MODVAR CoreChannelModeTable corechannelmodetable[];
 extern char *unreal_encodespace(char *s);
 extern char *unreal_decodespace(char *s);
@@ -781,6 +808,9 @@ extern int ssl_handshake(Client *);   /* Handshake the accpeted con.*/
 extern int ssl_client_handshake(Client *, ConfigItem_link *); /* and the initiated con.*/
 extern int ircd_SSL_accept(Client *acptr, int fd);
 extern int ircd_SSL_connect(Client *acptr, int fd);
+extern int tls_handshake_in_progress(Client *client);
+extern void tls_handshake_orphan(Client *client);
+extern void tls_handshake_pool_drain(void);
 extern int SSL_smart_shutdown(SSL *ssl);
 extern void ircd_SSL_client_handshake(int, int, void *);
 extern void SSL_set_nonblocking(SSL *s);
@@ -813,6 +843,10 @@ extern int del_listmode(Ban **list, Channel *channel, char *banid);
 extern int Halfop_mode(long mode);
 extern char *clean_ban_mask(char *, int, Client *);
 extern int find_invex(Channel *channel, Client *client);
+extern void count_ban_index_memory(int *indexes, int *entries, u_long *memory);
+extern int ban_index_classify(const char *banstr, char *key, size_t keylen);
+extern void ban_index_cidr_key(char *buf, size_t buflen, int family, unsigned char *addr, int bits);
+extern void ban_index_lowercase(char *buf, size_t buflen, const char *str);
 extern void DoMD5(char *mdout, const char *src, unsigned long n);
 extern char *md5hash(char *dst, const char *src, unsigned long n);
 extern char *sha256hash(char *dst, const char *src, unsigned long n);
@@ -936,6 +970,7 @@ extern void clicap_post_rehash(void);
 extern void unload_all_unused_mtag_handlers(void);
 extern void send_cap_notify(int add, char *token);
 extern void sendbufto_one(Client *to, char *msg, unsigned int quick);
+extern void packet_set_shared(dbufshared *s);
 extern MODVAR int current_serial;
 extern char *spki_fingerprint(Client *acptr);
 extern char *spki_fingerprint_ex(X509 *x509_cert);
@@ -977,6 +1012,7 @@ extern time_t server_time_to_unix_time(const char *tbuf);
 extern int history_set_limit(char *object, int max_lines, long max_t);
 extern int history_add(char *object, MessageTag *mtags, char *line);
 extern HistoryResult *history_request(char *object, HistoryFilter *filter);
+extern int history_request_targets(HistoryTarget *targets, int count, HistoryFilter *filter);
 extern int history_destroy(char *object);
 extern int can_receive_history(Client *client);
 extern void history_send_result(Client *client, HistoryResult *r);
@@ -1009,6 +1045,7 @@ extern int is_extended_ban(const char *str);
 extern int valid_sid(char *name);
 extern int valid_uid(char *name);
 extern void parse_client_queued(Client *client);
+extern MODVAR int client_input_queued;
 extern char *sha256sum_file(const char *fname);
 extern char *filename_strip_suffix(const char *fname, const char *suffix);
 extern char *filename_add_suffix(const char *fname, const char *suffix);
@@ -56,6 +56,7 @@
 typedef struct Event Event;
 typedef struct EventInfo EventInfo;
 typedef struct Hook Hook;
+typedef struct ProfileStats ProfileStats;
 typedef struct Hooktype Hooktype;
 typedef struct Callback Callback;
 typedef struct Efunction Efunction;
@@ -361,7 +362,8 @@ typedef enum ExtbanOptions {
         EXTBOPT_ACTMODIFIER=0x2,	/**< Action modifier (not a matcher). These are extended bans like ~q/~n/~j. */
         EXTBOPT_NOSTACKCHILD=0x4,	/**< Disallow prefixing with another extban. Eg disallow ~n:~T:censor:xyz */
         EXTBOPT_INVEX=0x8,		/**< Available for use with +I too */
-        EXTBOPT_TKL=0x10		/**< Available for use in TKL's too (eg: /GLINE ~a:account) */
+        EXTBOPT_TKL=0x10,		/**< Available for use in TKL's too (eg: /GLINE ~a:account) */
+        EXTBOPT_CACHEABLE=0x20		/**< Result only depends on the ban and the nick, user@host, IP, account or certfp of the user (see is_banned_msg()) */
 } ExtbanOptions;
 
 typedef struct {
@@ -518,7 +520,7 @@ struct HistoryLogLine {
 	HistoryLogLine *prev, *next;
 	time_t t;
 	MessageTag *mtags;
-	char line[1];
+	char *line;
 };
 
 typedef struct HistoryResult HistoryResult;
@@ -526,6 +528,14 @@ struct HistoryResult {
         char *object;					/**< Name of the history object, eg '#test' */
         HistoryLogLine *log;				/**< The resulting log lines */
         HistoryLogLine *log_tail;			/**< Last entry in the log lines */
+        int borrowed;					/**< Line and mtags of the log lines are the backend's, only valid until the history changes */
+};
+
+/** A history object for history_request_targets(), eg for CHATHISTORY TARGETS */
+typedef struct HistoryTarget HistoryTarget;
+struct HistoryTarget {
+	char *object;					/**< Name of the history object, eg '#test' (set by the caller) */
+	char datetime[64];				/**< Time of the latest line in the time window, or empty if none */
 };
 
 /** History Backend */
@@ -536,6 +546,7 @@ struct HistoryBackend {
 	int (*history_set_limit)(char *object, int max_lines, long max_time); /**< Impose a limit on a history object */
 	int (*history_add)(char *object, MessageTag *mtags, char *line); /**< Add to history */
 	HistoryResult *(*history_request)(char *object, HistoryFilter *filter);  /**< Request history */
+	int (*history_targets)(HistoryTarget *targets, int count, HistoryFilter *filter); /**< Latest activity of multiple objects (optional) */
 	int (*history_destroy)(char *object);  /**< Destroy history of this object completely */
 	Module *owner;                                /**< Module introducing this */
 	char unloaded;                                /**< Internal flag to indicate module is being unloaded */
@@ -549,6 +560,7 @@ typedef struct {
 	int (*history_set_limit)(char *object, int max_lines, long max_time);
 	int (*history_add)(char *object, MessageTag *mtags, char *line);
 	HistoryResult *(*history_request)(char *object, HistoryFilter *filter);
+	int (*history_targets)(HistoryTarget *targets, int count, HistoryFilter *filter);
 	int (*history_destroy)(char *object);
 } HistoryBackendInfo;
 
@@ -562,6 +574,24 @@ struct Hook {
 		char *(*pcharfunc)();
 	} func;
 	Module *owner;
+	ProfileStats *profile; /**< Set on first use, if set::profiling is on */
+};
+
+#define PROFILE_HOOK		1
+#define PROFILE_COMMAND		2
+/** Number of histogram buckets, 4 per power of 2 nanoseconds (up to ~30 minutes) */
+#define PROFILE_BUCKETS		160
+
+/** Time spent in a hook function of a module or in a command, see set::profiling */
+struct ProfileStats {
+	ProfileStats *prev, *next;
+	int type;			/**< PROFILE_HOOK or PROFILE_COMMAND */
+	int hooktype;			/**< Hook type (PROFILE_HOOK only) */
+	char *name;			/**< Module name (PROFILE_HOOK) or command name */
+	unsigned long calls;		/**< Number of calls */
+	unsigned long long total_nsec;	/**< Total time spent, in nanoseconds */
+	unsigned long long max_nsec;	/**< Slowest call */
+	unsigned int histogram[PROFILE_BUCKETS]; /**< Number of calls per duration, for percentiles */
 };
 
 struct Callback {
@@ -693,10 +723,18 @@ struct Event {
 	vFP		event;		/**< Actual function to call */
 	void		*data;		/**< The data to pass in the function call */
 	struct timeval	last_run;	/**< Last time this event ran */
+	struct timeval	next_run;	/**< Next time this event should run */
+	int		heap_index;	/**< Position in the event heap (or EVENT_NOT_SCHEDULED / EVENT_PENDING) */
 	char		deleted;	/**< Set to 1 if this event is marked for deletion */
 	Module		*owner;		/**< To which module this event belongs */
+	unsigned long	calls;		/**< Number of times this event ran */
+	unsigned long long total_usec;	/**< Total time spent in this event, in microseconds */
+	unsigned long	max_usec;	/**< Longest time spent in a single call, in microseconds */
 };
 
+#define EVENT_NOT_SCHEDULED	-1
+#define EVENT_PENDING		-2
+
 #define EMOD_EVERY 0x0001
 #define EMOD_HOWMANY 0x0002
 #define EMOD_NAME 0x0004
@@ -725,9 +763,21 @@ extern Event *EventMarkDel(Event *event);
 extern Event *EventFind(char *name);
 extern int EventMod(Event *event, EventInfo *mods);
 extern void DoEvents(void);
+extern long NextEventDelay(long maximum);
 extern void EventStatus(Client *client);
+extern void EventFixTimers(void);
 extern void SetupEvents(void);
 
+extern MODVAR ProfileStats *profile_stats;
+extern long long profile_clock(void);
+extern ProfileStats *profile_find(int type, int hooktype, const char *name);
+extern ProfileStats *hook_profile(Hook *h);
+extern void profile_add(ProfileStats *p, long long start);
+extern unsigned long long profile_percentile(ProfileStats *p, int permille);
+extern void profile_reset(void);
+extern ProfileStats **profile_sorted(int *count);
+extern int profile_dump(const char *filename);
+
 
 extern void    Module_Init(void);
 extern char    *Module_Create(char *path);
@@ -802,15 +852,25 @@ extern Hook	*HookDel(Hook *hook);
 extern Hooktype *HooktypeAdd(Module *module, char *string, int *type);
 extern void HooktypeDel(Hooktype *hooktype, Module *module);
 
-#define RunHook0(hooktype) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next)(*(h->func.intfunc))(); } while(0)
-#define RunHook(hooktype,x) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next) (*(h->func.intfunc))(x); } while(0)
+/** Call a hook function, measuring the time it takes if set::profiling is on */
+#define HookCall(h, call) \
+do { \
+ ProfileStats *hook_prof = iConf.profiling ? hook_profile(h) : NULL; \
+ long long hook_start = hook_prof ? profile_clock() : 0; \
+ call; \
+ if (hook_prof) \
+  profile_add(hook_prof, hook_start); \
+} while(0)
+
+#define RunHook0(hooktype) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next) HookCall(h, (*(h->func.intfunc))()); } while(0)
+#define RunHook(hooktype,x) do { Hook *h; for (h = Hooks[hooktype]; h; h = h->next) HookCall(h, (*(h->func.intfunc))(x)); } while(0)
 #define RunHookReturn(hooktype,x,retchk) \
 { \
  int retval; \
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  HookCall(h, retval = (*(h->func.intfunc))(x)); \
   if (retval retchk) return; \
  } \
 }
@@ -820,7 +880,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  HookCall(h, retval = (*(h->func.intfunc))(x,y)); \
   if (retval retchk) return; \
  } \
 }
@@ -830,7 +890,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  HookCall(h, retval = (*(h->func.intfunc))(x,y,z)); \
   if (retval retchk) return; \
  } \
 }
@@ -840,7 +900,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  HookCall(h, retval = (*(h->func.intfunc))(a,b,c,d)); \
   if (retval retchk) return; \
  } \
 }
@@ -850,7 +910,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x); \
+  HookCall(h, retval = (*(h->func.intfunc))(x)); \
   if (retval retchk) return retval; \
  } \
 }
@@ -860,7 +920,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x,y); \
+  HookCall(h, retval = (*(h->func.intfunc))(x,y)); \
   if (retval retchk) return retval; \
  } \
 }
@@ -870,7 +930,7 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(x,y,z); \
+  HookCall(h, retval = (*(h->func.intfunc))(x,y,z)); \
   if (retval retchk) return retval; \
  } \
 }
@@ -880,19 +940,19 @@ extern void HooktypeDel(Hooktype *hooktype, Module *module);
  Hook *h; \
  for (h = Hooks[hooktype]; h; h = h->next) \
  { \
-  retval = (*(h->func.intfunc))(a,b,c,d); \
+  HookCall(h, retval = (*(h->func.intfunc))(a,b,c,d)); \
   if (retval retchk) return retval; \
  } \
 }
 
-#define RunHookReturnVoid(hooktype,x,ret) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) if((*(hook->func.intfunc))(x) ret) return; } while(0)
-#define RunHook2(hooktype,x,y) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(x,y); } while(0)
-#define RunHook3(hooktype,a,b,c) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c); } while(0)
-#define RunHook4(hooktype,a,b,c,d) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d); } while(0)
-#define RunHook5(hooktype,a,b,c,d,e) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e); } while(0)
-#define RunHook6(hooktype,a,b,c,d,e,f) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f); } while(0)
-#define RunHook7(hooktype,a,b,c,d,e,f,g) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g); } while(0)
-#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) (*(hook->func.intfunc))(a,b,c,d,e,f,g,h); } while(0)
+#define RunHookReturnVoid(hooktype,x,ret) do { Hook *hook; int retval; for (hook = Hooks[hooktype]; hook; hook = hook->next) { HookCall(hook, retval = (*(hook->func.intfunc))(x)); if (retval ret) return; } } while(0)
+#define RunHook2(hooktype,x,y) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(x,y)); } while(0)
+#define RunHook3(hooktype,a,b,c) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c)); } while(0)
+#define RunHook4(hooktype,a,b,c,d) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c,d)); } while(0)
+#define RunHook5(hooktype,a,b,c,d,e) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c,d,e)); } while(0)
+#define RunHook6(hooktype,a,b,c,d,e,f) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c,d,e,f)); } while(0)
+#define RunHook7(hooktype,a,b,c,d,e,f,g) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c,d,e,f,g)); } while(0)
+#define RunHook8(hooktype,a,b,c,d,e,f,g,h) do { Hook *hook; for (hook = Hooks[hooktype]; hook; hook = hook->next) HookCall(hook, (*(hook->func.intfunc))(a,b,c,d,e,f,g,h)); } while(0)
 
 #define CallbackAdd(cbtype, func) CallbackAddMain(NULL, cbtype, func, NULL, NULL)
 #define CallbackAddEx(module, cbtype, func) CallbackAddMain(module, cbtype, func, NULL, NULL)
@@ -1163,6 +1223,8 @@ extern void SavePersistentLongX(ModuleInfo *modinfo, char *varshortname, long va
 #define HOOKTYPE_CLOSE_CONNECTION	103
 /** See hooktype_connect_extinfo() */
 #define HOOKTYPE_CONNECT_EXTINFO	104
+/** See hooktype_userhost_change() */
+#define HOOKTYPE_USERHOST_CHANGE	105
 /* Adding a new hook here?
  * 1) Add the #define HOOKTYPE_.... with a new number
  * 2) Add a hook prototype (see below)
@@ -2104,6 +2166,17 @@ int hooktype_close_connection(Client *client);
  */
 int hooktype_connect_extinfo(Client *client, NameValuePrioList **list);
 
+/** Called when the username or hostname of a user may have changed (function prototype for HOOKTYPE_USERHOST_CHANGE).
+ * This is called from userhost_changed(), for both local and remote users.
+ * Note that it is also called if the visible user@host did not change,
+ * eg when the vhost of a user who is -x was changed.
+ * @param client		The client
+ * @param olduser		The old username
+ * @param oldhost		The old hostname, the new one is GetHost(client)
+ * @return The return value is ignored (use return 0)
+ */
+int hooktype_userhost_change(Client *client, const char *olduser, const char *oldhost);
+
 /** @} */
 
 #ifdef GCC_TYPECHECKING
@@ -2213,7 +2286,8 @@ _UNREAL_ERROR(_hook_error_incompatible, "Incompatible hook function. Check argum
         ((hooktype == HOOKTYPE_CONFIGRUN_EX) && !ValidateHook(hooktype_configrun_ex, func)) || \
         ((hooktype == HOOKTYPE_ACCOUNT_LOGIN) && !ValidateHook(hooktype_account_login, func)) || \
         ((hooktype == HOOKTYPE_CLOSE_CONNECTION) && !ValidateHook(hooktype_close_connection, func)) || \
-        ((hooktype == HOOKTYPE_CONNECT_EXTINFO) && !ValidateHook(hooktype_connect_extinfo, func)) ) \
+        ((hooktype == HOOKTYPE_CONNECT_EXTINFO) && !ValidateHook(hooktype_connect_extinfo, func)) || \
+        ((hooktype == HOOKTYPE_USERHOST_CHANGE) && !ValidateHook(hooktype_userhost_change, func)) ) \
         _hook_error_incompatible();
 #endif /* GCC_TYPECHECKING */
 
@@ -120,11 +120,17 @@ typedef struct ListStructPrio ListStructPrio;
 typedef struct Watch Watch;
 typedef struct Client Client;
 typedef struct LocalClient LocalClient;
+typedef struct TLSHandshakeJob TLSHandshakeJob;
+typedef struct ZipStream ZipStream;
+typedef struct ZipLinkStats ZipLinkStats;
 typedef struct Channel Channel;
 typedef struct User User;
 typedef struct Server Server;
 typedef struct Link Link;
 typedef struct Ban Ban;
+typedef struct BanIndex BanIndex;
+typedef struct BanIndexEntry BanIndexEntry;
+typedef struct ChannelDirectoryCursor ChannelDirectoryCursor;
 typedef struct Mode Mode;
 typedef struct MessageTag MessageTag;
 typedef struct MOTDFile MOTDFile; /* represents a whole MOTD, including remote MOTD support info */
@@ -134,6 +140,7 @@ typedef struct MOTDDownload MOTDDownload; /* used to coordinate download of a re
 #endif
 
 typedef struct RealCommand RealCommand;
+typedef struct IpUsersBucket IpUsersBucket;
 typedef struct CommandOverride CommandOverride;
 typedef struct Member Member;
 typedef struct Membership Membership;
@@ -187,6 +194,7 @@ typedef OperPermission (*OperClassEntryEvalCallback)(OperClassACLEntryVar* varia
 #define SWHOISLEN	256
 #define UMODETABLESZ (sizeof(long) * 8)
 #define MAXCCUSERS		20 /* Maximum for set::anti-flood::max-concurrent-conversations */
+#define TLS_HANDSHAKE_MAX_THREADS	32 /* Maximum for set::tls-handshake-threads */
 #define BATCHLEN	22
 
 /*
@@ -353,6 +361,7 @@ typedef enum ClientStatus {
 #define PROTO_EXTSWHOIS 0x004000	/* extended SWHOIS support */
 #define PROTO_SJSBY	0x008000	/* SJOIN setby information (TS and nick) */
 #define PROTO_MTAGS	0x010000	/* Support message tags and big buffers */
+#define PROTO_ZIP	0x020000	/* Can receive a compressed link (PROTOCTL ZIPSTART) */
 
 /* For client capabilities: */
 #define CAP_INVERT	1L
@@ -526,12 +535,14 @@ typedef enum ClientStatus {
 #define SupportVHP(x)		(CHECKSERVERPROTO(x, PROTO_VHP))
 #define SupportCLK(x)		(CHECKSERVERPROTO(x, PROTO_CLK))
 #define SupportMTAGS(x)		(CHECKSERVERPROTO(x, PROTO_MTAGS))
+#define SupportZIP(x)		(CHECKSERVERPROTO(x, PROTO_ZIP))
 
 #define SetVL(x)		((x)->local->proto |= PROTO_VL)
 #define SetSJSBY(x)		((x)->local->proto |= PROTO_SJSBY)
 #define SetVHP(x)		((x)->local->proto |= PROTO_VHP)
 #define SetCLK(x)		((x)->local->proto |= PROTO_CLK)
 #define SetMTAGS(x)		((x)->local->proto |= PROTO_MTAGS)
+#define SetZIP(x)		((x)->local->proto |= PROTO_ZIP)
 
 /*
  * defined debugging levels
@@ -1141,6 +1152,7 @@ struct NameValuePrioList {
 struct RealCommand {
 	RealCommand		*prev, *next;
 	char 			*cmd;
+	unsigned int		hashv; /* Case insensitive hash of cmd, used by find_command() */
 	CmdFunc			func;
 	AliasCmdFunc		aliasfunc;
 	int			flags;
@@ -1150,6 +1162,7 @@ struct RealCommand {
 	Module 			*owner;
 	RealCommand		*friend; /* cmd if token, token if cmd */
 	CommandOverride		*overriders;
+	ProfileStats		*profile; /**< Set on first use, if set::profiling is on */
 #ifdef DEBUGMODE
 	unsigned long 		lticks;
 	unsigned long 		rticks;
@@ -1198,7 +1211,7 @@ extern void unload_all_unused_moddata(void);
 #define IsServersOnlyListener(x)	((x) && ((x)->options & LISTENER_SERVERSONLY))
 
 #define CONNECT_TLS		0x000001
-//0x000002 unused (was ziplinks)
+#define CONNECT_COMPRESSED	0x000002
 #define CONNECT_AUTO		0x000004
 #define CONNECT_QUARANTINE	0x000008
 #define CONNECT_NODNSCACHE	0x000010
@@ -1259,6 +1272,7 @@ struct Client {
 	struct list_head id_hash;		/**< For UID/SID hash table (idTable) */
 	Client *srvptr;				/**< Server on where this client is connected to (can be &me) */
 	char *ip;				/**< IP address of user or server (never NULL) */
+	IpUsersBucket *ipusers;			/**< Entry in the per-IP user counts, set once registered as a user */
 	ModData moddata[MODDATA_MAX_CLIENT];	/**< Client attached module data, used by the ModData system */
 };
 
@@ -1267,12 +1281,15 @@ struct Client {
 struct LocalClient {
 	int fd;				/**< File descriptor, can be <0 if socket has been closed already. */
 	SSL *ssl;			/**< OpenSSL/LibreSSL struct for SSL/TLS connection */
+	TLSHandshakeJob *tls_job;	/**< TLS handshake step currently running in a worker thread, see set::tls-handshake-threads */
 	time_t since;			/**< Time when user will next be allowed to send something (actually since<currenttime+10) */
 	int since_msec;			/**< Used for calculating 'since' penalty (modulo) */
 	time_t firsttime;		/**< Time user was created (connected on IRC) */
 	time_t lasttime;		/**< Last time any message was received */
 	dbuf sendQ;			/**< Outgoing send queue (data to be sent) */
 	dbuf recvQ;			/**< Incoming receive queue (incoming data yet to be parsed) */
+	ZipStream *zipout;		/**< Server: compression of what we send, see link::options::compressed */
+	ZipStream *zipin;		/**< Server: decompression of what we receive */
 	ConfigItem_class *class;	/**< The class { } block associated to this client */
 	int proto;			/**< PROTOCTL options */
 	long caps;			/**< User: enabled capabilities (via CAP command) */
@@ -1286,6 +1303,8 @@ struct LocalClient {
 	long sendK;			/**< Statistics: total k-bytes send */
 	long receiveM;			/**< Statistics: protocol messages received */
 	long receiveK;			/**< Statistics: total k-bytes received */
+	long sendcalls;			/**< Statistics: write calls to the socket (syscalls, or SSL_write calls) */
+	long sendblocks;		/**< Statistics: sendQ blocks written, sendblocks-sendcalls is the number of calls saved */
 	u_short sendB;			/**< Statistics: counters to count upto 1-k lots of bytes */
 	u_short receiveB;		/**< Statistics: sent and received (???) */
 	short lastsq;			/**< # of 2k blocks when sendqueued called last */
@@ -1321,6 +1340,7 @@ struct User {
 	char *away;			/**< AWAY message, or NULL if not away */
 	char svid[SVIDLEN + 1];		/**< Services account name or ID (SVID) */
 	unsigned short joined;		/**< Number of channels joined */
+	unsigned int identity_serial;	/**< Changed when the nick, user@host or account changes, see is_banned_msg() */
 	char username[USERLEN + 1];	/**< Username, the user portion in nick!user@host. */
 	char realhost[HOSTLEN + 1];	/**< Realhost, the real host of the user (IP or hostname) - usually this is not shown to other users */
 	char cloakedhost[HOSTLEN + 1];	/**< Cloaked host - generated by cloaking algorithm */
@@ -1910,6 +1930,13 @@ struct IRCStatistics {
 	unsigned int is_abad;	/* bad auth requests */
 	unsigned int is_udp;	/* packets recv'd on udp port */
 	unsigned int is_loc;	/* local connections made */
+	unsigned long is_bclines;	/* channel broadcast lines rendered */
+	unsigned long is_bcclass;	/* channel broadcast recipients matched by tag class */
+	unsigned long is_bcsent;	/* channel broadcast lines queued */
+	unsigned long is_evctl;	/* I/O engine interest list changes (eg: epoll_ctl calls) */
+	unsigned long is_tlspool;	/* TLS handshake steps run by a worker thread */
+	unsigned long is_bvhit;	/* channel message ban checks answered from the membership cache */
+	unsigned long is_bvmiss;	/* channel message ban checks that had to match the ban list */
 };
 
 typedef struct MemoryInfo {
@@ -1974,6 +2001,10 @@ struct Channel {
 	struct Channel *nextch;			/**< Next channel in linked list (channel) */
 	struct Channel *prevch;			/**< Previous channel in linked list (channel) */
 	struct Channel *hnextch;		/**< Next channel in hash table */
+	struct Channel *dirnextch;		/**< Next channel in the same channel_directory[] bucket */
+	struct Channel *dirprevch;		/**< Previous channel in the same channel_directory[] bucket */
+	int dirbucket;				/**< The channel_directory[] bucket, see channel_directory_bucket() */
+	unsigned long dirserial;		/**< When the channel was put in this bucket, see channel_directory_next() */
 	Mode mode;				/**< Channel Mode set on this channel */
 	time_t creationtime;			/**< When the channel was first created */
 	char *topic;				/**< Channel TOPIC */
@@ -1985,6 +2016,12 @@ struct Channel {
 	Ban *banlist;				/**< List of bans (+b) */
 	Ban *exlist;				/**< List of ban exceptions (+e) */
 	Ban *invexlist;				/**< List of invite exceptions (+I) */
+	BanIndex *banindex;			/**< Index on banlist, only for long lists (see channel.c) */
+	BanIndex *exindex;			/**< Index on exlist, only for long lists */
+	BanIndex *invexindex;			/**< Index on invexlist, only for long lists */
+	unsigned int ban_serial;		/**< Changed whenever the +b/+e/+I lists change, never 0 */
+	unsigned int ban_cacheable_serial;	/**< The ban_serial for which 'ban_cacheable' was determined */
+	int ban_cacheable;			/**< Whether ban verdicts may be cached, see is_banned_msg() */
 	char *mode_lock;			/**< Mode lock (MLOCK) applied to channel - usually by Services */
 	ModData moddata[MODDATA_MAX_CHANNEL];	/**< Channel attached module data, used by the ModData system */
 	char chname[1];				/**< Channel name */
@@ -1998,7 +2035,9 @@ struct Channel {
 struct Member
 {
 	struct Member *next;				/**< Next entry in list */
+	struct Member *prev;				/**< Previous entry in list */
 	Client	      *client;				/**< The client */
+	Channel	      *channel;				/**< The channel (whose channel->members list this is in) */
 	int		flags;				/**< The access of the user on this channel (one or more of CHFL_*) */
 	ModData moddata[MODDATA_MAX_MEMBER];		/** Member attached module data, used by the ModData system */
 };
@@ -2011,8 +2050,15 @@ struct Member
 struct Membership
 {
 	struct Membership 	*next;			/**< Next entry in list */
+	struct Membership	*prev;			/**< Previous entry in list */
 	struct Channel		*channel;			/**< The channel */
+	Client			*client;		/**< The client (whose client->user->channel list this is in) */
+	Member			*member;		/**< The corresponding entry in channel->members */
+	struct Membership	*hnext;			/**< Next entry in the membership hash table bucket */
 	int			flags;			/**< The access of the user on this channel (one or more of CHFL_*) */
+	unsigned int		bancache_serial;	/**< channel->ban_serial of the cached ban verdict (0 = nothing cached) */
+	unsigned int		bancache_identity;	/**< client->user->identity_serial of the cached ban verdict */
+	int			bancache_banned;	/**< Cached verdict of is_banned_msg() */
 	ModData moddata[MODDATA_MAX_MEMBERSHIP];	/**< Membership attached module data, used by the ModData system */
 };
 
@@ -2026,6 +2072,69 @@ struct Ban {
 	time_t when;		/**< When the entry was added */
 };
 
+/* BanIndexEntry types */
+#define BANINDEX_LINEAR		0	/**< Extban or complex mask, checked one by one */
+#define BANINDEX_HOST		1	/**< Literal host or IPv4 address, eg: *!*@host.example.org */
+#define BANINDEX_SUFFIX		2	/**< Host suffix, eg: *!*@*.example.org */
+#define BANINDEX_PREFIX		3	/**< Host prefix, eg: *!*@192.168.* */
+#define BANINDEX_CIDR		4	/**< IPv4/IPv6 CIDR mask, eg: *!*@192.168.0.0/16 */
+#define BANINDEX_NICK		5	/**< Literal nick with any other host, eg: nick!*@* */
+
+/** Entry in a BanIndex, there is one for each Ban in the list */
+struct BanIndexEntry {
+	BanIndexEntry *hnext;	/**< Next entry in the same hash bucket */
+	BanIndexEntry *lnext;	/**< Next entry in the linear list (only for BANINDEX_LINEAR) */
+	Ban *ban;		/**< The ban this entry is for */
+	unsigned int serial;	/**< Position in the list: higher means closer to the head */
+	char type;		/**< One of BANINDEX_* */
+	char *key;		/**< Lowercased lookup key (NULL for BANINDEX_LINEAR) */
+};
+
+/** Index on a channel ban list (+b/+e/+I), to avoid calling
+ * match_user() on every single entry for every JOIN, message, etc.
+ */
+struct BanIndex {
+	Ban *head;			/**< List head at the time the index was last updated */
+	unsigned int serial;		/**< Highest serial handed out */
+	unsigned int count;		/**< Number of entries in the index */
+	unsigned int types[BANINDEX_NICK+1];	/**< Number of entries per BANINDEX_* type */
+	unsigned int size;		/**< Number of hash buckets, always a power of 2 */
+	BanIndexEntry **table;		/**< Hash buckets */
+	BanIndexEntry *linear;		/**< Entries that must be checked one by one, ordered like the list */
+	unsigned short cidr4[33];	/**< Number of IPv4 CIDR entries per prefix length */
+	unsigned short cidr6[129];	/**< Number of IPv6 CIDR entries per prefix length */
+};
+
+/** Number of buckets in the channel directory (channel_directory[]).
+ * Bucket 0 has channels with 0 or 1 users, bucket N has channels
+ * with 2^N up to 2^(N+1)-1 users and the last bucket has the rest.
+ */
+#define CHANNEL_DIRECTORY_BUCKETS	24
+
+/** A channel that moved to another bucket while a cursor was active */
+typedef struct ChannelDirectoryMove {
+	Channel *channel;	/**< The channel, or NULL if it has been destroyed since */
+	int visited;		/**< Set if the cursor already visited the channel */
+} ChannelDirectoryMove;
+
+/** Position in the channel directory, eg for a /LIST that is sent in parts.
+ * See channel_directory_add_cursor() and channel_directory_next().
+ * Channels that change buckets while the cursor is active are tracked
+ * in 'moved', so they are visited exactly once.
+ */
+struct ChannelDirectoryCursor {
+	ChannelDirectoryCursor *prev, *next;
+	int bucket;		/**< The current bucket in channel_directory[] */
+	int minbucket;		/**< The last bucket to visit */
+	Channel *channel;	/**< Next channel to visit, or NULL if the bucket is done */
+	unsigned long serial;	/**< Value of the directory serial when the cursor was added */
+	ChannelDirectoryMove *moved;	/**< Channels that changed bucket since the cursor was added */
+	int num_moved;		/**< Number of entries used in 'moved' */
+	int max_moved;		/**< Number of entries allocated in 'moved' */
+	int *moved_hash;	/**< Hash table on channel with indexes in 'moved' (-1 is free), twice the size of 'moved' */
+	int extra;		/**< Position in 'moved' when visiting the leftovers at the end */
+};
+
 /*
 ** Channel Related macros follow
 */
@@ -2181,6 +2290,25 @@ struct ThrottlingBucket
 	char count;
 };
 
+/** Number of users per IP address, and per /64 for IPv6 (see find_ip_users()) */
+struct IpUsersBucket
+{
+	IpUsersBucket *prev, *next;
+	char *ip;			/**< IP address, or IPv6 prefix such as "2001:db8::/64" */
+	int local_clients;		/**< Number of local users */
+	int global_clients;		/**< Number of users on the network (including local) */
+	IpUsersBucket *prefix;		/**< For IPv6 addresses: the bucket of the /64 */
+};
+
+/** Traffic of a compressed server link, see zip_link_stats() */
+struct ZipLinkStats
+{
+	unsigned long long out_plain;		/**< Bytes sent, before compression */
+	unsigned long long out_compressed;	/**< Bytes sent, after compression */
+	unsigned long long in_compressed;	/**< Bytes received, before decompression */
+	unsigned long long in_plain;		/**< Bytes received, after decompression */
+};
+
 typedef struct CoreChannelModeTable CoreChannelModeTable;
 struct CoreChannelModeTable {
 	long mode;			/**< Mode value (which bit will be set) */
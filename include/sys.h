@@ -61,10 +61,16 @@
 #ifndef _WIN32
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
+/* Only used to pass buffers around, we don't do vectored I/O on Windows */
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 #endif
 
 #ifndef _WIN32
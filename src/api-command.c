@@ -25,6 +25,19 @@
 /* Forward declarations */
 static Command *CommandAddInternal(Module *module, char *cmd, CmdFunc func, AliasCmdFunc aliasfunc, unsigned char params, int flags);
 static RealCommand *add_Command_backend(char *cmd);
+static unsigned int command_hash(const char *cmd);
+static void command_index_add(RealCommand *c);
+static void command_index_del(RealCommand *c);
+
+/* The lists in CommandHash[] are what we walk when we need all commands.
+ * For lookups by name we use an open addressing hash table (linear probing).
+ * Commands are inserted and deleted one at a time, the table is only
+ * rebuilt (lazily) when it needs to grow.
+ */
+static RealCommand **command_index = NULL;
+static unsigned int command_index_size = 0; /* always a power of 2 */
+static unsigned int command_index_count = 0;
+static int command_index_dirty = 1;
 
 /** @defgroup CommandAPI Command API
  * @{
@@ -34,15 +47,7 @@ static RealCommand *add_Command_backend(char *cmd);
  */
 int CommandExists(char *name)
 {
-	RealCommand *p;
-	
-	for (p = CommandHash[toupper(*name)]; p; p = p->next)
-	{
-		if (!strcasecmp(p->cmd, name))
-			return 1;
-	}
-
-	return 0;
+	return find_command_simple(name) ? 1 : 0;
 }
 
 /** Register a new command.
@@ -135,6 +140,7 @@ void CommandDelX(Command *command, RealCommand *cmd)
 	CommandOverride *ovr, *ovrnext;
 
 	DelListItem(cmd, CommandHash[toupper(*cmd->cmd)]);
+	command_index_del(cmd);
 	if (command && cmd->owner)
 	{
 		ModuleObject *cmdobj;
@@ -238,13 +244,113 @@ static RealCommand *add_Command_backend(char *cmd)
 	RealCommand *c = safe_alloc(sizeof(RealCommand));
 
 	safe_strdup(c->cmd, cmd);
+	c->hashv = command_hash(cmd);
 
 	/* Add in hash with hash value = first byte */
 	AddListItem(c, CommandHash[toupper(*cmd)]);
+	command_index_add(c);
 
 	return c;
 }
 
+/** Case insensitive hash of a command name (FNV-1a) */
+static unsigned int command_hash(const char *cmd)
+{
+	unsigned int hashv = 2166136261U;
+
+	for (; *cmd; cmd++)
+		hashv = (hashv ^ (unsigned char)toupper(*cmd)) * 16777619U;
+	return hashv;
+}
+
+/** (Re)build the command_index[] table from the CommandHash[] lists */
+static void build_command_index(void)
+{
+	RealCommand *c;
+	unsigned int cnt = 0, size, i, slot;
+
+	for (i = 0; i < 256; i++)
+		for (c = CommandHash[i]; c; c = c->next)
+			cnt++;
+
+	/* Keep the table at most 25% full, so lookups of unknown
+	 * commands hit an empty slot quickly.
+	 */
+	for (size = 256; size < cnt * 4; size *= 2)
+		;
+
+	if (size != command_index_size)
+	{
+		safe_free(command_index);
+		command_index = safe_alloc(sizeof(RealCommand *) * size);
+		command_index_size = size;
+	} else {
+		memset(command_index, 0, sizeof(RealCommand *) * size);
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		for (c = CommandHash[i]; c; c = c->next)
+		{
+			for (slot = c->hashv & (size - 1); command_index[slot]; slot = (slot + 1) & (size - 1))
+				;
+			command_index[slot] = c;
+		}
+	}
+
+	command_index_count = cnt;
+	command_index_dirty = 0;
+}
+
+/** Add a new command to the command_index[] table */
+static void command_index_add(RealCommand *c)
+{
+	unsigned int slot;
+
+	/* Let the next lookup rebuild (and grow) the table if it becomes
+	 * more than 25% full. Since the size doubles each time, that is rare.
+	 */
+	if (command_index_dirty || ((command_index_count + 1) * 4 > command_index_size))
+	{
+		command_index_dirty = 1;
+		return;
+	}
+
+	for (slot = c->hashv & (command_index_size - 1); command_index[slot]; slot = (slot + 1) & (command_index_size - 1))
+		;
+	command_index[slot] = c;
+	command_index_count++;
+}
+
+/** Remove a command from the command_index[] table */
+static void command_index_del(RealCommand *c)
+{
+	unsigned int mask = command_index_size - 1;
+	unsigned int i, j, k;
+
+	if (command_index_dirty)
+		return;
+
+	for (i = c->hashv & mask; command_index[i] != c; i = (i + 1) & mask)
+		if (!command_index[i])
+			return; /* not found, should not happen */
+
+	/* Move back the entries after it in the same run, so that
+	 * they can still be found without tombstones.
+	 */
+	for (j = (i + 1) & mask; command_index[j]; j = (j + 1) & mask)
+	{
+		k = command_index[j]->hashv & mask;
+		/* Leave it if its home slot is in (i, j] (cyclic) */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		command_index[i] = command_index[j];
+		i = j;
+	}
+	command_index[i] = NULL;
+	command_index_count--;
+}
+
 /** @defgroup CommandAPI Command API
  * @{
  */
@@ -252,31 +358,38 @@ static RealCommand *add_Command_backend(char *cmd)
 /** Find a command by name and flags */
 RealCommand *find_command(char *cmd, int flags)
 {
-	RealCommand *p;
-	for (p = CommandHash[toupper(*cmd)]; p; p = p->next) {
-		if ((flags & CMD_UNREGISTERED) && !(p->flags & CMD_UNREGISTERED))
-			continue;
-		if ((flags & CMD_SHUN) && !(p->flags & CMD_SHUN))
-			continue;
-		if ((flags & CMD_VIRUS) && !(p->flags & CMD_VIRUS))
-			continue;
-		if ((flags & CMD_ALIAS) && !(p->flags & CMD_ALIAS))
-			continue;
-		if (!strcasecmp(p->cmd, cmd))
-			return p;
-	}
-	return NULL;
+	RealCommand *p = find_command_simple(cmd);
+
+	/* Command names are unique, so if the flags don't match
+	 * then there is no other command that could.
+	 */
+	if (!p)
+		return NULL;
+	if ((flags & CMD_UNREGISTERED) && !(p->flags & CMD_UNREGISTERED))
+		return NULL;
+	if ((flags & CMD_SHUN) && !(p->flags & CMD_SHUN))
+		return NULL;
+	if ((flags & CMD_VIRUS) && !(p->flags & CMD_VIRUS))
+		return NULL;
+	if ((flags & CMD_ALIAS) && !(p->flags & CMD_ALIAS))
+		return NULL;
+	return p;
 }
 
 /** Find a command by name (no access rights check) */
 RealCommand *find_command_simple(char *cmd)
 {
 	RealCommand *c;
+	unsigned int hashv, slot;
+
+	if (command_index_dirty)
+		build_command_index();
 
-	for (c = CommandHash[toupper(*cmd)]; c; c = c->next)
+	hashv = command_hash(cmd);
+	for (slot = hashv & (command_index_size - 1); (c = command_index[slot]); slot = (slot + 1) & (command_index_size - 1))
 	{
-		if (!strcasecmp(c->cmd, cmd))
-				return c;
+		if ((c->hashv == hashv) && !strcasecmp(c->cmd, cmd))
+			return c;
 	}
 
 	return NULL;
@@ -27,10 +27,148 @@ ID_Copyright("(C) Carsten Munk 2001");
 
 MODVAR Event *events = NULL;
 
+/** Events ordered by next_run: a binary min-heap, so the next
+ * event to run is always event_heap[0].
+ */
+static Event **event_heap = NULL;
+static int event_heap_count = 0;
+static int event_heap_size = 0;
+
+/** Set while DoEvents() is running */
+static int doing_events = 0;
+/** Number of events with heap_index EVENT_PENDING */
+static int pending_events = 0;
+/** Number of events marked for deletion, see CleanupEvents() */
+static int deleted_events = 0;
+
 extern EVENT(unrealdns_removeoldrecords);
 extern EVENT(unrealdb_expire_secret_cache);
 extern EVENT(deprecated_notice);
 
+/** Returns 1 if event 'a' should run before event 'b' */
+static int event_before(Event *a, Event *b)
+{
+	if (a->next_run.tv_sec != b->next_run.tv_sec)
+		return a->next_run.tv_sec < b->next_run.tv_sec;
+	return a->next_run.tv_usec < b->next_run.tv_usec;
+}
+
+/** Microseconds from now until 'tv' (negative if in the past) */
+static long long usec_until(struct timeval *tv)
+{
+	return ((long long)(tv->tv_sec - timeofday_tv.tv_sec) * 1000000) +
+	       (tv->tv_usec - timeofday_tv.tv_usec);
+}
+
+static void event_heap_set(Event *e, int i)
+{
+	event_heap[i] = e;
+	e->heap_index = i;
+}
+
+/** Move the event at position 'i' up or down the heap to where it belongs */
+static void event_heap_fix(int i)
+{
+	Event *e = event_heap[i];
+	int child;
+
+	/* Up */
+	while ((i > 0) && event_before(e, event_heap[(i - 1) / 2]))
+	{
+		event_heap_set(event_heap[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+
+	/* Down */
+	while ((child = 2 * i + 1) < event_heap_count)
+	{
+		if ((child + 1 < event_heap_count) && event_before(event_heap[child + 1], event_heap[child]))
+			child++;
+		if (!event_before(event_heap[child], e))
+			break;
+		event_heap_set(event_heap[child], i);
+		i = child;
+	}
+
+	event_heap_set(e, i);
+}
+
+/** Remove the event from the heap (if it is in there) */
+static void event_unschedule(Event *e)
+{
+	int i = e->heap_index;
+
+	if (i == EVENT_PENDING)
+		pending_events--;
+	e->heap_index = EVENT_NOT_SCHEDULED;
+	if (i < 0)
+		return;
+
+	event_heap_count--;
+	if (i == event_heap_count)
+		return; /* was the last one */
+	event_heap_set(event_heap[event_heap_count], i);
+	event_heap_fix(i);
+}
+
+/** Set e->next_run to 'every_msec' after the last run */
+static void event_set_next_run(Event *e)
+{
+	long long t, slack = EVENT_TIMER_SLACK * 1000;
+
+	t = ((long long)e->last_run.tv_sec * 1000000) + e->last_run.tv_usec + ((long long)e->every_msec * 1000);
+	/* Round up to EVENT_TIMER_SLACK (see config.h). The 2ms is because we
+	 * wake up slightly after the time that an event was due, otherwise
+	 * the event would shift by one EVENT_TIMER_SLACK every time it runs.
+	 */
+	if (e->every_msec > 0)
+		t = ((t - 2000 + slack - 1) / slack) * slack;
+	e->next_run.tv_sec = t / 1000000;
+	e->next_run.tv_usec = t % 1000000;
+}
+
+/** (Re)schedule the event to run 'every_msec' after the last run.
+ * Events that are (re)scheduled while DoEvents() is running are only
+ * put in the heap after DoEvents() is done, so they run at the earliest
+ * during the next DoEvents() call, like before.
+ */
+static void event_schedule(Event *e)
+{
+	if (e->deleted)
+		return;
+
+	event_set_next_run(e);
+
+	if (e->heap_index >= 0)
+	{
+		event_heap_fix(e->heap_index);
+		return;
+	}
+
+	if (doing_events)
+	{
+		if (e->heap_index != EVENT_PENDING)
+		{
+			e->heap_index = EVENT_PENDING;
+			pending_events++;
+		}
+		return;
+	}
+
+	if (e->heap_index == EVENT_PENDING)
+		pending_events--;
+
+	if (event_heap_count == event_heap_size)
+	{
+		event_heap_size = event_heap_size ? event_heap_size * 2 : 32;
+		event_heap = realloc(event_heap, sizeof(Event *) * event_heap_size);
+		if (!event_heap)
+			outofmemory(sizeof(Event *) * event_heap_size);
+	}
+	event_heap_set(e, event_heap_count++);
+	event_heap_fix(e->heap_index);
+}
+
 /** Add an event, a function that will run at regular intervals.
  * @param module	Module that this event belongs to
  * @param name		Name of the event
@@ -40,8 +178,7 @@ extern EVENT(deprecated_notice);
  * @param count		After how many times we should stop calling this even (0 = infinite times)
  * @returns an Event struct
  * @note  UnrealIRCd will try to call the event every 'every_msec' milliseconds.
- *        However, in case of low traffic the minimum time is at least SOCKETLOOP_MAX_DELAY
- *        which is 250ms at the time of writing. Also, we reject any value below 100 msecs.
+ *        We reject any value below 100 msecs.
  *        The actual calling time will not be quicker than the specified every_msec but
  *        can be later, in case of high load, in very extreme cases even up to 1000 or 2000
  *        msec later but that would be very unusual. Just saying, it's not a guarantee..
@@ -76,7 +213,9 @@ Event *EventAdd(Module *module, char *name, vFP event, void *data, long every_ms
 	newevent->last_run.tv_sec = timeofday_tv.tv_sec;
 	newevent->last_run.tv_usec = timeofday_tv.tv_usec;
 	newevent->owner = module;
+	newevent->heap_index = EVENT_NOT_SCHEDULED;
 	AddListItem(newevent,events);
+	event_schedule(newevent);
 	if (module)
 	{
 		ModuleObject *eventobj = safe_alloc(sizeof(ModuleObject));
@@ -98,7 +237,10 @@ void EventDel(Event *e)
 	char buf[128];
 
 	/* Mark for deletion */
+	if (!e->deleted)
+		deleted_events++;
 	e->deleted = 1;
+	event_unschedule(e);
 
 	/* Replace the name so deleted events are clearly labeled */
 	if (e->name)
@@ -146,6 +288,10 @@ static void EventDelReal(Event *e)
 static void CleanupEvents(void)
 {
 	Event *e, *e_next;
+
+	if (!deleted_events)
+		return;
+	deleted_events = 0;
 	for (e = events; e; e = e_next)
 	{
 		e_next = e->next;
@@ -186,6 +332,7 @@ int EventMod(Event *event, EventInfo *mods)
 		}
 
 		event->every_msec = mods->every_msec;
+		event_schedule(event);
 	}
 	if (mods->flags & EMOD_HOWMANY)
 		event->count = mods->count;
@@ -200,37 +347,128 @@ int EventMod(Event *event, EventInfo *mods)
 	return 0;
 }
 
+/** Run all events that are due */
 void DoEvents(void)
 {
 	Event *e;
+	struct timeval start, end;
+	long long usec;
 
-	for (e = events; e; e = e->next)
+	doing_events = 1;
+	while (event_heap_count && (usec_until(&event_heap[0]->next_run) <= 0))
 	{
-		if (e->deleted)
-			continue;
+		e = event_heap[0];
+		event_unschedule(e);
 		if (e->count == -1)
 		{
 			EventDel(e);
 			continue;
 		}
-		if ((e->every_msec == 0) || minimum_msec_since_last_run(&e->last_run, e->every_msec))
+
+		gettimeofday(&start, NULL);
+		(*e->event)(e->data);
+		gettimeofday(&end, NULL);
+		usec = ((long long)(end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+		if (usec < 0)
+			usec = 0; /* time went backwards */
+		e->calls++;
+		e->total_usec += usec;
+		if (usec > e->max_usec)
+			e->max_usec = usec;
+
+		if (e->deleted)
+			continue; /* the event deleted itself */
+		if (e->count > 0)
 		{
-			(*e->event)(e->data);
-			if (e->count > 0)
+			e->count--;
+			if (e->count == 0)
 			{
-				e->count--;
-				if (e->count == 0)
-				{
-					EventDel(e);
-					continue;
-				}
+				EventDel(e);
+				continue;
 			}
 		}
+		e->last_run = timeofday_tv;
+		event_schedule(e);
+	}
+	doing_events = 0;
+
+	/* Now schedule the events that were added or changed in the meantime */
+	if (pending_events)
+	{
+		for (e = events; e; e = e->next)
+			if (e->heap_index == EVENT_PENDING)
+				event_schedule(e);
 	}
 
 	CleanupEvents();
 }
 
+/** Recalculate when each event should run and rebuild the heap.
+ * This is called from fix_timers() when the system clock jumped.
+ */
+void EventFixTimers(void)
+{
+	Event *e;
+	int i, n;
+
+	for (e = events; e; e = e->next)
+	{
+		if (e->last_run.tv_sec > TStime())
+		{
+			e->last_run.tv_sec = TStime()-1;
+			e->last_run.tv_usec = 0;
+		}
+		if (!e->deleted)
+			event_set_next_run(e);
+	}
+
+	/* Add them to the heap again, one by one */
+	n = event_heap_count;
+	event_heap_count = 0;
+	for (i = 0; i < n; i++)
+	{
+		e = event_heap[i];
+		event_heap_set(e, event_heap_count++);
+		event_heap_fix(e->heap_index);
+	}
+}
+
+/** Returns the number of milliseconds until the next event is due,
+ * with a maximum of 'maximum'. Used for the timeout of fd_select().
+ */
+long NextEventDelay(long maximum)
+{
+	long long v;
+
+	if (!event_heap_count)
+		return maximum;
+	v = (usec_until(&event_heap[0]->next_run) + 999) / 1000; /* round up */
+	if (v < 0)
+		return 0;
+	if (v > maximum)
+		return maximum;
+	return v;
+}
+
+/** Send the list of events and how much time they take (STATS events) */
+void EventStatus(Client *client)
+{
+	Event *e;
+
+	for (e = events; e; e = e->next)
+	{
+		if (e->deleted)
+			continue;
+		sendnumericfmt(client, RPL_STATSDEBUG,
+			"event %s every %ld msec, next in %ld msec, calls %lu, total %llu usec, avg %llu usec, max %lu usec",
+			e->name, e->every_msec,
+			(long)(usec_until(&e->next_run) / 1000),
+			e->calls, e->total_usec,
+			e->calls ? e->total_usec / e->calls : 0ULL,
+			e->max_usec);
+	}
+}
+
 void SetupEvents(void)
 {
 	/* Start events */
@@ -88,6 +88,7 @@ Extban *ExtbanAdd(Module *module, ExtbanInfo req)
 	}
 	ExtBan_highest = slot;
 	set_isupport_extban();
+	all_channel_bans_changed();
 	return &ExtBan_Table[slot];
 }
 
@@ -110,6 +111,7 @@ void ExtbanDel(Extban *eb)
 	}
 	memset(eb, 0, sizeof(Extban));
 	set_isupport_extban();
+	all_channel_bans_changed();
 	/* Hmm do we want to go trough all chans and remove the bans?
 	 * I would say 'no' because perhaps we are just reloading,
 	 * and else.. well... screw them?
@@ -91,6 +91,7 @@ HistoryBackend *HistoryBackendAdd(Module *module, HistoryBackendInfo *mreq)
 	m->owner = module;
 	m->history_add = mreq->history_add;
 	m->history_request = mreq->history_request;
+	m->history_targets = mreq->history_targets;
 	m->history_destroy = mreq->history_destroy;
 	m->history_set_limit = mreq->history_set_limit;
 
@@ -183,6 +184,54 @@ HistoryResult *history_request(char *object, HistoryFilter *filter)
 	return NULL;
 }
 
+/** Find the latest activity of a number of history objects in one go.
+ * For each target this finds the latest line with a time before
+ * filter->timestamp_a and not before filter->timestamp_b, and sets
+ * target->datetime to its time. This is what CHATHISTORY TARGETS needs.
+ * @param targets	The targets, with 'object' filled in.
+ * @param count		The number of targets.
+ * @param filter	The filter, only timestamp_a and timestamp_b are used.
+ * @returns The number of targets that have a datetime.
+ */
+int history_request_targets(HistoryTarget *targets, int count, HistoryFilter *filter)
+{
+	HistoryBackend *hb;
+	HistoryFilter f;
+	HistoryResult *r;
+	MessageTag *m;
+	int i, found = 0;
+
+	for (i = 0; i < count; i++)
+		*targets[i].datetime = '\0';
+
+	hb = historybackends;
+	if (!hb)
+		return 0; /* no history backend loaded */
+
+	if (hb->history_targets)
+		return hb->history_targets(targets, count, filter);
+
+	/* Backend can't do it, so request the latest line of each object */
+	memset(&f, 0, sizeof(f));
+	f.cmd = HFC_BEFORE;
+	f.timestamp_a = filter->timestamp_a;
+	f.timestamp_b = filter->timestamp_b;
+	f.limit = 1;
+	for (i = 0; i < count; i++)
+	{
+		r = history_request(targets[i].object, &f);
+		if (!r)
+			continue;
+		if (r->log && (m = find_mtag(r->log->mtags, "time")) && m->value)
+		{
+			strlcpy(targets[i].datetime, m->value, sizeof(targets[i].datetime));
+			found++;
+		}
+		free_history_result(r);
+	}
+	return found;
+}
+
 int history_destroy(char *object)
 {
 	HistoryBackend *hb;
@@ -210,7 +259,11 @@ void free_history_result(HistoryResult *r)
 	for (l = r->log; l; l = l_next)
 	{
 		l_next = l->next;
-		free_message_tags(l->mtags);
+		if (!r->borrowed)
+		{
+			free_message_tags(l->mtags);
+			safe_free(l->line);
+		}
 		safe_free(l);
 	}
 	safe_free(r->object);
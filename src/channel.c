@@ -40,6 +40,19 @@ long sajoinmode = 0;
  */
 Channel *channels = NULL;
 
+/** All channels on the network, in buckets by user count.
+ * This allows /LIST with a minimum or maximum number of users to only
+ * look at the channels that are in range. See channel_directory_bucket()
+ * for which channels are in which bucket.
+ */
+MODVAR Channel *channel_directory[CHANNEL_DIRECTORY_BUCKETS];
+
+/** Cursors in channel_directory[], see channel_directory_add_cursor() */
+static ChannelDirectoryCursor *channel_directory_cursors = NULL;
+
+/** Incremented each time a channel is put in a channel_directory[] bucket */
+static unsigned long channel_directory_serial = 0;
+
 /* some buffers for rebuilding channel/nick lists with comma's */
 static char buf[BUFSIZE];
 /** Mode buffer (eg: "+sntkl") */
@@ -111,31 +124,29 @@ static int list_length(Link *lp)
 	return count;
 }
 
-/** Find client in a Member linked list (eg: channel->members) */
+/** Find client in a Member linked list.
+ * @param lp	The head of the list, that is: channel->members
+ * @param ptr	The client to look for
+ * @note This uses the membership hash table, it does not walk the list.
+ */
 Member *find_member_link(Member *lp, Client *ptr)
 {
-	if (ptr)
-	{
-		while (lp)
-		{
-			if (lp->client == ptr)
-				return (lp);
-			lp = lp->next;
-		}
-	}
+	Membership *mb;
+
+	if (lp && ptr && (mb = hash_find_membership(ptr, lp->channel)))
+		return mb->member;
 	return NULL;
 }
 
-/** Find channel in a Membership linked list (eg: client->user->channel) */
+/** Find channel in a Membership linked list.
+ * @param lp	The head of the list, that is: client->user->channel
+ * @param ptr	The channel to look for
+ * @note This uses the membership hash table, it does not walk the list.
+ */
 Membership *find_membership_link(Membership *lp, Channel *ptr)
 {
-	if (ptr)
-		while (lp)
-		{
-			if (lp->channel == ptr)
-				return (lp);
-			lp = lp->next;
-		}
+	if (lp && ptr)
+		return hash_find_membership(lp->client, ptr);
 	return NULL;
 }
 
@@ -264,6 +275,581 @@ int identical_ban(char *one, char *two)
 	return 0;
 }
 
+/* Channel ban list index.
+ * Without an index, checking a client against a ban list means calling
+ * match_user() or an extban callback for each and every entry, on every
+ * JOIN, message and nick change. For lists with BAN_INDEX_MIN_ENTRIES
+ * or more entries we therefore build an index: n!u@h masks whose host
+ * portion is a literal, a literal with a wildcard prefix or suffix,
+ * or a CIDR mask (or otherwise whose nick portion is a literal) are put
+ * in a hash table, so we only need to look up the hosts, IP and nick of
+ * the client. Anything else, such as extbans, goes in a linear list
+ * which is checked entry by entry like before.
+ * Every entry has a serial number reflecting its position in the list.
+ * This way we return the same ban as walking the list would and we never
+ * call an extban that comes after the matching ban (some extbans have
+ * side effects, such as ~T which censors the message).
+ * The index is kept up to date by add_listmode_ex() and del_listmode().
+ * Code that manipulates the lists directly (SJOIN, channeldb) always
+ * changes the list head, which causes the index to be rebuilt.
+ */
+#define BAN_INDEX_MIN_ENTRIES	16
+
+/** Return the index slot belonging to 'list', or NULL if it is not a channel list */
+static BanIndex **ban_index_slot(Channel *channel, Ban **list)
+{
+	if (list == &channel->banlist)
+		return &channel->banindex;
+	if (list == &channel->exlist)
+		return &channel->exindex;
+	if (list == &channel->invexlist)
+		return &channel->invexindex;
+	return NULL;
+}
+
+static void ban_index_free(BanIndex *idx)
+{
+	BanIndexEntry *e, *e_next;
+	unsigned int i;
+
+	for (i = 0; i < idx->size; i++)
+	{
+		for (e = idx->table[i]; e; e = e_next)
+		{
+			e_next = e->hnext;
+			safe_free(e->key);
+			safe_free(e);
+		}
+	}
+	for (e = idx->linear; e; e = e_next)
+	{
+		e_next = e->lnext;
+		safe_free(e);
+	}
+	safe_free(idx->table);
+	safe_free(idx);
+}
+
+/** Free all ban list indexes of a channel */
+static void ban_index_free_all(Channel *channel)
+{
+	if (channel->banindex)
+	{
+		ban_index_free(channel->banindex);
+		channel->banindex = NULL;
+	}
+	if (channel->exindex)
+	{
+		ban_index_free(channel->exindex);
+		channel->exindex = NULL;
+	}
+	if (channel->invexindex)
+	{
+		ban_index_free(channel->invexindex);
+		channel->invexindex = NULL;
+	}
+}
+
+/** Copy 'str' to 'buf' in lowercase, for use as an index key */
+void ban_index_lowercase(char *buf, size_t buflen, const char *str)
+{
+	char *p = buf;
+
+	for (; *str && (p < buf + buflen - 1); str++)
+		*p++ = tolower(*str);
+	*p = '\0';
+}
+
+/** Zero out all bits after the first 'bits' bits of 'addr' */
+static void ban_index_mask_address(unsigned char *addr, int addrlen, int bits)
+{
+	int i;
+
+	for (i = bits / 8; i < addrlen; i++)
+	{
+		if (i == bits / 8)
+			addr[i] &= (0xff00 >> (bits % 8)) & 0xff;
+		else
+			addr[i] = 0;
+	}
+}
+
+/** Make the key of a CIDR entry, eg: '192.168.0.0/16' */
+void ban_index_cidr_key(char *buf, size_t buflen, int family, unsigned char *addr, int bits)
+{
+	char ipbuf[64];
+
+	ban_index_mask_address(addr, (family == AF_INET6) ? 16 : 4, bits);
+	if (!inet_ntop(family, addr, ipbuf, sizeof(ipbuf)))
+		*ipbuf = '\0';
+	snprintf(buf, buflen, "%s/%d", ipbuf, bits);
+}
+
+/** Figure out the BANINDEX_* type and key for a ban mask.
+ * The type may only be something other than BANINDEX_LINEAR if we are
+ * certain that match_user() can only match the mask if the key is equal
+ * to the key derived from one of the hosts, the IP or the nick of a client.
+ * This is also used for the server ban index in the tkl module.
+ */
+int ban_index_classify(const char *banstr, char *key, size_t keylen)
+{
+	char mask[NICKLEN+USERLEN+HOSTLEN+8];
+	char addr[16];
+	char *nick = NULL, *host, *p, *s;
+	int bits;
+
+	if (is_extended_ban(banstr) || (strlen(banstr) >= sizeof(mask)))
+		return BANINDEX_LINEAR;
+
+	strlcpy(mask, banstr, sizeof(mask));
+
+	/* Split the mask up the same way as match_user() does */
+	host = mask;
+	p = strchr(mask, '!');
+	if (p)
+	{
+		*p++ = '\0';
+		nick = mask;
+		host = p;
+	}
+	p = strchr(host, '@');
+	if (p)
+	{
+		*p++ = '\0';
+		if (!*host)
+			return BANINDEX_LINEAR;
+		host = p;
+	} else
+	if (nick)
+	{
+		return BANINDEX_LINEAR;
+	}
+	if (!*host || (nick && !*nick))
+		return BANINDEX_LINEAR;
+
+	if (!strpbrk(host, "*?"))
+	{
+		p = strchr(host, '/');
+		if (p)
+		{
+			/* CIDR: match_user() only checks the IP for these */
+			*p++ = '\0';
+			bits = atoi(p);
+			if (bits <= 0)
+				return BANINDEX_LINEAR;
+			if (strchr(host, ':'))
+			{
+				if ((bits > 128) || (inet_pton(AF_INET6, host, addr) != 1))
+					return BANINDEX_LINEAR;
+				ban_index_cidr_key(key, keylen, AF_INET6, (unsigned char *)addr, bits);
+			} else {
+				if ((bits > 32) || (inet_pton(AF_INET, host, addr) != 1))
+					return BANINDEX_LINEAR;
+				ban_index_cidr_key(key, keylen, AF_INET, (unsigned char *)addr, bits);
+			}
+			return BANINDEX_CIDR;
+		}
+		/* IPv6 addresses are compared in binary form, so
+		 * they can be written in different ways. Leave them.
+		 */
+		if (!strchr(host, ':'))
+		{
+			ban_index_lowercase(key, keylen, host);
+			return BANINDEX_HOST;
+		}
+	} else {
+		/* *.example.org */
+		for (s = host; *s == '*'; s++);
+		if ((s > host) && (*s == '.') && !strpbrk(s, "*?"))
+		{
+			ban_index_lowercase(key, keylen, s);
+			return BANINDEX_SUFFIX;
+		}
+		/* 192.168.* */
+		p = host + strlen(host);
+		while ((p > host) && (p[-1] == '*'))
+			p--;
+		if ((p < host + strlen(host)) && (p > host) && ((p[-1] == '.') || (p[-1] == ':')))
+		{
+			*p = '\0';
+			if (!strpbrk(host, "*?"))
+			{
+				ban_index_lowercase(key, keylen, host);
+				return BANINDEX_PREFIX;
+			}
+		}
+	}
+
+	/* nick!*@* and the like */
+	if (nick && !strpbrk(nick, "*?"))
+	{
+		ban_index_lowercase(key, keylen, nick);
+		return BANINDEX_NICK;
+	}
+
+	return BANINDEX_LINEAR;
+}
+
+static inline unsigned int ban_index_bucket(BanIndex *idx, int type, const char *key)
+{
+	return (hash_ban_index_key(key) + type) & (idx->size - 1);
+}
+
+/** Resize the hash table of an index, re-adding all entries */
+static void ban_index_resize(BanIndex *idx, unsigned int newsize)
+{
+	BanIndexEntry **oldtable = idx->table;
+	unsigned int oldsize = idx->size;
+	BanIndexEntry *e, *e_next;
+	unsigned int i, hashv;
+
+	idx->table = safe_alloc(sizeof(BanIndexEntry *) * newsize);
+	idx->size = newsize;
+	for (i = 0; i < oldsize; i++)
+	{
+		for (e = oldtable[i]; e; e = e_next)
+		{
+			e_next = e->hnext;
+			hashv = ban_index_bucket(idx, e->type, e->key);
+			e->hnext = idx->table[hashv];
+			idx->table[hashv] = e;
+		}
+	}
+	safe_free(oldtable);
+}
+
+/** Add 'ban' to the index with the specified serial */
+static void ban_index_add(BanIndex *idx, Ban *ban, unsigned int serial)
+{
+	BanIndexEntry *e, **ep;
+	char key[NICKLEN+USERLEN+HOSTLEN+8];
+	unsigned int hashv;
+
+	e = safe_alloc(sizeof(BanIndexEntry));
+	e->ban = ban;
+	e->serial = serial;
+	e->type = ban_index_classify(ban->banstr, key, sizeof(key));
+	idx->types[(int)e->type]++;
+	idx->count++;
+
+	if (e->type == BANINDEX_LINEAR)
+	{
+		/* Keep the linear list in the same order as the ban list */
+		for (ep = &idx->linear; *ep && ((*ep)->serial > serial); ep = &(*ep)->lnext);
+		e->lnext = *ep;
+		*ep = e;
+		return;
+	}
+
+	if (e->type == BANINDEX_CIDR)
+	{
+		int bits = atoi(strchr(key, '/') + 1);
+		if (strchr(key, ':'))
+			idx->cidr6[bits]++;
+		else
+			idx->cidr4[bits]++;
+	}
+
+	if (idx->count > idx->size)
+		ban_index_resize(idx, idx->size * 2);
+
+	safe_strdup(e->key, key);
+	hashv = ban_index_bucket(idx, e->type, e->key);
+	e->hnext = idx->table[hashv];
+	idx->table[hashv] = e;
+}
+
+/** Remove 'ban' from the index.
+ * @returns The serial of the removed entry, or 0 if not found.
+ */
+static unsigned int ban_index_del(BanIndex *idx, Ban *ban)
+{
+	BanIndexEntry *e, **ep;
+	char key[NICKLEN+USERLEN+HOSTLEN+8];
+	unsigned int serial;
+	int type;
+
+	type = ban_index_classify(ban->banstr, key, sizeof(key));
+	if (type == BANINDEX_LINEAR)
+		ep = &idx->linear;
+	else
+		ep = &idx->table[ban_index_bucket(idx, type, key)];
+
+	for (; *ep; ep = (type == BANINDEX_LINEAR) ? &(*ep)->lnext : &(*ep)->hnext)
+	{
+		if ((*ep)->ban == ban)
+			break;
+	}
+	if (!*ep)
+		return 0;
+
+	e = *ep;
+	*ep = (type == BANINDEX_LINEAR) ? e->lnext : e->hnext;
+	if (type == BANINDEX_CIDR)
+	{
+		int bits = atoi(strchr(key, '/') + 1);
+		if (strchr(key, ':'))
+			idx->cidr6[bits]--;
+		else
+			idx->cidr4[bits]--;
+	}
+	idx->types[type]--;
+	idx->count--;
+	serial = e->serial;
+	safe_free(e->key);
+	safe_free(e);
+	return serial;
+}
+
+/** Build an index for a list */
+static BanIndex *ban_index_build(Ban *list)
+{
+	BanIndex *idx;
+	Ban *ban, **bans;
+	unsigned int n = 0, i;
+
+	for (ban = list; ban; ban = ban->next)
+		n++;
+
+	idx = safe_alloc(sizeof(BanIndex));
+	idx->head = list;
+	idx->size = 32;
+	while (idx->size < n)
+		idx->size *= 2;
+	idx->table = safe_alloc(sizeof(BanIndexEntry *) * idx->size);
+
+	/* Add from tail to head, so serials go up and
+	 * adding to the linear list is cheap.
+	 */
+	bans = safe_alloc(sizeof(Ban *) * n);
+	for (ban = list, i = 0; ban; ban = ban->next)
+		bans[i++] = ban;
+	while (i > 0)
+	{
+		i--;
+		ban_index_add(idx, bans[i], ++idx->serial);
+	}
+	safe_free(bans);
+
+	return idx;
+}
+
+/** Drop the index of a list if the list was changed behind our back.
+ * @returns The (still valid) index, or NULL if the list has no index.
+ */
+static BanIndex *ban_index_check(BanIndex **slot, Ban *list)
+{
+	if (*slot && ((*slot)->head != list))
+	{
+		/* Don't touch any of the Ban's, they may be gone already */
+		ban_index_free(*slot);
+		*slot = NULL;
+	}
+	return *slot;
+}
+
+/** Get the index of a list, building one if the list is long enough */
+static BanIndex *ban_index_get(Channel *channel, Ban **list)
+{
+	BanIndex **slot = ban_index_slot(channel, list);
+	Ban *ban;
+	int n = 0;
+
+	if (!slot)
+		return NULL;
+	if (ban_index_check(slot, *list))
+		return *slot;
+
+	for (ban = *list; ban && (n < BAN_INDEX_MIN_ENTRIES); ban = ban->next)
+		n++;
+	if (n < BAN_INDEX_MIN_ENTRIES)
+		return NULL;
+
+	*slot = ban_index_build(*list);
+	return *slot;
+}
+
+/** Look up a key in the index and update 'best' if we find a
+ * matching ban that comes before 'best' in the list.
+ */
+static void ban_index_probe(BanIndex *idx, int type, const char *key, Client *client, BanIndexEntry **best)
+{
+	BanIndexEntry *e;
+
+	for (e = idx->table[ban_index_bucket(idx, type, key)]; e; e = e->hnext)
+	{
+		if ((e->type == type) &&
+		    (!*best || (e->serial > (*best)->serial)) &&
+		    !strcmp(e->key, key) &&
+		    match_user(e->ban->banstr, client, MATCH_CHECK_ALL))
+		{
+			*best = e;
+		}
+	}
+}
+
+/** Look up all host, suffix and prefix keys for a host or IP of the client */
+static void ban_index_probe_host(BanIndex *idx, const char *host, Client *client, BanIndexEntry **best)
+{
+	char buf[HOSTLEN+1];
+	char *p, c;
+
+	ban_index_lowercase(buf, sizeof(buf), host);
+
+	if (idx->types[BANINDEX_HOST])
+		ban_index_probe(idx, BANINDEX_HOST, buf, client, best);
+
+	if (!idx->types[BANINDEX_SUFFIX] && !idx->types[BANINDEX_PREFIX])
+		return;
+
+	for (p = buf; *p; p++)
+	{
+		if ((*p == '.') && idx->types[BANINDEX_SUFFIX])
+			ban_index_probe(idx, BANINDEX_SUFFIX, p, client, best);
+		if (((*p == '.') || (*p == ':')) && idx->types[BANINDEX_PREFIX])
+		{
+			c = p[1];
+			p[1] = '\0';
+			ban_index_probe(idx, BANINDEX_PREFIX, buf, client, best);
+			p[1] = c;
+		}
+	}
+}
+
+/** Look up the CIDR keys for the IP of the client, for each prefix length in use */
+static void ban_index_probe_cidr(BanIndex *idx, Client *client, BanIndexEntry **best)
+{
+	char key[80];
+	unsigned char addr[16], masked[16];
+	int family, addrlen, maxbits, bits;
+	unsigned short *counts;
+
+	if (!client->ip)
+		return;
+
+	if (strchr(client->ip, ':'))
+	{
+		family = AF_INET6;
+		addrlen = 16;
+		maxbits = 128;
+		counts = idx->cidr6;
+	} else {
+		family = AF_INET;
+		addrlen = 4;
+		maxbits = 32;
+		counts = idx->cidr4;
+	}
+	if (inet_pton(family, client->ip, addr) != 1)
+		return;
+
+	for (bits = 1; bits <= maxbits; bits++)
+	{
+		if (!counts[bits])
+			continue;
+		memcpy(masked, addr, addrlen);
+		ban_index_cidr_key(key, sizeof(key), family, masked, bits);
+		ban_index_probe(idx, BANINDEX_CIDR, key, client, best);
+	}
+}
+
+/** Find the first entry in a ban list that matches the client.
+ * This is what is_banned_with_nick() and find_invex() use,
+ * see ban_check_mask() for the meaning of the parameters.
+ */
+static Ban *find_matching_ban(Client *client, Channel *channel, Ban **list, int type, char **msg, char **errmsg)
+{
+	BanIndex *idx = ban_index_get(channel, list);
+	BanIndexEntry *best = NULL, *e;
+	Ban *ban;
+	char *hosts[4];
+	int i, j, n = 0;
+
+	if (!idx)
+	{
+		for (ban = *list; ban; ban = ban->next)
+			if (ban_check_mask(client, channel, ban->banstr, type, msg, errmsg, 0))
+				return ban;
+		return NULL;
+	}
+
+	if (idx->types[BANINDEX_HOST] || idx->types[BANINDEX_SUFFIX] || idx->types[BANINDEX_PREFIX])
+	{
+		/* These are all the things match_user() checks the host portion against */
+		if (client->user)
+		{
+			hosts[n++] = GetHost(client);
+			hosts[n++] = client->user->cloakedhost;
+			hosts[n++] = client->user->realhost;
+		} else
+		if (MyConnect(client))
+		{
+			hosts[n++] = client->local->sockhost;
+		}
+		if (client->ip)
+			hosts[n++] = client->ip;
+
+		for (i = 0; i < n; i++)
+		{
+			if (!*hosts[i])
+				continue;
+			for (j = 0; j < i; j++)
+				if (!strcasecmp(hosts[i], hosts[j]))
+					break;
+			if (j == i)
+				ban_index_probe_host(idx, hosts[i], client, &best);
+		}
+	}
+
+	if (idx->types[BANINDEX_CIDR])
+		ban_index_probe_cidr(idx, client, &best);
+
+	if (idx->types[BANINDEX_NICK])
+	{
+		char nick[NICKLEN+1];
+		ban_index_lowercase(nick, sizeof(nick), client->name);
+		ban_index_probe(idx, BANINDEX_NICK, nick, client, &best);
+	}
+
+	/* Now the entries we could not index, but only the ones
+	 * that come before the one we found (if any).
+	 */
+	for (e = idx->linear; e && (!best || (e->serial > best->serial)); e = e->lnext)
+		if (ban_check_mask(client, channel, e->ban->banstr, type, msg, errmsg, 0))
+			return e->ban;
+
+	return best ? best->ban : NULL;
+}
+
+/** Count the ban list indexes of all channels, for STATS z */
+void count_ban_index_memory(int *indexes, int *entries, u_long *memory)
+{
+	Channel *channel;
+	BanIndex *idx[3];
+	BanIndexEntry *e;
+	unsigned int i, j;
+
+	*indexes = *entries = 0;
+	*memory = 0;
+	for (channel = channels; channel; channel = channel->nextch)
+	{
+		idx[0] = channel->banindex;
+		idx[1] = channel->exindex;
+		idx[2] = channel->invexindex;
+		for (i = 0; i < 3; i++)
+		{
+			if (!idx[i])
+				continue;
+			(*indexes)++;
+			*entries += idx[i]->count;
+			*memory += sizeof(BanIndex) + sizeof(BanIndexEntry *) * idx[i]->size;
+			*memory += sizeof(BanIndexEntry) * idx[i]->count;
+			for (j = 0; j < idx[i]->size; j++)
+				for (e = idx[i]->table[j]; e; e = e->hnext)
+					*memory += strlen(e->key) + 1;
+		}
+	}
+}
+
 /** Add a listmode (+beI) with the specified banid to
  *  the specified channel. (Extended version with
  *  set by nick and set on timestamp)
@@ -273,6 +859,9 @@ int add_listmode_ex(Ban **list, Client *client, Channel *channel, char *banid, c
 	Ban *ban;
 	int cnt = 0, len;
 	int do_not_add = 0;
+	BanIndex **slot = ban_index_slot(channel, list);
+	BanIndex *idx = slot ? ban_index_check(slot, *list) : NULL;
+	unsigned int serial = 0;
 
 	if (MyUser(client))
 		collapse(banid);
@@ -319,6 +908,11 @@ int add_listmode_ex(Ban **list, Client *client, Channel *channel, char *banid, c
 		ban = make_ban();
 		ban->next = *list;
 		*list = ban;
+	} else
+	if (idx && !((ban->when > 0) && (seton >= ban->when)))
+	{
+		/* Existing ban is being updated, keep its position */
+		serial = ban_index_del(idx, ban);
 	}
 
 	if ((ban->when > 0) && (seton >= ban->when))
@@ -333,6 +927,12 @@ int add_listmode_ex(Ban **list, Client *client, Channel *channel, char *banid, c
 	safe_strdup(ban->banstr, banid); /* cAsE may differ, use oldest version of it */
 	safe_strdup(ban->who, setby);
 	ban->when = seton;
+	if (idx)
+	{
+		ban_index_add(idx, ban, serial ? serial : ++idx->serial);
+		idx->head = *list;
+	}
+	channel_bans_changed(channel);
 	return 0;
 }
 
@@ -356,6 +956,8 @@ int del_listmode(Ban **list, Channel *channel, char *banid)
 {
 	Ban **ban;
 	Ban *tmp;
+	BanIndex **slot = ban_index_slot(channel, list);
+	BanIndex *idx = slot ? ban_index_check(slot, *list) : NULL;
 
 	if (!banid)
 		return -1;
@@ -364,10 +966,22 @@ int del_listmode(Ban **list, Channel *channel, char *banid)
 		if (identical_ban(banid, (*ban)->banstr))
 		{
 			tmp = *ban;
+			if (idx)
+				ban_index_del(idx, tmp);
 			*ban = tmp->next;
+			if (idx)
+			{
+				idx->head = *list;
+				if (!*list)
+				{
+					ban_index_free(idx);
+					*slot = NULL;
+				}
+			}
 			safe_free(tmp->banstr);
 			safe_free(tmp->who);
 			free_ban(tmp);
+			channel_bans_changed(channel);
 			return 0;
 		}
 	}
@@ -434,7 +1048,7 @@ inline int ban_check_mask(Client *client, Channel *channel, char *banstr, int ty
  */
 Ban *is_banned_with_nick(Client *client, Channel *channel, int type, char *nick, char **msg, char **errmsg)
 {
-	Ban *ban, *ex;
+	Ban *ban;
 	char savednick[NICKLEN+1];
 
 	/* It's not really doable to pass 'nick' to all the ban layers,
@@ -458,34 +1072,346 @@ Ban *is_banned_with_nick(Client *client, Channel *channel, int type, char *nick,
 	 * If a +e was found we return NULL, if not, we return the ban.
 	 */
 
-	for (ban = channel->banlist; ban; ban = ban->next)
+	ban = find_matching_ban(client, channel, &channel->banlist, type, msg, errmsg);
+
+	/* Ban found, now check for +e */
+	if (ban && find_matching_ban(client, channel, &channel->exlist, type, msg, errmsg))
+		ban = NULL; /* except matched */
+
+	if (nick)
 	{
-		if (ban_check_mask(client, channel, ban->banstr, type, msg, errmsg, 0))
-			break;
+		/* Restore the nick */
+		strlcpy(client->name, savednick, sizeof(client->name));
+	}
+
+	return ban;
+}
+
+/** Drop all cached ban verdicts of a channel.
+ * add_listmode_ex() and del_listmode() already call this, use it
+ * when changing the +b/+e/+I lists directly (eg: SJOIN).
+ */
+void channel_bans_changed(Channel *channel)
+{
+	channel->ban_serial++;
+	if (!channel->ban_serial)
+		channel->ban_serial = 1; /* 0 means 'nothing cached' in Membership */
+}
+
+/** Drop the cached ban verdicts of all channels.
+ * Used when an extended ban type is added or removed.
+ */
+void all_channel_bans_changed(void)
+{
+	Channel *channel;
+
+	for (channel = channels; channel; channel = channel->nextch)
+		channel_bans_changed(channel);
+}
+
+/** Drop the cached ban verdicts of a user, call this when
+ * the nick, user@host or account of the user changes.
+ */
+void user_identity_changed(Client *client)
+{
+	if (client->user)
+		client->user->identity_serial++;
+}
+
+/** Returns 1 if the result of this ban or exempt only depends on
+ * who the user is, that is: not on the message, the time, the
+ * channels the user is in, etc.
+ */
+static int ban_is_cacheable(char *banstr)
+{
+	Extban *extban;
+
+	if (!is_extended_ban(banstr))
+		return 1;
+	extban = findmod_by_bantype(banstr[1]);
+	if (!extban || !(extban->options & EXTBOPT_CACHEABLE))
+		return 0;
+	/* For stacked extbans like ~q:~a:account the inner one counts too */
+	if ((extban->options & EXTBOPT_ACTMODIFIER) && (banstr[2] == ':'))
+		return ban_is_cacheable(banstr + 3);
+	return 1;
+}
+
+/** Returns 1 if ban verdicts in this channel may be cached */
+static int channel_bans_cacheable(Channel *channel)
+{
+	Ban *ban;
+
+	if (channel->ban_cacheable_serial != channel->ban_serial)
+	{
+		channel->ban_cacheable = 1;
+		for (ban = channel->banlist; ban && channel->ban_cacheable; ban = ban->next)
+			if (!ban_is_cacheable(ban->banstr))
+				channel->ban_cacheable = 0;
+		for (ban = channel->exlist; ban && channel->ban_cacheable; ban = ban->next)
+			if (!ban_is_cacheable(ban->banstr))
+				channel->ban_cacheable = 0;
+		channel->ban_cacheable_serial = channel->ban_serial;
 	}
+	return channel->ban_cacheable;
+}
 
-	if (ban)
+/** Check if a user is banned from talking in a channel (BANCHK_MSG).
+ * This is is_banned() with a cache: the verdict is stored in the
+ * membership of the user and used until the +b/+e lists of the channel
+ * or the nick, user@host or account of the user change.
+ * Nothing is cached if any +b/+e entry depends on anything else, such
+ * as the message text (~T) or the channels the user is in (~c).
+ * @param client	The user (local)
+ * @param channel	The channel
+ * @param mb		The membership of the user in the channel, or NULL
+ * @param msg		The message, see is_banned()
+ * @param errmsg	The error message, see is_banned()
+ * @returns 1 if banned, 0 if not.
+ */
+int is_banned_msg(Client *client, Channel *channel, Membership *mb, char **msg, char **errmsg)
+{
+	int banned;
+
+	if (!mb || !client->user || !channel_bans_cacheable(channel))
+		return is_banned(client, channel, BANCHK_MSG, msg, errmsg) ? 1 : 0;
+
+	if ((mb->bancache_serial == channel->ban_serial) &&
+	    (mb->bancache_identity == client->user->identity_serial))
 	{
-		/* Ban found, now check for +e */
-		for (ex = channel->exlist; ex; ex = ex->next)
+		ircstats.is_bvhit++;
+		return mb->bancache_banned;
+	}
+
+	ircstats.is_bvmiss++;
+	banned = is_banned(client, channel, BANCHK_MSG, msg, errmsg) ? 1 : 0;
+	mb->bancache_serial = channel->ban_serial;
+	mb->bancache_identity = client->user->identity_serial;
+	mb->bancache_banned = banned;
+	return banned;
+}
+
+/** Return the channel_directory[] bucket for a channel with this many users */
+int channel_directory_bucket(int users)
+{
+	int bucket = 0;
+
+	while ((users > 1) && (bucket < CHANNEL_DIRECTORY_BUCKETS - 1))
+	{
+		users >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/** Register a cursor for walking through the channel directory.
+ * The cursor walks from bucket 'maxbucket' down to 'minbucket' and
+ * within each bucket from the newest to the oldest entry.
+ * Call channel_directory_next() to get the channels and
+ * channel_directory_del_cursor() before freeing the cursor.
+ */
+void channel_directory_add_cursor(ChannelDirectoryCursor *cursor, int minbucket, int maxbucket)
+{
+	memset(cursor, 0, sizeof(ChannelDirectoryCursor));
+	cursor->minbucket = minbucket;
+	cursor->bucket = MAX(maxbucket, minbucket);
+	cursor->channel = channel_directory[cursor->bucket];
+	cursor->serial = channel_directory_serial;
+	cursor->next = channel_directory_cursors;
+	if (cursor->next)
+		cursor->next->prev = cursor;
+	channel_directory_cursors = cursor;
+}
+
+/** Unregister a cursor that was added with channel_directory_add_cursor() */
+void channel_directory_del_cursor(ChannelDirectoryCursor *cursor)
+{
+	if (cursor->prev)
+		cursor->prev->next = cursor->next;
+	else if (channel_directory_cursors == cursor)
+		channel_directory_cursors = cursor->next;
+	if (cursor->next)
+		cursor->next->prev = cursor->prev;
+	cursor->prev = cursor->next = NULL;
+	safe_free(cursor->moved);
+	safe_free(cursor->moved_hash);
+	cursor->num_moved = cursor->max_moved = 0;
+}
+
+/** Slot of the channel in cursor->moved_hash */
+static int channel_directory_move_hash(ChannelDirectoryCursor *cursor, Channel *channel)
+{
+	return (int)((((uintptr_t)channel >> 4) * 2654435761U) & (cursor->max_moved * 2 - 1));
+}
+
+/** Find the entry of a channel in cursor->moved.
+ * Only channels that changed bucket after the cursor was added
+ * (channel->dirserial > cursor->serial) can be in there.
+ */
+static ChannelDirectoryMove *channel_directory_find_move(ChannelDirectoryCursor *cursor, Channel *channel)
+{
+	int i, n;
+
+	if ((channel->dirserial <= cursor->serial) || !cursor->num_moved)
+		return NULL;
+
+	/* Entries of destroyed channels have channel NULL, so they never match */
+	for (i = channel_directory_move_hash(cursor, channel); (n = cursor->moved_hash[i]) != -1; i = (i + 1) & (cursor->max_moved * 2 - 1))
+		if (cursor->moved[n].channel == channel)
+			return &cursor->moved[n];
+	return NULL;
+}
+
+/** Add an entry to cursor->moved for the channel */
+static ChannelDirectoryMove *channel_directory_add_move(ChannelDirectoryCursor *cursor, Channel *channel)
+{
+	ChannelDirectoryMove *m;
+	int i, n;
+
+	if (cursor->num_moved == cursor->max_moved)
+	{
+		cursor->max_moved = cursor->max_moved ? cursor->max_moved * 2 : 8;
+		cursor->moved = realloc(cursor->moved, sizeof(ChannelDirectoryMove) * cursor->max_moved);
+		if (!cursor->moved)
+			outofmemory(sizeof(ChannelDirectoryMove) * cursor->max_moved);
+		/* Rebuild the hash table at twice the new size */
+		safe_free(cursor->moved_hash);
+		cursor->moved_hash = safe_alloc(sizeof(int) * cursor->max_moved * 2);
+		for (i = 0; i < cursor->max_moved * 2; i++)
+			cursor->moved_hash[i] = -1;
+		for (n = 0; n < cursor->num_moved; n++)
 		{
-			if (ban_check_mask(client, channel, ex->banstr, type, msg, errmsg, 0))
+			if (!cursor->moved[n].channel)
+				continue;
+			for (i = channel_directory_move_hash(cursor, cursor->moved[n].channel); cursor->moved_hash[i] != -1; i = (i + 1) & (cursor->max_moved * 2 - 1))
+				;
+			cursor->moved_hash[i] = n;
+		}
+	}
+
+	n = cursor->num_moved++;
+	m = &cursor->moved[n];
+	m->channel = channel;
+	for (i = channel_directory_move_hash(cursor, channel); cursor->moved_hash[i] != -1; i = (i + 1) & (cursor->max_moved * 2 - 1))
+		;
+	cursor->moved_hash[i] = n;
+	return m;
+}
+
+/** Has the cursor walked past this channel? (position before unlinking) */
+static int channel_directory_visited(ChannelDirectoryCursor *cursor, Channel *channel)
+{
+	if (channel->dirbucket != cursor->bucket)
+		return channel->dirbucket > cursor->bucket;
+	if (!cursor->channel)
+		return 1; /* bucket is done */
+	/* New entries are added at the head, so the list is ordered by dirserial (high to low) */
+	return (channel != cursor->channel) && (channel->dirserial > cursor->channel->dirserial);
+}
+
+/** Get the next channel of a cursor.
+ * Note that this does no filtering at all (eg for user count or secret channels).
+ * @returns The channel, or NULL if all channels have been visited.
+ */
+Channel *channel_directory_next(ChannelDirectoryCursor *cursor)
+{
+	ChannelDirectoryMove *m;
+	Channel *channel;
+
+	while (1)
+	{
+		channel = cursor->channel;
+		if (!channel)
+		{
+			if (cursor->bucket > cursor->minbucket)
 			{
-				/* except matched */
-				ban = NULL;
-				break;
+				cursor->bucket--;
+				cursor->channel = channel_directory[cursor->bucket];
+				continue;
 			}
+			break;
 		}
-		/* user is not on except, 'ban' stays non-NULL. */
+		cursor->channel = channel->dirnextch;
+		/* A channel that moved here after the cursor was added may have been visited already */
+		if ((m = channel_directory_find_move(cursor, channel)))
+		{
+			if (m->visited)
+				continue;
+			m->visited = 1;
+		}
+		return channel;
 	}
 
-	if (nick)
+	/* Finally, the channels that moved to a bucket that was already done */
+	for (; cursor->extra < cursor->num_moved; cursor->extra++)
 	{
-		/* Restore the nick */
-		strlcpy(client->name, savednick, sizeof(client->name));
+		m = &cursor->moved[cursor->extra];
+		if (m->channel && !m->visited)
+		{
+			m->visited = 1;
+			cursor->extra++;
+			return m->channel;
+		}
 	}
+	return NULL;
+}
 
-	return ban;
+static void channel_directory_link(Channel *channel)
+{
+	int bucket = channel_directory_bucket(channel->users);
+
+	channel->dirbucket = bucket;
+	channel->dirserial = ++channel_directory_serial;
+	channel->dirprevch = NULL;
+	channel->dirnextch = channel_directory[bucket];
+	if (channel->dirnextch)
+		channel->dirnextch->dirprevch = channel;
+	channel_directory[bucket] = channel;
+}
+
+/** Remove the channel from its channel_directory[] bucket.
+ * @param channel	The channel
+ * @param destroy	Set if the channel is being destroyed, otherwise
+ *			it is about to be linked to another bucket.
+ */
+static void channel_directory_unlink(Channel *channel, int destroy)
+{
+	ChannelDirectoryCursor *cursor;
+	ChannelDirectoryMove *m;
+
+	for (cursor = channel_directory_cursors; cursor; cursor = cursor->next)
+	{
+		m = channel_directory_find_move(cursor, channel);
+		if (destroy)
+		{
+			if (m)
+				m->channel = NULL;
+		} else
+		if (!m)
+		{
+			m = channel_directory_add_move(cursor, channel);
+			m->visited = channel_directory_visited(cursor, channel);
+		}
+		if (cursor->channel == channel)
+			cursor->channel = channel->dirnextch;
+	}
+
+	if (channel->dirprevch)
+		channel->dirprevch->dirnextch = channel->dirnextch;
+	else
+		channel_directory[channel->dirbucket] = channel->dirnextch;
+	if (channel->dirnextch)
+		channel->dirnextch->dirprevch = channel->dirprevch;
+	channel->dirprevch = channel->dirnextch = NULL;
+}
+
+/** Move the channel to another channel_directory[] bucket, if the user count requires so */
+static void channel_directory_update(Channel *channel)
+{
+	if (channel_directory_bucket(channel->users) == channel->dirbucket)
+		return;
+	channel_directory_unlink(channel, 0);
+	channel_directory_link(channel);
 }
 
 /** Add user to the channel.
@@ -502,17 +1428,26 @@ void add_user_to_channel(Channel *channel, Client *who, int flags)
 	{
 		m = make_member();
 		m->client = who;
+		m->channel = channel;
 		m->flags = flags;
 		m->next = channel->members;
+		if (m->next)
+			m->next->prev = m;
 		channel->members = m;
 		channel->users++;
+		channel_directory_update(channel);
 
 		mb = make_membership();
 		mb->channel = channel;
+		mb->client = who;
+		mb->member = m;
 		mb->next = who->user->channel;
+		if (mb->next)
+			mb->next->prev = mb;
 		mb->flags = flags;
 		who->user->channel = mb;
 		who->user->joined++;
+		add_to_membership_hash_table(mb);
 		RunHook2(HOOKTYPE_JOIN_DATA, who, channel);
 	}
 }
@@ -525,31 +1460,31 @@ void add_user_to_channel(Channel *channel, Client *who, int flags)
  */
 int remove_user_from_channel(Client *client, Channel *channel)
 {
-	Member **m;
-	Member *m2;
-	Membership **mb;
-	Membership *mb2;
+	Member *m;
+	Membership *mb;
 
-	/* Update channel->members list */
-	for (m = &channel->members; (m2 = *m); m = &m2->next)
+	if ((mb = hash_find_membership(client, channel)))
 	{
-		if (m2->client == client)
-		{
-			*m = m2->next;
-			free_member(m2);
-			break;
-		}
-	}
+		del_from_membership_hash_table(mb);
 
-	/* Update client->user->channel list */
-	for (mb = &client->user->channel; (mb2 = *mb); mb = &mb2->next)
-	{
-		if (mb2->channel == channel)
-		{
-			*mb = mb2->next;
-			free_membership(mb2);
-			break;
-		}
+		/* Update channel->members list */
+		m = mb->member;
+		if (m->prev)
+			m->prev->next = m->next;
+		else
+			channel->members = m->next;
+		if (m->next)
+			m->next->prev = m->prev;
+		free_member(m);
+
+		/* Update client->user->channel list */
+		if (mb->prev)
+			mb->prev->next = mb->next;
+		else
+			client->user->channel = mb->next;
+		if (mb->next)
+			mb->next->prev = mb->prev;
+		free_membership(mb);
 	}
 
 	/* Update user record to reflect 1 less joined */
@@ -878,13 +1813,7 @@ char *clean_ban_mask(char *mask, int what, Client *client)
 /** Check if 'client' matches an invite exception (+I) on 'channel' */
 int find_invex(Channel *channel, Client *client)
 {
-	Ban *inv;
-
-	for (inv = channel->invexlist; inv; inv = inv->next)
-		if (ban_check_mask(client, channel, inv->banstr, BANCHK_JOIN, NULL, NULL, 0))
-			return 1;
-
-	return 0;
+	return find_matching_ban(client, channel, &channel->invexlist, BANCHK_JOIN, NULL, NULL) ? 1 : 0;
 }
 
 /** Remove unwanted characters from channel name.
@@ -975,8 +1904,10 @@ Channel *get_channel(Client *client, char *chname, int flag)
 		channel->prevch = NULL;
 		channel->nextch = channels;
 		channel->creationtime = MyUser(client) ? TStime() : 0;
+		channel->ban_serial = 1;
 		channels = channel;
 		add_to_channel_hash_table(chname, channel);
+		channel_directory_link(channel);
 		irccounts.channels++;
 		RunHook2(HOOKTYPE_CHANNEL_CREATE, client, channel);
 	}
@@ -1081,10 +2012,14 @@ int sub1_from_channel(Channel *channel)
 
 	--channel->users;
 	if (channel->users > 0)
+	{
+		channel_directory_update(channel);
 		return 0;
+	}
 
 	/* No users in the channel anymore */
 	channel->users = 0; /* to be sure */
+	channel_directory_update(channel);
 
 	/* If the channel is +P then this hook will actually stop destruction. */
 	RunHook2(HOOKTYPE_CHANNEL_DESTROY, channel, &should_destroy);
@@ -1100,6 +2035,7 @@ int sub1_from_channel(Channel *channel)
 	while ((lp = channel->invites))
 		del_invite(lp->value.client, channel);
 
+	ban_index_free_all(channel);
 	while (channel->banlist)
 	{
 		ban = channel->banlist;
@@ -1140,6 +2076,7 @@ int sub1_from_channel(Channel *channel)
 	if (channel->nextch)
 		channel->nextch->prevch = channel->prevch;
 	del_from_channel_hash_table(channel->chname, channel);
+	channel_directory_unlink(channel, 1);
 
 	irccounts.channels--;
 	safe_free(channel);
@@ -1306,6 +2243,17 @@ int has_common_channels(Client *c1, Client *c2)
 {
 	Membership *lp;
 
+	/* Walk the channel list of whoever is in the fewest channels */
+	if (c2->user && (c2->user->joined < c1->user->joined))
+	{
+		for (lp = c2->user->channel; lp; lp = lp->next)
+		{
+			if (IsMember(c1, lp->channel) && user_can_see_member(c1, c2, lp->channel))
+				return 1;
+		}
+		return 0;
+	}
+
 	for (lp = c1->user->channel; lp; lp = lp->next)
 	{
 		if (IsMember(c2, lp->channel) && user_can_see_member(c1, c2, lp->channel))
@@ -152,6 +152,7 @@ static NameValue _ListenerFlags[] = {
 /* This MUST be alphabetized */
 static NameValue _LinkFlags[] = {
 	{ CONNECT_AUTO,	"autoconnect" },
+	{ CONNECT_COMPRESSED,	"compressed" },
 	{ CONNECT_INSECURE,	"insecure" },
 	{ CONNECT_QUARANTINE, "quarantine"},
 	{ CONNECT_TLS, "ssl" },
@@ -1770,6 +1771,9 @@ void config_setdefaultsettings(Configuration *i)
 	safe_strdup(i->oper_snomask, SNO_DEFOPER);
 	i->ident_read_timeout = 7;
 	i->ident_connect_timeout = 3;
+	i->dns_cache_size = 10000;
+	i->dns_cache_ttl = 600; /* 10m */
+	i->dns_negative_cache_ttl = 60; /* 1m */
 	i->ban_version_tkl_time = 86400; /* 1d */
 	i->spamfilter_ban_time = 86400; /* 1d */
 	safe_strdup(i->spamfilter_ban_reason, "Spam/advertising");
@@ -1806,6 +1810,7 @@ void config_setdefaultsettings(Configuration *i)
 	i->handshake_timeout = 30;
 	i->sasl_timeout = 15;
 	i->handshake_delay = -1;
+	i->tls_handshake_threads = 0;
 	i->broadcast_channel_messages = BROADCAST_CHANNEL_MESSAGES_AUTO;
 
 	/* Flood options */
@@ -2214,6 +2219,7 @@ int	init_conf(char *rootconf, int rehash)
 			Hook *h;
 			safe_strdup(old_pid_file, conf_files->pid_file);
 			unrealdns_delasyncconnects();
+			tls_handshake_pool_drain();
 			config_rehash();
 			Unload_all_loaded_modules();
 
@@ -6721,9 +6727,17 @@ int	_test_link(ConfigFile *conf, ConfigEntry *ce)
 			{
 				if (!strcmp(cepp->ce_varname, "quarantine"))
 					;
+				else if (!strcmp(cepp->ce_varname, "compressed"))
+				{
+#ifndef USE_ZLIB
+					config_warn("%s:%d: link::options::compressed: this UnrealIRCd was compiled without zlib, "
+					            "the link will not be compressed.",
+					            cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum);
+#endif
+				}
 				else
 				{
-					config_error("%s:%d: link::options only has one possible option ('quarantine', rarely used). "
+					config_error("%s:%d: link::options only has two possible options ('compressed' and 'quarantine'). "
 					             "Option '%s' is unrecognized. "
 					             "Perhaps you meant to set an outgoing option in link::outgoing::options instead?",
 					             cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum, cepp->ce_varname);
@@ -7561,6 +7575,9 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		else if (!strcmp(cep->ce_varname, "check-target-nick-bans")) {
 			tempiConf.check_target_nick_bans = config_checkval(cep->ce_vardata, CFG_YESNO);
 		}
+		else if (!strcmp(cep->ce_varname, "profiling")) {
+			tempiConf.profiling = config_checkval(cep->ce_vardata, CFG_YESNO);
+		}
 		else if (!strcmp(cep->ce_varname, "ping-cookie")) {
 			tempiConf.ping_cookie = config_checkval(cep->ce_vardata, CFG_YESNO);
 		}
@@ -7698,6 +7715,15 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 				if (!strcmp(cepp->ce_varname, "bind-ip")) {
 					safe_strdup(tempiConf.dns_bindip, cepp->ce_vardata);
 				}
+				else if (!strcmp(cepp->ce_varname, "cache-size")) {
+					tempiConf.dns_cache_size = atoi(cepp->ce_vardata);
+				}
+				else if (!strcmp(cepp->ce_varname, "cache-ttl")) {
+					tempiConf.dns_cache_ttl = config_checkval(cepp->ce_vardata, CFG_TIME);
+				}
+				else if (!strcmp(cepp->ce_varname, "negative-cache-ttl")) {
+					tempiConf.dns_negative_cache_ttl = config_checkval(cepp->ce_vardata, CFG_TIME);
+				}
 			}
 		}
 		else if (!strcmp(cep->ce_varname, "anti-flood")) {
@@ -7999,6 +8025,10 @@ int	_conf_set(ConfigFile *conf, ConfigEntry *ce)
 		{
 			tempiConf.handshake_delay = config_checkval(cep->ce_vardata, CFG_TIME);
 		}
+		else if (!strcmp(cep->ce_varname, "tls-handshake-threads"))
+		{
+			tempiConf.tls_handshake_threads = atoi(cep->ce_vardata);
+		}
 		else if (!strcmp(cep->ce_varname, "automatic-ban-target"))
 		{
 			tempiConf.automatic_ban_target = ban_target_strtoval(cep->ce_vardata);
@@ -8242,6 +8272,10 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 			CheckNull(cep);
 			CheckDuplicate(cep, check_target_nick_bans, "check-target-nick-bans");
 		}
+		else if (!strcmp(cep->ce_varname, "profiling")) {
+			CheckNull(cep);
+			CheckDuplicate(cep, profiling, "profiling");
+		}
 		else if (!strcmp(cep->ce_varname, "pingpong-warning")) {
 			config_error("%s:%i: set::pingpong-warning no longer exists (the warning is always off)",
 			             cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
@@ -8523,6 +8557,22 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 						}
 					}
 				}
+				else if (!strcmp(cepp->ce_varname, "cache-size")) {
+					int v = atoi(cepp->ce_vardata);
+					CheckDuplicate(cepp, dns_cache_size, "dns::cache-size");
+					if ((v < 0) || (v > 1000000))
+					{
+						config_error("%s:%i: set::dns::cache-size should be between 0 and 1000000 (0 disables the cache)",
+							cepp->ce_fileptr->cf_filename, cepp->ce_varlinenum);
+						errors++;
+					}
+				}
+				else if (!strcmp(cepp->ce_varname, "cache-ttl")) {
+					CheckDuplicate(cepp, dns_cache_ttl, "dns::cache-ttl");
+				}
+				else if (!strcmp(cepp->ce_varname, "negative-cache-ttl")) {
+					CheckDuplicate(cepp, dns_negative_cache_ttl, "dns::negative-cache-ttl");
+				}
 				else
 				{
 					config_error_unknownopt(cepp->ce_fileptr->cf_filename,
@@ -9302,6 +9352,18 @@ int	_test_set(ConfigFile *conf, ConfigEntry *ce)
 				errors++;
 			}
 		}
+		else if (!strcmp(cep->ce_varname, "tls-handshake-threads"))
+		{
+			int v;
+			CheckNull(cep);
+			v = atoi(cep->ce_vardata);
+			if ((v < 0) || (v > TLS_HANDSHAKE_MAX_THREADS))
+			{
+				config_error("%s:%i: set::tls-handshake-threads: value should be between 0 and %d.",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum, TLS_HANDSHAKE_MAX_THREADS);
+				errors++;
+			}
+		}
 		else if (!strcmp(cep->ce_varname, "ban-include-username"))
 		{
 			config_error("%s:%i: set::ban-include-username is no longer supported. "
@@ -20,14 +20,16 @@
 #include "unrealircd.h"
 
 static mp_pool_t *dbuf_bufpool = NULL;
+static mp_pool_t *dbuf_refpool = NULL;
 
 void dbuf_init(void)
 {
-	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024);
+	dbuf_bufpool = mp_pool_new(sizeof(struct dbufbuf) + DBUF_BLOCK_SIZE, 512 * 1024);
+	dbuf_refpool = mp_pool_new(sizeof(struct dbufbuf), 512 * 1024);
 }
 
 /*
-** dbuf_alloc - allocates a dbufbuf structure either from freelist or
+** dbuf_alloc - allocates a private dbufbuf structure either from freelist or
 ** creates a new one.
 */
 static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
@@ -38,6 +40,7 @@ static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
 
 	ptr = mp_pool_get(dbuf_bufpool);
 	memset(ptr, 0, sizeof(dbufbuf));
+	ptr->data = ptr->buf;
 
 	INIT_LIST_HEAD(&ptr->dbuf_node);
 	list_add_tail(&ptr->dbuf_node, &dbuf_p->dbuf_list);
@@ -46,16 +49,29 @@ static dbufbuf *dbuf_alloc(dbuf *dbuf_p)
 }
 
 /*
-** dbuf_free - return a dbufbuf structure to the freelist
+** dbuf_free - return a dbufbuf structure to the freelist,
+** and drop the reference to the shared segment (if any).
 */
 static void dbuf_free(dbufbuf *ptr)
 {
 	assert(ptr != NULL);
 
 	list_del(&ptr->dbuf_node);
+	if (ptr->shared)
+		dbuf_shared_release(ptr->shared);
 	mp_pool_release(ptr);
 }
 
+/*
+** dbuf_room - number of bytes that can still be appended to this block
+*/
+static size_t dbuf_room(dbufbuf *block)
+{
+	if (block->shared)
+		return 0; /* shared segments are immutable */
+	return DBUF_BLOCK_SIZE - (block->data - block->buf) - block->size;
+}
+
 void dbuf_queue_init(dbuf *dyn)
 {
 	INIT_LIST_HEAD(&dyn->dbuf_list);
@@ -74,7 +90,7 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	{
 		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
 
-		amount = DBUF_BLOCK_SIZE - block->size;
+		amount = dbuf_room(block);
 		if (!amount)
 		{
 			block = dbuf_alloc(dyn);
@@ -92,18 +108,67 @@ void dbuf_put(dbuf *dyn, char *buf, size_t length)
 	}
 }
 
-void dbuf_delete(dbuf *dyn, size_t length)
+dbufshared *dbuf_shared_new(char *buf, size_t length)
+{
+	dbufshared *s;
+
+	s = safe_alloc(sizeof(dbufshared) + length);
+	s->refcount = 1;
+	s->size = length;
+	memcpy(s->data, buf, length);
+	return s;
+}
+
+void dbuf_shared_release(dbufshared *s)
+{
+	if (--s->refcount == 0)
+		safe_free(s);
+}
+
+void dbuf_put_shared(dbuf *dyn, dbufshared *s)
+{
+	struct dbufbuf *block;
+
+	assert(s->size > 0);
+
+	/* If it fits in the last (private) block then simply copy it,
+	 * which uses less memory than a reference block.
+	 */
+	if (!list_empty(&dyn->dbuf_list))
+	{
+		block = container_of(dyn->dbuf_list.prev, struct dbufbuf, dbuf_node);
+		if (dbuf_room(block) >= s->size)
+		{
+			dbuf_put(dyn, s->data, s->size);
+			return;
+		}
+	}
+
+	block = mp_pool_get(dbuf_refpool);
+	memset(block, 0, sizeof(dbufbuf));
+	block->shared = s;
+	block->data = s->data;
+	block->size = s->size;
+	s->refcount++;
+
+	INIT_LIST_HEAD(&block->dbuf_node);
+	list_add_tail(&block->dbuf_node, &dyn->dbuf_list);
+	dyn->length += s->size;
+}
+
+int dbuf_delete(dbuf *dyn, size_t length)
 {
 	struct dbufbuf *block;
+	int freed = 0;
 
 	assert(dyn->length >= length);
 	if (length == 0)
-		return;
+		return 0;
 
 	for (;;)
 	{
 		if (length == 0)
-			return;
+			return freed;
 
 		block = container_of(dyn->dbuf_list.next, struct dbufbuf, dbuf_node);
 		if (length < block->size)
@@ -112,11 +177,14 @@ void dbuf_delete(dbuf *dyn, size_t length)
 		dyn->length -= block->size;
 		length -= block->size;
 		dbuf_free(block);
+		freed++;
 	}
 
+	/* Partially consumed: simply skip over the consumed bytes */
 	block->size -= length;
+	block->data += length;
 	dyn->length -= length;
-	memmove(block->data, &block->data[length], block->size);
+	return freed;
 }
 
 /*
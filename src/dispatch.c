@@ -70,6 +70,8 @@ void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 		{
 			fde->read_callback = iocb;
 			changed = 1;
+			if (iocb && fde->edge_triggered)
+				fde->backend_pending |= FD_SELECT_READ;
 		}
 	}
 	if (flags & FD_SELECT_WRITE)
@@ -78,15 +80,33 @@ void fd_setselect(int fd, int flags, IOCallbackFunc iocb, void *data)
 		{
 			fde->write_callback = iocb;
 			changed = 1;
+			if (iocb && fde->edge_triggered)
+				fde->backend_pending |= FD_SELECT_WRITE;
 		}
 	}
 
-	// This is efficient, but.. there are places which do two fd_setselect(),
-	// it would be nice if we can merge this into one syscall..
+	/* Some backends (epoll) merge multiple changes into one syscall */
 	if (changed)
 		fd_refresh(fd);
 }
 
+/** Indicate that the callbacks of this fd are suitable for edge-triggered I/O.
+ * That is: the read callback reads until EAGAIN and the write callback
+ * writes until EAGAIN (or until there is nothing left to write).
+ * This is only used by the epoll backend, and only if compiled with
+ * EPOLL_EDGE_TRIGGERED, otherwise it does nothing.
+ */
+void fd_edge_triggered(int fd)
+{
+#if defined(BACKEND_EPOLL) && defined(EPOLL_EDGE_TRIGGERED)
+	if ((fd < 0) || (fd >= MAXCONNECTIONS) || fd_table[fd].edge_triggered)
+		return;
+
+	fd_table[fd].edge_triggered = 1;
+	fd_refresh(fd);
+#endif
+}
+
 /***************************************************************************************
  * select() backend.                                                                   *
  ***************************************************************************************/
@@ -406,21 +426,64 @@ void fd_select(time_t delay)
 static int epoll_fd = -1;
 static struct epoll_event epfds[MAXCONNECTIONS + 1];
 
+/* Changes to the interest list are not done immediately by fd_refresh(),
+ * but are collected in this set and flushed by fd_select(). This way,
+ * multiple changes to the same fd (eg: setting and clearing the
+ * write callback) within one loop iteration cost at most one syscall.
+ */
+static int dirty_fds[MAXCONNECTIONS + 1];
+static int num_dirty_fds = 0;
+static unsigned char fd_is_dirty[MAXCONNECTIONS + 1];
+
+#ifdef EPOLL_EDGE_TRIGGERED
+/* Edge-triggered fds that have events pending in fde->backend_pending */
+static int pending_fds[MAXCONNECTIONS + 1];
+static int num_pending_fds = 0;
+static unsigned char fd_is_pending[MAXCONNECTIONS + 1];
+static int run_fds[MAXCONNECTIONS + 1];
+#endif
+
 void fd_refresh(int fd)
+{
+	if (!fd_is_dirty[fd])
+	{
+		fd_is_dirty[fd] = 1;
+		dirty_fds[num_dirty_fds++] = fd;
+	}
+#ifdef EPOLL_EDGE_TRIGGERED
+	if (fd_table[fd].backend_pending && !fd_is_pending[fd])
+	{
+		fd_is_pending[fd] = 1;
+		pending_fds[num_pending_fds++] = fd;
+	}
+#endif
+}
+
+/** Update the epoll interest list for this fd, if needed */
+static void fd_flush(int fd)
 {
 	struct epoll_event ep_event;
 	FDEntry *fde = &fd_table[fd];
 	unsigned int pflags = 0;
 	int op = -1;
 
-	if (epoll_fd == -1)
-		epoll_fd = epoll_create(MAXCONNECTIONS);
-
-	if (fde->read_callback)
-		pflags |= EPOLLIN;
+#ifdef EPOLL_EDGE_TRIGGERED
+	if (fde->edge_triggered && (fde->read_callback || fde->write_callback))
+	{
+		/* Registered once, regardless of which callbacks are set.
+		 * If a callback is (re)set then fd_setselect() marks it in
+		 * backend_pending so we call it without waiting for an edge.
+		 */
+		pflags = EPOLLIN | EPOLLOUT | EPOLLET;
+	} else
+#endif
+	{
+		if (fde->read_callback)
+			pflags |= EPOLLIN;
 
-	if (fde->write_callback)
-		pflags |= EPOLLOUT;
+		if (fde->write_callback)
+			pflags |= EPOLLOUT;
+	}
 
 	if (pflags == 0 && fde->backend_flags == 0)
 		return;
@@ -438,6 +501,7 @@ void fd_refresh(int fd)
 	ep_event.events = pflags;
 	ep_event.data.ptr = fde;
 
+	ircstats.is_evctl++;
 	if (epoll_ctl(epoll_fd, op, fd, &ep_event) != 0)
 	{
 		if (ERRNO == P_EWOULDBLOCK || ERRNO == P_EAGAIN)
@@ -451,6 +515,52 @@ void fd_refresh(int fd)
 	fde->backend_flags = pflags;
 }
 
+/** Flush all pending interest list changes, see fd_refresh() */
+static void fd_flush_dirty(void)
+{
+	int i, fd;
+
+	for (i = 0; i < num_dirty_fds; i++)
+	{
+		fd = dirty_fds[i];
+		fd_is_dirty[fd] = 0;
+		fd_flush(fd);
+	}
+	num_dirty_fds = 0;
+}
+
+#ifdef EPOLL_EDGE_TRIGGERED
+/** Call the callbacks of edge-triggered fds that were (re)set,
+ * since any edge may have happened while the callback was not set.
+ * The callbacks must handle being called when there is nothing
+ * to read or write (they will simply hit EAGAIN).
+ */
+static void fd_run_pending(void)
+{
+	int i, n, fd, flags;
+	FDEntry *fde;
+
+	/* Only process the current ones, any new ones are for the next round */
+	n = num_pending_fds;
+	memcpy(run_fds, pending_fds, n * sizeof(int));
+	num_pending_fds = 0;
+	for (i = 0; i < n; i++)
+	{
+		fd = run_fds[i];
+		fd_is_pending[fd] = 0;
+		fde = &fd_table[fd];
+		flags = fde->backend_pending;
+		fde->backend_pending = 0;
+		if (!fde->edge_triggered)
+			continue; /* fd was closed */
+		if ((flags & FD_SELECT_READ) && fde->read_callback)
+			fde->read_callback(fd, FD_SELECT_READ, fde->data);
+		if ((flags & FD_SELECT_WRITE) && fde->write_callback)
+			fde->write_callback(fd, FD_SELECT_WRITE, fde->data);
+	}
+}
+#endif
+
 void fd_select(time_t delay)
 {
 	int num, p, revents, fd;
@@ -463,7 +573,17 @@ void fd_select(time_t delay)
 	if (epoll_fd == -1)
 		epoll_fd = epoll_create(MAXCONNECTIONS);
 
+	fd_flush_dirty();
+
+#ifdef EPOLL_EDGE_TRIGGERED
+	if (num_pending_fds)
+		delay = 0; /* don't wait, we have work to do already */
+#endif
+
 	num = epoll_wait(epoll_fd, epfds, MAXCONNECTIONS, delay);
+#ifdef EPOLL_EDGE_TRIGGERED
+	fd_run_pending();
+#endif
 	if (num <= 0)
 		return;
 
@@ -41,7 +41,7 @@ void unrealdns_cb_nametoip_link(void *arg, int status, int timeouts, struct host
 void unrealdns_delasyncconnects(void);
 static uint64_t unrealdns_hash_ip(const char *ip);
 static void unrealdns_addtocache(char *name, char *ip);
-static char *unrealdns_findcache_ip(char *ip);
+static DNSCache *unrealdns_findcache_ip(char *ip);
 struct hostent *unreal_create_hostent(char *name, char *ip);
 static void unrealdns_freeandremovereq(DNSReq *r);
 void unrealdns_removecacherecord(DNSCache *c);
@@ -57,8 +57,10 @@ DNSStats dnsstats;
 
 static DNSReq *requests = NULL; /**< Linked list of requests (pending responses). */
 
-static DNSCache *cache_list = NULL; /**< Linked list of cache */
-static DNSCache *cache_hashtbl[DNS_HASH_SIZE]; /**< Hash table of cache */
+static DNSCache *cache_list = NULL; /**< Linked list of cache, most recently used first */
+static DNSCache *cache_tail = NULL; /**< Last entry in cache_list, the first to be evicted */
+static DNSCache **cache_hashtbl = NULL; /**< Hash table of cache */
+static unsigned int cache_hashtbl_size = 0; /**< Size of cache_hashtbl (power of 2) */
 
 static unsigned int unrealdns_num_cache = 0; /**< # of cache entries in memory */
 
@@ -131,7 +133,8 @@ void init_resolver(int firsttime)
 		
 	if (firsttime)
 	{
-		memset(&cache_hashtbl, 0, sizeof(cache_hashtbl));
+		cache_hashtbl_size = DNS_HASH_MIN_SIZE;
+		cache_hashtbl = safe_alloc(sizeof(DNSCache *) * cache_hashtbl_size);
 		memset(&dnsstats, 0, sizeof(dnsstats));
 		siphash_generate_key(siphashkey_dns_ip);
 		ares_library_init(ARES_LIB_INIT_ALL);
@@ -203,11 +206,17 @@ void unrealdns_addreqtolist(DNSReq *r)
 struct hostent *unrealdns_doclient(Client *client)
 {
 	DNSReq *r;
-	char *cache_name;
+	DNSCache *c;
 
-	cache_name = unrealdns_findcache_ip(client->ip);
-	if (cache_name)
-		return unreal_create_hostent(cache_name, client->ip);
+	c = unrealdns_findcache_ip(client->ip);
+	if (c)
+	{
+		if (c->name)
+			return unreal_create_hostent(c->name, client->ip);
+		/* Negative entry: we recently found that this IP does not resolve */
+		proceed_normal_client_handshake(client, NULL);
+		return NULL;
+	}
 
 	/* Create a request */
 	r = safe_alloc(sizeof(DNSReq));
@@ -269,7 +278,11 @@ void unrealdns_cb_iptoname(void *arg, int status, int timeouts, struct hostent *
 	/* Check for status and null name (yes, we must) */
 	if ((status != 0) || !he->h_name || !*he->h_name)
 	{
-		/* Failed */
+		/* Failed. Only remember it if the IP really has no name,
+		 * not if the resolver timed out or failed otherwise.
+		 */
+		if ((status == ARES_ENOTFOUND) || (status == ARES_ENODATA) || (status == 0))
+			unrealdns_addtocache(NULL, client->ip);
 		proceed_normal_client_handshake(client, NULL);
 		return;
 	}
@@ -345,13 +358,15 @@ void unrealdns_cb_nametoip_verify(void *arg, int status, int timeouts, struct ho
 	if (!he->h_addr_list[i])
 	{
 		/* Failed name <-> IP mapping */
+		unrealdns_addtocache(NULL, client->ip);
 		proceed_normal_client_handshake(client, NULL);
 		goto bad;
 	}
 
 	if (!verify_hostname(r->name))
 	{
-		/* Hostname is bad, don't cache and consider unresolved */
+		/* Hostname is bad, consider unresolved */
+		unrealdns_addtocache(NULL, client->ip);
 		proceed_normal_client_handshake(client, NULL);
 		goto bad;
 	}
@@ -440,13 +455,68 @@ void unrealdns_cb_nametoip_link(void *arg, int status, int timeouts, struct host
 
 static uint64_t unrealdns_hash_ip(const char *ip)
 {
-        return siphash(ip, siphashkey_dns_ip) % DNS_HASH_SIZE;
+        return siphash(ip, siphashkey_dns_ip) & (cache_hashtbl_size - 1);
+}
+
+/** Resize the cache hash table, re-adding all entries */
+static void unrealdns_resizecache(unsigned int newsize)
+{
+	DNSCache *c;
+	unsigned int hashv;
+
+	safe_free(cache_hashtbl);
+	cache_hashtbl = safe_alloc(sizeof(DNSCache *) * newsize);
+	cache_hashtbl_size = newsize;
+
+	for (c = cache_list; c; c = c->next)
+	{
+		hashv = unrealdns_hash_ip(c->ip);
+		c->hprev = NULL;
+		c->hnext = cache_hashtbl[hashv];
+		if (c->hnext)
+			c->hnext->hprev = c;
+		cache_hashtbl[hashv] = c;
+	}
+}
+
+/** Put a cache record at the head of the list (most recently used) */
+static void unrealdns_cachelist_addhead(DNSCache *c)
+{
+	c->prev = NULL;
+	c->next = cache_list;
+	if (cache_list)
+		cache_list->prev = c;
+	else
+		cache_tail = c;
+	cache_list = c;
+}
+
+/** Take a cache record out of the list (but not out of the hash table) */
+static void unrealdns_cachelist_del(DNSCache *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		cache_list = c->next; /* new list HEAD */
+
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		cache_tail = c->prev; /* new list TAIL */
 }
 
+/** Add a record to the cache.
+ * @param name	The verified hostname, or NULL if the IP does not resolve.
+ * @param ip	The IP address
+ */
 static void unrealdns_addtocache(char *name, char *ip)
 {
 	unsigned int hashv;
 	DNSCache *c;
+	long ttl = name ? DNS_CACHE_TTL : DNS_NEGATIVE_CACHE_TTL;
+
+	if ((DNS_CACHE_SIZE <= 0) || (ttl <= 0))
+		return; /* caching disabled */
 
 	dnsstats.cache_adds++;
 
@@ -454,23 +524,39 @@ static void unrealdns_addtocache(char *name, char *ip)
 
 	/* Check first if it is already present in the cache.
 	 * This is possible, when 2 clients connect at the same time.
-	 */	
+	 * In that case we simply update the entry.
+	 */
 	for (c = cache_hashtbl[hashv]; c; c = c->hnext)
+	{
 		if (!strcmp(ip, c->ip))
-			return; /* already present in cache */
+		{
+			safe_strdup(c->name, name);
+			c->expires = TStime() + ttl;
+			unrealdns_cachelist_del(c);
+			unrealdns_cachelist_addhead(c);
+			return;
+		}
+	}
 
-	/* Remove last item, if we got too many entries.. */
-	if (unrealdns_num_cache >= DNS_MAX_ENTRIES)
+	/* Remove the least recently used item(s), if we got too many entries.. */
+	while (cache_tail && (unrealdns_num_cache >= DNS_CACHE_SIZE))
 	{
-		for (c = cache_list; c->next; c = c->next);
-		unrealdns_removecacherecord(c);
+		dnsstats.cache_evictions++;
+		unrealdns_removecacherecord(cache_tail);
+	}
+
+	/* Keep the average hash chain length below 1 */
+	if (unrealdns_num_cache >= cache_hashtbl_size)
+	{
+		unrealdns_resizecache(cache_hashtbl_size * 2);
+		hashv = unrealdns_hash_ip(ip);
 	}
 
 	/* Create record */
 	c = safe_alloc(sizeof(DNSCache));
 	safe_strdup(c->name, name);
 	safe_strdup(c->ip, ip);
-	c->expires = TStime() + DNSCACHE_TTL;
+	c->expires = TStime() + ttl;
 	
 	/* Add to hash table */
 	if (cache_hashtbl[hashv])
@@ -481,21 +567,17 @@ static void unrealdns_addtocache(char *name, char *ip)
 	cache_hashtbl[hashv] = c;
 	
 	/* Add to linked list */
-	if (cache_list)
-	{
-		cache_list->prev = c;
-		c->next = cache_list;
-	}
-	cache_list = c;
+	unrealdns_cachelist_addhead(c);
 
 	unrealdns_num_cache++;
 	/* DONE */
 }
 
 /** Search the cache for a confirmed ip->name and name->ip match, by address.
- * @returns The resolved hostname, or NULL if not found in cache.
+ * @returns The cache record, or NULL if not found in cache.
+ *          If the name of the record is NULL then the IP is known not to resolve.
  */
-static char *unrealdns_findcache_ip(char *ip)
+static DNSCache *unrealdns_findcache_ip(char *ip)
 {
 	unsigned int hashv;
 	DNSCache *c;
@@ -503,11 +585,28 @@ static char *unrealdns_findcache_ip(char *ip)
 	hashv = unrealdns_hash_ip(ip);
 	
 	for (c = cache_hashtbl[hashv]; c; c = c->hnext)
+	{
 		if (!strcmp(ip, c->ip))
 		{
-			dnsstats.cache_hits++;
-			return c->name;
+			if (c->expires < TStime())
+			{
+				dnsstats.cache_expired++;
+				unrealdns_removecacherecord(c);
+				break;
+			}
+			if (c->name)
+				dnsstats.cache_hits++;
+			else
+				dnsstats.cache_negative_hits++;
+			/* Move to the front, so it is evicted last */
+			if (c != cache_list)
+			{
+				unrealdns_cachelist_del(c);
+				unrealdns_cachelist_addhead(c);
+			}
+			return c;
 		}
+	}
 	
 	dnsstats.cache_misses++;
 	return NULL;
@@ -524,15 +623,9 @@ unsigned int hashv;
 	 * <next listitem>->previous
 	 * <previous hashitem>->next
 	 * <next hashitem>->prev.
-	 * And we need to update 'cache_list' and 'cache_hash[]' if needed.
+	 * And we need to update 'cache_list', 'cache_tail' and 'cache_hash[]' if needed.
 	 */
-	if (c->prev)
-		c->prev->next = c->next;
-	else
-		cache_list = c->next; /* new list HEAD */
-	
-	if (c->next)
-		c->next->prev = c->prev;
+	unrealdns_cachelist_del(c);
 	
 	if (c->hprev)
 		c->hprev->hnext = c->hnext;
@@ -564,6 +657,7 @@ DNSCache *c, *next;
 		next = c->next;
 		if (c->expires < TStime())
 		{
+			dnsstats.cache_expired++;
 #if 0
 			sendto_realops(client, "[Syzop/DNS] Expire: %s [%s] (%ld < %ld)",
 				c->name, c->ip, c->expires, TStime());
@@ -664,7 +758,7 @@ CMD_FUNC(cmd_dns)
 	{
 		sendtxtnumeric(client, "DNS CACHE List (%u items):", unrealdns_num_cache);
 		for (c = cache_list; c; c = c->next)
-			sendtxtnumeric(client, " %s [%s]", c->name, c->ip);
+			sendtxtnumeric(client, " %s [%s]", c->name ? c->name : "<unresolved>", c->ip);
 	} else
 	if (*param == 'r') /* LIST REQUESTS */
 	{
@@ -678,15 +772,7 @@ CMD_FUNC(cmd_dns)
 			client->name, client->user->username, client->user->realhost);
 		
 		while (cache_list)
-		{
-			c = cache_list->next;
-			safe_free(cache_list->name);
-			safe_free(cache_list->ip);
-			safe_free(cache_list);
-			cache_list = c;
-		}
-		memset(&cache_hashtbl, 0, sizeof(cache_hashtbl));
-		unrealdns_num_cache = 0;
+			unrealdns_removecacherecord(cache_list);
 		sendnotice(client, "DNS Cache has been cleared");
 	} else
 	if (*param == 'i') /* INFORMATION */
@@ -728,8 +814,13 @@ CMD_FUNC(cmd_dns)
 	} else /* STATISTICS */
 	{
 		sendtxtnumeric(client, "DNS CACHE Stats:");
-		sendtxtnumeric(client, " hits: %d", dnsstats.cache_hits);
-		sendtxtnumeric(client, " misses: %d", dnsstats.cache_misses);
+		sendtxtnumeric(client, " entries: %u (max %d, %u hash buckets)", unrealdns_num_cache, DNS_CACHE_SIZE, cache_hashtbl_size);
+		sendtxtnumeric(client, " hits: %u", dnsstats.cache_hits);
+		sendtxtnumeric(client, " negative hits: %u", dnsstats.cache_negative_hits);
+		sendtxtnumeric(client, " misses: %u", dnsstats.cache_misses);
+		sendtxtnumeric(client, " adds: %u", dnsstats.cache_adds);
+		sendtxtnumeric(client, " evictions: %u", dnsstats.cache_evictions);
+		sendtxtnumeric(client, " expired: %u", dnsstats.cache_expired);
 	}
 	return;
 }
@@ -267,6 +267,20 @@ static char siphashkey_chan[SIPHASH_KEY_LENGTH];
 static char siphashkey_watch[SIPHASH_KEY_LENGTH];
 static char siphashkey_whowas[SIPHASH_KEY_LENGTH];
 static char siphashkey_throttling[SIPHASH_KEY_LENGTH];
+static char siphashkey_membership[SIPHASH_KEY_LENGTH];
+static char siphashkey_banindex[SIPHASH_KEY_LENGTH];
+static char siphashkey_ipusers[SIPHASH_KEY_LENGTH];
+static IpUsersBucket *IpUsersHash[IPUSERS_HASH_TABLE_SIZE];
+static int ipusers_addresses = 0;
+static int ipusers_prefixes = 0;
+
+/* The membership hash table is keyed on (client, channel) pointers.
+ * Unlike the other tables it grows, since the number of memberships
+ * can be a lot higher than the number of clients or channels.
+ */
+static Membership **membershipTable = NULL;
+static unsigned int membership_table_size = 0; /* always a power of 2 */
+static unsigned int membership_count = 0;
 
 extern char unreallogo[];
 
@@ -280,6 +294,9 @@ void init_hash(void)
 	siphash_generate_key(siphashkey_watch);
 	siphash_generate_key(siphashkey_whowas);
 	siphash_generate_key(siphashkey_throttling);
+	siphash_generate_key(siphashkey_membership);
+	siphash_generate_key(siphashkey_banindex);
+	siphash_generate_key(siphashkey_ipusers);
 
 	for (i = 0; i < NICK_HASH_TABLE_SIZE; i++)
 		INIT_LIST_HEAD(&clientTable[i]);
@@ -290,6 +307,7 @@ void init_hash(void)
 	memset(channelTable, 0, sizeof(channelTable));
 	memset(watchTable, 0, sizeof(watchTable));
 	memset(ThrottlingHash, 0, sizeof(ThrottlingHash));
+	memset(IpUsersHash, 0, sizeof(IpUsersHash));
 
 	if (strcmp(BASE_VERSION, &unreallogo[337]))
 		loop.tainted = 1;
@@ -315,6 +333,114 @@ uint64_t hash_whowas_name(const char *name)
 	return siphash_nocase(name, siphashkey_whowas) % WHOWAS_HASH_TABLE_SIZE;
 }
 
+/** Hash a (lowercased) key of a channel ban index.
+ * The caller is responsible for reducing it to the table size.
+ */
+uint64_t hash_ban_index_key(const char *key)
+{
+	return siphash(key, siphashkey_banindex);
+}
+
+static inline unsigned int hash_membership(Client *client, Channel *channel, unsigned int size)
+{
+	void *key[2];
+
+	key[0] = client;
+	key[1] = channel;
+	return siphash_raw((char *)key, sizeof(key), siphashkey_membership) & (size - 1);
+}
+
+/** Resize the membership hash table, re-adding all entries */
+static void resize_membership_hash_table(unsigned int newsize)
+{
+	Membership **newtable = safe_alloc(sizeof(Membership *) * newsize);
+	Membership *mb, *next;
+	unsigned int i, hashv;
+
+	for (i = 0; i < membership_table_size; i++)
+	{
+		for (mb = membershipTable[i]; mb; mb = next)
+		{
+			next = mb->hnext;
+			hashv = hash_membership(mb->client, mb->channel, newsize);
+			mb->hnext = newtable[hashv];
+			newtable[hashv] = mb;
+		}
+	}
+	safe_free(membershipTable);
+	membershipTable = newtable;
+	membership_table_size = newsize;
+}
+
+/** Add a membership to the membership hash table.
+ * @param mb	The membership, with mb->client and mb->channel set.
+ */
+void add_to_membership_hash_table(Membership *mb)
+{
+	unsigned int hashv;
+
+	/* Keep the average chain length below 1 */
+	if (membership_count >= membership_table_size)
+		resize_membership_hash_table(membership_table_size ? membership_table_size * 2 : MEMBERSHIP_HASH_TABLE_MIN_SIZE);
+
+	hashv = hash_membership(mb->client, mb->channel, membership_table_size);
+	mb->hnext = membershipTable[hashv];
+	membershipTable[hashv] = mb;
+	membership_count++;
+}
+
+/** Delete a membership from the membership hash table */
+void del_from_membership_hash_table(Membership *mb)
+{
+	Membership **p;
+
+	if (!membershipTable)
+		return;
+
+	for (p = &membershipTable[hash_membership(mb->client, mb->channel, membership_table_size)]; *p; p = &(*p)->hnext)
+	{
+		if (*p == mb)
+		{
+			*p = mb->hnext;
+			mb->hnext = NULL;
+			membership_count--;
+			return;
+		}
+	}
+}
+
+/** Find the membership of a client in a channel.
+ * @param client	The client
+ * @param channel	The channel
+ * @returns The membership (client->user->channel entry), or NULL if not a member.
+ *          The channel->members entry is available as ->member.
+ */
+Membership *hash_find_membership(Client *client, Channel *channel)
+{
+	Membership *mb;
+
+	if (!membershipTable)
+		return NULL;
+
+	for (mb = membershipTable[hash_membership(client, channel, membership_table_size)]; mb; mb = mb->hnext)
+		if ((mb->client == client) && (mb->channel == channel))
+			return mb;
+
+	return NULL;
+}
+
+/** Memory used by the membership hash table.
+ * This is the bucket array plus the fields in Member and Membership
+ * that only exist for the sake of the index (prev, client, member,
+ * hnext and channel).
+ */
+void count_membership_memory(int *count, int *buckets, u_long *memory)
+{
+	*count = membership_count;
+	*buckets = membership_table_size;
+	*memory = membership_table_size * sizeof(Membership *) + membership_count * 6 * sizeof(void *);
+}
+
 /*
  * add_to_client_hash_table
  */
@@ -1023,3 +1149,135 @@ int throttle_can_connect(Client *client)
 		return 2;
 	}
 }
+
+/*** Per-IP user counts ***/
+
+static uint64_t hash_ip_users(const char *ip)
+{
+	return siphash(ip, siphashkey_ipusers) % IPUSERS_HASH_TABLE_SIZE;
+}
+
+/** Find the user counts of an IP address (or IPv6 prefix, eg "2001:db8::/64").
+ * This is used by allow::maxperip and allow::global-maxperip, so we don't
+ * have to walk through all clients for each client that connects.
+ * @param ip	The IP address, as in GetIP()
+ * @returns The bucket, or NULL if there are no users with this IP.
+ */
+IpUsersBucket *find_ip_users(const char *ip)
+{
+	IpUsersBucket *b;
+
+	for (b = IpUsersHash[hash_ip_users(ip)]; b; b = b->next)
+		if (!strcmp(b->ip, ip))
+			return b;
+	return NULL;
+}
+
+static IpUsersBucket *make_ip_users(const char *ip)
+{
+	IpUsersBucket *b = find_ip_users(ip);
+
+	if (b)
+		return b;
+	b = safe_alloc(sizeof(IpUsersBucket));
+	safe_strdup(b->ip, ip);
+	AddListItem(b, IpUsersHash[hash_ip_users(ip)]);
+	return b;
+}
+
+static void free_ip_users(IpUsersBucket *b)
+{
+	DelListItem(b, IpUsersHash[hash_ip_users(b->ip)]);
+	safe_free(b->ip);
+	safe_free(b);
+}
+
+/** Get the /64 of an IPv6 address, eg "2001:db8::/64".
+ * @returns 1 if this is an IPv6 address, 0 if not.
+ */
+static int ipv6_prefix64(const char *ip, char *buf, size_t buflen)
+{
+	unsigned char addr[16];
+
+	if (!strchr(ip, ':') || (inet_pton(AF_INET6, ip, addr) != 1))
+		return 0;
+	memset(addr + 8, 0, 8);
+	if (!inet_ntop(AF_INET6, addr, buf, buflen - 3))
+		return 0;
+	strlcat(buf, "/64", buflen);
+	return 1;
+}
+
+/** Count a (local or remote) user that has just registered.
+ * Called from register_user() once the IP address is final.
+ */
+void add_ip_users(Client *client)
+{
+	IpUsersBucket *b;
+	char prefix[64];
+
+	if (client->ipusers)
+		return; /* already counted */
+
+	b = make_ip_users(GetIP(client));
+	if (!b->global_clients)
+	{
+		ipusers_addresses++;
+		if (ipv6_prefix64(GetIP(client), prefix, sizeof(prefix)))
+		{
+			b->prefix = make_ip_users(prefix);
+			if (!b->prefix->global_clients)
+				ipusers_prefixes++;
+		}
+	}
+	b->global_clients++;
+	if (MyConnect(client))
+		b->local_clients++;
+	if (b->prefix)
+	{
+		b->prefix->global_clients++;
+		if (MyConnect(client))
+			b->prefix->local_clients++;
+	}
+	client->ipusers = b;
+}
+
+/** Stop counting a user, called when the user is removed from the client list */
+void del_ip_users(Client *client)
+{
+	IpUsersBucket *b = client->ipusers;
+
+	if (!b)
+		return;
+	client->ipusers = NULL;
+
+	if (b->prefix)
+	{
+		b->prefix->global_clients--;
+		if (MyConnect(client))
+			b->prefix->local_clients--;
+	}
+	b->global_clients--;
+	if (MyConnect(client))
+		b->local_clients--;
+
+	if (b->global_clients <= 0)
+	{
+		ipusers_addresses--;
+		if (b->prefix && (b->prefix->global_clients <= 0))
+		{
+			ipusers_prefixes--;
+			free_ip_users(b->prefix);
+		}
+		free_ip_users(b);
+	}
+}
+
+/** Memory used by the per-IP user counts */
+void count_ip_users_memory(int *addresses, int *prefixes, u_long *memory)
+{
+	*addresses = ipusers_addresses;
+	*prefixes = ipusers_prefixes;
+	/* Approximation: the bucket plus a short IP string */
+	*memory = sizeof(IpUsersHash) + (ipusers_addresses + ipusers_prefixes) * (sizeof(IpUsersBucket) + 24);
+}
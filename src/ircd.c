@@ -554,7 +554,6 @@ void fix_timers(void)
 {
 	int i, cnt;
 	Client *client;
-	Event *e;
 	struct ThrottlingBucket *thr;
 	ConfigItem_link *lnk;
 
@@ -599,14 +598,7 @@ void fix_timers(void)
 	}
 
 	/* Reset all event timers */
-	for (e = events; e; e = e->next)
-	{
-		if (e->last_run.tv_sec > TStime())
-		{
-			e->last_run.tv_sec = TStime()-1;
-			e->last_run.tv_usec = 0;
-		}
-	}
+	EventFixTimers();
 
 	/* For throttling we only have to deal with time jumping backward, which
 	 * is a real problem as if the jump was, say, 900 seconds, then it would
@@ -1283,9 +1275,8 @@ int InitUnrealIRCd(int argc, char *argv[])
  */
 void SocketLoop(void *dummy)
 {
-	struct timeval doevents_tv, process_clients_tv;
+	struct timeval process_clients_tv;
 
-	memset(&doevents_tv, 0, sizeof(doevents_tv));
 	memset(&process_clients_tv, 0, sizeof(process_clients_tv));
 
 	while (1)
@@ -1295,8 +1286,8 @@ void SocketLoop(void *dummy)
 
 		detect_timeshift_and_warn();
 
-		if (minimum_msec_since_last_run(&doevents_tv, 250))
-			DoEvents();
+		/* Run the events that are due (cheap if there are none) */
+		DoEvents();
 
 		/* Update statistics */
 		if (irccounts.clients > irccounts.global_max)
@@ -1304,8 +1295,8 @@ void SocketLoop(void *dummy)
 		if (irccounts.me_clients > irccounts.me_max)
 			irccounts.me_max = irccounts.me_clients;
 
-		/* Process I/O */
-		fd_select(SOCKETLOOP_MAX_DELAY);
+		/* Process I/O, waiting no longer than until the next event is due */
+		fd_select(NextEventDelay(client_input_queued ? SOCKETLOOP_MAX_DELAY : SOCKETLOOP_IDLE_MAX_DELAY));
 
 		if (minimum_msec_since_last_run(&process_clients_tv, 200))
 			process_clients();
@@ -162,6 +162,7 @@ void free_client(Client *client)
 			safe_free(client->local->error_str);
 			if (client->local->hostp)
 				unreal_free_hostent(client->local->hostp);
+			zip_free(client);
 			
 			mp_pool_release(client->local);
 		}
@@ -299,6 +300,7 @@ void remove_client_from_list(Client *client)
 		irccounts.clients--;
 		if (client->srvptr && client->srvptr->serv)
 			client->srvptr->serv->users--;
+		del_ip_users(client);
 	}
 	if (IsUnknown(client) || IsConnecting(client) || IsHandshake(client)
 		|| IsTLSHandshake(client)
@@ -449,11 +449,17 @@ int unreal_match(Match *m, char *str)
 	
 	if (m->type == MATCH_PCRE_REGEX)
 	{
-		pcre2_match_data *md = pcre2_match_data_create(9, NULL);
+		/* We never use the match data, unfortunately the argument must be
+		 * non-NULL for pcre2_match(). So create it once and reuse it,
+		 * rather than allocating and freeing it on every call.
+		 */
+		static pcre2_match_data *md = NULL;
 		int ret;
-		
+
+		if (!md)
+			md = pcre2_match_data_create(9, NULL);
+
 		ret = pcre2_match(m->ext.pcre2_expr, str, PCRE2_ZERO_TERMINATED, 0, 0, md, NULL); /* run the regex */
-		pcre2_match_data_free(md); /* yeah, we never use it. unfortunately argument must be non-NULL for pcre2_match() */
 		
 		if (ret > 0)
 			return 1; /* MATCH */		
@@ -516,6 +516,7 @@ int read_channeldb(void)
 		R_SAFE(read_listmode(db, &channel->banlist));
 		R_SAFE(read_listmode(db, &channel->exlist));
 		R_SAFE(read_listmode(db, &channel->invexlist));
+		channel_bans_changed(channel);
 		R_SAFE(unrealdb_read_int32(db, &magic));
 		FreeChannelEntry();
 		added++;
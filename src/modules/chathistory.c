@@ -16,14 +16,6 @@ ModuleHeader MOD_HEADER
 	"unrealircd-5",
 };
 
-/* Structs */
-typedef struct ChatHistoryTarget ChatHistoryTarget;
-struct ChatHistoryTarget {
-	ChatHistoryTarget *prev, *next;
-	char *datetime;
-	char *object;
-};
-
 /* Forward declarations */
 CMD_FUNC(cmd_chathistory);
 
@@ -73,65 +65,22 @@ int chathistory_token(char *str, char *token, char **store)
 	return 0;
 }
 
-static void add_chathistory_target_list(ChatHistoryTarget *new, ChatHistoryTarget **list)
-{
-	ChatHistoryTarget *x, *last = NULL;
-
-	if (!*list)
-	{
-		/* We are the only item. Easy. */
-		*list = new;
-		return;
-	}
-
-	for (x = *list; x; x = x->next)
-	{
-		last = x;
-		if (strcmp(new->datetime, x->datetime) >= 0)
-			break;
-	}
-
-	if (x)
-	{
-		if (x->prev)
-		{
-			/* We will insert ourselves just before this item */
-			new->prev = x->prev;
-			new->next = x;
-			x->prev->next = new;
-			x->prev = new;
-		} else {
-			/* We are the new head */
-			*list = new;
-			new->next = x;
-			x->prev = new;
-		}
-	} else
-	{
-		/* We are the last item */
-		last->next = new;
-		new->prev = last;
-	}
-}
-
-static void add_chathistory_target(ChatHistoryTarget **list, HistoryResult *r)
+/** Sort CHATHISTORY TARGETS on datetime, latest first.
+ * For the same datetime, the channel that comes later in the
+ * membership list goes first (the order that we always used).
+ */
+static int chathistory_targets_cmp(const void *a, const void *b)
 {
-	MessageTag *m;
-	time_t ts;
-	char *datetime;
-	ChatHistoryTarget *e;
+	HistoryTarget *one = *(HistoryTarget **)a;
+	HistoryTarget *two = *(HistoryTarget **)b;
+	int n = strcmp(two->datetime, one->datetime);
 
-	if (!r->log || !((m = find_mtag(r->log->mtags, "time"))) || !m->value)
-		return;
-	datetime = m->value;
-
-	e = safe_alloc(sizeof(ChatHistoryTarget));
-	safe_strdup(e->datetime, datetime);
-	safe_strdup(e->object, r->object);
-	add_chathistory_target_list(e, list);
+	if (n)
+		return n;
+	return (one < two) ? 1 : -1;
 }
 
-static void chathistory_targets_send_line(Client *client, ChatHistoryTarget *r, char *batchid)
+static void chathistory_targets_send_line(Client *client, HistoryTarget *r, char *batchid)
 {
 	MessageTag *mtags = NULL;
 	MessageTag *m;
@@ -153,14 +102,12 @@ static void chathistory_targets_send_line(Client *client, ChatHistoryTarget *r,
 void chathistory_targets(Client *client, HistoryFilter *filter, int limit)
 {
 	Membership *mp;
-	HistoryResult *r;
+	HistoryTarget *targets, **sorted;
 	char batch[BATCHLEN+1];
-	int sent = 0;
-	ChatHistoryTarget *targets = NULL, *targets_next;
+	int count = 0, found = 0, sent = 0, i;
 
-	/* 1. Grab all information we need */
+	/* 1. Grab all information we need, for all channels in one go */
 
-	filter->cmd = HFC_BEFORE;
 	if (strcmp(filter->timestamp_a, filter->timestamp_b) < 0)
 	{
 		/* Swap if needed */
@@ -168,17 +115,20 @@ void chathistory_targets(Client *client, HistoryFilter *filter, int limit)
 		filter->timestamp_a = filter->timestamp_b;
 		filter->timestamp_b = swap;
 	}
-	filter->limit = 1;
 
 	for (mp = client->user->channel; mp; mp = mp->next)
+		count++;
+	targets = safe_alloc(sizeof(HistoryTarget) * (count + 1));
+	sorted = safe_alloc(sizeof(HistoryTarget *) * (count + 1));
+	for (mp = client->user->channel, i = 0; mp; mp = mp->next, i++)
+		targets[i].object = mp->channel->chname;
+
+	if (count && history_request_targets(targets, count, filter))
 	{
-		Channel *channel = mp->channel;
-		r = history_request(channel->chname, filter);
-		if (r)
-		{
-			add_chathistory_target(&targets, r);
-			free_history_result(r);
-		}
+		for (i = 0; i < count; i++)
+			if (*targets[i].datetime)
+				sorted[found++] = &targets[i];
+		qsort(sorted, found, sizeof(HistoryTarget *), chathistory_targets_cmp);
 	}
 
 	/* 2. Now send it to the client */
@@ -191,19 +141,18 @@ void chathistory_targets(Client *client, HistoryFilter *filter, int limit)
 		sendto_one(client, NULL, ":%s BATCH +%s draft/chathistory-targets", me.name, batch);
 	}
 
-	for (; targets; targets = targets_next)
+	for (i = 0; i < found; i++)
 	{
-		targets_next = targets->next;
 		if (++sent < limit)
-			chathistory_targets_send_line(client, targets, batch);
-		safe_free(targets->datetime);
-		safe_free(targets->object);
-		safe_free(targets);
+			chathistory_targets_send_line(client, sorted[i], batch);
 	}
 
 	/* End of batch */
 	if (*batch)
 		sendto_one(client, NULL, ":%s BATCH -%s", me.name, batch);
+
+	safe_free(sorted);
+	safe_free(targets);
 }
 
 CMD_FUNC(cmd_chathistory)
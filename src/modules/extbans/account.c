@@ -40,7 +40,7 @@ MOD_INIT()
 	req.is_ok = NULL;
 	req.conv_param = extban_account_conv_param;
 	req.is_banned = extban_account_is_banned;
-	req.options = EXTBOPT_INVEX|EXTBOPT_TKL;
+	req.options = EXTBOPT_INVEX|EXTBOPT_TKL|EXTBOPT_CACHEABLE;
 	if (!ExtbanAdd(modinfo->handle, req))
 	{
 		config_error("could not register extended ban type");
@@ -41,7 +41,7 @@ MOD_INIT()
 	req.is_ok = extban_certfp_is_ok;
 	req.conv_param = extban_certfp_conv_param;
 	req.is_banned = extban_certfp_is_banned;
-	req.options = EXTBOPT_INVEX|EXTBOPT_TKL;
+	req.options = EXTBOPT_INVEX|EXTBOPT_TKL|EXTBOPT_CACHEABLE;
 	if (!ExtbanAdd(modinfo->handle, req))
 	{
 		config_error("could not register extended ban type");
@@ -39,7 +39,7 @@ MOD_INIT()
 	req.is_ok = extban_is_ok_nuh_extban;
 	req.conv_param = extban_conv_param_nuh_or_extban;
 	req.is_banned = extban_modej_is_banned;
-	req.options = EXTBOPT_ACTMODIFIER;
+	req.options = EXTBOPT_ACTMODIFIER|EXTBOPT_CACHEABLE;
 	if (!ExtbanAdd(modinfo->handle, req))
 	{
 		config_error("could not register extended ban type");
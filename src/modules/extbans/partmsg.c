@@ -37,7 +37,7 @@ MOD_INIT()
 	req.flag = 'p';
 	req.is_ok = extban_is_ok_nuh_extban;
 	req.conv_param = extban_conv_param_nuh_or_extban;
-	req.options = EXTBOPT_ACTMODIFIER;
+	req.options = EXTBOPT_ACTMODIFIER|EXTBOPT_CACHEABLE;
 	req.is_banned = extban_partmsg_is_banned;
 	if (!ExtbanAdd(modinfo->handle, req))
 	{
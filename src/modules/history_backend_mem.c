@@ -4,6 +4,12 @@
  */
 #include "unrealircd.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+/* Write the persistent history files from a separate thread */
+#define USE_HISTORY_WRITER_THREAD
+#endif
+
 /* This is the memory type backend. It is optimized for speed.
  * For example, per-channel, it caches the field "number of lines"
  * and "oldest record", so frequent cleaning operations such as
@@ -55,6 +61,23 @@ ModuleHeader MOD_HEADER
 #define HISTORYDB_MAGIC_FILE_END	0xEFEFEFEF
 #define HISTORYDB_MAGIC_ENTRY_START	0xFFFFFFFF
 #define HISTORYDB_MAGIC_ENTRY_END	0xEEEEEEEE
+#define HISTORYDB_MAGIC_JOURNAL_START	0xFDFDFDFD
+
+/* Version 5001 added the journal generation to the header */
+#define HISTORYDB_VERSION	5001
+
+/* With 'persist' enabled, the history of a channel is stored in a base
+ * file with all lines, followed by journal segments with only the lines
+ * that were added since the previous save. So saving a busy channel
+ * is proportional to the number of new lines, not to the size of
+ * the history. Lines that are removed from the log (too old, too many)
+ * are removed again when reading the files back in.
+ * Every now and then the base file is rewritten and the segments are
+ * deleted (compaction): when there are HISTORY_JOURNAL_MAX_SEGMENTS
+ * segments, or when there are more lines on disk than twice the number
+ * of lines in memory.
+ */
+#define HISTORY_JOURNAL_MAX_SEGMENTS	16
 
 /* Definitions (structs, etc.) -- all for persistent history */
 struct cfgstruct {
@@ -64,6 +87,34 @@ struct cfgstruct {
 	char *db_secret;
 };
 
+/** A chunk of line storage, see hbm_storage_alloc() */
+typedef struct HistoryChunk HistoryChunk;
+struct HistoryChunk {
+	HistoryChunk *prev, *next;
+	size_t size; /**< Size of the data area, which follows this struct */
+	size_t used; /**< Number of bytes used in the data area */
+	int lines; /**< Number of lines in this chunk that are not deleted yet */
+};
+
+/** A stored line: the HistoryLogLine, followed by its message tags and all strings */
+typedef struct HistoryRecord HistoryRecord;
+struct HistoryRecord {
+	HistoryChunk *chunk;
+	HistoryLogLine line;
+};
+
+/** An entry in the index of a history object, see hbm_index_build() */
+typedef struct HistoryIndexEntry HistoryIndexEntry;
+struct HistoryIndexEntry {
+	HistoryLogLine *line;
+	int64_t t; /**< Time of the line in msec, or -1 if the "time" tag is not in the usual format */
+	char *time; /**< Value of the "time" message tag (can be NULL) */
+	char *msgid; /**< Value of the "msgid" message tag (can be NULL) */
+	int hnext; /**< Next slot in the msgid hash chain, or -1 */
+};
+
+typedef struct HistoryWriteJob HistoryWriteJob;
+
 typedef struct HistoryLogObject HistoryLogObject;
 struct HistoryLogObject {
 	HistoryLogObject *prev, *next;
@@ -71,9 +122,27 @@ struct HistoryLogObject {
 	HistoryLogLine *tail; /**< End of the log (the latest entry) */
 	int num_lines; /**< Number of lines of log */
 	time_t oldest_t; /**< Oldest time in log */
+	char *latest_time; /**< "time" tag of the last line (h->tail), for CHATHISTORY TARGETS */
 	int max_lines; /**< Maximum number of lines permitted */
 	long max_time; /**< Maximum number of seconds to retain history */
 	int dirty; /**< Dirty flag, used for disk writing */
+	HistoryIndexEntry *index; /**< Ring buffer with all lines in order, NULL if not built (yet) */
+	int *index_hash; /**< Hash table on msgid: first slot of each chain, or -1 */
+	int index_size; /**< Size of the ring buffer and of the hash table, a power of two */
+	int index_start; /**< Slot of the first (earliest) line in the ring buffer */
+	int index_count; /**< Number of lines in the ring buffer */
+	int index_sorted; /**< All lines have a usual "time" tag and are in chronological order */
+	HistoryChunk *chunks; /**< Storage of the lines, oldest chunk first */
+	HistoryChunk *chunks_tail; /**< Chunk that new lines are stored in */
+	size_t storage_size; /**< Total size of all chunks */
+	int journal_pending; /**< Number of lines at the end of the log that are not saved yet */
+	int journal_segments; /**< Number of journal segments after the base file */
+	int journal_lines; /**< Number of lines in the base file and journal segments */
+	int journal_reset; /**< Rewrite the base file on the next save, eg after a removal we can't replay */
+	uint64_t journal_generation; /**< Generation of the base file, 0 if never written */
+	long id; /**< Unique id of this object, see HistoryWriteJob */
+	int writer_jobs; /**< Number of write jobs that read lines from our storage */
+	HistoryWriteJob *writer_last; /**< The last of those jobs */
 	char name[OBJECTLEN+1];
 };
 
@@ -83,6 +152,7 @@ struct cfgstruct test;
 static char *siphashkey_history_backend_mem = NULL;
 HistoryLogObject **history_hash_table;
 static long already_loaded = 0;
+static long hbm_object_serial = 0; /**< For HistoryLogObject->id */
 static char *hbm_prehash = NULL;
 static char *hbm_posthash = NULL;
 
@@ -100,17 +170,25 @@ int hbm_modechar_del(Channel *channel, int modechar);
 int hbm_history_add(char *object, MessageTag *mtags, char *line);
 int hbm_history_cleanup(HistoryLogObject *h);
 HistoryResult *hbm_history_request(char *object, HistoryFilter *filter);
+int hbm_history_targets(HistoryTarget *targets, int count, HistoryFilter *filter);
 int hbm_history_destroy(char *object);
 int hbm_history_set_limit(char *object, int max_lines, long max_time);
+int hbm_stats(Client *client, char *flag);
 EVENT(history_mem_clean);
 EVENT(history_mem_init);
 static int hbm_read_masterdb(void);
 static void hbm_read_dbs(void);
-static int hbm_read_db(char *fname);
+static int hbm_read_db(char *fname, HistoryLogObject *journal_of);
 static int hbm_write_masterdb(void);
 static int hbm_write_db(HistoryLogObject *h);
 static void hbm_delete_db(HistoryLogObject *h);
 static void hbm_flush(void);
+static void hbm_read_journal(HistoryLogObject *h, char *fname);
+static void hbm_journal_filename(char *buf, size_t buflen, char *fname, int n);
+static void hbm_unlink_journal(char *fname);
+static void hbm_writer_collect(void);
+static void hbm_writer_stop(void);
+static void hbm_writer_orphan_storage(HistoryWriteJob *job, HistoryChunk *chunks);
 void hbm_generic_free(ModData *m);
 void hbm_free_all_history(ModData *m);
 
@@ -137,6 +215,7 @@ MOD_INIT()
 	setcfg(&cfg);
 
 	LoadPersistentLong(modinfo, already_loaded);
+	LoadPersistentLong(modinfo, hbm_object_serial);
 	LoadPersistentPointer(modinfo, siphashkey_history_backend_mem, hbm_generic_free);
 	LoadPersistentPointer(modinfo, history_hash_table, hbm_free_all_history);
 	if (history_hash_table == NULL)
@@ -147,6 +226,7 @@ MOD_INIT()
 	HookAdd(modinfo->handle, HOOKTYPE_MODECHAR_DEL, 0, hbm_modechar_del);
 	HookAdd(modinfo->handle, HOOKTYPE_REHASH, 0, hbm_rehash);
 	HookAdd(modinfo->handle, HOOKTYPE_REHASH_COMPLETE, 0, hbm_rehash_complete);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, hbm_stats);
 
 	if (siphashkey_history_backend_mem == NULL)
 	{
@@ -158,6 +238,7 @@ MOD_INIT()
 	hbi.name = "mem";
 	hbi.history_add = hbm_history_add;
 	hbi.history_request = hbm_history_request;
+	hbi.history_targets = hbm_history_targets;
 	hbi.history_destroy = hbm_history_destroy;
 	hbi.history_set_limit = hbm_history_set_limit;
 	if (!HistoryBackendAdd(modinfo->handle, &hbi))
@@ -202,6 +283,7 @@ MOD_UNLOAD()
 {
 	if (loop.ircd_terminating)
 		hbm_flush();
+	hbm_writer_stop();
 	freecfg(&test);
 	freecfg(&cfg);
 	SavePersistentPointer(modinfo, hbm_prehash);
@@ -209,6 +291,7 @@ MOD_UNLOAD()
 	SavePersistentPointer(modinfo, history_hash_table);
 	SavePersistentPointer(modinfo, siphashkey_history_backend_mem);
 	SavePersistentLong(modinfo, already_loaded);
+	SavePersistentLong(modinfo, hbm_object_serial);
 	return MOD_SUCCESS;
 }
 
@@ -458,6 +541,7 @@ HistoryLogObject *hbm_find_or_add_object(char *object)
 	/* Create new one */
 	h = safe_alloc(sizeof(HistoryLogObject));
 	strlcpy(h->name, object, sizeof(h->name));
+	h->id = ++hbm_object_serial;
 	AddListItem(h, history_hash_table[hashv]);
 	return h;
 }
@@ -496,18 +580,420 @@ int hbm_modechar_del(Channel *channel, int modechar)
 	return 0;
 }
 
-void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
+/* The index of a history object.
+ * CHATHISTORY requests refer to a msgid or a timestamp, for which we
+ * would otherwise have to walk the entire log and look at the message
+ * tags of each line. So, on the first such request for a history object
+ * we build an index: a ring buffer with all lines in order, with the
+ * "time" tag parsed to msec and a hash table on msgid. After that it is
+ * kept up to date when lines are added or removed at the head, which is
+ * the normal case. Anything else simply throws the index away, and it
+ * is built again on the next request.
+ * As long as all lines are in chronological order (the normal case)
+ * we can use a binary search to find a timestamp. If not, we fall back
+ * to comparing the time strings one by one, like we used to do.
+ */
+#define HBM_INDEX_MIN_SIZE	16
+#define HBM_INDEX_SLOT(h, i)	(((h)->index_start + (i)) & ((h)->index_size - 1))
+#define HBM_INDEX_ENTRY(h, i)	(&(h)->index[HBM_INDEX_SLOT(h, i)])
+
+/** Parse a "time" message tag value to msec since the epoch.
+ * @returns the time, or -1 if it is not in the usual
+ *          YYYY-MM-DDThh:mm:ss.sssZ format (with valid values).
+ * @note For times in this format, comparing the returned values
+ *       gives the same result as doing strcmp() on the strings.
+ */
+static int64_t hbm_parse_time(const char *str)
+{
+	static const char *format = "dddd-dd-ddTdd:dd:dd.dddZ";
+	static const int days_in_month[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int year, mon, day, hour, min, sec, msec, y;
+	int64_t days;
+	int i;
+
+	for (i = 0; format[i]; i++)
+	{
+		if (format[i] == 'd' ? !isdigit(str[i]) : (str[i] != format[i]))
+			return -1;
+	}
+	if (str[i])
+		return -1;
+
+#define DIGITS2(p)	(((p)[0] - '0') * 10 + ((p)[1] - '0'))
+	year = DIGITS2(str) * 100 + DIGITS2(str + 2);
+	mon = DIGITS2(str + 5);
+	day = DIGITS2(str + 8);
+	hour = DIGITS2(str + 11);
+	min = DIGITS2(str + 14);
+	sec = DIGITS2(str + 17);
+	msec = DIGITS2(str + 20) * 10 + (str[22] - '0');
+#undef DIGITS2
+
+	if ((year < 1970) || (mon < 1) || (mon > 12) || (day < 1) || (day > days_in_month[mon - 1]) ||
+	    (hour > 23) || (min > 59) || (sec > 59))
+		return -1;
+	if ((mon == 2) && (day == 29) && !(((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0)))
+		return -1;
+
+	/* Days since 1970-01-01, counting years from March so leap days come last */
+	y = year - (mon <= 2);
+	days = (int64_t)y * 365 + y / 4 - y / 100 + y / 400 +
+	       (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1 - 719468;
+
+	return ((days * 86400 + hour * 3600 + min * 60 + sec) * 1000) + msec;
+}
+
+static uint64_t hbm_index_hash(HistoryLogObject *h, const char *msgid)
+{
+	return siphash(msgid, siphashkey_history_backend_mem) & (h->index_size - 1);
+}
+
+static void hbm_index_hash_add(HistoryLogObject *h, int slot)
 {
-	MessageTag *n;
+	HistoryIndexEntry *e = &h->index[slot];
+	int hashv;
 
-	/* Duplicate all message tags */
-	for (; m; m = m->next)
+	if (!e->msgid)
 	{
-		n = duplicate_mtag(m);
-		AppendListItem(n, l->mtags);
+		e->hnext = -1;
+		return;
 	}
-	n = find_mtag(l->mtags, "time");
-	if (!n)
+	hashv = hbm_index_hash(h, e->msgid);
+	e->hnext = h->index_hash[hashv];
+	h->index_hash[hashv] = slot;
+}
+
+static void hbm_index_hash_del(HistoryLogObject *h, int slot)
+{
+	HistoryIndexEntry *e = &h->index[slot];
+	int *p;
+
+	if (!e->msgid)
+		return;
+	for (p = &h->index_hash[hbm_index_hash(h, e->msgid)]; *p != -1; p = &h->index[*p].hnext)
+	{
+		if (*p == slot)
+		{
+			*p = e->hnext;
+			return;
+		}
+	}
+}
+
+static void hbm_index_free(HistoryLogObject *h)
+{
+	safe_free(h->index);
+	safe_free(h->index_hash);
+	h->index_size = h->index_start = h->index_count = h->index_sorted = 0;
+}
+
+/** Change the size of the index to 'size' (which must be a power of two) */
+static void hbm_index_resize(HistoryLogObject *h, int size)
+{
+	HistoryIndexEntry *index = safe_alloc(sizeof(HistoryIndexEntry) * size);
+	int i;
+
+	for (i = 0; i < h->index_count; i++)
+		index[i] = *HBM_INDEX_ENTRY(h, i);
+	safe_free(h->index);
+	safe_free(h->index_hash);
+	h->index = index;
+	h->index_size = size;
+	h->index_start = 0;
+	h->index_hash = safe_alloc(sizeof(int) * size);
+	for (i = 0; i < size; i++)
+		h->index_hash[i] = -1;
+	for (i = 0; i < h->index_count; i++)
+		hbm_index_hash_add(h, i);
+}
+
+/** Add line 'l' to the end of the index */
+static void hbm_index_append(HistoryLogObject *h, HistoryLogLine *l)
+{
+	HistoryIndexEntry *e;
+	MessageTag *m;
+	int slot;
+
+	if (h->index_count == h->index_size)
+		hbm_index_resize(h, h->index_size * 2);
+
+	slot = HBM_INDEX_SLOT(h, h->index_count);
+	e = &h->index[slot];
+	e->line = l;
+	m = find_mtag(l->mtags, "time");
+	e->time = m ? m->value : NULL;
+	e->t = e->time ? hbm_parse_time(e->time) : -1;
+	m = find_mtag(l->mtags, "msgid");
+	e->msgid = m ? m->value : NULL;
+	hbm_index_hash_add(h, slot);
+
+	if ((e->t < 0) || (h->index_count && (e->t < HBM_INDEX_ENTRY(h, h->index_count - 1)->t)))
+		h->index_sorted = 0;
+	h->index_count++;
+}
+
+/** Build the index of history object 'h' */
+static void hbm_index_build(HistoryLogObject *h)
+{
+	HistoryLogLine *l;
+	int size = HBM_INDEX_MIN_SIZE;
+
+	while (size < h->num_lines)
+		size *= 2;
+	hbm_index_free(h);
+	hbm_index_resize(h, size);
+	h->index_sorted = 1;
+	for (l = h->head; l; l = l->next)
+		hbm_index_append(h, l);
+}
+
+/** Line 'l' is about to be deleted from history object 'h' */
+static void hbm_index_del_line(HistoryLogObject *h, HistoryLogLine *l)
+{
+	if (!h->index)
+		return;
+
+	if (h->index_count && (h->index[h->index_start].line == l))
+	{
+		/* Deleting the first line, the usual case */
+		hbm_index_hash_del(h, h->index_start);
+		h->index_start = HBM_INDEX_SLOT(h, 1);
+		h->index_count--;
+	} else {
+		/* Somewhere in the middle, just rebuild it later */
+		hbm_index_free(h);
+	}
+}
+
+/** Find the position of the first line with a time later
+ * than 'timestamp', or, if 'inclusive' is set, equal or later.
+ * @returns the position in the index, or index_count if none.
+ */
+static int hbm_index_find_time(HistoryLogObject *h, const char *timestamp, int inclusive)
+{
+	HistoryIndexEntry *e;
+	int64_t t;
+	int lo, hi, mid, i;
+
+	if (h->index_sorted && ((t = hbm_parse_time(timestamp)) >= 0))
+	{
+		lo = 0;
+		hi = h->index_count;
+		while (lo < hi)
+		{
+			mid = lo + (hi - lo) / 2;
+			e = HBM_INDEX_ENTRY(h, mid);
+			if (inclusive ? (e->t >= t) : (e->t > t))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		return lo;
+	}
+
+	for (i = 0; i < h->index_count; i++)
+	{
+		e = HBM_INDEX_ENTRY(h, i);
+		if (e->time && (inclusive ? (strcmp(e->time, timestamp) >= 0) : (strcmp(e->time, timestamp) > 0)))
+			return i;
+	}
+	return h->index_count;
+}
+
+/** Find the position of the last line with a time earlier than 'timestamp'.
+ * @returns the position in the index, or -1 if none.
+ */
+static int hbm_index_find_time_before(HistoryLogObject *h, const char *timestamp)
+{
+	HistoryIndexEntry *e;
+	int i;
+
+	if (h->index_sorted && (hbm_parse_time(timestamp) >= 0))
+		return hbm_index_find_time(h, timestamp, 1) - 1;
+
+	for (i = h->index_count - 1; i >= 0; i--)
+	{
+		e = HBM_INDEX_ENTRY(h, i);
+		if (e->time && (strcmp(e->time, timestamp) < 0))
+			return i;
+	}
+	return -1;
+}
+
+/** Find the position of the line with the specified msgid.
+ * @param last	If there are multiple, return the last one rather than the first.
+ * @returns the position in the index, or -1 if not found.
+ */
+static int hbm_index_find_msgid(HistoryLogObject *h, const char *msgid, int last)
+{
+	HistoryIndexEntry *e;
+	int slot, pos, ret = -1;
+
+	for (slot = h->index_hash[hbm_index_hash(h, msgid)]; slot != -1; slot = e->hnext)
+	{
+		e = &h->index[slot];
+		if (!strcmp(e->msgid, msgid))
+		{
+			pos = (slot - h->index_start) & (h->index_size - 1);
+			if ((ret == -1) || (last ? (pos > ret) : (pos < ret)))
+				ret = pos;
+		}
+	}
+	return ret;
+}
+
+/* Line storage.
+ * Rather than allocating each line and each of its message tags
+ * separately, a line is stored as one record: the HistoryLogLine,
+ * followed by its MessageTag structs, followed by the line and the
+ * names and values of the tags. Records are allocated from chunks
+ * which belong to the history object. Since lines are normally
+ * deleted in the same order as they were added, a chunk becomes
+ * empty as a whole and is freed. The chunk size grows with the
+ * amount of history of the object, to keep the number of
+ * allocations low without wasting memory on quiet channels.
+ * Results of history requests borrow the lines and tags from here.
+ */
+#define HBM_ALIGN(x)		(((x) + 7) & ~((size_t)7))
+#define HBM_CHUNK_DATA(c)	((char *)(c) + HBM_ALIGN(sizeof(HistoryChunk)))
+#define HBM_CHUNK_MIN_SIZE	1024
+#define HBM_CHUNK_MAX_SIZE	65536
+#define HBM_RECORD(l)		((HistoryRecord *)((char *)(l) - offsetof(HistoryRecord, line)))
+
+/** Allocate a record of 'size' bytes for history object 'h' */
+static HistoryRecord *hbm_storage_alloc(HistoryLogObject *h, size_t size)
+{
+	HistoryChunk *c = h->chunks_tail;
+	HistoryRecord *rec;
+	size_t chunk_size;
+
+	if (!c || (c->size - c->used < size))
+	{
+		chunk_size = h->storage_size / 4;
+		if (chunk_size < HBM_CHUNK_MIN_SIZE)
+			chunk_size = HBM_CHUNK_MIN_SIZE;
+		else if (chunk_size > HBM_CHUNK_MAX_SIZE)
+			chunk_size = HBM_CHUNK_MAX_SIZE;
+		if (chunk_size < size)
+			chunk_size = size;
+		c = safe_alloc(HBM_ALIGN(sizeof(HistoryChunk)) + chunk_size);
+		c->size = chunk_size;
+		c->prev = h->chunks_tail;
+		if (h->chunks_tail)
+			h->chunks_tail->next = c;
+		else
+			h->chunks = c;
+		h->chunks_tail = c;
+		h->storage_size += chunk_size;
+	}
+
+	rec = (HistoryRecord *)(HBM_CHUNK_DATA(c) + c->used);
+	c->used += size;
+	c->lines++;
+	rec->chunk = c;
+	return rec;
+}
+
+/** Free (or reuse) chunk 'c' of history object 'h', which has no lines left */
+static void hbm_storage_release_chunk(HistoryLogObject *h, HistoryChunk *c)
+{
+	if (c == h->chunks_tail)
+	{
+		/* Still in use for new lines, start from the beginning again */
+		c->used = 0;
+		return;
+	}
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		h->chunks = c->next;
+	c->next->prev = c->prev; /* (there is always a next, since we are not the tail) */
+	h->storage_size -= c->size;
+	safe_free(c);
+}
+
+/** Free the storage of line 'l' of history object 'h' */
+static void hbm_storage_free(HistoryLogObject *h, HistoryLogLine *l)
+{
+	HistoryChunk *c = HBM_RECORD(l)->chunk;
+
+	if (--c->lines > 0)
+		return;
+
+	/* The writer thread may still be reading lines from this chunk,
+	 * then it is released later by hbm_storage_sweep().
+	 */
+	if (h->writer_jobs)
+		return;
+
+	hbm_storage_release_chunk(h, c);
+}
+
+/** Release the chunks that became empty while write jobs were pending */
+static void hbm_storage_sweep(HistoryLogObject *h)
+{
+	HistoryChunk *c, *c_next;
+
+	for (c = h->chunks; c; c = c_next)
+	{
+		c_next = c->next;
+		if (c->lines == 0)
+			hbm_storage_release_chunk(h, c);
+	}
+}
+
+/** Free a list of chunks */
+static void hbm_storage_free_chunks(HistoryChunk *c)
+{
+	HistoryChunk *c_next;
+
+	for (; c; c = c_next)
+	{
+		c_next = c->next;
+		safe_free(c);
+	}
+}
+
+/** Free all storage of history object 'h' */
+static void hbm_storage_free_all(HistoryLogObject *h)
+{
+	if (h->writer_jobs)
+	{
+		/* The writer thread may still be reading lines from it,
+		 * the last job frees it, see hbm_writer_finish().
+		 */
+		hbm_writer_orphan_storage(h->writer_last, h->chunks);
+	} else {
+		hbm_storage_free_chunks(h->chunks);
+	}
+	h->chunks = h->chunks_tail = NULL;
+	h->storage_size = 0;
+}
+
+/** Store a new line in history object 'h' */
+static HistoryLogLine *hbm_store_line(HistoryLogObject *h, MessageTag *mtags, char *line)
+{
+	HistoryRecord *rec;
+	HistoryLogLine *l;
+	MessageTag *m, *tags;
+	char timebuf[64];
+	char *p;
+	int has_time = 0, num_tags = 0, i;
+	size_t size, len;
+
+	/* First calculate the size of the record */
+	size = strlen(line) + 1;
+	for (m = mtags; m; m = m->next)
+	{
+		num_tags++;
+		size += strlen(m->name) + 1;
+		if (m->value)
+			size += strlen(m->value) + 1;
+		if (!strcmp(m->name, "time"))
+			has_time = 1;
+	}
+	if (!has_time)
 	{
 		/* This is duplicate code from src/modules/server-time.c
 		 * which seems silly.
@@ -515,12 +1001,11 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 		struct timeval t;
 		struct tm *tm;
 		time_t sec;
-		char buf[64];
 
 		gettimeofday(&t, NULL);
 		sec = t.tv_sec;
 		tm = gmtime(&sec);
-		snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+		snprintf(timebuf, sizeof(timebuf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
 			tm->tm_year + 1900,
 			tm->tm_mon + 1,
 			tm->tm_mday,
@@ -528,22 +1013,71 @@ void hbm_duplicate_mtags(HistoryLogLine *l, MessageTag *m)
 			tm->tm_min,
 			tm->tm_sec,
 			(int)(t.tv_usec / 1000));
+		num_tags++;
+		size += strlen("time") + 1 + strlen(timebuf) + 1;
+	}
+	size = HBM_ALIGN(HBM_ALIGN(sizeof(HistoryRecord)) + sizeof(MessageTag) * num_tags + size);
+
+	/* Now fill it in */
+	rec = hbm_storage_alloc(h, size);
+	l = &rec->line;
+	memset(l, 0, sizeof(HistoryLogLine));
+	tags = (MessageTag *)((char *)rec + HBM_ALIGN(sizeof(HistoryRecord)));
+	p = (char *)(tags + num_tags);
+
+#define HBM_STORE_STRING(dst, src) \
+	do { \
+		len = strlen(src) + 1; \
+		memcpy(p, src, len); \
+		dst = p; \
+		p += len; \
+	} while(0)
+
+	HBM_STORE_STRING(l->line, line);
+	i = 0;
+	if (!has_time)
+	{
+		/* The generated "time" tag goes first */
+		HBM_STORE_STRING(tags[i].name, "time");
+		HBM_STORE_STRING(tags[i].value, timebuf);
+		i++;
+	}
+	for (m = mtags; m; m = m->next, i++)
+	{
+		HBM_STORE_STRING(tags[i].name, m->name);
+		if (m->value)
+			HBM_STORE_STRING(tags[i].value, m->value);
+		else
+			tags[i].value = NULL;
+	}
+#undef HBM_STORE_STRING
 
-		n = safe_alloc(sizeof(MessageTag));
-		safe_strdup(n->name, "time");
-		safe_strdup(n->value, buf);
-		AddListItem(n, l->mtags);
+	for (i = 0; i < num_tags; i++)
+	{
+		tags[i].prev = (i > 0) ? &tags[i - 1] : NULL;
+		tags[i].next = (i < num_tags - 1) ? &tags[i + 1] : NULL;
 	}
+	l->mtags = num_tags ? tags : NULL;
+
 	/* Now convert the "time" message tag to something we can use in l->t */
-	l->t = server_time_to_unix_time(n->value);
+	m = find_mtag(l->mtags, "time");
+	l->t = server_time_to_unix_time(m->value);
+	return l;
+}
+
+/** Returns the "time" tag of a stored line (there always is one) */
+static char *hbm_line_time(HistoryLogLine *l)
+{
+	MessageTag *m = find_mtag(l->mtags, "time");
+
+	return m ? m->value : NULL;
 }
 
 /** Add a line to a history object */
 void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, char *line)
 {
-	HistoryLogLine *l = safe_alloc(sizeof(HistoryLogLine) + strlen(line));
-	strcpy(l->line, line); /* safe, see memory allocation above ^ */
-	hbm_duplicate_mtags(l, mtags);
+	HistoryLogLine *l = hbm_store_line(h, mtags, line);
+
 	if (h->tail)
 	{
 		/* append to tail */
@@ -556,13 +1090,23 @@ void hbm_history_add_line(HistoryLogObject *h, MessageTag *mtags, char *line)
 	}
 	h->dirty = 1;
 	h->num_lines++;
+	h->journal_pending++;
+	h->latest_time = hbm_line_time(l);
 	if ((l->t < h->oldest_t) || (h->oldest_t == 0))
 		h->oldest_t = l->t;
+	if (h->index)
+		hbm_index_append(h, l);
 }
 
 /** Delete a line from a history object */
 void hbm_history_del_line(HistoryLogObject *h, HistoryLogLine *l)
 {
+	hbm_index_del_line(h, l);
+
+	/* The journal can only replay removals from the head, see hbm_write_db() */
+	if (h->head != l)
+		h->journal_reset = 1;
+
 	if (l->prev)
 		l->prev->next = l->next;
 	if (l->next)
@@ -576,13 +1120,15 @@ void hbm_history_del_line(HistoryLogObject *h, HistoryLogLine *l)
 	{
 		/* New tail */
 		h->tail = l->prev; /* could be NULL now */
+		h->latest_time = h->tail ? hbm_line_time(h->tail) : NULL;
 	}
 
-	free_message_tags(l->mtags);
-	safe_free(l);
+	hbm_storage_free(h, l);
 
 	h->dirty = 1;
 	h->num_lines--;
+	if (h->journal_pending > h->num_lines)
+		h->journal_pending = h->num_lines;
 
 	/* IMPORTANT: updating h->oldest_t takes place at the caller
 	 * because it is in a better position to optimize the process
@@ -612,11 +1158,13 @@ int hbm_history_add(char *object, MessageTag *mtags, char *line)
 	return 0;
 }
 
-HistoryLogLine *duplicate_log_line(HistoryLogLine *l)
+/** Create a line for a result, which borrows the line and mtags from 'l' */
+static HistoryLogLine *duplicate_log_line(HistoryLogLine *l)
 {
-	HistoryLogLine *n = safe_alloc(sizeof(HistoryLogLine) + strlen(l->line));
-	strcpy(n->line, l->line); /* safe, see memory allocation above ^ */
-	hbm_duplicate_mtags(n, l->mtags);
+	HistoryLogLine *n = safe_alloc(sizeof(HistoryLogLine));
+	n->t = l->t;
+	n->mtags = l->mtags;
+	n->line = l->line;
 	return n;
 }
 
@@ -654,44 +1202,37 @@ static void hbm_result_prepend_line(HistoryResult *r, HistoryLogLine *n)
  */
 static int hbm_return_after(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
+	HistoryIndexEntry *e;
+	HistoryLogLine *n;
 	int written = 0;
-	int started = 0;
-	MessageTag *m;
+	int start = h->index_count;
+	int i;
 
-	for (l = h->head; l; l = l->next)
+	/* Find the starting point */
+	if (filter->timestamp_a)
+		start = hbm_index_find_time(h, filter->timestamp_a, 0);
+	if (filter->msgid_a && ((i = hbm_index_find_msgid(h, filter->msgid_a, 0)) >= 0) && (i < start))
+		start = i + 1; /* (excluding the line with the msgid itself) */
+
+	for (i = start; i < h->index_count; i++)
 	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
+		e = HBM_INDEX_ENTRY(h, i);
+
+		/* Check if we need to stop */
+		if (filter->timestamp_b && e->time && (strcmp(e->time, filter->timestamp_b) >= 0))
 		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) > 0))
-			{
-				started = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = 1;
-				continue;
-			}
-		}
-		if (started)
+			break;
+		} else
+		if (filter->msgid_b && e->msgid && !strcmp(e->msgid, filter->msgid_b))
 		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) >= 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
-
-			/* Add line to the return buffer */
-			n = duplicate_log_line(l);
-			hbm_result_append_line(r, n);
-			if (++written >= filter->limit)
-				break;
+			break;
 		}
+
+		/* Add line to the return buffer */
+		n = duplicate_log_line(e->line);
+		hbm_result_append_line(r, n);
+		if (++written >= filter->limit)
+			break;
 	}
 
 	return written;
@@ -707,44 +1248,37 @@ static int hbm_return_after(HistoryResult *r, HistoryLogObject *h, HistoryFilter
  */
 static int hbm_return_before(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
+	HistoryIndexEntry *e;
+	HistoryLogLine *n;
 	int written = 0;
-	int started = 0;
-	MessageTag *m;
+	int start = -1;
+	int i;
+
+	/* Find the starting point */
+	if (filter->timestamp_a)
+		start = hbm_index_find_time_before(h, filter->timestamp_a);
+	if (filter->msgid_a && ((i = hbm_index_find_msgid(h, filter->msgid_a, 1)) >= 0) && (i > start))
+		start = i - 1; /* (excluding the line with the msgid itself) */
 
-	for (l = h->tail; l; l = l->prev)
+	for (i = start; i >= 0; i--)
 	{
-		/* Not started yet? Check if this is the starting point... */
-		if (!started)
+		e = HBM_INDEX_ENTRY(h, i);
+
+		/* Check if we need to stop */
+		if (filter->timestamp_b && e->time && (strcmp(e->time, filter->timestamp_b) < 0))
 		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) < 0))
-			{
-				started = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				started = 1;
-				continue;
-			}
-		}
-		if (started)
+			break;
+		} else
+		if (filter->msgid_b && e->msgid && !strcmp(e->msgid, filter->msgid_b))
 		{
-			/* Check if we need to stop */
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) < 0))
-			{
-				break;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				break;
-			}
-
-			/* Add line to the return buffer */
-			n = duplicate_log_line(l);
-			hbm_result_prepend_line(r, n);
-			if (++written >= filter->limit)
-				break;
+			break;
 		}
+
+		/* Add line to the return buffer */
+		n = duplicate_log_line(e->line);
+		hbm_result_prepend_line(r, n);
+		if (++written >= filter->limit)
+			break;
 	}
 
 	return written;
@@ -759,19 +1293,21 @@ static int hbm_return_before(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_latest(HistoryResult *r, HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l, *n;
+	HistoryIndexEntry *e;
+	HistoryLogLine *n;
 	int written = 0;
-	MessageTag *m;
+	int i;
 
-	for (l = h->tail; l; l = l->prev)
+	for (i = h->index_count - 1; i >= 0; i--)
 	{
-		if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) <= 0))
+		e = HBM_INDEX_ENTRY(h, i);
+		if (filter->timestamp_a && e->time && (strcmp(e->time, filter->timestamp_a) <= 0))
 			break; /* Stop now */
 		else
-		if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
+		if (filter->msgid_a && e->msgid && !strcmp(e->msgid, filter->msgid_a))
 			break; /* Stop now */
 
-		n = duplicate_log_line(l);
+		n = duplicate_log_line(e->line);
 		hbm_result_prepend_line(r, n);
 		if (++written >= filter->limit)
 			break;
@@ -865,66 +1401,53 @@ static int hbm_return_around(HistoryResult *r, HistoryLogObject *h, HistoryFilte
  */
 static int hbm_return_between_figure_out_direction(HistoryLogObject *h, HistoryFilter *filter)
 {
-	HistoryLogLine *l;
-	int found_a = 0;
-	int found_b = 0;
-	MessageTag *m;
+	int pos_a = h->index_count;
+	int pos_b = h->index_count;
+	int i;
+	char *timestamp;
 
 	/* Two timestamps? Then we can easily tell the direction. */
 	if (filter->timestamp_a && filter->timestamp_b)
 		return (strcmp(filter->timestamp_a, filter->timestamp_b) <= 0) ? 1 : 0;
 
-	for (l = h->head; l; l = l->next)
+	/* Find the first line that matches point A and the first line that matches point B */
+	if (filter->timestamp_a)
+		pos_a = hbm_index_find_time(h, filter->timestamp_a, 1);
+	if (filter->msgid_a && ((i = hbm_index_find_msgid(h, filter->msgid_a, 0)) >= 0) && (i < pos_a))
+		pos_a = i;
+	if (filter->timestamp_b)
+		pos_b = hbm_index_find_time(h, filter->timestamp_b, 1);
+	if (filter->msgid_b && ((i = hbm_index_find_msgid(h, filter->msgid_b, 0)) >= 0) && (i < pos_b))
+		pos_b = i;
+
+	if ((pos_a < h->index_count) && (pos_a <= pos_b))
 	{
-		if (!found_a)
+		/* A was found first (or in the same line as B) */
+		timestamp = HBM_INDEX_ENTRY(h, pos_a)->time;
+		if (filter->timestamp_b && timestamp)
 		{
-			if (filter->timestamp_a && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_a) >= 0))
-			{
-				found_a = 1;
-			} else
-			if (filter->msgid_a && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_a))
-			{
-				found_a = 1;
-			}
-			if (found_a)
-			{
-				if (found_b)
-				{
-					/* B was found before A? Then the result is: backwards */
-					return 0;
-				}
-				if (filter->timestamp_b && (m = find_mtag(l->mtags, "time")) && m->value)
-				{
-					/* We can already resolve the direction now: */
-					char *timestamp_a = m->value;
-					return (strcmp(timestamp_a, filter->timestamp_b) <= 0) ? 1 : 0;
-				}
-			}
+			/* We can already resolve the direction now: */
+			return (strcmp(timestamp, filter->timestamp_b) <= 0) ? 1 : 0;
 		}
-		if (!found_b)
+		if (pos_b < h->index_count)
 		{
-			if (filter->timestamp_b && ((m = find_mtag(l->mtags, "time"))) && (strcmp(m->value, filter->timestamp_b) >= 0))
-			{
-				found_b = 1;
-			} else
-			if (filter->msgid_b && ((m = find_mtag(l->mtags, "msgid"))) && !strcmp(m->value, filter->msgid_b))
-			{
-				found_b = 1;
-			}
-			if (found_b)
-			{
-				if (found_a)
-				{
-					/* A was found before B? Then the result is: forwards */
-					return 1;
-				}
-				if (filter->timestamp_a && (m = find_mtag(l->mtags, "time")) && m->value)
-				{
-					/* We can already resolve the direction now: */
-					char *timestamp_b = m->value;
-					return (strcmp(filter->timestamp_a, timestamp_b) <= 0) ? 1 : 0;
-				}
-			}
+			/* A was found before B? Then the result is: forwards */
+			return 1;
+		}
+	} else
+	if (pos_b < h->index_count)
+	{
+		/* B was found first */
+		timestamp = HBM_INDEX_ENTRY(h, pos_b)->time;
+		if (filter->timestamp_a && timestamp)
+		{
+			/* We can already resolve the direction now: */
+			return (strcmp(filter->timestamp_a, timestamp) <= 0) ? 1 : 0;
+		}
+		if (pos_a < h->index_count)
+		{
+			/* B was found before A? Then the result is: backwards */
+			return 0;
 		}
 	}
 
@@ -976,6 +1499,11 @@ HistoryResult *hbm_history_request(char *object, HistoryFilter *filter)
 
 	r = safe_alloc(sizeof(HistoryResult));
 	safe_strdup(r->object, object);
+	r->borrowed = 1;
+
+	/* All requests except the 'simple' one need the index */
+	if ((filter->cmd != HFC_SIMPLE) && !h->index)
+		hbm_index_build(h);
 
 	switch(filter->cmd)
 	{
@@ -1051,25 +1579,76 @@ int hbm_history_cleanup(HistoryLogObject *h)
 	return 1;
 }
 
+/** Find the time of the latest line before 'before' and not before 'notbefore'.
+ * This is the same as HFC_BEFORE with a limit of 1, but without making
+ * a HistoryResult. Usually the latest line is in range, so this is O(1).
+ */
+static char *hbm_latest_time(HistoryLogObject *h, char *before, char *notbefore)
+{
+	HistoryLogLine *l;
+	char *t = NULL;
+	int i;
+
+	if (!h->latest_time || (strcmp(h->latest_time, before) < 0))
+	{
+		t = h->latest_time;
+	} else
+	if (h->index)
+	{
+		if ((i = hbm_index_find_time_before(h, before)) >= 0)
+			t = HBM_INDEX_ENTRY(h, i)->time;
+	} else
+	{
+		for (l = h->tail; l; l = l->prev)
+		{
+			t = hbm_line_time(l);
+			if (t && (strcmp(t, before) < 0))
+				break;
+		}
+		if (!l)
+			t = NULL;
+	}
+
+	if (t && (strcmp(t, notbefore) < 0))
+		return NULL;
+	return t;
+}
+
+/** Find the latest activity of multiple history objects, see history_request_targets() */
+int hbm_history_targets(HistoryTarget *targets, int count, HistoryFilter *filter)
+{
+	HistoryLogObject *h;
+	char *t;
+	int i, found = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(h = hbm_find_object(targets[i].object)))
+			continue;
+		if (h->oldest_t < TStime() - h->max_time)
+			hbm_history_cleanup(h); /* same as in hbm_history_request() */
+		t = hbm_latest_time(h, filter->timestamp_a, filter->timestamp_b);
+		if (t)
+		{
+			strlcpy(targets[i].datetime, t, sizeof(targets[i].datetime));
+			found++;
+		}
+	}
+	return found;
+}
+
 int hbm_history_destroy(char *object)
 {
 	HistoryLogObject *h = hbm_find_object(object);
-	HistoryLogLine *l, *l_next;
 
 	if (!h)
 		return 0;
 
-	for (l = h->head; l; l = l_next)
-	{
-		l_next = l->next;
-		/* We could use hbm_history_del_line() here but
-		 * it does unnecessary work, this is quicker.
-		 * The only danger is that we may forget to free some
-		 * fields that are added later there but not here.
-		 */
-		free_message_tags(l->mtags);
-		safe_free(l);
-	}
+	/* We could use hbm_history_del_line() on each line here but
+	 * it does unnecessary work, this is quicker.
+	 */
+	hbm_index_free(h);
+	hbm_storage_free_all(h);
 
 	hbm_delete_object_hlo(h);
 	return 1;
@@ -1079,12 +1658,43 @@ int hbm_history_destroy(char *object)
 int hbm_history_set_limit(char *object, int max_lines, long max_time)
 {
 	HistoryLogObject *h = hbm_find_or_add_object(object);
+	/* Reading the journal back in uses the current limits */
+	if (h->max_lines && ((h->max_lines != max_lines) || (h->max_time != max_time)))
+		h->journal_reset = 1;
 	h->max_lines = max_lines;
 	h->max_time = max_time;
 	hbm_history_cleanup(h); /* impose new restrictions */
 	return 1;
 }
 
+/** Add the memory usage of the history to 'STATS memory' */
+int hbm_stats(Client *client, char *flag)
+{
+	int hashnum;
+	HistoryLogObject *h;
+	int objects = 0;
+	long lines = 0;
+	unsigned long storage = 0, index = 0;
+
+	if (strcmp(flag, "z"))
+		return 0;
+
+	for (hashnum = 0; hashnum < HISTORY_BACKEND_MEM_HASH_TABLE_SIZE; hashnum++)
+	{
+		for (h = history_hash_table[hashnum]; h; h = h->next)
+		{
+			objects++;
+			lines += h->num_lines;
+			storage += sizeof(HistoryLogObject) + h->storage_size;
+			index += (sizeof(HistoryIndexEntry) + sizeof(int)) * h->index_size;
+		}
+	}
+
+	sendnumericfmt(client, RPL_STATSDEBUG, "history %d objects %ld lines %lu bytes (%lu bytes/line) index %lu bytes",
+		objects, lines, storage, lines ? storage / lines : 0, index);
+	return 1;
+}
+
 /** Read the master.db file, this is done at the INIT stage so we can still
  * reject the configuration / boot attempt.
  *
@@ -1228,7 +1838,7 @@ static void hbm_read_dbs(void)
 		snprintf(buf, sizeof(buf), "%s/%s", cfg.directory, fname);
 		if (filename_has_suffix(fname, ".db") && strcmp(fname, "master.db"))
 		{
-			if (!hbm_read_db(buf))
+			if (!hbm_read_db(buf, NULL))
 			{
 				/* On error, we move the file to the 'bad' subdirectory,
 				 * eg data/history/bad/xyz.db
@@ -1245,6 +1855,11 @@ static void hbm_read_dbs(void)
 				(void)rename(buf, buf2);
 			}
 		}
+		else if (filename_has_suffix(fname, ".tmp"))
+		{
+			/* Left behind by a write that did not finish, eg due to a crash */
+			unlink(buf);
+		}
 
 		/* End of common section */
 #ifndef _WIN32
@@ -1283,8 +1898,13 @@ static void hbm_read_dbs(void)
 	} while(0)
 
 
-/** Read a channel history db file */
-static int hbm_read_db(char *fname)
+/** Read a channel history db file.
+ * @param fname		The file to read
+ * @param journal_of	NULL for a base file, or the history object
+ *			if this is a journal segment of it.
+ * @returns 1 on success, 0 on failure (or a stale journal segment).
+ */
+static int hbm_read_db(char *fname, HistoryLogObject *journal_of)
 {
 	UnrealDB *db = NULL;
 	// header
@@ -1295,6 +1915,7 @@ static int hbm_read_db(char *fname)
 	char *object = NULL;
 	uint64_t max_lines = 0;
 	uint64_t max_time = 0;
+	uint64_t generation = 0;
 	// then, for each entry:
 	// (magic)
 	uint64_t line_ts;
@@ -1303,6 +1924,7 @@ static int hbm_read_db(char *fname)
 	MessageTag *mtags = NULL, *m;
 	char *line = NULL;
 	HistoryLogObject *h;
+	int lines = 0;
 
 	db = unrealdb_open(fname, UNREALDB_MODE_READ, cfg.db_secret);
 	if (!db)
@@ -1312,26 +1934,26 @@ static int hbm_read_db(char *fname)
 	}
 
 	R_SAFE(unrealdb_read_int32(db, &magic));
-	if (magic != HISTORYDB_MAGIC_FILE_START)
+	if (magic != (journal_of ? HISTORYDB_MAGIC_JOURNAL_START : HISTORYDB_MAGIC_FILE_START))
 	{
-		config_warn("[history] Database '%s' has wrong magic value, possibly corrupt (0x%lx), expected HISTORYDB_MAGIC_FILE_START.",
-			fname, (long)magic);
+		config_warn("[history] Database '%s' has wrong magic value, possibly corrupt (0x%lx), expected %s.",
+			fname, (long)magic, journal_of ? "HISTORYDB_MAGIC_JOURNAL_START" : "HISTORYDB_MAGIC_FILE_START");
 		unrealdb_close(db);
 		return 0;
 	}
 
 	/* Now do a version check */
 	R_SAFE(unrealdb_read_int32(db, &version));
-	if (version < 4999)
+	if ((version < 4999) || (journal_of && (version < 5001)))
 	{
 		config_warn("[history] Database '%s' uses an unsupported - possibly old - format (%ld).", fname, (long)version);
 		unrealdb_close(db);
 		return 0;
 	}
-	if (version > 5000)
+	if (version > HISTORYDB_VERSION)
 	{
 		config_warn("[history] Database '%s' has version %lu while we only support %lu. Did you just downgrade UnrealIRCd? Sorry this is not suported",
-			fname, (unsigned long)version, (unsigned long)5000);
+			fname, (unsigned long)version, (unsigned long)HISTORYDB_VERSION);
 		unrealdb_close(db);
 		return 0;
 	}
@@ -1348,14 +1970,31 @@ static int hbm_read_db(char *fname)
 	}
 
 	R_SAFE(unrealdb_read_str(db, &object));
-	R_SAFE(unrealdb_read_int64(db, &max_lines));
-	R_SAFE(unrealdb_read_int64(db, &max_time));
+	if (!journal_of)
+	{
+		R_SAFE(unrealdb_read_int64(db, &max_lines));
+		R_SAFE(unrealdb_read_int64(db, &max_time));
+	}
+	if (version >= 5001)
+		R_SAFE(unrealdb_read_int64(db, &generation));
 	h = hbm_find_object(object);
+	if (journal_of)
+	{
+		if ((h != journal_of) || (generation != h->journal_generation))
+		{
+			/* Left behind by a compaction that did not finish, eg
+			 * due to a crash. Its lines are in the base file already.
+			 */
+			R_SAFE_CLEANUP();
+			return 0;
+		}
+	} else
 	if (!h)
 	{
 		config_warn("Channel %s does not have +H set, deleting history", object);
 		R_SAFE_CLEANUP();
 		unlink(fname);
+		hbm_unlink_journal(fname);
 		return 1; /* No problem */
 	}
 
@@ -1397,7 +2036,21 @@ static int hbm_read_db(char *fname)
 			return 0;
 		}
 		hbm_history_add(object, mtags, line);
+		lines++;
 	}
+	R_SAFE_CLEANUP();
+
+	if (journal_of)
+	{
+		h->journal_lines += lines;
+		return 1;
+	}
+
+	h->journal_generation = generation;
+	h->journal_segments = 0;
+	h->journal_lines = lines;
+	h->journal_reset = 0;
+	hbm_read_journal(h, fname);
 
 	/* Prevent directly rewriting the channel, now that we have just read it.
 	 * This could cause things not to fire in case of corner issues like
@@ -1406,11 +2059,35 @@ static int hbm_read_db(char *fname)
 	 * which is a waste of resources.
 	 */
 	h->dirty = 0;
-
-	R_SAFE_CLEANUP();
+	h->journal_pending = 0;
+	if (h->journal_reset)
+		h->dirty = 1; /* get rid of the bad segment(s) soon */
 	return 1;
 }
 
+/** Read the journal segments that come after base file 'fname' */
+static void hbm_read_journal(HistoryLogObject *h, char *fname)
+{
+	char jname[512];
+	int n;
+
+	for (n = 1; ; n++)
+	{
+		hbm_journal_filename(jname, sizeof(jname), fname, n);
+		if (!file_exists(jname))
+			break;
+		if (!h->journal_generation || !hbm_read_db(jname, h))
+		{
+			/* Stale or bad segment: start over with a new base file,
+			 * which also deletes all the segments.
+			 */
+			h->journal_reset = 1;
+			break;
+		}
+		h->journal_segments = n;
+	}
+}
+
 /** Flush all dirty logs to disk on UnrealIRCd stop */
 static void hbm_flush(void)
 {
@@ -1468,12 +2145,18 @@ EVENT(history_mem_clean)
 	Channel *channel;
 	HistoryLogObject *h;
 
+	hbm_writer_collect();
+
 	do
 	{
 		for (h = history_hash_table[hashnum]; h; h = h->next)
 		{
 			hbm_history_cleanup(h);
-			if (cfg.persist && h->dirty)
+			/* If the previous save is still pending then the writer
+			 * is behind. We save the lines on a later call, together
+			 * with the lines that are added in the meantime.
+			 */
+			if (cfg.persist && h->dirty && !h->writer_jobs)
 				hbm_write_db(h);
 		}
 
@@ -1502,6 +2185,303 @@ char *hbm_history_filename(HistoryLogObject *h)
 	return fname;
 }
 
+/** Filename of journal segment 'n' that belongs to base file 'fname'.
+ * For example /path/xyz.db has segments /path/xyz.1.jnl, /path/xyz.2.jnl, etc.
+ */
+static void hbm_journal_filename(char *buf, size_t buflen, char *fname, int n)
+{
+	size_t len = strlen(fname);
+
+	if (filename_has_suffix(fname, ".db"))
+		len -= 3;
+	snprintf(buf, buflen, "%.*s.%d.jnl", (int)len, fname, n);
+}
+
+/** Delete all journal segments that belong to base file 'fname' */
+static void hbm_unlink_journal(char *fname)
+{
+	char jname[512];
+	int n;
+
+	for (n = 1; ; n++)
+	{
+		hbm_journal_filename(jname, sizeof(jname), fname, n);
+		if (unlink(jname) < 0)
+			break;
+	}
+}
+
+/* Writing of the history files.
+ * The file is opened and the header is written on the main thread,
+ * because unrealdb_open() is not thread safe (secret cache). The job
+ * gets an array with the lines to write, since the list keeps changing.
+ * The lines themselves stay where they are: the chunks of an object are
+ * not freed or reused while it has write jobs pending, see
+ * hbm_storage_free(). Writing the lines, encrypting, closing and moving
+ * the file in place is then done by the writer thread. The writer handles the jobs in order, so a new
+ * base file never overtakes the segments that were queued before it.
+ * Errors are reported back on the main thread by hbm_writer_collect().
+ */
+typedef enum HistoryWriteJobType {
+	HBM_WRITE_SEGMENT=1,	/**< Write a journal segment */
+	HBM_WRITE_BASE=2,	/**< Write the base file and delete all journal segments */
+	HBM_DELETE=3,		/**< Delete the base file and all journal segments */
+} HistoryWriteJobType;
+
+struct HistoryWriteJob {
+	HistoryWriteJob *next;
+	HistoryWriteJobType type;
+	char object[OBJECTLEN+1];
+	char basefname[512]; /**< The base file, see hbm_history_filename() */
+	char fname[512]; /**< The file that we write */
+	char tmpfname[512]; /**< The file that we write to, which is renamed to 'fname' */
+	UnrealDB *db;
+	HistoryLogLine **lines; /**< The lines to write, in the storage of the object */
+	int num_lines; /**< Number of lines in 'lines' */
+	long object_id; /**< HistoryLogObject->id, or 0 if the job does not read lines */
+	HistoryChunk *orphans; /**< Storage of the object, if it was destroyed before we finished */
+	char *error; /**< Set by the writer on failure */
+};
+
+#ifdef USE_HISTORY_WRITER_THREAD
+static pthread_t hbm_writer_thread;
+static int hbm_writer_running = 0;
+static int hbm_writer_stopping = 0;
+static pthread_mutex_t hbm_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hbm_writer_work = PTHREAD_COND_INITIALIZER;
+static HistoryWriteJob *hbm_writer_queue = NULL, *hbm_writer_queue_tail = NULL;
+#endif
+static HistoryWriteJob *hbm_writer_done = NULL;
+static unsigned long hbm_writer_serial = 0; /**< For unique temporary file names */
+
+#define W_SAFE_WRITER(x) \
+	do { \
+		if (!(x)) { \
+			safe_strdup(job->error, job->db->error_string ? job->db->error_string : "unknown error"); \
+			unrealdb_close(job->db); \
+			job->db = NULL; \
+			return; \
+		} \
+	} while(0)
+
+/** Do the work of a job. This is called from the writer thread,
+ * so be careful what you call from here.
+ */
+static void hbm_writer_run(HistoryWriteJob *job)
+{
+	HistoryLogLine *l;
+	MessageTag *m;
+	char buf[512];
+	int i;
+
+	if (job->type == HBM_DELETE)
+	{
+		unlink(job->basefname);
+		hbm_unlink_journal(job->basefname);
+		return;
+	}
+
+	for (i = 0; i < job->num_lines; i++)
+	{
+		l = job->lines[i];
+		W_SAFE_WRITER(unrealdb_write_int32(job->db, HISTORYDB_MAGIC_ENTRY_START));
+		W_SAFE_WRITER(unrealdb_write_int64(job->db, l->t));
+		for (m = l->mtags; m; m = m->next)
+		{
+			W_SAFE_WRITER(unrealdb_write_str(job->db, m->name));
+			W_SAFE_WRITER(unrealdb_write_str(job->db, m->value)); /* can be NULL */
+		}
+		W_SAFE_WRITER(unrealdb_write_str(job->db, NULL));
+		W_SAFE_WRITER(unrealdb_write_str(job->db, NULL));
+		W_SAFE_WRITER(unrealdb_write_str(job->db, l->line));
+		W_SAFE_WRITER(unrealdb_write_int32(job->db, HISTORYDB_MAGIC_ENTRY_END));
+	}
+	W_SAFE_WRITER(unrealdb_write_int32(job->db, HISTORYDB_MAGIC_FILE_END));
+
+	if (!unrealdb_close(job->db))
+	{
+		job->db = NULL;
+		safe_strdup(job->error, unrealdb_get_error_string());
+		return;
+	}
+	job->db = NULL;
+
+#ifdef _WIN32
+	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
+	unlink(job->fname);
+#endif
+	if (rename(job->tmpfname, job->fname) < 0)
+	{
+		snprintf(buf, sizeof(buf), "Error renaming '%s' to '%s': %s",
+			job->tmpfname, job->fname, strerror(errno));
+		safe_strdup(job->error, buf);
+		return;
+	}
+
+	/* The new base file has all lines, so the segments can go */
+	if (job->type == HBM_WRITE_BASE)
+		hbm_unlink_journal(job->basefname);
+}
+
+/** Hand the storage of a destroyed object over to its last write job */
+static void hbm_writer_orphan_storage(HistoryWriteJob *job, HistoryChunk *chunks)
+{
+	job->orphans = chunks;
+}
+
+/** Finish a job on the main thread: report errors and free it */
+static void hbm_writer_finish(HistoryWriteJob *job)
+{
+	HistoryLogObject *h = NULL;
+
+	if (job->object_id)
+	{
+		/* The object may be gone, or even be a new one with the same name */
+		h = hbm_find_object(job->object);
+		if (h && (h->id != job->object_id))
+			h = NULL;
+		if (h && (--h->writer_jobs == 0))
+		{
+			h->writer_last = NULL;
+			hbm_storage_sweep(h);
+		}
+	}
+
+	if (job->error)
+	{
+		sendto_realops_and_log("[history] Error writing to database file '%s': %s (HISTORY NOT SAVED)",
+			job->tmpfname, job->error);
+		/* Start over with a new base file on the next save */
+		if (h)
+		{
+			h->journal_reset = 1;
+			h->dirty = 1;
+		}
+	}
+
+	hbm_storage_free_chunks(job->orphans);
+	safe_free(job->lines);
+	safe_free(job->error);
+	safe_free(job);
+}
+
+#ifdef USE_HISTORY_WRITER_THREAD
+static void *hbm_writer_main(void *arg)
+{
+	HistoryWriteJob *job;
+
+	pthread_mutex_lock(&hbm_writer_lock);
+	while (1)
+	{
+		while (!hbm_writer_queue && !hbm_writer_stopping)
+			pthread_cond_wait(&hbm_writer_work, &hbm_writer_lock);
+		if (!hbm_writer_queue)
+			break; /* stopping, and nothing left to do */
+
+		job = hbm_writer_queue;
+		hbm_writer_queue = job->next;
+		if (!hbm_writer_queue)
+			hbm_writer_queue_tail = NULL;
+		pthread_mutex_unlock(&hbm_writer_lock);
+
+		hbm_writer_run(job);
+
+		pthread_mutex_lock(&hbm_writer_lock);
+		job->next = hbm_writer_done;
+		hbm_writer_done = job;
+	}
+	pthread_mutex_unlock(&hbm_writer_lock);
+	return NULL;
+}
+
+/** Start the writer thread, if it is not running yet.
+ * @returns 1 if the writer thread is running, 0 if not.
+ */
+static int hbm_writer_start(void)
+{
+	sigset_t newset, oldset;
+	int err;
+
+	if (hbm_writer_running)
+		return 1;
+
+	/* Signals are for the main thread only */
+	sigfillset(&newset);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	err = pthread_create(&hbm_writer_thread, NULL, hbm_writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (err)
+	{
+		ircd_log(LOG_ERROR, "[history] Could not create writer thread: %s", strerror(err));
+		return 0;
+	}
+	hbm_writer_running = 1;
+	return 1;
+}
+#endif
+
+/** Hand a job to the writer thread, or do it right away if there is none */
+static void hbm_writer_submit(HistoryWriteJob *job)
+{
+#ifdef USE_HISTORY_WRITER_THREAD
+	if (hbm_writer_start())
+	{
+		pthread_mutex_lock(&hbm_writer_lock);
+		if (hbm_writer_queue_tail)
+			hbm_writer_queue_tail->next = job;
+		else
+			hbm_writer_queue = job;
+		hbm_writer_queue_tail = job;
+		pthread_cond_signal(&hbm_writer_work);
+		pthread_mutex_unlock(&hbm_writer_lock);
+		return;
+	}
+#endif
+	hbm_writer_run(job);
+	hbm_writer_finish(job);
+}
+
+/** Finish the jobs that the writer thread is done with */
+static void hbm_writer_collect(void)
+{
+	HistoryWriteJob *job, *job_next;
+
+#ifdef USE_HISTORY_WRITER_THREAD
+	pthread_mutex_lock(&hbm_writer_lock);
+#endif
+	job = hbm_writer_done;
+	hbm_writer_done = NULL;
+#ifdef USE_HISTORY_WRITER_THREAD
+	pthread_mutex_unlock(&hbm_writer_lock);
+#endif
+
+	for (; job; job = job_next)
+	{
+		job_next = job->next;
+		hbm_writer_finish(job);
+	}
+}
+
+/** Wait for the writer thread to finish all jobs, and stop it.
+ * This must be done before the module is unloaded, also on REHASH.
+ */
+static void hbm_writer_stop(void)
+{
+#ifdef USE_HISTORY_WRITER_THREAD
+	if (hbm_writer_running)
+	{
+		pthread_mutex_lock(&hbm_writer_lock);
+		hbm_writer_stopping = 1;
+		pthread_cond_signal(&hbm_writer_work);
+		pthread_mutex_unlock(&hbm_writer_lock);
+		pthread_join(hbm_writer_thread, NULL);
+		hbm_writer_running = 0;
+		hbm_writer_stopping = 0;
+	}
+#endif
+	hbm_writer_collect();
+}
+
 #define WARN_WRITE_ERROR(fname) \
 	do { \
 		sendto_realops_and_log("[history] Error writing to temporary database file " \
@@ -1512,8 +2492,9 @@ char *hbm_history_filename(HistoryLogObject *h)
 #define W_SAFE(x) \
 	do { \
 		if (!(x)) { \
-			WARN_WRITE_ERROR(tmpfname); \
-			unrealdb_close(db); \
+			WARN_WRITE_ERROR(job->tmpfname); \
+			unrealdb_close(job->db); \
+			safe_free(job); \
 			return 0; \
 		} \
 	} while(0)
@@ -1521,14 +2502,19 @@ char *hbm_history_filename(HistoryLogObject *h)
 
 // FIXME: the code below will cause massive floods on disk or I/O errors if hundreds of
 // channel logs fail to write... fun.
+/** Save the history of a channel.
+ * Normally this writes a journal segment with the lines that were added
+ * since the previous save. Lines that were removed from the head of the
+ * log need no saving, since the same happens again when reading the files
+ * back in, see hbm_read_db(). Every now and then, or when this is not
+ * good enough (h->journal_reset), we write a new base file instead.
+ */
 static int hbm_write_db(HistoryLogObject *h)
 {
-	UnrealDB *db;
-	char *realfname;
-	char tmpfname[512];
+	HistoryWriteJob *job;
 	HistoryLogLine *l;
-	MessageTag *m;
 	Channel *channel;
+	int i, compact;
 
 	if (!cfg.db_secret)
 		abort();
@@ -1537,67 +2523,88 @@ static int hbm_write_db(HistoryLogObject *h)
 	if (!channel || !has_channel_mode(channel, 'P'))
 		return 1; /* Don't save this channel, pretend success */
 
-	realfname = hbm_history_filename(h);
-	snprintf(tmpfname, sizeof(tmpfname), "%s.tmp", realfname);
+	compact = h->journal_reset || !h->journal_generation ||
+	          (h->journal_segments >= HISTORY_JOURNAL_MAX_SEGMENTS) ||
+	          (h->journal_lines + h->journal_pending > 2 * h->num_lines);
 
-	db = unrealdb_open(tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
-	if (!db)
+	if (!compact && !h->journal_pending)
 	{
-		WARN_WRITE_ERROR(tmpfname);
-		return 0;
+		/* Only removals from the head, nothing to write */
+		h->dirty = 0;
+		return 1;
 	}
 
-	W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_FILE_START));
-	W_SAFE(unrealdb_write_int32(db, 5000)); /* VERSION */
-	W_SAFE(unrealdb_write_str(db, hbm_prehash));
-	W_SAFE(unrealdb_write_str(db, hbm_posthash));
-	W_SAFE(unrealdb_write_str(db, h->name));
-
-	W_SAFE(unrealdb_write_int64(db, h->max_lines));
-	W_SAFE(unrealdb_write_int64(db, h->max_time));
-
-	for (l = h->head; l; l = l->next)
+	job = safe_alloc(sizeof(HistoryWriteJob));
+	job->type = compact ? HBM_WRITE_BASE : HBM_WRITE_SEGMENT;
+	strlcpy(job->object, h->name, sizeof(job->object));
+	strlcpy(job->basefname, hbm_history_filename(h), sizeof(job->basefname));
+	if (compact)
 	{
-		W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_ENTRY_START));
-		W_SAFE(unrealdb_write_int64(db, l->t));
-		for (m = l->mtags; m; m = m->next)
-		{
-			W_SAFE(unrealdb_write_str(db, m->name));
-			W_SAFE(unrealdb_write_str(db, m->value)); /* can be NULL */
-		}
-		W_SAFE(unrealdb_write_str(db, NULL));
-		W_SAFE(unrealdb_write_str(db, NULL));
-		W_SAFE(unrealdb_write_str(db, l->line));
-		W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_ENTRY_END));
+		strlcpy(job->fname, job->basefname, sizeof(job->fname));
+		l = h->head;
+	} else {
+		hbm_journal_filename(job->fname, sizeof(job->fname), job->basefname, h->journal_segments + 1);
+		for (l = h->tail, i = 1; i < h->journal_pending; i++)
+			l = l->prev;
 	}
-	W_SAFE(unrealdb_write_int32(db, HISTORYDB_MAGIC_FILE_END));
+	/* A job for the same file can still be pending, so each job has its own temporary file */
+	snprintf(job->tmpfname, sizeof(job->tmpfname), "%s.%lu.tmp", job->fname, ++hbm_writer_serial);
 
-	if (!unrealdb_close(db))
+	job->db = unrealdb_open(job->tmpfname, UNREALDB_MODE_WRITE, cfg.db_secret);
+	if (!job->db)
 	{
-		WARN_WRITE_ERROR(tmpfname);
+		WARN_WRITE_ERROR(job->tmpfname);
+		safe_free(job);
 		return 0;
 	}
 
-#ifdef _WIN32
-	/* The rename operation cannot be atomic on Windows as it will cause a "file exists" error */
-	unlink(realfname);
-#endif
-	if (rename(tmpfname, realfname) < 0)
+	W_SAFE(unrealdb_write_int32(job->db, compact ? HISTORYDB_MAGIC_FILE_START : HISTORYDB_MAGIC_JOURNAL_START));
+	W_SAFE(unrealdb_write_int32(job->db, HISTORYDB_VERSION));
+	W_SAFE(unrealdb_write_str(job->db, hbm_prehash));
+	W_SAFE(unrealdb_write_str(job->db, hbm_posthash));
+	W_SAFE(unrealdb_write_str(job->db, h->name));
+	if (compact)
 	{
-		sendto_realops_and_log("[history] Error renaming '%s' to '%s': %s (HISTORY NOT SAVED)",
-			tmpfname, realfname, strerror(errno));
-		return 0;
+		W_SAFE(unrealdb_write_int64(job->db, h->max_lines));
+		W_SAFE(unrealdb_write_int64(job->db, h->max_time));
+		W_SAFE(unrealdb_write_int64(job->db, h->journal_generation + 1));
+	} else {
+		W_SAFE(unrealdb_write_int64(job->db, h->journal_generation));
+	}
+
+	job->num_lines = compact ? h->num_lines : h->journal_pending;
+	if (job->num_lines > 0)
+	{
+		job->lines = safe_alloc(sizeof(HistoryLogLine *) * job->num_lines);
+		for (i = 0; i < job->num_lines; i++, l = l->next)
+			job->lines[i] = l;
 	}
+	job->object_id = h->id;
+	h->writer_jobs++;
+	h->writer_last = job;
 
-	/* Now that everything was successful, clear the dirty flag */
+	/* If the writer fails then hbm_writer_finish() sets h->journal_reset */
+	if (compact)
+	{
+		h->journal_generation++;
+		h->journal_segments = 0;
+		h->journal_lines = h->num_lines;
+		h->journal_reset = 0;
+	} else {
+		h->journal_segments++;
+		h->journal_lines += h->journal_pending;
+	}
+	h->journal_pending = 0;
 	h->dirty = 0;
+
+	hbm_writer_submit(job);
 	return 1;
 }
 
 static void hbm_delete_db(HistoryLogObject *h)
 {
-	UnrealDB *db;
-	char *fname;
+	HistoryWriteJob *job;
+
 	if (!cfg.persist || !hbm_prehash || !hbm_posthash)
 	{
 #ifdef DEBUGMODE
@@ -1605,8 +2612,13 @@ static void hbm_delete_db(HistoryLogObject *h)
 #endif
 		return;
 	}
-	fname = hbm_history_filename(h);
-	unlink(fname);
+	/* Through the writer, so this happens after any pending writes */
+	job = safe_alloc(sizeof(HistoryWriteJob));
+	job->type = HBM_DELETE;
+	strlcpy(job->object, h->name, sizeof(job->object));
+	strlcpy(job->basefname, hbm_history_filename(h), sizeof(job->basefname));
+	hbm_writer_submit(job);
+	h->journal_reset = 1;
 }
 
 void hbm_generic_free(ModData *m)
@@ -686,6 +686,12 @@ void _userhost_changed(Client *client)
 		return; /* We cannot safely process this request anymore */
 	}
 
+	/* Called before the check below, since the vhost may have changed
+	 * while the visible host did not (eg: CHGHOST on a -x user).
+	 */
+	RunHook3(HOOKTYPE_USERHOST_CHANGE, client, remember_user, remember_host);
+	user_identity_changed(client);
+
 	/* It's perfectly acceptable to call us even if the userhost didn't change. */
 	if (!strcmp(remember_user, client->user->username) && !strcmp(remember_host, GetHost(client)))
 		return; /* Nothing to do */
@@ -40,8 +40,9 @@ typedef struct ChannelListOptions ChannelListOptions;
 struct ChannelListOptions {
 	NameList *yeslist;
 	NameList *nolist;
-	unsigned int starthash;
+	short int started;
 	short int showall;
+	ChannelDirectoryCursor cursor;
 	unsigned short usermin;
 	int  usermax;
 	time_t currenttime;
@@ -52,8 +53,19 @@ struct ChannelListOptions {
 	void *lr_context;
 };
 
+/** Rendered RPL_LIST line of a channel, cached in the channel moddata.
+ * It is re-rendered when the user count or topic changes.
+ */
+typedef struct ChannelListCache ChannelListCache;
+struct ChannelListCache {
+	int users;		/**< channel->users at the time of rendering */
+	time_t topic_time;	/**< channel->topic_time at the time of rendering */
+	char line[1];		/**< The RPL_LIST parameters, eg: "#channel 5 :topic" */
+};
+
 /* Global variables */
 ModDataInfo *list_md = NULL;
+ModDataInfo *list_cache_md = NULL;
 
 /* Macros */
 #define CHANNELLISTOPTIONS(x)       ((ChannelListOptions *)moddata_local_client(x, list_md).ptr)
@@ -66,6 +78,8 @@ ModDataInfo *list_md = NULL;
 /* Forward declarations */
 EVENT(send_queued_list_data);
 void list_md_free(ModData *md);
+void list_cache_md_free(ModData *md);
+int list_topic(Client *client, Channel *channel, MessageTag *mtags, char *topic);
 
 MOD_TEST()
 {
@@ -90,6 +104,18 @@ MOD_INIT()
 		return MOD_FAILED;
 	}
 
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "list_cache";
+	mreq.type = MODDATATYPE_CHANNEL;
+	mreq.free = list_cache_md_free;
+	list_cache_md = ModDataAdd(modinfo->handle, mreq);
+	if (!list_cache_md)
+	{
+		config_error("could not register list_cache moddata");
+		return MOD_FAILED;
+	}
+
+	HookAdd(modinfo->handle, HOOKTYPE_TOPIC, 0, list_topic);
 	CommandAdd(modinfo->handle, MSG_LIST, cmd_list, MAXPARA, CMD_USER);
 	EventAdd(modinfo->handle, "send_queued_list_data", send_queued_list_data, NULL, 1500, 0);
 
@@ -314,10 +340,31 @@ CMD_FUNC(cmd_list)
 
 	sendnumeric(client, RPL_LISTEND);
 }
+/** Return the (cached) RPL_LIST parameters of a channel */
+static char *list_line(Channel *channel)
+{
+	ChannelListCache *c = moddata_channel(channel, list_cache_md).ptr;
+	char *topic = channel->topic ? channel->topic : "";
+	size_t len;
+
+	if (c && (c->users == channel->users) && (c->topic_time == channel->topic_time))
+		return c->line;
+
+	safe_free(c);
+	len = strlen(channel->chname) + strlen(topic) + 16;
+	c = safe_alloc(sizeof(ChannelListCache) + len);
+	c->users = channel->users;
+	c->topic_time = channel->topic_time;
+	snprintf(c->line, len + 1, "%s %d :%s", channel->chname, channel->users, topic);
+	moddata_channel(channel, list_cache_md).ptr = c;
+	return c->line;
+}
+
 /*
  * The function which sends the actual channel list back to the user.
- * Operates by stepping through the hashtable, sending the entries back if
- * they match the criteria.
+ * Operates by stepping through the channel directory (channels by user
+ * count, largest first), sending the entries back if they match the
+ * criteria. Only the buckets that can match the user count are visited.
  * client = Local client to send the output back to.
  * Taken from bahamut, modified for Unreal by codemastr.
  */
@@ -325,128 +372,128 @@ int send_list(Client *client)
 {
 	Channel *channel;
 	ChannelListOptions *lopt = CHANNELLISTOPTIONS(client);
-	unsigned int  hashnum;
+	int see_secret;
 	int numsend = (get_sendq(client) / 768) + 1; /* (was previously hard-coded) */
 	/* ^
 	 * numsend = Number (roughly) of lines to send back. Once this number has
-	 * been exceeded, send_list will finish with the current hash bucket,
-	 * and record that number as the number to start next time send_list
-	 * is called for this user. So, this function will almost always send
-	 * back more lines than specified by numsend (though not by much,
-	 * assuming the hashing algorithm works well). Be conservative in your
-	 * choice of numsend. -Rak
-	 */	
+	 * been exceeded, send_list will stop and continue from the same position
+	 * in the channel directory the next time send_list is called for this user.
+	 */
 
 	/* Begin of /list? then send official channels. */
-	if ((lopt->starthash == 0) && conf_offchans)
+	if (!lopt->started)
 	{
-		ConfigItem_offchans *x;
-		for (x = conf_offchans; x; x = x->next)
+		lopt->started = 1;
+		if (conf_offchans)
 		{
-			if (find_channel(x->chname, NULL))
-				continue; /* exists, >0 users.. will be sent later */
-			sendnumeric(client, RPL_LIST, x->chname,
-			    0,
-#ifdef LIST_SHOW_MODES
-			    "",
-#endif					    
-			    x->topic ? x->topic : "");
-		}
-	}
-
-	for (hashnum = lopt->starthash; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++)
-	{
-		if (numsend > 0)
-			for (channel = hash_get_chan_bucket(hashnum);
-			    channel; channel = channel->hnextch)
+			ConfigItem_offchans *x;
+			for (x = conf_offchans; x; x = x->next)
 			{
-				if (SecretChannel(channel)
-				    && !IsMember(client, channel)
-				    && !ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
-					continue;
-
-				/* set::hide-list { deny-channel } */
-				if (!IsOper(client) && iConf.hide_list && find_channel_allowed(client, channel->chname))
-					continue;
-
-				/* Similarly, hide unjoinable channels for non-ircops since it would be confusing */
-				if (!IsOper(client) && !valid_channelname(channel->chname))
-					continue;
-
-				/* Much more readable like this -- codemastr */
-				if ((!lopt->showall))
-				{
-					/* User count must be in range */
-					if ((channel->users < lopt->usermin) || 
-					    ((lopt->usermax >= 0) && (channel->users > 
-					    lopt->usermax)))
-						continue;
-
-					/* Creation time must be in range */
-					if ((channel->creationtime && (channel->creationtime <
-					    lopt->chantimemin)) || (channel->creationtime >
-					    lopt->chantimemax))
-						continue;
-
-					/* Topic time must be in range */
-					if ((channel->topic_time < lopt->topictimemin) ||
-					    (channel->topic_time > lopt->topictimemax))
-						continue;
-
-					/* Must not be on nolist (if it exists) */
-					if (lopt->nolist && find_name_list_match(lopt->nolist, channel->chname))
-						continue;
-
-					/* Must be on yeslist (if it exists) */
-					if (lopt->yeslist && !find_name_list_match(lopt->yeslist, channel->chname))
-						continue;
-				}
+				if (find_channel(x->chname, NULL))
+					continue; /* exists, >0 users.. will be sent later */
+				sendnumeric(client, RPL_LIST, x->chname,
+				    0,
 #ifdef LIST_SHOW_MODES
-				modebuf[0] = '[';
-				channel_modes(client, modebuf+1, parabuf, sizeof(modebuf)-1, sizeof(parabuf), channel, 0);
-				if (modebuf[2] == '\0')
-					modebuf[0] = '\0';
-				else
-					strlcat(modebuf, "]", sizeof modebuf);
+				    "",
 #endif
-				if (!ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL))
-					sendnumeric(client, RPL_LIST,
-					    ShowChannel(client,
-					    channel) ? channel->chname :
-					    "*", channel->users,
-#ifdef LIST_SHOW_MODES
-					    ShowChannel(client, channel) ?
-					    modebuf : "",
-#endif
-					    ShowChannel(client,
-					    channel) ? (channel->topic ?
-					    channel->topic : "") : "");
-				else
-					sendnumeric(client, RPL_LIST, channel->chname,
-					    channel->users,
-#ifdef LIST_SHOW_MODES
-					    modebuf,
-#endif					    
-					    (channel->topic ? channel->topic : ""));
-				numsend--;
+				    x->topic ? x->topic : "");
 			}
+		}
+		/* Only visit the buckets that can have the requested number of users */
+		if (lopt->showall)
+			channel_directory_add_cursor(&lopt->cursor, 0, CHANNEL_DIRECTORY_BUCKETS - 1);
 		else
-			break;
+			channel_directory_add_cursor(&lopt->cursor, channel_directory_bucket(lopt->usermin),
+				(lopt->usermax >= 0) ? channel_directory_bucket(lopt->usermax) : CHANNEL_DIRECTORY_BUCKETS - 1);
 	}
 
-	/* All done */
-	if (hashnum == CHAN_HASH_TABLE_SIZE)
+	while (numsend > 0)
 	{
-		sendnumeric(client, RPL_LISTEND);
-		free_list_options(client);
-		return 0;
+		if (!(channel = channel_directory_next(&lopt->cursor)))
+		{
+			/* All done */
+			sendnumeric(client, RPL_LISTEND);
+			free_list_options(client);
+			return 0;
+		}
+
+		/* Non-opers never have this permission, skip the (expensive) check for them */
+		see_secret = IsOper(client) && ValidatePermissionsForPath("channel:see:list:secret",client,NULL,channel,NULL);
+
+		if (SecretChannel(channel) && !see_secret && !IsMember(client, channel))
+			continue;
+
+		/* set::hide-list { deny-channel } */
+		if (!IsOper(client) && iConf.hide_list && find_channel_allowed(client, channel->chname))
+			continue;
+
+		/* Similarly, hide unjoinable channels for non-ircops since it would be confusing */
+		if (!IsOper(client) && !valid_channelname(channel->chname))
+			continue;
+
+		/* Much more readable like this -- codemastr */
+		if ((!lopt->showall))
+		{
+			/* User count must be in range */
+			if ((channel->users < lopt->usermin) || 
+			    ((lopt->usermax >= 0) && (channel->users > 
+			    lopt->usermax)))
+				continue;
+
+			/* Creation time must be in range */
+			if ((channel->creationtime && (channel->creationtime <
+			    lopt->chantimemin)) || (channel->creationtime >
+			    lopt->chantimemax))
+				continue;
+
+			/* Topic time must be in range */
+			if ((channel->topic_time < lopt->topictimemin) ||
+			    (channel->topic_time > lopt->topictimemax))
+				continue;
+
+			/* Must not be on nolist (if it exists) */
+			if (lopt->nolist && find_name_list_match(lopt->nolist, channel->chname))
+				continue;
+
+			/* Must be on yeslist (if it exists) */
+			if (lopt->yeslist && !find_name_list_match(lopt->yeslist, channel->chname))
+				continue;
+		}
+#ifdef LIST_SHOW_MODES
+		modebuf[0] = '[';
+		channel_modes(client, modebuf+1, parabuf, sizeof(modebuf)-1, sizeof(parabuf), channel, 0);
+		if (modebuf[2] == '\0')
+			modebuf[0] = '\0';
+		else
+			strlcat(modebuf, "]", sizeof modebuf);
+		if (!see_secret)
+			sendnumeric(client, RPL_LIST,
+			    ShowChannel(client,
+			    channel) ? channel->chname :
+			    "*", channel->users,
+			    ShowChannel(client, channel) ?
+			    modebuf : "",
+			    ShowChannel(client,
+			    channel) ? (channel->topic ?
+			    channel->topic : "") : "");
+		else
+			sendnumeric(client, RPL_LIST, channel->chname,
+			    channel->users,
+			    modebuf,
+			    (channel->topic ? channel->topic : ""));
+#else
+		if (!see_secret && !ShowChannel(client, channel))
+			sendnumeric(client, RPL_LIST, "*", channel->users, "");
+		else
+			sendnumericfmt(client, RPL_LIST, "%s", list_line(channel));
+#endif
+		numsend--;
 	}
 
 	/* 
 	 * We've exceeded the limit on the number of channels to send back
 	 * at once.
 	 */
-	lopt->starthash = hashnum;
 	return 1;
 }
 
@@ -476,9 +523,27 @@ void list_md_free(ModData *md)
 	if (!lopt)
 		return;
 
+	if (lopt->started)
+		channel_directory_del_cursor(&lopt->cursor);
 	free_entire_name_list(lopt->yeslist);
 	free_entire_name_list(lopt->nolist);
 	safe_free(lopt->lr_context);
 
 	safe_free(md->ptr);
 }
+
+/** Free the cached RPL_LIST line of a channel */
+void list_cache_md_free(ModData *md)
+{
+	safe_free(md->ptr);
+}
+
+/** Topic changed: forget the cached RPL_LIST line.
+ * Checking channel->topic_time in list_line() is not enough
+ * if the topic is changed twice in the same second.
+ */
+int list_topic(Client *client, Channel *channel, MessageTag *mtags, char *topic)
+{
+	safe_free(moddata_channel(channel, list_cache_md).ptr);
+	return 0;
+}
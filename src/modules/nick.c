@@ -231,6 +231,7 @@ CMD_FUNC(cmd_nick_remote)
 
 	strcpy(client->name, nick);
 	add_to_client_hash_table(nick, client);
+	user_identity_changed(client);
 
 	hash_check_watch(client, RPL_LOGON);
 }
@@ -461,6 +462,7 @@ CMD_FUNC(cmd_nick_local)
 
 	strlcpy(client->name, nick, sizeof(client->name));
 	add_to_client_hash_table(nick, client);
+	user_identity_changed(client);
 
 	/* update fdlist --nenolod */
 	snprintf(descbuf, sizeof(descbuf), "Client: %s", nick);
@@ -1106,6 +1108,9 @@ int _register_user(Client *client, char *nick, char *username, char *umode, char
 			safe_strdup(client->user->virthost, virthost);
 	}
 
+	/* The IP is final now, count the user for allow::maxperip */
+	add_ip_users(client);
+
 	hash_check_watch(client, RPL_LOGON);	/* Uglier hack */
 	build_umode_string(client, 0, SEND_UMODES|UMODE_SERVNOTICE, buf);
 
@@ -1295,27 +1300,20 @@ int check_init(Client *client, char *sockn, size_t size)
 /** Returns 1 if allow::maxperip is exceeded by 'client' */
 int exceeds_maxperip(Client *client, ConfigItem_allow *aconf)
 {
-	Client *acptr;
-	int local_cnt = 1;
-	int global_cnt = 1;
+	IpUsersBucket *b;
 
 	if (find_tkl_exception(TKL_MAXPERIP, client))
 		return 0; /* exempt */
 
-	list_for_each_entry(acptr, &client_list, client_node)
+	b = find_ip_users(GetIP(client));
+	if (!b)
+		return 0; /* first user from this IP */
+
+	/* The client itself is not counted yet, hence the +1 */
+	if ((b->local_clients + 1 > aconf->maxperip) ||
+	    (b->global_clients + 1 > aconf->global_maxperip))
 	{
-		if (IsUser(acptr) && !strcmp(GetIP(acptr), GetIP(client)))
-		{
-			if (MyUser(acptr))
-			{
-				local_cnt++;
-				if (local_cnt > aconf->maxperip)
-					return 1;
-			}
-			global_cnt++;
-			if (global_cnt > aconf->global_maxperip)
-				return 1;
-		}
+		return 1;
 	}
 	return 0;
 }
@@ -114,6 +114,26 @@ CMD_FUNC(cmd_protoctl)
 		{
 			SetMTAGS(client);
 		}
+#ifdef USE_ZLIB
+		else if (!strcmp(name, "ZIP"))
+		{
+			SetZIP(client);
+		}
+#endif
+		else if (!strcmp(name, "ZIPSTART"))
+		{
+			/* We only announce ZIP if the link block has options::compressed.
+			 * Everything after this line is compressed, so it must be the last token.
+			 */
+			if (!IsServer(client) || !client->serv->conf ||
+			    !(client->serv->conf->options & CONNECT_COMPRESSED) || (i != parc - 1))
+			{
+				exit_client(client, NULL, "Unexpected PROTOCTL ZIPSTART");
+				return;
+			}
+			zip_start_in(client);
+			return;
+		}
 		else if (!strcmp(name, "NICKCHARS") && value)
 		{
 			if (!IsServer(client) && !IsEAuth(client) && !IsHandshake(client))
@@ -34,6 +34,71 @@ struct cfgstruct {
 	AutoConnectStrategy autoconnect_strategy;
 	long connect_timeout;
 	long handshake_timeout;
+	long burst_sendq;
+};
+
+/** How often the burst to a new server is continued (msec) */
+#define BURST_EVENT_MSEC	100
+
+/** Maximum time spent on generating burst data in one go (msec) */
+#define BURST_SLICE_MSEC	25
+
+typedef enum BurstStage {
+	BURST_USERS = 0,
+	BURST_CHANNELS = 1,
+	BURST_FINISH = 2
+} BurstStage;
+
+/** A user or channel that was on the network when the burst started.
+ * The array of these is sorted by 'ptr' so it can be searched.
+ */
+typedef struct BurstItem BurstItem;
+struct BurstItem {
+	void *ptr;
+	int done;		/**< Sent already, or the user/channel is gone */
+};
+
+/** A burst to a newly linked server that is still in progress.
+ *
+ * Instead of putting the whole network in the sendQ at once, the users
+ * and channels are sent in chunks whenever the sendQ of the link is
+ * below set::server-linking::burst-sendq. Any user or channel that is
+ * not sent yet but is used by a message that goes to the link in the
+ * meantime is sent straight away, see server_burst_packet().
+ * Users and channels that are created during the burst are not in the
+ * lists, they are sent to the link the normal way.
+ */
+typedef struct ServerBurst ServerBurst;
+struct ServerBurst {
+	ServerBurst *prev, *next;
+	Client *client;		/**< The server that we are bursting to */
+	BurstStage stage;
+	BurstItem *users;
+	int num_users;
+	int user_pos;		/**< Next entry of 'users' to send */
+	BurstItem *channels;
+	int num_channels;
+	int channel_pos;	/**< Next entry of 'channels' to send */
+	int users_sent;
+	int channels_sent;
+	int out_of_order;	/**< Users and channels that had to be sent early */
+	int sending;		/**< We are sending burst data ourselves */
+	long long start;	/**< Start time, see profile_clock() */
+	unsigned long bytes;	/**< Bytes of burst data */
+};
+
+/** Bursts in progress and statistics of the finished ones */
+typedef struct BurstInfo BurstInfo;
+struct BurstInfo {
+	ServerBurst *bursts;
+	Event *event;
+	unsigned long completed;
+	char last_name[HOSTLEN+1];
+	long long last_nsec;
+	unsigned long last_bytes;
+	int last_users;
+	int last_channels;
+	int last_out_of_order;
 };
 
 /* Forward declarations */
@@ -54,12 +119,24 @@ void _broadcast_sinfo(Client *acptr, Client *to, Client *except);
 int server_sync(Client *cptr, ConfigItem_link *conf);
 void server_generic_free(ModData *m);
 int server_post_connect(Client *client);
+void server_burst_start(Client *client);
+static void server_burst_continue(ServerBurst *b);
+void server_burst_free(ServerBurst *b);
+void server_burstinfo_free(ModData *m);
+EVENT(server_burst_event);
+int server_burst_packet(Client *from, Client *to, Client *intended_to, char **msg, int *length);
+int server_burst_server_quit(Client *client, MessageTag *mtags);
+int server_burst_free_user(Client *client);
+int server_burst_channel_destroy(Channel *channel, int *should_destroy);
+int server_burst_stats(Client *client, char *flag);
 
 
 /* Global variables */
 static char buf[BUFSIZE];
 static cfgstruct cfg;
 static char *last_autoconnect_server = NULL;
+static BurstInfo *burstinfo = NULL;
+static Module *server_module = NULL;
 
 ModuleHeader MOD_HEADER
   = {
@@ -86,10 +163,20 @@ MOD_TEST()
 MOD_INIT()
 {
 	MARK_AS_OFFICIAL_MODULE(modinfo);
+	server_module = modinfo->handle;
 	LoadPersistentPointer(modinfo, last_autoconnect_server, server_generic_free);
+	LoadPersistentPointer(modinfo, burstinfo, server_burstinfo_free);
+	if (!burstinfo)
+		burstinfo = safe_alloc(sizeof(BurstInfo));
 	server_config_setdefaults(&cfg);
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, server_config_run);
 	HookAdd(modinfo->handle, HOOKTYPE_POST_SERVER_CONNECT, 0, server_post_connect);
+	HookAdd(modinfo->handle, HOOKTYPE_PACKET, 0, server_burst_packet);
+	HookAdd(modinfo->handle, HOOKTYPE_SERVER_QUIT, 0, server_burst_server_quit);
+	HookAdd(modinfo->handle, HOOKTYPE_FREE_USER, 0, server_burst_free_user);
+	/* Run after all others, since +P may stop the destruction */
+	HookAdd(modinfo->handle, HOOKTYPE_CHANNEL_DESTROY, 2000000, server_burst_channel_destroy);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, server_burst_stats);
 	CommandAdd(modinfo->handle, "SERVER", cmd_server, MAXPARA, CMD_UNREGISTERED|CMD_SERVER);
 	CommandAdd(modinfo->handle, "SID", cmd_sid, MAXPARA, CMD_SERVER);
 
@@ -100,12 +187,17 @@ MOD_LOAD()
 {
 	EventAdd(modinfo->handle, "server_autoconnect", server_autoconnect, NULL, 2000, 0);
 	EventAdd(modinfo->handle, "server_handshake_timeout", server_handshake_timeout, NULL, 1000, 0);
+	/* The event is only there while bursting (it is deleted on unload) */
+	burstinfo->event = NULL;
+	if (burstinfo->bursts)
+		burstinfo->event = EventAdd(modinfo->handle, "server_burst", server_burst_event, NULL, BURST_EVENT_MSEC, 0);
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
 	SavePersistentPointer(modinfo, last_autoconnect_server);
+	SavePersistentPointer(modinfo, burstinfo);
 	return MOD_SUCCESS;
 }
 
@@ -148,6 +240,7 @@ void server_config_setdefaults(cfgstruct *cfg)
 	cfg->autoconnect_strategy = AUTOCONNECT_SEQUENTIAL;
 	cfg->connect_timeout = 10;
 	cfg->handshake_timeout = 20;
+	cfg->burst_sendq = 1048576;
 }
 
 int server_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
@@ -204,6 +297,17 @@ int server_config_test(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 				continue;
 			}
 		} else
+		if (!strcmp(cep->ce_varname, "burst-sendq"))
+		{
+			long v = config_checkval(cep->ce_vardata, CFG_SIZE);
+			if ((v != 0) && ((v < 65536) || (v > 104857600)))
+			{
+				config_error("%s:%i: set::server-linking::burst-sendq should be 0 (no pacing) or between 64K and 100M",
+					cep->ce_fileptr->cf_filename, cep->ce_varlinenum);
+				errors++;
+				continue;
+			}
+		} else
 		{
 			config_error("%s:%i: unknown directive set::server-linking::%s",
 				cep->ce_fileptr->cf_filename, cep->ce_varlinenum, cep->ce_varname);
@@ -240,6 +344,10 @@ int server_config_run(ConfigFile *cf, ConfigEntry *ce, int type)
 		if (!strcmp(cep->ce_varname, "handshake-timeout"))
 		{
 			cfg.handshake_timeout = config_checkval(cep->ce_vardata, CFG_TIME);
+		} else
+		if (!strcmp(cep->ce_varname, "burst-sendq"))
+		{
+			cfg.burst_sendq = config_checkval(cep->ce_vardata, CFG_SIZE);
 		}
 	}
 	return 1;
@@ -1348,6 +1456,13 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 		send_server_message(cptr);
 	}
 
+	/* Compress everything from here on, if both sides asked for it */
+	if ((aconf->options & CONNECT_COMPRESSED) && SupportZIP(cptr))
+	{
+		sendto_one(cptr, NULL, "PROTOCTL ZIPSTART");
+		zip_start_out(cptr);
+	}
+
 	/* Set up server structure */
 	free_pending_net(cptr);
 	SetServer(cptr);
@@ -1461,54 +1576,509 @@ int	server_sync(Client *cptr, ConfigItem_link *aconf)
 		}
 	}
 
-	/* Synching nick information */
+	/* The users, channels and the rest follow in chunks */
+	server_burst_start(cptr);
+	return 0;
+}
+
+static int burst_item_compare(const void *a, const void *b)
+{
+	const BurstItem *x = a;
+	const BurstItem *y = b;
+
+	if (x->ptr < y->ptr)
+		return -1;
+	if (x->ptr > y->ptr)
+		return 1;
+	return 0;
+}
+
+/** Find the entry of user or channel 'ptr' in a burst list, or NULL if not there */
+static BurstItem *burst_find_item(BurstItem *items, int num, void *ptr)
+{
+	BurstItem key;
+
+	if (!num)
+		return NULL;
+	key.ptr = ptr;
+	return bsearch(&key, items, num, sizeof(BurstItem), burst_item_compare);
+}
+
+/** Find the burst in progress to server 'client', if any */
+static ServerBurst *find_burst(Client *client)
+{
+	ServerBurst *b;
+
+	for (b = burstinfo->bursts; b; b = b->next)
+		if (b->client == client)
+			return b;
+	return NULL;
+}
+
+/** The limit of the sendQ of the link below which we continue bursting */
+static long burst_sendq_limit(ServerBurst *b)
+{
+	if (cfg.burst_sendq == 0)
+		return LONG_MAX; /* no pacing */
+	/* Stay well below the sendq of the class, whatever the setting */
+	return MIN(cfg.burst_sendq, get_sendq(b->client) / 2);
+}
+
+static void burst_send_user(ServerBurst *b, Client *acptr)
+{
+	b->sending++;
+	introduce_user(b->client, acptr);
+	b->sending--;
+	b->users_sent++;
+}
+
+static void burst_send_channel(ServerBurst *b, Channel *channel)
+{
+	b->sending++;
+	send_channel_modes_sjoin3(b->client, channel);
+	if (channel->topic_time)
+		sendto_one(b->client, NULL, "TOPIC %s %s %lld :%s",
+		    channel->chname, channel->topic_nick,
+		    (long long)channel->topic_time, channel->topic);
+	send_moddata_channel(b->client, channel);
+	b->sending--;
+	b->channels_sent++;
+}
+
+/** Send user 'acptr' now if it was not sent yet (used out of order) */
+static void burst_user_now(ServerBurst *b, Client *acptr)
+{
+	BurstItem *e = burst_find_item(b->users, b->num_users, acptr);
+
+	if (!e || e->done)
+		return;
+	e->done = 1;
+	burst_send_user(b, acptr);
+	b->out_of_order++;
+}
+
+/** Send channel 'channel' now if it was not sent yet (used out of order).
+ * During the user stage the members of the channel are sent first.
+ */
+static void burst_channel_now(ServerBurst *b, Channel *channel)
+{
+	BurstItem *e = burst_find_item(b->channels, b->num_channels, channel);
+	Member *m;
+
+	if (!e || e->done)
+		return;
+	e->done = 1;
+	if (b->stage == BURST_USERS)
+		for (m = channel->members; m; m = m->next)
+			burst_user_now(b, m->client);
+	burst_send_channel(b, channel);
+	b->out_of_order++;
+}
+
+/** Start bursting our users and channels to the just linked server 'client'.
+ * This is called from server_sync() after the servers have been sent.
+ */
+void server_burst_start(Client *client)
+{
+	ServerBurst *b;
+	Client *acptr;
+	Channel *channel;
+	int n;
+
+	b = safe_alloc(sizeof(ServerBurst));
+	b->client = client;
+	b->start = profile_clock();
+
+	n = 0;
+	list_for_each_entry(acptr, &client_list, client_node)
+		if (IsUser(acptr) && (acptr->direction != client))
+			n++;
+	b->users = safe_alloc(sizeof(BurstItem) * (n + 1));
 	list_for_each_entry_reverse(acptr, &client_list, client_node)
-	{
-		/* acptr->direction == acptr for acptr == cptr */
-		if (acptr->direction == cptr)
-			continue;
-		if (IsUser(acptr))
-			introduce_user(cptr, acptr);
-	}
-	/*
-	   ** Last, pass all channels plus statuses
-	 */
-	{
-		Channel *channel;
-		for (channel = channels; channel; channel = channel->nextch)
-		{
-			send_channel_modes_sjoin3(cptr, channel);
-			if (channel->topic_time)
-				sendto_one(cptr, NULL, "TOPIC %s %s %lld :%s",
-				    channel->chname, channel->topic_nick,
-				    (long long)channel->topic_time, channel->topic);
-			send_moddata_channel(cptr, channel);
-		}
-	}
-	
+		if (IsUser(acptr) && (acptr->direction != client))
+			b->users[b->num_users++].ptr = acptr;
+	qsort(b->users, b->num_users, sizeof(BurstItem), burst_item_compare);
+
+	n = 0;
+	for (channel = channels; channel; channel = channel->nextch)
+		n++;
+	b->channels = safe_alloc(sizeof(BurstItem) * (n + 1));
+	for (channel = channels; channel; channel = channel->nextch)
+		b->channels[b->num_channels++].ptr = channel;
+	qsort(b->channels, b->num_channels, sizeof(BurstItem), burst_item_compare);
+
+	AddListItem(b, burstinfo->bursts);
+	if (!burstinfo->event)
+		burstinfo->event = EventAdd(server_module, "server_burst", server_burst_event, NULL, BURST_EVENT_MSEC, 0);
+
+	/* Send the first chunk straight away */
+	server_burst_continue(b);
+}
+
+/** Send the rest of the burst: moddata of memberships, TKLs, NETINFO and EOS */
+static void server_burst_finish(ServerBurst *b)
+{
+	Client *client = b->client;
+
+	b->sending++;
+
 	/* Send ModData for all member(ship) structs */
-	send_moddata_members(cptr);
-	
+	send_moddata_members(client);
+
 	/* pass on TKLs */
-	tkl_sync(cptr);
+	tkl_sync(client);
 
-	RunHook(HOOKTYPE_SERVER_SYNC, cptr);
+	RunHook(HOOKTYPE_SERVER_SYNC, client);
 
-	sendto_one(cptr, NULL, "NETINFO %i %lld %i %s 0 0 0 :%s",
+	sendto_one(client, NULL, "NETINFO %i %lld %i %s 0 0 0 :%s",
 	    irccounts.global_max, (long long)TStime(), UnrealProtocol,
 	    CLOAK_KEYCRC,
 	    ircnetwork);
 
 	/* Send EOS (End Of Sync) to the just linked server... */
-	sendto_one(cptr, NULL, ":%s EOS", me.id);
+	sendto_one(client, NULL, ":%s EOS", me.id);
 #ifdef DEBUGMODE
 	ircd_log(LOG_ERROR, "[EOSDBG] server_sync: sending to justlinked '%s' with src ME...",
-			cptr->name);
+			client->name);
 #endif
-	RunHook(HOOKTYPE_POST_SERVER_CONNECT, cptr);
+	b->sending--;
+}
+
+/** Continue the burst 'b' until the sendQ of the link is full enough
+ * or we spent BURST_SLICE_MSEC on it.
+ * @returns 1 if the burst is complete, 0 if not.
+ */
+static int server_burst_step(ServerBurst *b)
+{
+	Client *client = b->client;
+	long limit = burst_sendq_limit(b);
+	long long deadline = profile_clock() + (BURST_SLICE_MSEC * 1000000LL);
+	int n = 0;
+
+	while (b->stage != BURST_FINISH)
+	{
+		if (IsDeadSocket(client))
+			return 0;
+		if ((DBufLength(&client->local->sendQ) >= limit) ||
+		    ((cfg.burst_sendq != 0) && (++n % 64 == 0) && (profile_clock() > deadline)))
+		{
+			return 0;
+		}
+
+		if (b->stage == BURST_USERS)
+		{
+			if (b->user_pos == b->num_users)
+			{
+				b->stage = BURST_CHANNELS;
+				continue;
+			}
+			if (!b->users[b->user_pos].done)
+			{
+				b->users[b->user_pos].done = 1;
+				burst_send_user(b, b->users[b->user_pos].ptr);
+			}
+			b->user_pos++;
+		} else
+		if (b->stage == BURST_CHANNELS)
+		{
+			if (b->channel_pos == b->num_channels)
+			{
+				b->stage = BURST_FINISH;
+				continue;
+			}
+			if (!b->channels[b->channel_pos].done)
+			{
+				b->channels[b->channel_pos].done = 1;
+				burst_send_channel(b, b->channels[b->channel_pos].ptr);
+			}
+			b->channel_pos++;
+		}
+	}
+
+	server_burst_finish(b);
+	return 1;
+}
+
+/** Continue burst 'b' and clean up if it is complete */
+static void server_burst_continue(ServerBurst *b)
+{
+	Client *client = b->client;
+	long long nsec;
+
+	if (!server_burst_step(b))
+		return;
+
+	nsec = profile_clock() - b->start;
+	burstinfo->completed++;
+	strlcpy(burstinfo->last_name, client->name, sizeof(burstinfo->last_name));
+	burstinfo->last_nsec = nsec;
+	burstinfo->last_bytes = b->bytes;
+	burstinfo->last_users = b->users_sent;
+	burstinfo->last_channels = b->channels_sent;
+	burstinfo->last_out_of_order = b->out_of_order;
+	sendto_realops("(\2link\2) Burst to %s completed in %lld.%03lld seconds (%d users, %d channels, %lu KB)",
+		client->name, nsec / 1000000000LL, (nsec / 1000000LL) % 1000,
+		b->users_sent, b->channels_sent, b->bytes / 1024);
+	server_burst_free(b);
+
+	RunHook(HOOKTYPE_POST_SERVER_CONNECT, client);
+}
+
+/** Remove a burst in progress (finished or not) */
+void server_burst_free(ServerBurst *b)
+{
+	DelListItem(b, burstinfo->bursts);
+	safe_free(b->users);
+	safe_free(b->channels);
+	safe_free(b);
+	if (!burstinfo->bursts && burstinfo->event)
+	{
+		EventDel(burstinfo->event);
+		burstinfo->event = NULL;
+	}
+}
+
+/** Free all burst information, called when the module is unloaded for good */
+void server_burstinfo_free(ModData *m)
+{
+	BurstInfo *info = m->ptr;
+	ServerBurst *b, *b_next;
+
+	if (!info)
+		return;
+	for (b = info->bursts; b; b = b_next)
+	{
+		b_next = b->next;
+		safe_free(b->users);
+		safe_free(b->channels);
+		safe_free(b);
+	}
+	safe_free(info);
+	m->ptr = NULL;
+}
+
+EVENT(server_burst_event)
+{
+	ServerBurst *b, *b_next;
+
+	for (b = burstinfo->bursts; b; b = b_next)
+	{
+		b_next = b->next;
+		server_burst_continue(b);
+	}
+}
+
+/** Copy the next space separated token of 'p' to 'token'.
+ * @returns The position after the token (and any spaces).
+ */
+static char *burst_token(char *p, char *token, size_t tokenlen)
+{
+	size_t n = 0;
+
+	while (*p && (*p != ' ') && (*p != '\r') && (*p != '\n'))
+	{
+		if (n + 1 < tokenlen)
+			token[n++] = *p;
+		p++;
+	}
+	token[n] = '\0';
+	while (*p == ' ')
+		p++;
+	return p;
+}
+
+/** Users of a SJOIN that are not sent yet are sent now */
+static void burst_sjoin_users(ServerBurst *b, char *p)
+{
+	char token[128], *nick;
+	Client *acptr;
+
+	p = strchr(p, ':');
+	if (!p)
+		return;
+	for (p++; *p && (*p != '\r') && (*p != '\n'); )
+	{
+		p = burst_token(p, token, sizeof(token));
+		nick = token;
+		if (*nick == '<')
+		{
+			/* SJSBY: <setat,setby>prefix+nick */
+			nick = strchr(nick, '>');
+			if (!nick)
+				continue;
+			nick++;
+		}
+		if ((*nick == '&') || (*nick == '"') || (*nick == '\''))
+			continue; /* ban, exempt or invex */
+		nick += strspn(nick, "*~@%+");
+		if (*nick && (acptr = find_client(nick, NULL)) && IsUser(acptr))
+			burst_user_now(b, acptr);
+	}
+}
+
+/** Outgoing messages to a server that we are still bursting to.
+ * The server would kill users that it does not know about and would
+ * reply with errors for unknown channels. So when a message is about
+ * a user or channel that was not sent yet, we send it now, before
+ * the message. QUIT's and KILL's of users that were not sent yet are dropped.
+ */
+int server_burst_packet(Client *from, Client *to, Client *intended_to, char **msg, int *length)
+{
+	static char copy[1024];
+	char source[128], command[32], param[CHANNELLEN+16];
+	char *p = *msg, *chname;
+	ServerBurst *b;
+	Client *acptr = NULL;
+	Channel *channel = NULL;
+	BurstItem *e;
+	int is_sjoin, offset;
+
+	if (!burstinfo->bursts || (from != &me) || !(b = find_burst(to)))
+		return 0;
+
+	if (b->sending)
+	{
+		b->bytes += *length;
+		return 0;
+	}
+
+	/* [@tags] [:source] command param ... */
+	if (*p == '@')
+	{
+		p = strchr(p, ' ');
+		if (!p)
+			return 0;
+		p++;
+	}
+	*source = '\0';
+	if (*p == ':')
+		p = burst_token(p + 1, source, sizeof(source));
+	p = burst_token(p, command, sizeof(command));
+	is_sjoin = !strcmp(command, "SJOIN");
+	if (is_sjoin)
+		p = burst_token(p, param, sizeof(param)); /* timestamp */
+	p = burst_token(p, param, sizeof(param));
+
+	if (!strcmp(command, "KILL") && (acptr = find_client(param, NULL)) && IsUser(acptr) &&
+	    (e = burst_find_item(b->users, b->num_users, acptr)) && !e->done)
+	{
+		/* Same as a QUIT: they never knew about this user */
+		e->done = 1;
+		*msg = NULL;
+		return 0;
+	}
+
+	if (*source && (acptr = find_client(source, NULL)) && IsUser(acptr))
+	{
+		e = burst_find_item(b->users, b->num_users, acptr);
+		if (!e || e->done)
+		{
+			acptr = NULL;
+		} else
+		if (!strcmp(command, "QUIT"))
+		{
+			/* They never knew about this user, so no need to tell */
+			e->done = 1;
+			*msg = NULL;
+			return 0;
+		}
+	} else {
+		acptr = NULL;
+	}
+
+	chname = param + strspn(param, "~&@%+");
+	if ((*chname == '#') && (channel = find_channel(chname, NULL)))
+	{
+		e = burst_find_item(b->channels, b->num_channels, channel);
+		if (!e || e->done)
+			channel = NULL;
+	}
+
+	if (!acptr && !channel && !is_sjoin)
+		return 0;
+
+	/* We are going to send other things first, which may overwrite
+	 * the buffer that *msg points to, so use a copy.
+	 */
+	if (*length >= sizeof(copy))
+		return 0; /* cannot happen */
+	offset = p - *msg;
+	memcpy(copy, *msg, *length);
+	copy[*length] = '\0';
+	*msg = copy;
+	p = copy + offset;
+
+	if (acptr)
+		burst_user_now(b, acptr);
+	if (channel)
+		burst_channel_now(b, channel);
+	if (is_sjoin)
+		burst_sjoin_users(b, p);
+	return 0;
+}
+
+int server_burst_server_quit(Client *client, MessageTag *mtags)
+{
+	ServerBurst *b;
+
+	if (MyConnect(client) && (b = find_burst(client)))
+		server_burst_free(b);
+	return 0;
+}
+
+int server_burst_free_user(Client *client)
+{
+	ServerBurst *b;
+	BurstItem *e;
+
+	for (b = burstinfo->bursts; b; b = b->next)
+		if ((e = burst_find_item(b->users, b->num_users, client)))
+			e->done = 1;
+	return 0;
+}
+
+int server_burst_channel_destroy(Channel *channel, int *should_destroy)
+{
+	ServerBurst *b;
+	BurstItem *e;
+
+	if (!*should_destroy)
+		return 0;
+	for (b = burstinfo->bursts; b; b = b->next)
+		if ((e = burst_find_item(b->channels, b->num_channels, channel)))
+			e->done = 1;
 	return 0;
 }
 
+/** Show bursts in progress and the last completed burst in STATS linkinfo */
+int server_burst_stats(Client *client, char *flag)
+{
+	ServerBurst *b;
+	long long nsec;
+
+	if (strcmp(flag, "l") && strcmp(flag, "L"))
+		return 0;
+
+	for (b = burstinfo->bursts; b; b = b->next)
+	{
+		nsec = profile_clock() - b->start;
+		sendnumericfmt(client, RPL_STATSDEBUG, "burst to %s in progress: users %d/%d channels %d/%d "
+			"(%d out of order), %lu KB, sendq %u, %lld.%03lld seconds",
+			b->client->name, b->user_pos, b->num_users, b->channel_pos, b->num_channels,
+			b->out_of_order, b->bytes / 1024, DBufLength(&b->client->local->sendQ),
+			nsec / 1000000000LL, (nsec / 1000000LL) % 1000);
+	}
+	if (burstinfo->completed)
+	{
+		sendnumericfmt(client, RPL_STATSDEBUG, "bursts completed %lu, last to %s: %d users %d channels "
+			"(%d out of order), %lu KB, %lld.%03lld seconds",
+			burstinfo->completed, burstinfo->last_name, burstinfo->last_users,
+			burstinfo->last_channels, burstinfo->last_out_of_order, burstinfo->last_bytes / 1024,
+			burstinfo->last_nsec / 1000000000LL, (burstinfo->last_nsec / 1000000LL) % 1000);
+	}
+	return 1;
+}
+
 /** This will send "to" a full list of the modes for channel channel,
  *
  * Half of it recoded by Syzop: the whole buffering and size checking stuff
@@ -272,6 +272,7 @@ CMD_FUNC(cmd_sjoin)
 			safe_free(ban->who);
 			free_ban(ban);
 		}
+		channel_bans_changed(channel);
 		for (lp = channel->members; lp; lp = lp->next)
 		{
 			lp2 = find_membership_link(lp->client->user->channel, channel);
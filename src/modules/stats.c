@@ -86,6 +86,9 @@ int stats_class(Client *, char *);
 int stats_officialchannels(Client *, char *);
 int stats_spamfilter(Client *, char *);
 int stats_fdtable(Client *, char *);
+int stats_events(Client *, char *);
+int stats_profile(Client *, char *);
+int stats_memory(Client *, char *);
 
 #define SERVER_AS_PARA 0x1
 #define FLAGS_AS_PARA 0x2
@@ -103,6 +106,7 @@ struct statstab StatsTable[] = {
 	{ 'B', "banversion",	stats_banversion,	0		},
 	{ 'C', "link", 		stats_links,		0 		},
 	{ 'D', "denylinkall",	stats_denylinkall,	0		},
+	{ 'E', "events",	stats_events,		0		},
 	{ 'G', "gline",		stats_gline,		FLAGS_AS_PARA	},
 	{ 'H', "link",	 	stats_links,		0 		},
 	{ 'I', "allow",		stats_allow,		0 		},
@@ -131,6 +135,7 @@ struct statstab StatsTable[] = {
 	{ 'm', "command",	stats_command,		0 		},
 	{ 'n', "banrealname",	stats_banrealname,	0 		},
 	{ 'o', "oper",		stats_oper,		0 		},
+	{ 'p', "profile",	stats_profile,		FLAGS_AS_PARA	},
 	{ 'q', "bannick",	stats_bannick,		FLAGS_AS_PARA	},
 	{ 'r', "chanrestrict",	stats_chanrestrict,	0 		},
 	{ 's', "shun",		stats_shun,		FLAGS_AS_PARA	},
@@ -139,6 +144,7 @@ struct statstab StatsTable[] = {
 	{ 'v', "denyver",	stats_denyver,		0 		},
 	{ 'x', "notlink",	stats_notlink,		0 		},
 	{ 'y', "class",		stats_class,		0 		},
+	{ 'z', "memory",	stats_memory,		0 		},
 	{ 0, 	NULL, 		NULL, 			0		}
 };
 
@@ -195,6 +201,7 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "d - denylinkauto - Send the deny link (auto) block list");
 	sendnumeric(client, RPL_STATSHELP, "D - denylinkall - Send the deny link (all) block list");
 	sendnumeric(client, RPL_STATSHELP, "e - except - Send the ban exception list (ELINEs and in config))");
+	sendnumeric(client, RPL_STATSHELP, "E - events - Send the list of timed events and the time spent in them");
 	sendnumeric(client, RPL_STATSHELP, "f - spamfilter - Send the spamfilter list");
 	sendnumeric(client, RPL_STATSHELP, "F - denydcc - Send the deny dcc and allow dcc block lists");
 	sendnumeric(client, RPL_STATSHELP, "G - gline - Send the gline and gzline list");
@@ -210,6 +217,8 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "M - command - Send list of how many times each command was used");
 	sendnumeric(client, RPL_STATSHELP, "n - banrealname - Send the ban realname block list");
 	sendnumeric(client, RPL_STATSHELP, "O - oper - Send the oper block list");
+	sendnumeric(client, RPL_STATSHELP, "p - profile - Send the time spent in each hook and command (set::profiling)");
+	sendnumeric(client, RPL_STATSHELP, "  Use /STATS p <server> reset to clear the counters, or dump to write them to profile.json");
 	sendnumeric(client, RPL_STATSHELP, "P - port - Send information about ports");
 	sendnumeric(client, RPL_STATSHELP, "q - bannick - Send the ban nick block list");
 	sendnumeric(client, RPL_STATSHELP, "Q - sqline - Send the global qline list");
@@ -229,6 +238,7 @@ static inline void stats_help(Client *client)
 	sendnumeric(client, RPL_STATSHELP, "W - fdtable - Send the FD table listing");
 	sendnumeric(client, RPL_STATSHELP, "X - notlink - Send the list of servers that are not current linked");
 	sendnumeric(client, RPL_STATSHELP, "Y - class - Send the class block list");
+	sendnumeric(client, RPL_STATSHELP, "z - memory - Send memory usage of various tables and indexes");
 }
 
 static inline int allow_user_stats_short(char c)
@@ -596,6 +606,7 @@ int stats_traffic(Client *client, char *para)
 	IRCStatistics *sp;
 	IRCStatistics tmp;
 	time_t now = TStime();
+	long cl_sendcalls = 0, cl_sendblocks = 0, sv_sendcalls = 0, sv_sendblocks = 0;
 
 	sp = &tmp;
 	memcpy(sp, &ircstats, sizeof(IRCStatistics));
@@ -610,6 +621,8 @@ int stats_traffic(Client *client, char *para)
 			sp->is_skr += acptr->local->receiveK;
 			sp->is_sti += now - acptr->local->firsttime;
 			sp->is_sv++;
+			sv_sendcalls += acptr->local->sendcalls;
+			sv_sendblocks += acptr->local->sendblocks;
 			if (sp->is_sbs > 1023)
 			{
 				sp->is_sks += (sp->is_sbs >> 10);
@@ -629,6 +642,8 @@ int stats_traffic(Client *client, char *para)
 			sp->is_ckr += acptr->local->receiveK;
 			sp->is_cti += now - acptr->local->firsttime;
 			sp->is_cl++;
+			cl_sendcalls += acptr->local->sendcalls;
+			cl_sendblocks += acptr->local->sendblocks;
 			if (sp->is_cbs > 1023)
 			{
 				sp->is_cks += (sp->is_cbs >> 10);
@@ -651,6 +666,10 @@ int stats_traffic(Client *client, char *para)
 	sendnumericfmt(client, RPL_STATSDEBUG, "numerics seen %u mode fakes %u", sp->is_num, sp->is_fake);
 	sendnumericfmt(client, RPL_STATSDEBUG, "auth successes %u fails %u", sp->is_asuc, sp->is_abad);
 	sendnumericfmt(client, RPL_STATSDEBUG, "local connections %u udp packets %u", sp->is_loc, sp->is_udp);
+	sendnumericfmt(client, RPL_STATSDEBUG, "channel broadcast lines rendered %lu queued %lu tag class hits %lu", sp->is_bclines, sp->is_bcsent, sp->is_bcclass);
+	sendnumericfmt(client, RPL_STATSDEBUG, "io engine interest changes %lu", sp->is_evctl);
+	sendnumericfmt(client, RPL_STATSDEBUG, "tls handshake steps offloaded %lu", sp->is_tlspool);
+	sendnumericfmt(client, RPL_STATSDEBUG, "channel message ban checks cached %lu matched %lu", sp->is_bvhit, sp->is_bvmiss);
 	sendnumericfmt(client, RPL_STATSDEBUG, "Client Server");
 	sendnumericfmt(client, RPL_STATSDEBUG, "connected %u %u", sp->is_cl, sp->is_sv);
 	sendnumericfmt(client, RPL_STATSDEBUG, "bytes sent %ld.%huK %ld.%huK",
@@ -659,10 +678,84 @@ int stats_traffic(Client *client, char *para)
 	    sp->is_ckr, sp->is_cbr, sp->is_skr, sp->is_sbr);
 	sendnumericfmt(client, RPL_STATSDEBUG, "time connected %lld %lld",
 	    (long long)sp->is_cti, (long long)sp->is_sti);
+	sendnumericfmt(client, RPL_STATSDEBUG, "write calls %ld %ld", cl_sendcalls, sv_sendcalls);
+	sendnumericfmt(client, RPL_STATSDEBUG, "sendq blocks written %ld %ld", cl_sendblocks, sv_sendblocks);
 
 	return 0;
 }
 
+int stats_memory(Client *client, char *para)
+{
+	int count = 0, buckets = 0, indexes = 0;
+	u_long memory = 0;
+
+	count_watch_memory(&count, &memory);
+	sendnumericfmt(client, RPL_STATSDEBUG, "watch entries %d bytes %lu", count, memory);
+
+	count_membership_memory(&count, &buckets, &memory);
+	sendnumericfmt(client, RPL_STATSDEBUG, "membership index entries %d buckets %d bytes %lu", count, buckets, memory);
+
+	count_ban_index_memory(&indexes, &count, &memory);
+	sendnumericfmt(client, RPL_STATSDEBUG, "ban list indexes %d entries %d bytes %lu", indexes, count, memory);
+
+	count_ip_users_memory(&count, &buckets, &memory);
+	sendnumericfmt(client, RPL_STATSDEBUG, "ip user counts addresses %d ipv6 /64 prefixes %d bytes %lu", count, buckets, memory);
+
+	return 0;
+}
+
+int stats_events(Client *client, char *para)
+{
+	EventStatus(client);
+	return 0;
+}
+
+int stats_profile(Client *client, char *para)
+{
+	ProfileStats **list;
+	int n, i;
+
+	if (para && (!strcasecmp(para, "reset") || !strcasecmp(para, "dump")))
+	{
+		if (!ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL))
+		{
+			sendnumeric(client, ERR_NOPRIVILEGES);
+			return 0;
+		}
+		if (!strcasecmp(para, "reset"))
+		{
+			profile_reset();
+			sendnotice(client, "Profiling counters have been reset");
+		} else
+		if (profile_dump(PERMDATADIR "/profile.json"))
+			sendnotice(client, "Profiling data written to %s", PERMDATADIR "/profile.json");
+		else
+			sendnotice(client, "Could not write profiling data to %s: %s", PERMDATADIR "/profile.json", strerror(errno));
+		return 0;
+	}
+
+	if (!iConf.profiling)
+		sendnotice(client, "Profiling is off, see set::profiling");
+
+	list = profile_sorted(&n);
+	for (i = 0; i < n; i++)
+	{
+		ProfileStats *p = list[i];
+		char name[128];
+
+		if (p->type == PROFILE_HOOK)
+			snprintf(name, sizeof(name), "hook %d %s", p->hooktype, p->name);
+		else
+			snprintf(name, sizeof(name), "command %s", p->name);
+		sendnumericfmt(client, RPL_STATSDEBUG,
+			"%s calls %lu total %llu usec avg %llu nsec p99 %llu nsec max %llu nsec",
+			name, p->calls, p->total_nsec / 1000, p->total_nsec / p->calls,
+			profile_percentile(p, 990), p->max_nsec);
+	}
+	safe_free(list);
+	return 0;
+}
+
 int stats_fdtable(Client *client, char *para)
 {
 	int i;
@@ -911,6 +1004,9 @@ int stats_set(Client *client, char *para)
 	sendtxtnumeric(client, "silence-limit: %d", SILENCE_LIMIT);
 	if (DNS_BINDIP)
 		sendtxtnumeric(client, "dns::bind-ip: %s", DNS_BINDIP);
+	sendtxtnumeric(client, "dns::cache-size: %d", DNS_CACHE_SIZE);
+	sendtxtnumeric(client, "dns::cache-ttl: %s", pretty_time_val(DNS_CACHE_TTL));
+	sendtxtnumeric(client, "dns::negative-cache-ttl: %s", pretty_time_val(DNS_NEGATIVE_CACHE_TTL));
 	sendtxtnumeric(client, "ban-version-tkl-time: %s", pretty_time_val(BAN_VERSION_TKL_TIME));
 	if (LINK_BINDIP)
 		sendtxtnumeric(client, "link::bind-ip: %s", LINK_BINDIP);
@@ -939,6 +1035,7 @@ int stats_set(Client *client, char *para)
 	if (SPAMFILTER_EXCEPT)
 		sendtxtnumeric(client, "spamfilter::except: %s", SPAMFILTER_EXCEPT);
 	sendtxtnumeric(client, "check-target-nick-bans: %s", CHECK_TARGET_NICK_BANS ? "yes" : "no");
+	sendtxtnumeric(client, "profiling: %s", iConf.profiling ? "yes" : "no");
 	sendtxtnumeric(client, "plaintext-policy::user: %s", policy_valtostr(iConf.plaintext_policy_user));
 	sendtxtnumeric(client, "plaintext-policy::oper: %s", policy_valtostr(iConf.plaintext_policy_oper));
 	sendtxtnumeric(client, "plaintext-policy::server: %s", policy_valtostr(iConf.plaintext_policy_server));
@@ -1047,6 +1144,7 @@ int stats_linkinfoint(Client *client, char *para, int all)
 	int doall = 0;
 	int showports = ValidatePermissionsForPath("server:info:stats",client,NULL,NULL,NULL);
 	Client *acptr;
+	ZipLinkStats zs;
 	/*
 	 * send info about connections which match, or all if the
 	 * mask matches me.name.  Only restrictions are on those who
@@ -1111,6 +1209,16 @@ int stats_linkinfoint(Client *client, char *para, int all)
 #else
 				pbuf);
 #endif
+			if (zip_link_stats(acptr, &zs))
+			{
+				sendnumericfmt(client, RPL_STATSDEBUG,
+					"%s compression: sent %llu bytes as %llu (%d%%), received %llu bytes as %llu (%d%%)",
+					acptr->name,
+					zs.out_plain, zs.out_compressed,
+					zs.out_plain ? (int)(zs.out_compressed * 100 / zs.out_plain) : 100,
+					zs.in_plain, zs.in_compressed,
+					zs.in_plain ? (int)(zs.in_compressed * 100 / zs.in_plain) : 100);
+			}
 		}
 		else if (!strchr(acptr->name, '.'))
 			sendnumericfmt(client, RPL_STATSLINKINFO, Lformat,
@@ -111,5 +111,6 @@ CMD_FUNC(cmd_svsnick)
 
 	strlcpy(acptr->name, parv[2], sizeof acptr->name);
 	add_to_client_hash_table(parv[2], acptr);
+	user_identity_changed(acptr);
 	hash_check_watch(acptr, RPL_LOGON);
 }
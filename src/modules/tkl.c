@@ -98,6 +98,13 @@ TKL *_find_tkl_nameban(int type, char *name, int hold);
 TKL *_find_tkl_spamfilter(int type, char *match_string, BanAction action, unsigned short target);
 int _find_tkl_exception(int ban_type, Client *client);
 static void add_default_exempts(void);
+char *tkl_uhost(TKL *tkl, char *buf, size_t buflen, int options);
+#define NO_SOFT_PREFIX	1
+static void tkl_index_add(TKL *tkl);
+static void tkl_index_del(TKL *tkl);
+static void tkl_index_free(void);
+static void spamfilter_index_free(void);
+static void spamfilter_index_invalidate(void);
 
 /* Externals (only for us :D) */
 extern int MODVAR spamf_ugly_vchanoverride;
@@ -224,6 +231,8 @@ MOD_LOAD()
 
 MOD_UNLOAD()
 {
+	tkl_index_free();
+	spamfilter_index_free();
 	return MOD_SUCCESS;
 }
 
@@ -2339,6 +2348,463 @@ TKL *tkl_find_head(char type, char *hostmask, TKL *def)
 	return def;
 }
 
+/* Index on the server bans and ban exceptions in tklines[].
+ * Entries for a literal IP address are in tklines_ip_hash[] already,
+ * but all others (hostnames, CIDR masks, wildcards) used to be matched
+ * one by one against every connecting client. Now, entries whose host
+ * portion is a literal host, a '*.suffix', a 'prefix.*' or a CIDR mask
+ * are put in a hash table, keyed on what the real host or IP of a client
+ * must look like for match_user() to be able to succeed. The remaining
+ * entries, such as extended server bans, go in a linear list for each
+ * tklines[] index.
+ * Each entry has a sequence number which is higher for entries closer
+ * to the head of their tklines[] list. Candidates from the hash table
+ * are merged with the linear lists in that order, so we end up with the
+ * same TKL as a walk through tklines[] would give.
+ * The index lives in this module while the TKL's live in the core,
+ * so the index is (re)built on first use after the module is loaded.
+ * Note that on REHASH the efunctions of the new module are used before
+ * the old module is unloaded, so the TKL's don't point to their entry.
+ */
+typedef struct TKLIndexEntry TKLIndexEntry;
+struct TKLIndexEntry {
+	TKLIndexEntry *prev, *next;	/**< Hash bucket or linear list */
+	TKLIndexEntry *pnext;		/**< Next in the same bucket of the table keyed on the TKL pointer */
+	TKL *tkl;
+	unsigned int seq;		/**< Higher means closer to the head of the tklines[] list */
+	unsigned char list;		/**< The tklines[] index */
+	char type;			/**< One of BANINDEX_* */
+	char *key;			/**< Lowercased lookup key (NULL for BANINDEX_LINEAR) */
+};
+
+typedef struct TKLIndex TKLIndex;
+struct TKLIndex {
+	unsigned int count;
+	unsigned int size;		/**< Number of hash buckets, always a power of 2 */
+	TKLIndexEntry **table;
+	TKLIndexEntry **ptrtable;	/**< For finding the entry of a TKL, same size as 'table' */
+	TKLIndexEntry *linear[TKLISTLEN];
+	unsigned int types[BANINDEX_NICK+1];
+	unsigned int cidr4[33];
+	unsigned int cidr6[129];
+};
+
+/** Candidates found in the hash table during a lookup */
+typedef struct TKLIndexCandidates TKLIndexCandidates;
+struct TKLIndexCandidates {
+	TKLIndexEntry **entries;
+	int count;
+	int size;
+	TKLIndexEntry *buf[64];
+};
+
+/** Matcher used for verifying entries, such as find_tkline_match_matcher() */
+typedef int (*TKLIndexMatcher)(Client *client, int arg, TKL *tkl);
+
+static TKLIndex tkl_serverban_index;
+static TKLIndex tkl_exception_index;
+static int tkl_index_built = 0;
+static unsigned int tkl_index_seq = 0;
+static char siphashkey_tkl_index[SIPHASH_KEY_LENGTH];
+
+/** Which index a TKL belongs in (if it is on tklines[]) */
+static TKLIndex *tkl_index_for(TKL *tkl)
+{
+	if (TKLIsServerBan(tkl) && !(tkl->type & TKL_SHUN))
+		return &tkl_serverban_index;
+	if (TKLIsBanException(tkl))
+		return &tkl_exception_index;
+	return NULL;
+}
+
+static inline unsigned int tkl_index_bucket(TKLIndex *idx, int type, const char *key)
+{
+	return (siphash(key, siphashkey_tkl_index) + type) & (idx->size - 1);
+}
+
+static inline unsigned int tkl_index_ptr_bucket(TKLIndex *idx, TKL *tkl)
+{
+	return siphash_raw((char *)&tkl, sizeof(tkl), siphashkey_tkl_index) & (idx->size - 1);
+}
+
+/** Figure out the BANINDEX_* type and key of a TKL.
+ * We classify the exact string that the matchers pass to match_user().
+ */
+static int tkl_index_classify(TKL *tkl, char *key, size_t keylen)
+{
+	char uhost[NICKLEN+HOSTLEN+1];
+	char *usermask, *hostmask;
+	int type;
+
+	if (TKLIsServerBan(tkl))
+	{
+		usermask = tkl->ptr.serverban->usermask;
+		hostmask = tkl->ptr.serverban->hostmask;
+	} else {
+		usermask = tkl->ptr.banexception->usermask;
+		hostmask = tkl->ptr.banexception->hostmask;
+	}
+
+	/* find_tkline_match_zap() uses the hostmask on its own,
+	 * the rest uses the (possibly truncated) user@host.
+	 */
+	if (strpbrk(usermask, "!@") || strpbrk(hostmask, "!@"))
+		return BANINDEX_LINEAR;
+	tkl_uhost(tkl, uhost, sizeof(uhost), NO_SOFT_PREFIX);
+	if (strlen(uhost) >= sizeof(uhost) - 1)
+		return BANINDEX_LINEAR;
+
+	type = ban_index_classify(uhost, key, keylen);
+	if (type == BANINDEX_NICK)
+		return BANINDEX_LINEAR;
+	return type;
+}
+
+static void tkl_index_resize(TKLIndex *idx, unsigned int newsize)
+{
+	TKLIndexEntry **oldtable = idx->table;
+	TKLIndexEntry **oldptrtable = idx->ptrtable;
+	unsigned int oldsize = idx->size;
+	TKLIndexEntry *e, *e_next;
+	unsigned int i, hashv;
+
+	idx->table = safe_alloc(sizeof(TKLIndexEntry *) * newsize);
+	idx->ptrtable = safe_alloc(sizeof(TKLIndexEntry *) * newsize);
+	idx->size = newsize;
+	for (i = 0; i < oldsize; i++)
+	{
+		for (e = oldtable[i]; e; e = e_next)
+		{
+			e_next = e->next;
+			hashv = tkl_index_bucket(idx, e->type, e->key);
+			e->prev = NULL;
+			e->next = idx->table[hashv];
+			if (e->next)
+				e->next->prev = e;
+			idx->table[hashv] = e;
+		}
+		for (e = oldptrtable[i]; e; e = e_next)
+		{
+			e_next = e->pnext;
+			hashv = tkl_index_ptr_bucket(idx, e->tkl);
+			e->pnext = idx->ptrtable[hashv];
+			idx->ptrtable[hashv] = e;
+		}
+	}
+	safe_free(oldtable);
+	safe_free(oldptrtable);
+}
+
+/** Add a TKL to the index. Call this after adding it to tklines[]. */
+static void tkl_index_add(TKL *tkl)
+{
+	TKLIndex *idx = tkl_index_for(tkl);
+	TKLIndexEntry *e, **head;
+	char key[NICKLEN+HOSTLEN+1];
+
+	if (!tkl_index_built || !idx)
+		return;
+
+	e = safe_alloc(sizeof(TKLIndexEntry));
+	e->tkl = tkl;
+	e->seq = ++tkl_index_seq;
+	e->list = tkl_hash(tkl_typetochar(tkl->type));
+	e->type = tkl_index_classify(tkl, key, sizeof(key));
+	idx->types[(int)e->type]++;
+	idx->count++;
+	if (idx->count > idx->size)
+		tkl_index_resize(idx, idx->size * 2);
+	e->pnext = idx->ptrtable[tkl_index_ptr_bucket(idx, tkl)];
+	idx->ptrtable[tkl_index_ptr_bucket(idx, tkl)] = e;
+
+	if (e->type == BANINDEX_LINEAR)
+	{
+		head = &idx->linear[e->list];
+	} else {
+		if (e->type == BANINDEX_CIDR)
+		{
+			int bits = atoi(strchr(key, '/') + 1);
+			if (strchr(key, ':'))
+				idx->cidr6[bits]++;
+			else
+				idx->cidr4[bits]++;
+		}
+		safe_strdup(e->key, key);
+		head = &idx->table[tkl_index_bucket(idx, e->type, e->key)];
+	}
+
+	/* Entries are always added at the head of tklines[] as well */
+	e->next = *head;
+	if (e->next)
+		e->next->prev = e;
+	*head = e;
+}
+
+/** Remove a TKL from the index. Call this before freeing it. */
+static void tkl_index_del(TKL *tkl)
+{
+	TKLIndex *idx = tkl_index_for(tkl);
+	TKLIndexEntry *e, **ep;
+
+	if (!tkl_index_built || !idx)
+		return;
+
+	for (ep = &idx->ptrtable[tkl_index_ptr_bucket(idx, tkl)]; *ep; ep = &(*ep)->pnext)
+		if ((*ep)->tkl == tkl)
+			break;
+	if (!*ep)
+		return;
+	e = *ep;
+	*ep = e->pnext;
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else if (e->type == BANINDEX_LINEAR)
+		idx->linear[e->list] = e->next;
+	else
+		idx->table[tkl_index_bucket(idx, e->type, e->key)] = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+
+	if (e->type == BANINDEX_CIDR)
+	{
+		int bits = atoi(strchr(e->key, '/') + 1);
+		if (strchr(e->key, ':'))
+			idx->cidr6[bits]--;
+		else
+			idx->cidr4[bits]--;
+	}
+	idx->types[(int)e->type]--;
+	idx->count--;
+	safe_free(e->key);
+	safe_free(e);
+}
+
+static void tkl_index_free_one(TKLIndex *idx)
+{
+	TKLIndexEntry *e, *e_next;
+	unsigned int i;
+
+	for (i = 0; i < idx->size; i++)
+	{
+		for (e = idx->table[i]; e; e = e_next)
+		{
+			e_next = e->next;
+			safe_free(e->key);
+			safe_free(e);
+		}
+	}
+	for (i = 0; i < TKLISTLEN; i++)
+	{
+		for (e = idx->linear[i]; e; e = e_next)
+		{
+			e_next = e->next;
+			safe_free(e);
+		}
+	}
+	safe_free(idx->table);
+	safe_free(idx->ptrtable);
+	memset(idx, 0, sizeof(TKLIndex));
+}
+
+/** Free the index, eg. when the module is unloaded */
+static void tkl_index_free(void)
+{
+	tkl_index_free_one(&tkl_serverban_index);
+	tkl_index_free_one(&tkl_exception_index);
+	tkl_index_built = 0;
+}
+
+/** Build the index from tklines[] */
+static void tkl_index_build(void)
+{
+	TKL *tkl;
+	int index;
+
+	tkl_index_free();
+	siphash_generate_key(siphashkey_tkl_index);
+	tkl_serverban_index.size = tkl_exception_index.size = 256;
+	tkl_serverban_index.table = safe_alloc(sizeof(TKLIndexEntry *) * 256);
+	tkl_exception_index.table = safe_alloc(sizeof(TKLIndexEntry *) * 256);
+	tkl_serverban_index.ptrtable = safe_alloc(sizeof(TKLIndexEntry *) * 256);
+	tkl_exception_index.ptrtable = safe_alloc(sizeof(TKLIndexEntry *) * 256);
+	tkl_index_built = 1;
+
+	/* Add each list from tail to head, since tkl_index_add()
+	 * assumes it is called for the new head of the list.
+	 */
+	for (index = 0; index < TKLISTLEN; index++)
+	{
+		for (tkl = tklines[index]; tkl && tkl->next; tkl = tkl->next);
+		for (; tkl; tkl = tkl->prev)
+			tkl_index_add(tkl);
+	}
+}
+
+static void tkl_index_probe(TKLIndex *idx, int type, const char *key, int list, TKLIndexCandidates *c)
+{
+	TKLIndexEntry *e;
+
+	for (e = idx->table[tkl_index_bucket(idx, type, key)]; e; e = e->next)
+	{
+		if ((e->type != type) || ((list >= 0) && (e->list != list)) || strcmp(e->key, key))
+			continue;
+		if (c->count == c->size)
+		{
+			TKLIndexEntry **n = safe_alloc(sizeof(TKLIndexEntry *) * c->size * 2);
+			memcpy(n, c->entries, sizeof(TKLIndexEntry *) * c->count);
+			if (c->entries != c->buf)
+				safe_free(c->entries);
+			c->entries = n;
+			c->size *= 2;
+		}
+		c->entries[c->count++] = e;
+	}
+}
+
+static void tkl_index_probe_host(TKLIndex *idx, const char *host, int list, TKLIndexCandidates *c)
+{
+	char buf[HOSTLEN+1];
+	char *p, ch;
+
+	ban_index_lowercase(buf, sizeof(buf), host);
+
+	if (idx->types[BANINDEX_HOST])
+		tkl_index_probe(idx, BANINDEX_HOST, buf, list, c);
+
+	if (!idx->types[BANINDEX_SUFFIX] && !idx->types[BANINDEX_PREFIX])
+		return;
+
+	for (p = buf; *p; p++)
+	{
+		if ((*p == '.') && idx->types[BANINDEX_SUFFIX])
+			tkl_index_probe(idx, BANINDEX_SUFFIX, p, list, c);
+		if (((*p == '.') || (*p == ':')) && idx->types[BANINDEX_PREFIX])
+		{
+			ch = p[1];
+			p[1] = '\0';
+			tkl_index_probe(idx, BANINDEX_PREFIX, buf, list, c);
+			p[1] = ch;
+		}
+	}
+}
+
+static void tkl_index_probe_cidr(TKLIndex *idx, const char *ip, int list, TKLIndexCandidates *c)
+{
+	char key[80];
+	unsigned char addr[16], masked[16];
+	int family, addrlen, maxbits, bits;
+	unsigned int *counts;
+
+	if (strchr(ip, ':'))
+	{
+		family = AF_INET6;
+		addrlen = 16;
+		maxbits = 128;
+		counts = idx->cidr6;
+	} else {
+		family = AF_INET;
+		addrlen = 4;
+		maxbits = 32;
+		counts = idx->cidr4;
+	}
+	if (inet_pton(family, ip, addr) != 1)
+		return;
+
+	for (bits = 1; bits <= maxbits; bits++)
+	{
+		if (!counts[bits])
+			continue;
+		memcpy(masked, addr, addrlen);
+		ban_index_cidr_key(key, sizeof(key), family, masked, bits);
+		tkl_index_probe(idx, BANINDEX_CIDR, key, list, c);
+	}
+}
+
+/** Sort candidates in tklines[] order: by list, then head to tail */
+static int tkl_index_candidate_cmp(const void *a, const void *b)
+{
+	const TKLIndexEntry *x = *(const TKLIndexEntry **)a;
+	const TKLIndexEntry *y = *(const TKLIndexEntry **)b;
+
+	if (x->list != y->list)
+		return (x->list < y->list) ? -1 : 1;
+	if (x->seq != y->seq)
+		return (x->seq > y->seq) ? -1 : 1;
+	return 0;
+}
+
+/** Find the first TKL in tklines[] that 'matcher' accepts.
+ * @param idx      The index to use
+ * @param client   The client
+ * @param list     The tklines[] index to search, or -1 for all
+ * @param ip_only  Only the IP of the client is matched (Z-Lines)
+ * @param matcher  Function that does the actual checking
+ * @param arg      Passed on to the matcher
+ * @returns The TKL, or NULL if none matched.
+ */
+static TKL *tkl_index_find(TKLIndex *idx, Client *client, int list, int ip_only, TKLIndexMatcher matcher, int arg)
+{
+	TKLIndexCandidates c;
+	TKLIndexEntry *e, *l, *prev = NULL;
+	TKL *ret = NULL;
+	char *realhost = NULL;
+	int i = 0, from, to;
+
+	if (!tkl_index_built)
+		tkl_index_build();
+
+	if (!idx->count)
+		return NULL;
+
+	c.entries = c.buf;
+	c.count = 0;
+	c.size = 64;
+
+	if (!ip_only)
+		realhost = client->user ? client->user->realhost : (MyUser(client) ? client->local->sockhost : NULL);
+	if (client->ip)
+	{
+		tkl_index_probe_host(idx, client->ip, list, &c);
+		if (idx->types[BANINDEX_CIDR])
+			tkl_index_probe_cidr(idx, client->ip, list, &c);
+	}
+	if (realhost && *realhost && (!client->ip || strcasecmp(realhost, client->ip)))
+		tkl_index_probe_host(idx, realhost, list, &c);
+
+	qsort(c.entries, c.count, sizeof(TKLIndexEntry *), tkl_index_candidate_cmp);
+
+	from = (list >= 0) ? list : 0;
+	to = (list >= 0) ? list : TKLISTLEN - 1;
+	for (; from <= to; from++)
+	{
+		l = idx->linear[from];
+		while (l || ((i < c.count) && (c.entries[i]->list == from)))
+		{
+			if ((i < c.count) && (c.entries[i]->list == from) && (!l || (c.entries[i]->seq > l->seq)))
+			{
+				e = c.entries[i++];
+				if (e == prev)
+					continue; /* found twice */
+			} else {
+				e = l;
+				l = l->next;
+			}
+			prev = e;
+			if (matcher(client, arg, e->tkl))
+			{
+				ret = e->tkl;
+				goto done;
+			}
+		}
+	}
+
+done:
+	if (c.entries != c.buf)
+		safe_free(c.entries);
+	return ret;
+}
+
 /** Add a spamfilter entry to the list.
  * @param type                TKL_SPAMF or TKL_SPAMF|TKL_GLOBAL.
  * @param target              The spamfilter target (SPAMF_*)
@@ -2387,6 +2853,7 @@ TKL *_tkl_add_spamfilter(int type, unsigned short target, BanAction action, Matc
 	/* Spamfilters go via the normal TKL list... */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
+	spamfilter_index_invalidate();
 
 	if (target & SPAMF_MTAG)
 		mtag_spamfilters_present = 1;
@@ -2450,6 +2917,7 @@ TKL *_tkl_add_serverban(int type, char *usermask, char *hostmask, char *reason,
 	/* If we get here it's just for our normal list.. */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
+	tkl_index_add(tkl);
 
 	return tkl;
 }
@@ -2511,6 +2979,7 @@ TKL *_tkl_add_banexception(int type, char *usermask, char *hostmask, char *reaso
 	/* If we get here it's just for our normal list.. */
 	index = tkl_hash(tkl_typetochar(type));
 	AddListItem(tkl, tklines[index]);
+	tkl_index_add(tkl);
 
 	return tkl;
 }
@@ -2657,6 +3126,9 @@ void _tkl_del_line(TKL *tkl)
 		/* If we get here it's just for our normal list.. */
 		index = tkl_hash(tkl_typetochar(tkl->type));
 		DelListItem(tkl, tklines[index]);
+		tkl_index_del(tkl);
+		if (TKLIsSpamfilter(tkl))
+			spamfilter_index_invalidate();
 	}
 
 	/* Finally, free the entry */
@@ -2745,7 +3217,6 @@ void _tkl_check_local_remove_shun(TKL *tmp)
 /** This returns something like user@host, or %user@host, or ~a:Trusted
  * that can be used in oper notices like expiring kline, added kline, etc.
  */
-#define NO_SOFT_PREFIX	1
 char *tkl_uhost(TKL *tkl, char *buf, size_t buflen, int options)
 {
 	if (TKLIsServerBan(tkl))
@@ -2937,11 +3408,8 @@ int _find_tkl_exception(int ban_type, Client *client)
 	}
 
 	/* If not banned (yet), then check regular entries.. */
-	for (tkl = tklines[tkl_hash('e')]; tkl; tkl = tkl->next)
-	{
-			if (find_tkl_exception_matcher(client, ban_type, tkl))
-				return 1; /* exempt */
-	}
+	if (tkl_index_find(&tkl_exception_index, client, tkl_hash('e'), 0, find_tkl_exception_matcher, ban_type))
+		return 1; /* exempt */
 
 	for (hook = Hooks[HOOKTYPE_TKL_EXCEPT]; hook; hook = hook->next)
 	{
@@ -3014,17 +3482,9 @@ int _find_tkline_match(Client *client, int skip_soft)
 	/* If not banned (yet), then check regular entries.. */
 	if (!banned)
 	{
-		for (index = 0; index < TKLISTLEN; index++)
-		{
-			for (tkl = tklines[index]; tkl; tkl = tkl->next)
-			{
-				banned = find_tkline_match_matcher(client, skip_soft, tkl);
-				if (banned)
-					break;
-			}
-			if (banned)
-				break;
-		}
+		tkl = tkl_index_find(&tkl_serverban_index, client, -1, 0, find_tkline_match_matcher, skip_soft);
+		if (tkl)
+			banned = 1;
 	}
 
 	if (!banned)
@@ -3272,6 +3732,12 @@ TKL *find_tkline_match_zap_matcher(Client *client, TKL *tkl)
 	return NULL; /* no match */
 }
 
+/** find_tkline_match_zap_matcher() in the form that tkl_index_find() wants */
+static int find_tkline_match_zap_index_matcher(Client *client, int unused, TKL *tkl)
+{
+	return find_tkline_match_zap_matcher(client, tkl) ? 1 : 0;
+}
+
 /** Find matching (G)ZLINE, if any.
  * Note: function prototype changed as per UnrealIRCd 4.2.0.
  * @retval The (G)Z-Line that matched, or NULL if no such ban was found.
@@ -3298,14 +3764,7 @@ TKL *_find_tkline_match_zap(Client *client)
 	}
 
 	/* If not banned (yet), then check regular entries.. */
-	for (tkl = tklines[tkl_hash('z')]; tkl; tkl = tkl->next)
-	{
-		ret = find_tkline_match_zap_matcher(client, tkl);
-		if (ret)
-			return ret;
-	}
-
-	return NULL;
+	return tkl_index_find(&tkl_serverban_index, client, tkl_hash('z'), 1, find_tkline_match_zap_index_matcher, 0);
 }
 
 #define BY_MASK 0x1
@@ -4674,6 +5133,405 @@ int _join_viruschan(Client *client, TKL *tkl, int type)
 	return 1;
 }
 
+/* Spamfilter prefilter.
+ * With many spamfilters, running each and every one of them on every
+ * message is expensive. Most filters require some literal text to be
+ * present though, like "foo" in '*foo*bar*' or in 'buy.*foo+ bar'.
+ * We extract such a literal from each filter and put all of them in
+ * one Aho-Corasick automaton, so we can scan a message once and then
+ * only run the filters whose literal was found (or that have none).
+ * Filters are still run in list order, so the result is the same.
+ * Matching in the automaton is case insensitive and treats '_' and ' '
+ * as the same character. This only means some more filters are run.
+ * The prefilter is rebuilt when the spamfilter list has changed.
+ */
+typedef struct SpamfilterIndexEntry SpamfilterIndexEntry;
+struct SpamfilterIndexEntry {
+	TKL *tkl;
+	int literal;		/**< Automaton state of the literal, or -1 if none */
+};
+
+static struct {
+	int dirty;		/**< Spamfilters were added or removed since the last build */
+	int built;
+	SpamfilterIndexEntry *entries;	/**< All spamfilters, in the order of tklines[] */
+	int count;
+	int nstates;
+	int nclasses;
+	unsigned char classmap[256];	/**< Byte to character class */
+	int *delta;		/**< State transitions, nstates * nclasses */
+	int *dictlink;		/**< Nearest state (via fail links) that ends a literal, 0 for none */
+	char *final;		/**< Does a literal end in this state? */
+	unsigned int *seen;	/**< Per state: scan generation in which it was reached */
+	unsigned int generation;
+} spamfilter_index;
+
+#define SPAMFILTER_LITERAL_MAX	128
+
+static inline unsigned char spamfilter_fold(unsigned char c)
+{
+	c = tolower(c);
+	return (c == '_') ? ' ' : c;
+}
+
+/** Get the longest run of literal text from a simple (glob) match */
+static int spamfilter_simple_literal(const char *str, char *out)
+{
+	int len = 0, bestlen = 0;
+	const char *p, *start = str;
+
+	for (p = str; ; p++)
+	{
+		if (!*p || (*p == '*') || (*p == '?'))
+		{
+			len = p - start;
+			if ((len > bestlen) && (len < SPAMFILTER_LITERAL_MAX))
+			{
+				memcpy(out, start, len);
+				bestlen = len;
+			}
+			if (!*p)
+				break;
+			start = p + 1;
+		}
+	}
+	out[bestlen] = '\0';
+	return bestlen;
+}
+
+/** Skip a regex quantifier (and a lazy/possessive suffix), if any.
+ * @returns 0 if there was no quantifier, 1 if the previous atom
+ *          is still required (+), 2 if it is optional.
+ */
+static int spamfilter_regex_skip_quantifier(const char **pp)
+{
+	const char *p = *pp;
+	int ret;
+
+	if ((*p == '?') || (*p == '*'))
+	{
+		ret = 2;
+		p++;
+	} else
+	if (*p == '+')
+	{
+		ret = 1;
+		p++;
+	} else
+	if (*p == '{')
+	{
+		const char *q;
+		for (q = p + 1; isdigit(*q) || (*q == ','); q++);
+		if ((*q != '}') || (q == p + 1))
+			return 0; /* not a quantifier, but a literal '{' */
+		ret = 2;
+		p = q + 1;
+	} else
+		return 0;
+
+	if ((*p == '?') || (*p == '+'))
+		p++;
+	*pp = p;
+	return ret;
+}
+
+/** Skip a regex character class such as '[a-z]'.
+ * @returns 1 on success, 0 if we don't understand it.
+ */
+static int spamfilter_regex_skip_class(const char **pp)
+{
+	const char *p = *pp + 1;
+
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p && (*p != ']'))
+	{
+		if ((*p == '\\') && p[1])
+			p += 2;
+		else if ((*p == '[') && (p[1] == ':'))
+		{
+			p = strstr(p + 2, ":]");
+			if (!p)
+				return 0;
+			p += 2;
+		} else
+			p++;
+	}
+	if (!*p)
+		return 0;
+	*pp = p + 1;
+	return 1;
+}
+
+/** Get the longest run of literal text that every string matching
+ * the (PCRE2) regex must contain. This only understands the basics
+ * and gives up (returns 0) on anything else, which is always safe.
+ */
+static int spamfilter_regex_literal(const char *re, char *out)
+{
+	char run[SPAMFILTER_LITERAL_MAX];
+	int runlen = 0, bestlen = 0, depth, q;
+	const char *p = re;
+	char c;
+
+#define END_RUN do { \
+		if (runlen > bestlen) { memcpy(out, run, runlen); bestlen = runlen; } \
+		runlen = 0; \
+	} while(0)
+
+	while (*p)
+	{
+		c = *p;
+		if (c == '\\')
+		{
+			if (!p[1])
+				return 0;
+			if (isalnum(p[1]))
+			{
+				/* Character types and assertions break the run,
+				 * anything else (\x, \Q, \p, backreferences..) we don't deal with.
+				 */
+				if (!strchr("dDwWsSbBAzZGhHvVR", p[1]))
+					return 0;
+				END_RUN;
+				p += 2;
+				spamfilter_regex_skip_quantifier(&p);
+				continue;
+			}
+			c = p[1];
+			p += 2;
+		} else
+		if (c == '[')
+		{
+			END_RUN;
+			if (!spamfilter_regex_skip_class(&p))
+				return 0;
+			spamfilter_regex_skip_quantifier(&p);
+			continue;
+		} else
+		if (c == '(')
+		{
+			/* Skip groups entirely. Only plain groups, lookarounds and
+			 * the like, not things like option settings that affect the
+			 * rest of the regex.
+			 */
+			if ((p[1] == '*') || ((p[1] == '?') && !strchr(":=!<>|P'", p[2])))
+				return 0;
+			END_RUN;
+			for (p++, depth = 1; *p && depth; )
+			{
+				if (*p == '\\')
+				{
+					if (!p[1])
+						return 0;
+					p += 2;
+				} else
+				if (*p == '[')
+				{
+					if (!spamfilter_regex_skip_class(&p))
+						return 0;
+				} else
+				{
+					if (*p == '(')
+						depth++;
+					else if (*p == ')')
+						depth--;
+					p++;
+				}
+			}
+			if (depth)
+				return 0;
+			spamfilter_regex_skip_quantifier(&p);
+			continue;
+		} else
+		if ((c == ')') || (c == '|'))
+		{
+			/* An alternative at the top level: nothing is required */
+			return 0;
+		} else
+		if ((c == '.') || (c == '^') || (c == '$') || (c == '*') || (c == '+') || (c == '?') || (c == '{'))
+		{
+			END_RUN;
+			p++;
+			spamfilter_regex_skip_quantifier(&p);
+			continue;
+		} else
+		{
+			p++;
+		}
+
+		/* Literal character 'c' */
+		q = spamfilter_regex_skip_quantifier(&p);
+		if (q == 2)
+		{
+			END_RUN;
+			continue;
+		}
+		if (runlen < SPAMFILTER_LITERAL_MAX - 1)
+			run[runlen++] = c;
+		if (q == 1)
+			END_RUN;
+	}
+	END_RUN;
+#undef END_RUN
+
+	out[bestlen] = '\0';
+	return bestlen;
+}
+
+static void spamfilter_index_free(void)
+{
+	unsigned int generation = spamfilter_index.generation;
+
+	safe_free(spamfilter_index.entries);
+	safe_free(spamfilter_index.delta);
+	safe_free(spamfilter_index.dictlink);
+	safe_free(spamfilter_index.final);
+	safe_free(spamfilter_index.seen);
+	memset(&spamfilter_index, 0, sizeof(spamfilter_index));
+	/* Keep counting, so a scan that was in progress can tell it is stale */
+	spamfilter_index.generation = generation;
+}
+
+/** Mark the spamfilter prefilter as outdated, it is rebuilt on next use */
+static void spamfilter_index_invalidate(void)
+{
+	spamfilter_index.dirty = 1;
+}
+
+/** Build the spamfilter prefilter from tklines[] */
+static void spamfilter_index_build(void)
+{
+	char **literals;
+	char buf[SPAMFILTER_LITERAL_MAX];
+	int *fail, *queue;
+	int i, c, s, t, head, tail, maxstates = 1, nclasses = 1;
+	unsigned char *p;
+	TKL *tkl;
+
+	spamfilter_index_free();
+	spamfilter_index.built = 1;
+	spamfilter_index.dirty = 0;
+
+	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
+		spamfilter_index.count++;
+	if (!spamfilter_index.count)
+		return;
+	spamfilter_index.entries = safe_alloc(sizeof(SpamfilterIndexEntry) * spamfilter_index.count);
+	literals = safe_alloc(sizeof(char *) * spamfilter_index.count);
+
+	/* Extract the literals and figure out which characters are used */
+	for (tkl = tklines[tkl_hash('F')], i = 0; tkl; tkl = tkl->next, i++)
+	{
+		Match *m = tkl->ptr.spamfilter->match;
+		int len = 0;
+
+		spamfilter_index.entries[i].tkl = tkl;
+		spamfilter_index.entries[i].literal = -1;
+		if (m->type == MATCH_SIMPLE)
+			len = spamfilter_simple_literal(m->str, buf);
+		else if (m->type == MATCH_PCRE_REGEX)
+			len = spamfilter_regex_literal(m->str, buf);
+		if (len == 0)
+			continue;
+		for (p = (unsigned char *)buf; *p; p++)
+		{
+			*p = spamfilter_fold(*p);
+			if (!spamfilter_index.classmap[*p])
+				spamfilter_index.classmap[*p] = nclasses++;
+		}
+		safe_strdup(literals[i], buf);
+		maxstates += len;
+	}
+	for (c = 0; c < 256; c++)
+		spamfilter_index.classmap[c] = spamfilter_index.classmap[spamfilter_fold(c)];
+
+	/* Build the trie */
+	spamfilter_index.nclasses = nclasses;
+	spamfilter_index.nstates = 1;
+	spamfilter_index.delta = safe_alloc(sizeof(int) * maxstates * nclasses);
+	spamfilter_index.dictlink = safe_alloc(sizeof(int) * maxstates);
+	spamfilter_index.final = safe_alloc(maxstates);
+	spamfilter_index.seen = safe_alloc(sizeof(unsigned int) * maxstates);
+	for (i = 0; i < maxstates * nclasses; i++)
+		spamfilter_index.delta[i] = -1;
+	for (i = 0; i < spamfilter_index.count; i++)
+	{
+		if (!literals[i])
+			continue;
+		s = 0;
+		for (p = (unsigned char *)literals[i]; *p; p++)
+		{
+			c = spamfilter_index.classmap[*p];
+			if (spamfilter_index.delta[s * nclasses + c] < 0)
+				spamfilter_index.delta[s * nclasses + c] = spamfilter_index.nstates++;
+			s = spamfilter_index.delta[s * nclasses + c];
+		}
+		spamfilter_index.final[s] = 1;
+		spamfilter_index.entries[i].literal = s;
+		safe_free(literals[i]);
+	}
+	safe_free(literals);
+
+	/* Turn it into a DFA, breadth first */
+	fail = safe_alloc(sizeof(int) * spamfilter_index.nstates);
+	queue = safe_alloc(sizeof(int) * spamfilter_index.nstates);
+	head = tail = 0;
+	for (c = 0; c < nclasses; c++)
+	{
+		t = spamfilter_index.delta[c];
+		if (t < 0)
+		{
+			spamfilter_index.delta[c] = 0;
+		} else {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail)
+	{
+		s = queue[head++];
+		for (c = 0; c < nclasses; c++)
+		{
+			t = spamfilter_index.delta[s * nclasses + c];
+			if (t < 0)
+			{
+				spamfilter_index.delta[s * nclasses + c] = spamfilter_index.delta[fail[s] * nclasses + c];
+				continue;
+			}
+			fail[t] = spamfilter_index.delta[fail[s] * nclasses + c];
+			spamfilter_index.dictlink[t] = spamfilter_index.final[fail[t]] ? fail[t] : spamfilter_index.dictlink[fail[t]];
+			queue[tail++] = t;
+		}
+	}
+	safe_free(fail);
+	safe_free(queue);
+}
+
+/** Scan 'str' and remember which literals it contains */
+static void spamfilter_index_scan(const char *str)
+{
+	const unsigned char *p;
+	int s = 0, t;
+	unsigned int gen;
+
+	if (++spamfilter_index.generation == 0)
+	{
+		memset(spamfilter_index.seen, 0, sizeof(unsigned int) * spamfilter_index.nstates);
+		spamfilter_index.generation = 1;
+	}
+	gen = spamfilter_index.generation;
+
+	for (p = (const unsigned char *)str; *p; p++)
+	{
+		s = spamfilter_index.delta[s * spamfilter_index.nclasses + spamfilter_index.classmap[*p]];
+		for (t = spamfilter_index.final[s] ? s : spamfilter_index.dictlink[s]; t && (spamfilter_index.seen[t] != gen); t = spamfilter_index.dictlink[t])
+			spamfilter_index.seen[t] = gen;
+	}
+}
+
 /** match_spamfilter: executes the spamfilter on the input string.
  * @param str		The text (eg msg text, notice text, part text, quit text, etc
  * @param target	The spamfilter target (SPAMF_*)
@@ -4692,6 +5550,8 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *cmd, char
 	char *str;
 	int ret = -1;
 	char *reason = NULL;
+	int i, literal, scanned = 0;
+	unsigned int generation = 0;
 #ifdef SPAMFILTER_DETECTSLOW
 	struct rusage rnow, rprev;
 	long ms_past;
@@ -4720,8 +5580,13 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *cmd, char
 	if (find_tkl_exception(TKL_SPAMF, client))
 		return 0;
 
-	for (tkl = tklines[tkl_hash('F')]; tkl; tkl = tkl->next)
+	if (!spamfilter_index.built || spamfilter_index.dirty)
+		spamfilter_index_build();
+
+	for (i = 0; i < spamfilter_index.count; i++)
 	{
+		tkl = spamfilter_index.entries[i].tkl;
+
 		if (!(tkl->ptr.spamfilter->target & target))
 			continue;
 
@@ -4734,6 +5599,23 @@ int _match_spamfilter(Client *client, char *str_in, int target, char *cmd, char
 		if (IsSoftBanAction(tkl->ptr.spamfilter->action) && IsLoggedIn(client))
 			continue;
 
+		/* Skip the filter if the text does not contain its literal.
+		 * The text is scanned on first use, and again if a hook
+		 * that we called has done a scan of its own in the meantime.
+		 */
+		literal = spamfilter_index.entries[i].literal;
+		if (literal > 0)
+		{
+			if (!scanned || (generation != spamfilter_index.generation))
+			{
+				scanned = 1;
+				spamfilter_index_scan(str);
+				generation = spamfilter_index.generation;
+			}
+			if (spamfilter_index.seen[literal] != generation)
+				continue;
+		}
+
 #ifdef SPAMFILTER_DETECTSLOW
 		memset(&rnow, 0, sizeof(rnow));
 		memset(&rprev, 0, sizeof(rnow));
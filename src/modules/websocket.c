@@ -42,6 +42,21 @@ struct WebSocketUser {
 	char *sec_websocket_protocol; /**< Only valid during parsing of the request, after that it is NULL again */
 };
 
+/** The last line that was framed for each WebSocketType.
+ * When a message is sent to a channel, sendbufto_one() is called with
+ * the same line for every member, so the UTF8 conversion and framing
+ * only needs to be done for the first websocket user of each type.
+ * The other users get the frame queued via a shared sendQ segment.
+ */
+typedef struct WebSocketFrameCache WebSocketFrameCache;
+struct WebSocketFrameCache {
+	int inlen; /**< Length of 'in', 0 if the cache is empty */
+	int outlen; /**< Length of 'out' */
+	dbufshared *shared; /**< Shared segment with 'out', created on first reuse */
+	char in[1024]; /**< The line before conversion (sendbufto_one() never sends more than this) */
+	char out[WEBSOCKET_SEND_BUFFER_SIZE]; /**< The resulting websocket frame(s) */
+};
+
 #define WSU(client)	((WebSocketUser *)moddata_client(client, websocket_md).ptr)
 
 #define WEBSOCKET_PORT(client)	((client->local && client->local->listener) ? client->local->listener->websocket_options : 0)
@@ -67,12 +82,13 @@ int websocket_handle_handshake(Client *client, char *readbuf, int *length);
 int websocket_handshake_send_response(Client *client);
 int websocket_handle_packet_ping(Client *client, char *buf, int len);
 int websocket_handle_packet_pong(Client *client, char *buf, int len);
-int websocket_create_packet(int opcode, char **buf, int *len);
+int websocket_create_packet(int opcode, char **buf, int *len, char *sendbuf, size_t sendbufsize);
 int websocket_send_pong(Client *client, char *buf, int len);
 
 /* Global variables */
 ModDataInfo *websocket_md;
 static int ws_text_mode_available = 1;
+static WebSocketFrameCache ws_frame_cache[2]; /**< [0] for binary, [1] for text */
 
 MOD_TEST()
 {
@@ -109,8 +125,21 @@ MOD_LOAD()
 	return MOD_SUCCESS;
 }
 
+/** Empty the frame cache, dropping our reference to the shared segment */
+static void ws_frame_cache_clear(WebSocketFrameCache *cache)
+{
+	cache->inlen = 0;
+	if (cache->shared)
+	{
+		dbuf_shared_release(cache->shared);
+		cache->shared = NULL;
+	}
+}
+
 MOD_UNLOAD()
 {
+	ws_frame_cache_clear(&ws_frame_cache[0]);
+	ws_frame_cache_clear(&ws_frame_cache[1]);
 	return MOD_SUCCESS;
 }
 
@@ -242,16 +271,55 @@ int websocket_packet_out(Client *from, Client *to, Client *intended_to, char **m
 {
 	if (MyConnect(to) && WSU(to) && WSU(to)->handshake_completed)
 	{
+		WebSocketFrameCache *cache;
+		char *buf;
+		int len;
+
+		if ((WEBSOCKET_TYPE(to) != WEBSOCKET_TYPE_BINARY) && (WEBSOCKET_TYPE(to) != WEBSOCKET_TYPE_TEXT))
+			return 0;
+
+		cache = &ws_frame_cache[WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_TEXT];
+
+		/* Same line as last time? Then reuse the frame. */
+		if ((*length > 0) && (cache->inlen == *length) && !memcmp(cache->in, *msg, *length))
+		{
+			if (!cache->shared)
+				cache->shared = dbuf_shared_new(cache->out, cache->outlen);
+			*msg = cache->shared->data;
+			*length = cache->shared->size;
+			packet_set_shared(cache->shared);
+			return 0;
+		}
+		ws_frame_cache_clear(cache);
+
+		buf = *msg;
+		len = *length;
 		if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_BINARY)
-			websocket_create_packet(WSOP_BINARY, msg, length);
-		else if (WEBSOCKET_TYPE(to) == WEBSOCKET_TYPE_TEXT)
+		{
+			if (websocket_create_packet(WSOP_BINARY, &buf, &len, cache->out, sizeof(cache->out)) < 0)
+				return 0;
+		} else
 		{
 			/* Some more conversions are needed */
-			char *safe_msg = unrl_utf8_make_valid(*msg);
-			*msg = safe_msg;
-			*length = *msg ? strlen(safe_msg) : 0;
-			websocket_create_packet(WSOP_TEXT, msg, length);
+			buf = unrl_utf8_make_valid(buf);
+			len = buf ? strlen(buf) : 0;
+			if (websocket_create_packet(WSOP_TEXT, &buf, &len, cache->out, sizeof(cache->out)) < 0)
+			{
+				/* Same as before: send the converted line as-is */
+				*msg = buf;
+				*length = len;
+				return 0;
+			}
+		}
+
+		if (*length < sizeof(cache->in))
+		{
+			memcpy(cache->in, *msg, *length);
+			cache->inlen = *length;
+			cache->outlen = len;
 		}
+		*msg = buf;
+		*length = len;
 		return 0;
 	}
 	return 0;
@@ -831,9 +899,8 @@ int websocket_create_packet_simple(int opcode, char **buf, int *len)
  * The end result is one or more websocket frames,
  * all in a single packet *buf with size *len.
  */
-int websocket_create_packet(int opcode, char **buf, int *len)
+int websocket_create_packet(int opcode, char **buf, int *len, char *sendbuf, size_t sendbufsize)
 {
-	static char sendbuf[WEBSOCKET_SEND_BUFFER_SIZE];
 	char *s = *buf; /* points to start of current line */
 	char *s2; /* used for searching of end of current line */
 	char *lastbyte = *buf + *len - 1; /* points to last byte in *buf that can be safely read */
@@ -865,11 +932,11 @@ int websocket_create_packet(int opcode, char **buf, int *len)
 		else
 			bytes_single_frame = 4 + bytes_to_copy;
 
-		if (bytes_in_sendbuf + bytes_single_frame > sizeof(sendbuf))
+		if (bytes_in_sendbuf + bytes_single_frame > sendbufsize)
 		{
 			/* Overflow. This should never happen. */
 			sendto_ops("[websocket] [BUG] Overflow prevented: %d + %d > %d",
-				bytes_in_sendbuf, bytes_single_frame, (int)sizeof(sendbuf));
+				bytes_in_sendbuf, bytes_single_frame, (int)sendbufsize);
 			return -1;
 		}
 
@@ -55,9 +55,22 @@ ModuleHeader MOD_HEADER
 #define HasField(x, y) ((x)->fields & (y))
 #define IsMatch(x, y) ((x)->matchsel & (y))
 
-#define IsMarked(x)           (moddata_client(x, whox_md).l)
-#define SetMark(x)            do { moddata_client(x, whox_md).l = 1; } while(0)
-#define ClearMark(x)          do { moddata_client(x, whox_md).l = 0; } while(0)
+/* Clients are marked with the serial of the current who_global() call,
+ * so there is no need to clear the marks of all clients first.
+ */
+#define IsMarked(x)           (moddata_client(x, whox_md).l == whox_serial)
+#define SetMark(x)            do { moddata_client(x, whox_md).l = whox_serial; } while(0)
+
+/* Types of keys in the user index, see whox_index_add() */
+#define WHOX_KEY_HOST		1	/* Last two labels of the virthost, cloakedhost, realhost or IP */
+#define WHOX_KEY_ACCOUNT	2	/* Services account */
+#define WHOX_KEY_SERVER		3	/* Server the user is on */
+
+/* Maximum number of keys per user (4 hosts, server, account) */
+#define WHOX_INDEX_MAX_KEYS	6
+
+/* Initial size of the user index, it grows automatically */
+#define WHOX_INDEX_MIN_SIZE	1024
 
 /* Structs */
 struct who_format
@@ -71,8 +84,41 @@ struct who_format
 	int show_ip;
 };
 
+/** Entry in the user index: one for each key of each user */
+typedef struct WhoxIndexEntry WhoxIndexEntry;
+struct WhoxIndexEntry {
+	WhoxIndexEntry *prev, *next;	/**< Other entries in the same hash bucket */
+	Client *client;
+	uint64_t hash;			/**< Hash of the key, see whox_hash() */
+};
+
+/** All index entries of a user, stored in the whox_index moddata */
+typedef struct WhoxIndexUser WhoxIndexUser;
+struct WhoxIndexUser {
+	int num;
+	WhoxIndexEntry entry[1];
+};
+
+/** How who_global() finds the candidates, see whox_plan() */
+typedef struct WhoxPlan WhoxPlan;
+struct WhoxPlan {
+	int scan;		/**< Walk through all users (no index can be used) */
+	Client *nick;		/**< The user with exactly this nick (or NULL) */
+	int host;		/**< Look up host_hash in the index */
+	uint64_t host_hash;
+	int account;		/**< Look up account_hash in the index */
+	uint64_t account_hash;
+	int servers;		/**< Look up all servers that match the mask in the index */
+};
+
 /* Global variables */
 ModDataInfo *whox_md = NULL;
+ModDataInfo *whox_index_md = NULL;
+static long whox_serial = 0;
+static WhoxIndexEntry **whox_index = NULL;
+static unsigned int whox_index_size = 0;
+static unsigned int whox_index_count = 0;
+static char whox_index_key[SIPHASH_KEY_LENGTH];
 
 /* Forward declarations */
 CMD_FUNC(cmd_whox);
@@ -84,6 +130,13 @@ static int convert_classical_who_request(Client *client, int *parc, char *parv[]
 char *whox_md_serialize(ModData *m);
 void whox_md_unserialize(char *str, ModData *m);
 void whox_md_free(ModData *md);
+void whox_index_md_free(ModData *md);
+static void whox_index_add(Client *client);
+static void whox_index_free_all(void);
+int whox_connect(Client *client);
+int whox_userhost_change(Client *client, const char *olduser, const char *oldhost);
+int whox_account_login(Client *client, MessageTag *mtags);
+int whox_stats(Client *client, char *flag);
 
 MOD_INIT()
 {
@@ -111,17 +164,51 @@ MOD_INIT()
 		return MOD_FAILED;
 	}
 
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "whox_index";
+	mreq.type = MODDATATYPE_CLIENT;
+	mreq.free = whox_index_md_free;
+	whox_index_md = ModDataAdd(modinfo->handle, mreq);
+	if (!whox_index_md)
+	{
+		config_error("could not register whox_index moddata");
+		return MOD_FAILED;
+	}
+
+	HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CONNECT, 0, whox_connect);
+	HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CONNECT, 0, whox_connect);
+	HookAdd(modinfo->handle, HOOKTYPE_USERHOST_CHANGE, 0, whox_userhost_change);
+	HookAdd(modinfo->handle, HOOKTYPE_ACCOUNT_LOGIN, 0, whox_account_login);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, whox_stats);
+
 	ISupportAdd(modinfo->handle, "WHOX", NULL);
 	return MOD_SUCCESS;
 }
 
 MOD_LOAD()
 {
+	Client *client;
+
+	/* (Re)build the user index and reset the marks, these may
+	 * still be set from before a REHASH.
+	 */
+	siphash_generate_key(whox_index_key);
+	whox_serial = 0;
+	list_for_each_entry(client, &client_list, client_node)
+	{
+		moddata_client(client, whox_md).l = 0;
+		if (IsUser(client))
+			whox_index_add(client);
+	}
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
+	/* The index is rebuilt on load, since the entries point into
+	 * the hash table of this module.
+	 */
+	whox_index_free_all();
 	return MOD_SUCCESS;
 }
 
@@ -148,6 +235,180 @@ void whox_md_free(ModData *md)
 	md->l = 0;
 }
 
+/** Hash a key of the user index */
+static uint64_t whox_hash(int type, const char *str)
+{
+	return siphash_nocase(str, whox_index_key) ^ ((uint64_t)type * 0x9E3779B97F4A7C15ULL);
+}
+
+/** Return the last two labels of a host, eg "example.org" for "irc.example.org".
+ * If the host has less than two dots then the entire host is returned.
+ */
+static const char *whox_host_key(const char *host)
+{
+	const char *p;
+	int dots = 0;
+
+	for (p = host + strlen(host); p > host; p--)
+		if ((p[-1] == '.') && (++dots == 2))
+			return p;
+	return host;
+}
+
+static void whox_index_link(WhoxIndexEntry *e)
+{
+	WhoxIndexEntry **bucket = &whox_index[e->hash & (whox_index_size - 1)];
+
+	e->prev = NULL;
+	e->next = *bucket;
+	if (e->next)
+		e->next->prev = e;
+	*bucket = e;
+}
+
+static void whox_index_unlink(WhoxIndexEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		whox_index[e->hash & (whox_index_size - 1)] = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+}
+
+/** Resize the user index, re-adding all entries */
+static void whox_index_resize(unsigned int newsize)
+{
+	WhoxIndexEntry **old = whox_index;
+	unsigned int oldsize = whox_index_size;
+	WhoxIndexEntry *e, *e_next;
+	unsigned int i;
+
+	whox_index = safe_alloc(sizeof(WhoxIndexEntry *) * newsize);
+	whox_index_size = newsize;
+	for (i = 0; i < oldsize; i++)
+	{
+		for (e = old[i]; e; e = e_next)
+		{
+			e_next = e->next;
+			whox_index_link(e);
+		}
+	}
+	safe_free(old);
+}
+
+/** Add a user to the user index.
+ * The user is added under the last two labels of each host that
+ * GetHost() may return (virthost or realhost), the cloakedhost and
+ * the IP. Since the realhost, IP, cloakedhost and server never change
+ * for a user only virthost changes need to be tracked, see
+ * whox_userhost_change(). The account is tracked by whox_account_login().
+ */
+static void whox_index_add(Client *client)
+{
+	uint64_t hashes[WHOX_INDEX_MAX_KEYS];
+	int num = 0, i, j;
+	WhoxIndexUser *u;
+
+	if (moddata_client(client, whox_index_md).ptr || !client->user)
+		return; /* already in the index, or not a user */
+
+	if (client->user->virthost)
+		hashes[num++] = whox_hash(WHOX_KEY_HOST, whox_host_key(client->user->virthost));
+	if (*client->user->cloakedhost)
+		hashes[num++] = whox_hash(WHOX_KEY_HOST, whox_host_key(client->user->cloakedhost));
+	hashes[num++] = whox_hash(WHOX_KEY_HOST, whox_host_key(client->user->realhost));
+	if (client->ip)
+		hashes[num++] = whox_hash(WHOX_KEY_HOST, whox_host_key(client->ip));
+	if (client->user->server)
+		hashes[num++] = whox_hash(WHOX_KEY_SERVER, client->user->server);
+	if (IsLoggedIn(client))
+		hashes[num++] = whox_hash(WHOX_KEY_ACCOUNT, client->user->svid);
+
+	u = safe_alloc(sizeof(WhoxIndexUser) + sizeof(WhoxIndexEntry) * (num - 1));
+	for (i = 0; i < num; i++)
+	{
+		/* Each key only once per user, eg the virthost is usually the cloakedhost */
+		for (j = 0; j < u->num; j++)
+			if (u->entry[j].hash == hashes[i])
+				break;
+		if (j < u->num)
+			continue;
+		u->entry[u->num].client = client;
+		u->entry[u->num].hash = hashes[i];
+		u->num++;
+	}
+
+	if (whox_index_count + u->num > whox_index_size)
+		whox_index_resize(whox_index_size ? whox_index_size * 2 : WHOX_INDEX_MIN_SIZE);
+	for (i = 0; i < u->num; i++)
+		whox_index_link(&u->entry[i]);
+	whox_index_count += u->num;
+	moddata_client(client, whox_index_md).ptr = u;
+}
+
+/** Remove a user from the user index (called on quit and on changes) */
+void whox_index_md_free(ModData *md)
+{
+	WhoxIndexUser *u = md->ptr;
+	int i;
+
+	if (!u)
+		return;
+	for (i = 0; i < u->num; i++)
+		whox_index_unlink(&u->entry[i]);
+	whox_index_count -= u->num;
+	safe_free(md->ptr);
+}
+
+static void whox_index_free_all(void)
+{
+	Client *client;
+
+	list_for_each_entry(client, &client_list, client_node)
+		whox_index_md_free(&moddata_client(client, whox_index_md));
+	safe_free(whox_index);
+	whox_index_size = whox_index_count = 0;
+}
+
+/** Re-add the user to the index if it is in there */
+static void whox_index_update(Client *client)
+{
+	if (!moddata_client(client, whox_index_md).ptr)
+		return; /* not yet, will be added on connect */
+	whox_index_md_free(&moddata_client(client, whox_index_md));
+	whox_index_add(client);
+}
+
+int whox_connect(Client *client)
+{
+	whox_index_add(client);
+	return 0;
+}
+
+int whox_userhost_change(Client *client, const char *olduser, const char *oldhost)
+{
+	whox_index_update(client);
+	return 0;
+}
+
+int whox_account_login(Client *client, MessageTag *mtags)
+{
+	whox_index_update(client);
+	return 0;
+}
+
+int whox_stats(Client *client, char *flag)
+{
+	if (strcmp(flag, "z"))
+		return 0;
+
+	sendnumericfmt(client, RPL_STATSDEBUG, "who index entries %u buckets %u bytes %lu",
+		whox_index_count, whox_index_size,
+		(unsigned long)(whox_index_count * sizeof(WhoxIndexEntry) + whox_index_size * sizeof(WhoxIndexEntry *)));
+	return 1;
+}
+
 /** cmd_whox: standardized "extended" version of WHO.
  * The good thing about WHOX is that it allows the client to define what
  * output they want to see. Another good thing is that it is standardized
@@ -521,19 +782,162 @@ static void who_common_channel(Client *client, Channel *channel,
  *			  and will be left cleared on return
  */
 
+/** Number of characters a string needs at least to match this mask */
+static int whox_mask_minlen(const char *mask)
+{
+	int len = 0;
+
+	for (; *mask; mask++)
+		if (*mask != '*')
+			len++;
+	return len;
+}
+
+/** Return the index key of a host mask, or NULL if it can not be used.
+ * This is the case if the mask has wildcards in the last two labels,
+ * eg "*.example.org" can use the index (key "example.org") but
+ * "*example.org" or "irc.*.org" can not.
+ */
+static const char *whox_mask_host_key(const char *mask)
+{
+	const char *p, *suffix = mask;
+	int dots = 0;
+
+	for (p = mask; *p; p++)
+		if ((*p == '*') || (*p == '?'))
+			suffix = p + 1;
+	if (suffix == mask)
+		return whox_host_key(mask); /* no wildcards at all */
+	for (p = suffix; *p; p++)
+		if (*p == '.')
+			dots++;
+	if (dots < 2)
+		return NULL;
+	return whox_host_key(suffix);
+}
+
+/** Decide how who_global() should find the candidates for the mask.
+ * For every field that the mask is matched against we either find
+ * the candidates in the index or we fall back to walking through
+ * all users. Fields which can never match are skipped, eg a nick
+ * can never contain a dot or be longer than NICKLEN.
+ */
+static void whox_plan(Client *client, char *mask, Client *hunted, struct who_format *fmt, WhoxPlan *plan)
+{
+	int fields = fmt->matchsel & ~WMATCH_OPER;
+	int literal = !strchr(mask, '*') && !strchr(mask, '?');
+	int minlen = whox_mask_minlen(mask);
+	const char *key;
+
+	memset(plan, 0, sizeof(WhoxPlan));
+
+	if (fmt->matchsel == 0)
+		fields = WMATCH_NICK|WMATCH_USER|WMATCH_HOST; /* default, see do_match() */
+
+	if (fields & WMATCH_NICK)
+	{
+		if (literal)
+			plan->nick = hunted;
+		else if (!strchr(mask, '.') && (minlen <= NICKLEN))
+			plan->scan = 1;
+	}
+
+	if ((fields & WMATCH_USER) && (minlen <= USERLEN))
+		plan->scan = 1;
+
+	if (fields & WMATCH_HOST)
+	{
+		key = whox_mask_host_key(mask);
+		if (key)
+		{
+			plan->host = 1;
+			plan->host_hash = whox_hash(WHOX_KEY_HOST, key);
+		} else {
+			plan->scan = 1;
+		}
+	}
+
+	/* IP masks may be in CIDR notation, see match_user() */
+	if ((fields & WMATCH_IP) && IsOper(client))
+		plan->scan = 1;
+
+	if ((fields & WMATCH_SERVER) && IsOper(client))
+		plan->servers = 1;
+
+	if ((fields & WMATCH_INFO) && (minlen <= REALLEN))
+		plan->scan = 1;
+
+	if (fields & WMATCH_ACCOUNT)
+	{
+		if (literal)
+		{
+			plan->account = 1;
+			plan->account_hash = whox_hash(WHOX_KEY_ACCOUNT, mask);
+		} else {
+			plan->scan = 1;
+		}
+	}
+
+	if ((fields & WMATCH_MODES) && (fmt->umodes || fmt->noumodes))
+		plan->scan = 1;
+}
+
+/** Check a single candidate for who_global() and send it if it matches */
+static void who_global_candidate(Client *client, Client *acptr, char *mask, int operspy,
+	Client *hunted, int *maxmatches, struct who_format *fmt)
+{
+	if (!IsUser(acptr))
+		return;
+
+	if (IsInvisible(acptr) && !operspy && (client != acptr) && (acptr != hunted))
+		return;
+
+	if (IsMarked(acptr))
+		return;
+
+	/* Mark the client, it may be found again through another key */
+	SetMark(acptr);
+
+	if (IsMatch(fmt, WMATCH_OPER) && !IsOper(acptr))
+		return;
+
+	if (*maxmatches > 0)
+	{
+		if (do_match(client, acptr, mask, fmt))
+		{
+			do_who(client, acptr, NULL, fmt);
+			--(*maxmatches);
+		}
+	}
+}
+
+/** Send all candidates with this key in the index to who_global_candidate() */
+static void who_global_lookup(Client *client, uint64_t hash, char *mask, int operspy,
+	Client *hunted, int *maxmatches, struct who_format *fmt)
+{
+	WhoxIndexEntry *e;
+
+	if (!whox_index)
+		return;
+
+	for (e = whox_index[hash & (whox_index_size - 1)]; e && (*maxmatches > 0); e = e->next)
+		if (e->hash == hash)
+			who_global_candidate(client, e->client, mask, operspy, hunted, maxmatches, fmt);
+}
+
 static void who_global(Client *client, char *mask, int operspy, struct who_format *fmt)
 {
 	Client *hunted = NULL;
 	Client *acptr;
 	int maxmatches = IsOper(client) ? INT_MAX : WHOLIMIT;
+	WhoxPlan plan;
 
 	/* If searching for a nick explicitly, then include it later on in the result: */
 	if (mask && ((fmt->matchsel & WMATCH_NICK) || (fmt->matchsel == 0)))
 		hunted = find_person(mask, NULL);
 
-	/* Initialize the markers to zero */
-	list_for_each_entry(acptr, &client_list, client_node)
-		ClearMark(acptr);
+	/* Start a new round of markers */
+	whox_serial++;
 
 	/* First, if not operspy, then list all matching clients on common channels */
 	if (!operspy)
@@ -545,28 +949,34 @@ static void who_global(Client *client, char *mask, int operspy, struct who_forma
 	}
 
 	/* Second, list all matching visible clients. */
-	list_for_each_entry(acptr, &client_list, client_node)
+	if (mask)
+		whox_plan(client, mask, hunted, fmt, &plan);
+	if (!mask || plan.scan)
 	{
-		if (!IsUser(acptr))
-			continue;
-
-		if (IsInvisible(acptr) && !operspy && (client != acptr) && (acptr != hunted))
-			continue;
-
-		if (IsMarked(acptr))
-			continue;
-
-		if (IsMatch(fmt, WMATCH_OPER) && !IsOper(acptr))
-			continue;
-
-		if (maxmatches > 0)
+		list_for_each_entry(acptr, &client_list, client_node)
 		{
-			if (do_match(client, acptr, mask, fmt))
- 			{
-				do_who(client, acptr, NULL, fmt);
-				--maxmatches;
- 			}
- 		}
+			if (maxmatches <= 0)
+				break;
+			who_global_candidate(client, acptr, mask, operspy, hunted, &maxmatches, fmt);
+		}
+	} else {
+		if (plan.nick)
+			who_global_candidate(client, plan.nick, mask, operspy, hunted, &maxmatches, fmt);
+		if (plan.host)
+			who_global_lookup(client, plan.host_hash, mask, operspy, hunted, &maxmatches, fmt);
+		if (plan.account)
+			who_global_lookup(client, plan.account_hash, mask, operspy, hunted, &maxmatches, fmt);
+		if (plan.servers)
+		{
+			list_for_each_entry(acptr, &global_server_list, client_node)
+			{
+				if (match_simple(mask, acptr->name))
+				{
+					who_global_lookup(client, whox_hash(WHOX_KEY_SERVER, acptr->name),
+						mask, operspy, hunted, &maxmatches, fmt);
+				}
+			}
+		}
 	}
 
 	if (maxmatches <= 0)
@@ -60,6 +60,10 @@ int process_packet(Client *client, char *readbuf, int length, int killsafely)
 	if (IsDead(client))
 		return 0;
 
+	/* Data left, then process_clients() needs to run again soon */
+	if (DBufLength(&client->local->recvQ))
+		client_input_queued = 1;
+
 	/* flood from unknown connection */
 	if (IsUnknown(client) && (DBufLength(&client->local->recvQ) > iConf.handshake_data_flood_amount))
 	{
@@ -257,6 +261,8 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, int mtags_
 	int retval;
 #endif
 	RealCommand *cmptr = NULL;
+	ProfileStats *profile = NULL;
+	long long profile_start = 0;
 	int bytes;
 
 	*fromptr = cptr; /* The default, unless a source is specified (and permitted) */
@@ -504,6 +510,17 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, int mtags_
 	if (IsUser(cptr) && (cmptr->flags & CMD_RESETIDLE))
 		cptr->local->last = TStime();
 
+	/* Time the command if set::profiling is on. The entry is looked up
+	 * before the call, since the command may be removed by it (REHASH).
+	 */
+	if (iConf.profiling)
+	{
+		if (!cmptr->profile)
+			cmptr->profile = profile_find(PROFILE_COMMAND, 0, cmptr->cmd);
+		profile = cmptr->profile;
+		profile_start = profile_clock();
+	}
+
 	/* Now ready to execute the command */
 #ifndef DEBUGMODE
 	if (cmptr->flags & CMD_ALIAS)
@@ -536,6 +553,8 @@ static void parse2(Client *cptr, Client **fromptr, MessageTag *mtags, int mtags_
 		cptr->local->cputime += ticks;
 	}
 #endif
+	if (profile)
+		profile_add(profile, profile_start);
 }
 
 /** Ban user that is "flooding from an unknown connection".
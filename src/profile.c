@@ -0,0 +1,238 @@
+/************************************************************************
+ *   UnrealIRCd - Unreal Internet Relay Chat Daemon - src/profile.c
+ *   (c) 2021- Bram Matthys and The UnrealIRCd Team
+ *
+ *   See file AUTHORS in IRC package for additional names of
+ *   the programmers.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief Profiling of hooks and commands, see set::profiling.
+ */
+
+#include "unrealircd.h"
+
+/** All profile entries. These are never freed, so they survive a
+ * module reload (REHASH) and can safely be used by a hook or command
+ * that is removed while it is running.
+ */
+MODVAR ProfileStats *profile_stats = NULL;
+
+/** Returns a monotonic clock in nanoseconds (only used for differences) */
+long long profile_clock(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+#else
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (long long)((double)now.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#endif
+}
+
+/** Find or create the profile entry for a hook or command.
+ * @param type		PROFILE_HOOK or PROFILE_COMMAND
+ * @param hooktype	The hook type (for PROFILE_HOOK)
+ * @param name		The module name (for PROFILE_HOOK) or the command
+ */
+ProfileStats *profile_find(int type, int hooktype, const char *name)
+{
+	ProfileStats *p;
+
+	for (p = profile_stats; p; p = p->next)
+		if ((p->type == type) && (p->hooktype == hooktype) && !strcmp(p->name, name))
+			return p;
+
+	p = safe_alloc(sizeof(ProfileStats));
+	p->type = type;
+	p->hooktype = hooktype;
+	safe_strdup(p->name, name);
+	AddListItem(p, profile_stats);
+	return p;
+}
+
+/** Returns the profile entry of a hook, used by the RunHook macros */
+ProfileStats *hook_profile(Hook *h)
+{
+	if (!h->profile)
+		h->profile = profile_find(PROFILE_HOOK, h->type, h->owner ? h->owner->header->name : "core");
+	return h->profile;
+}
+
+/** Histogram bucket for a duration: 4 buckets per power of 2 */
+static int profile_bucket(unsigned long long nsec)
+{
+	int b = 0;
+
+	if (nsec < 4)
+		return (int)nsec;
+	while ((nsec >> b) > 7)
+		b++;
+	/* now nsec >> b is between 4 and 7 */
+	b = (b * 4) + (int)(nsec >> b);
+	if (b >= PROFILE_BUCKETS)
+		b = PROFILE_BUCKETS - 1;
+	return b;
+}
+
+/** Lowest duration (in nanoseconds) that ends up in bucket 'b' */
+static unsigned long long profile_bucket_start(int b)
+{
+	if (b < 4)
+		return b;
+	return (unsigned long long)(4 + (b % 4)) << ((b / 4) - 1);
+}
+
+/** Add a call that started at 'start' (see profile_clock()) */
+void profile_add(ProfileStats *p, long long start)
+{
+	long long nsec = profile_clock() - start;
+
+	if (nsec < 0)
+		nsec = 0;
+	p->calls++;
+	p->total_nsec += nsec;
+	if (nsec > p->max_nsec)
+		p->max_nsec = nsec;
+	p->histogram[profile_bucket(nsec)]++;
+}
+
+/** Returns the (approximate) duration that 'permille' of the calls
+ * took at most, eg 990 for the 99th percentile.
+ */
+unsigned long long profile_percentile(ProfileStats *p, int permille)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	if (!p->calls)
+		return 0;
+	want = (unsigned long)(((unsigned long long)p->calls * permille + 999) / 1000);
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		seen += p->histogram[i];
+		if (seen >= want)
+		{
+			/* Use the end of the bucket, but not more than the maximum */
+			unsigned long long v = (i + 1 < PROFILE_BUCKETS) ? profile_bucket_start(i + 1) - 1 : p->max_nsec;
+			return MIN(v, p->max_nsec);
+		}
+	}
+	return p->max_nsec;
+}
+
+/** Reset all counters */
+void profile_reset(void)
+{
+	ProfileStats *p;
+
+	for (p = profile_stats; p; p = p->next)
+	{
+		p->calls = 0;
+		p->total_nsec = 0;
+		p->max_nsec = 0;
+		memset(p->histogram, 0, sizeof(p->histogram));
+	}
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+	const ProfileStats *x = *(ProfileStats * const *)a;
+	const ProfileStats *y = *(ProfileStats * const *)b;
+
+	if (x->total_nsec > y->total_nsec)
+		return -1;
+	if (x->total_nsec < y->total_nsec)
+		return 1;
+	return 0;
+}
+
+/** Returns all profile entries that were called at least once,
+ * the most expensive (total time) first. Free the result with safe_free().
+ */
+ProfileStats **profile_sorted(int *count)
+{
+	ProfileStats *p, **list;
+	int n = 0;
+
+	for (p = profile_stats; p; p = p->next)
+		if (p->calls)
+			n++;
+	list = safe_alloc(sizeof(ProfileStats *) * (n + 1));
+	n = 0;
+	for (p = profile_stats; p; p = p->next)
+		if (p->calls)
+			list[n++] = p;
+	qsort(list, n, sizeof(ProfileStats *), profile_compare);
+	*count = n;
+	return list;
+}
+
+/** Write all profile entries to a file in JSON format.
+ * @returns 1 on success, 0 on failure (errno is set).
+ */
+int profile_dump(const char *filename)
+{
+	ProfileStats **list;
+	int n, i, j, first;
+	FILE *fd;
+
+	fd = fopen(filename, "w");
+	if (!fd)
+		return 0;
+
+	list = profile_sorted(&n);
+	fprintf(fd, "{\n\"time\": %lld,\n\"entries\": [\n", (long long)TStime());
+	for (i = 0; i < n; i++)
+	{
+		ProfileStats *p = list[i];
+
+		/* Module and command names never contain characters that need escaping */
+		if (p->type == PROFILE_HOOK)
+			fprintf(fd, "{\"type\": \"hook\", \"hooktype\": %d, \"module\": \"%s\"", p->hooktype, p->name);
+		else
+			fprintf(fd, "{\"type\": \"command\", \"command\": \"%s\"", p->name);
+		fprintf(fd, ", \"calls\": %lu, \"total_nsec\": %llu, \"max_nsec\": %llu, "
+		            "\"p50_nsec\": %llu, \"p99_nsec\": %llu, \"histogram\": [",
+		            p->calls, p->total_nsec, p->max_nsec,
+		            profile_percentile(p, 500), profile_percentile(p, 990));
+		/* The histogram as [start_nsec, count] pairs, only the non-empty buckets */
+		first = 1;
+		for (j = 0; j < PROFILE_BUCKETS; j++)
+		{
+			if (p->histogram[j])
+			{
+				fprintf(fd, "%s[%llu, %u]", first ? "" : ", ", profile_bucket_start(j), p->histogram[j]);
+				first = 0;
+			}
+		}
+		fprintf(fd, "]}%s\n", (i + 1 < n) ? "," : "");
+	}
+	fprintf(fd, "]\n}\n");
+	safe_free(list);
+
+	if (fclose(fd) != 0)
+		return 0;
+	return 1;
+}
@@ -30,6 +30,10 @@
 void vsendto_one(Client *to, MessageTag *mtags, const char *pattern, va_list vl);
 void vsendto_prefix_one(Client *to, Client *from, MessageTag *mtags, const char *pattern, va_list vl);
 static int vmakebuf_local_withprefix(char *buf, size_t buflen, Client *from, const char *pattern, va_list vl);
+static void sendbufto_one_shared(Client *to, char *msg, unsigned int quick, dbufshared **shared);
+
+/** Shared segment announced by a HOOKTYPE_PACKET hook, see packet_set_shared() */
+static dbufshared *packet_shared = NULL;
 
 #define ADD_CRLF(buf, len) { if (len > 510) len = 510; \
                              buf[len++] = '\r'; buf[len++] = '\n'; buf[len] = '\0'; } while(0)
@@ -38,6 +42,68 @@ static int vmakebuf_local_withprefix(char *buf, size_t buflen, Client *from, con
 static char sendbuf[2048];
 static char sendbuf2[4096];
 
+/** Maximum number of distinct pre-rendered lines per sendto_channel() call.
+ * Normally there are only a few: one for each combination of
+ * local/remote and the set of message tags a recipient may see.
+ */
+#define MAXBROADCASTLINES 8
+
+/** A line that was rendered once by sendto_channel() and is then
+ * queued as-is to all recipients that should receive exactly these bytes.
+ */
+typedef struct BroadcastLine BroadcastLine;
+struct BroadcastLine {
+	int local;		/**< Body with expanded nick!user@host prefix (for local users) */
+	int taglen;		/**< Length of the message tag string, or -1 if none */
+	int len;		/**< Length of the entire line, including CR+LF */
+	dbufshared *shared;	/**< Shared sendQ segment with this line (created on first use) */
+	char buf[1024];		/**< The line itself: "@tags body\r\n" or "body\r\n" */
+};
+
+/** Maximum number of distinct recipient classes per sendto_channel() call */
+#define MAXBROADCASTCLASSES 16
+
+/** Maximum number of tags with a can_send() filter per sendto_channel() call */
+#define MAXBROADCASTFILTERS 8
+
+/** Recipient class, for the message tags: which tags a recipient may
+ * see only depends on the type of recipient and, for local clients, on
+ * the capabilities that matter for these tags and on the outcome of
+ * the can_send() filters of these tags. Recipients of the same
+ * class get the same line, so mtags_to_string() is only called once
+ * per class rather than for every recipient.
+ */
+typedef enum BroadcastClassType {
+	BROADCAST_CLASS_CAPS=0,		/**< Local client, depends on 'caps' */
+	BROADCAST_CLASS_ALL_TAGS=1,	/**< Server or remote client: gets all tags */
+	BROADCAST_CLASS_NO_TAGS=2,	/**< Behind a server without PROTOCTL MTAGS */
+} BroadcastClassType;
+
+typedef struct BroadcastClass BroadcastClass;
+struct BroadcastClass {
+	int local;		/**< Same as BroadcastLine->local */
+	BroadcastClassType type;
+	long caps;		/**< Capabilities of the client, masked with broadcast.tag_caps */
+	int filters;		/**< Bit N is set if broadcast.tag_filters[N] allows the tag */
+	BroadcastLine *line;	/**< The line for this class, or NULL for the slow path */
+};
+
+/** The broadcast state of the current sendto_channel() call */
+static struct {
+	int in_use;		/**< Set while sendto_channel() is running (recursion guard) */
+	int bodylen[2];		/**< Length of body[] or 0 if not rendered yet */
+	char body[2][2048];	/**< [0] is the remote form, [1] is the local form */
+	int num_lines;		/**< Number of entries used in lines[] */
+	BroadcastLine lines[MAXBROADCASTLINES];
+	int tags_resolved;	/**< Set once the tag_* fields below are known */
+	int tags_uncacheable;	/**< Too many tag filters, so classes can't be used */
+	long tag_caps;		/**< Capabilities that decide which tags a local client sees */
+	int num_tag_filters;	/**< Number of entries used in tag_filters[] */
+	int (*tag_filters[MAXBROADCASTFILTERS])(Client *client); /**< can_send() of the tags */
+	int num_classes;	/**< Number of entries used in classes[] */
+	BroadcastClass classes[MAXBROADCASTCLASSES];
+} broadcast;
+
 /** This is used to ensure no duplicate messages are sent
  * to the same server uplink/direction. In send functions
  * that deliver to multiple users or servers the value is
@@ -96,34 +162,75 @@ void send_queued_cb(int fd, int revents, void *data)
 	send_queued(to);
 }
 
+/** Maximum number of sendQ blocks that send_queued() writes in one call.
+ * On Windows we don't have writev() so there we do one block at a time.
+ */
+#ifndef _WIN32
+ #define SENDQ_MAX_IOV 64
+#else
+ #define SENDQ_MAX_IOV 1
+#endif
+
+/** Maximum number of bytes that send_queued() writes in one SSL_write(),
+ * which is the maximum size of a TLS record.
+ */
+#define SENDQ_MAX_TLS 16384
+
 /** This function is called when queued data might be ready to be
  * sent to the client. It is called from the event loop and also
  * a couple of other places (such as when closing the connection).
+ * Multiple blocks of the sendQ are written at once, see deliver_it_iov().
  */
 int send_queued(Client *to)
 {
 	int  len, rlen;
 	dbufbuf *block;
 	int want_read;
+	struct iovec iov[SENDQ_MAX_IOV];
+	int iovcnt;
 
 	/* We NEVER write to dead sockets. */
 	if (IsDeadSocket(to))
 		return -1;
 
+	/* Nor to sockets that a TLS handshake thread is using */
+	if (tls_handshake_in_progress(to))
+		return 0;
+
+	/* Compressed server links have their own write path */
+	if (to->local->zipout)
+		return zip_send_queued(to);
+
 	while (DBufLength(&to->local->sendQ) > 0)
 	{
-		block = container_of(to->local->sendQ.dbuf_list.next, dbufbuf, dbuf_node);
-		len = block->size;
+		/* Gather the first SENDQ_MAX_IOV blocks. For TLS we stop at
+		 * SENDQ_MAX_TLS bytes, since deliver_it_iov() has to copy them.
+		 * Note that a retry of SSL_write() may not be for less bytes
+		 * than the previous attempt, which is fine since the sendQ
+		 * only grows at the end and so does this gathered length.
+		 */
+		len = iovcnt = 0;
+		list_for_each_entry(block, &to->local->sendQ.dbuf_list, dbuf_node)
+		{
+			iov[iovcnt].iov_base = block->data;
+			iov[iovcnt].iov_len = block->size;
+			if (IsTLS(to) && (len + block->size > SENDQ_MAX_TLS))
+				iov[iovcnt].iov_len = SENDQ_MAX_TLS - len;
+			len += iov[iovcnt].iov_len;
+			if ((++iovcnt == SENDQ_MAX_IOV) || (len == SENDQ_MAX_TLS))
+				break;
+		}
 
 		/* Deliver it and check for fatal error.. */
-		if ((rlen = deliver_it(to, block->data, len, &want_read)) < 0)
+		if ((rlen = deliver_it_iov(to, iov, iovcnt, &want_read)) < 0)
 		{
 			char buf[256];
 			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
 			return dead_socket(to, buf);
 		}
-		dbuf_delete(&to->local->sendQ, rlen);
+		to->local->sendblocks += dbuf_delete(&to->local->sendQ, rlen);
 		to->local->lastsq = DBufLength(&to->local->sendQ) / 1024;
+
 		if (want_read)
 		{
 			/* SSL_write indicated that it cannot write data at this
@@ -243,10 +350,37 @@ void vsendto_one(Client *to, MessageTag *mtags, const char *pattern, va_list vl)
  *   effects not mentioned here.
  */
 void sendbufto_one(Client *to, char *msg, unsigned int quick)
+{
+	sendbufto_one_shared(to, msg, quick, NULL);
+}
+
+/** Tell sendbufto_one() that the line was replaced by the data of a shared
+ * segment. For use by HOOKTYPE_PACKET hooks that set *msg to s->data and
+ * *length to s->size, so the line can be queued by reference to 's',
+ * just like a channel broadcast line. The hook keeps its own reference.
+ */
+void packet_set_shared(dbufshared *s)
+{
+	packet_shared = s;
+}
+
+/** Send a line buffer to the client, possibly via a shared sendQ segment.
+ * This is the same as sendbufto_one(), except that if 'shared' is
+ * non-NULL and the line ends up being queued unmodified (no hook
+ * changed it) to a client that already has data pending, then the
+ * line is queued by reference to *shared rather than by copying it.
+ * *shared is created on first use and the caller must release it
+ * via dbuf_shared_release() after the last recipient.
+ * The same is done for a line that a hook replaced by a shared
+ * segment, see packet_set_shared().
+ */
+static void sendbufto_one_shared(Client *to, char *msg, unsigned int quick, dbufshared **shared)
 {
 	int len;
 	Hook *h;
 	Client *intended_to = to;
+	char *orig_msg;
+	dbufshared *s = NULL;
 	
 	Debug((DEBUG_ERROR, "Sending [%s] to %s", msg, to->name));
 
@@ -333,12 +467,17 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
+	orig_msg = msg;
+	packet_shared = NULL;
 	for (h = Hooks[HOOKTYPE_PACKET]; h; h = h->next)
 	{
 		(*(h->func.intfunc))(&me, to, intended_to, &msg, &len);
 		if (!msg)
 			return;
 	}
+	if (packet_shared && (msg == packet_shared->data) && (len == packet_shared->size))
+		s = packet_shared;
+	packet_shared = NULL;
 
 #if defined(DEBUGMODE) && defined(RAWCMDLOGGING)
 	{
@@ -362,7 +501,25 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 		return;
 	}
 
-	dbuf_put(&to->local->sendQ, msg, len);
+	/* For clients that already have at least a block worth of data
+	 * queued (eg: they are lagging behind a channel flood) we add a
+	 * reference to the shared segment rather than a copy of the line.
+	 */
+	if (DBufLength(&to->local->sendQ) >= DBUF_BLOCK_SIZE)
+	{
+		if (!s && shared && (msg == orig_msg))
+		{
+			if (!*shared)
+				*shared = dbuf_shared_new(msg, len);
+			s = *shared;
+		}
+	} else {
+		s = NULL;
+	}
+	if (s)
+		dbuf_put_shared(&to->local->sendQ, s);
+	else
+		dbuf_put(&to->local->sendQ, msg, len);
 
 	/*
 	 * Update statistics. The following is slightly incorrect
@@ -380,6 +537,209 @@ void sendbufto_one(Client *to, char *msg, unsigned int quick)
 	mark_data_to_send(to);
 }
 
+/** Render (if not done already) the message body used by sendto_channel().
+ * @param local		Whether to render the local form, which has the
+ *			":%s " prefix expanded to ":nick!user@host ".
+ * @returns Length of the body, including CR+LF.
+ */
+static int broadcast_body(int local, Client *from, const char *pattern, va_list vl)
+{
+	char *buf = broadcast.body[local];
+	int len;
+
+	if (broadcast.bodylen[local])
+		return broadcast.bodylen[local];
+
+	if (local)
+	{
+		len = vmakebuf_local_withprefix(buf, sizeof(broadcast.body[local]), from, pattern, vl);
+	} else {
+		ircvsnprintf(buf, sizeof(broadcast.body[local]), pattern, vl);
+		len = strlen(buf);
+		ADD_CRLF(buf, len);
+	}
+	broadcast.bodylen[local] = len;
+	return len;
+}
+
+/** Look up the message tag handlers of this broadcast, once.
+ * This mirrors the checks in mtags_to_string() (message-tags module):
+ * a local client sees a tag if it has the 'message-tags' capability
+ * or the capability of the tag, and if the can_send() filter of the
+ * tag (if any) allows it.
+ */
+static void broadcast_resolve_tags(MessageTag *mtags)
+{
+	MessageTagHandler *h;
+
+	broadcast.tags_resolved = 1;
+	broadcast.tags_uncacheable = 0;
+	broadcast.num_tag_filters = 0;
+	broadcast.tag_caps = ClientCapabilityBit("message-tags");
+	for (; mtags; mtags = mtags->next)
+	{
+		h = MessageTagHandlerFind(mtags->name);
+		if (!h)
+			continue;
+		if (h->can_send)
+		{
+			if (broadcast.num_tag_filters == MAXBROADCASTFILTERS)
+				broadcast.tags_uncacheable = 1;
+			else
+				broadcast.tag_filters[broadcast.num_tag_filters++] = h->can_send;
+		}
+		if (h->clicap_handler)
+			broadcast.tag_caps |= h->clicap_handler->cap;
+	}
+}
+
+/** Find the recipient class of 'to', see BroadcastClass.
+ * @returns The class, or NULL if it is not known yet.
+ */
+static BroadcastClass *broadcast_class(Client *to, int local, BroadcastClass *key)
+{
+	BroadcastClass *c;
+	int i;
+
+	key->local = local;
+	key->caps = 0;
+	key->filters = 0;
+	if (to->direction && IsServer(to->direction) && !SupportMTAGS(to->direction))
+		key->type = BROADCAST_CLASS_NO_TAGS;
+	else if (IsServer(to) || !MyConnect(to))
+		key->type = BROADCAST_CLASS_ALL_TAGS;
+	else
+	{
+		key->type = BROADCAST_CLASS_CAPS;
+		key->caps = to->local->caps & broadcast.tag_caps;
+		for (i = 0; i < broadcast.num_tag_filters; i++)
+			if (broadcast.tag_filters[i](to))
+				key->filters |= 1 << i;
+	}
+
+	for (i = 0; i < broadcast.num_classes; i++)
+	{
+		c = &broadcast.classes[i];
+		if ((c->local == key->local) && (c->type == key->type) &&
+		    (c->caps == key->caps) && (c->filters == key->filters))
+			return c;
+	}
+	return NULL;
+}
+
+/** Find or create the pre-rendered line for this recipient.
+ * Recipients that would receive the same bytes share one BroadcastLine.
+ * @returns The line, or NULL if the caller should fall back to
+ *          vsendto_prefix_one() (out of slots or oversized tags).
+ */
+static BroadcastLine *broadcast_line(Client *to, Client *from, MessageTag *mtags, const char *pattern, va_list vl)
+{
+	char *mtags_str;
+	int local = (from && MyUser(to) && from->user) ? 1 : 0;
+	int taglen;
+	BroadcastClass key, *c = NULL;
+	BroadcastLine *l;
+	int i, bodylen;
+
+	if (mtags)
+	{
+		if (!broadcast.tags_resolved)
+			broadcast_resolve_tags(mtags);
+		if (!broadcast.tags_uncacheable)
+		{
+			if ((c = broadcast_class(to, local, &key)))
+			{
+				ircstats.is_bcclass++;
+				return c->line;
+			}
+			if (broadcast.num_classes < MAXBROADCASTCLASSES)
+			{
+				c = &broadcast.classes[broadcast.num_classes++];
+				*c = key;
+				c->line = NULL;
+			}
+		}
+	}
+
+	mtags_str = mtags ? mtags_to_string(mtags, to) : NULL;
+	taglen = BadPtr(mtags_str) ? -1 : strlen(mtags_str);
+
+	for (i = 0; i < broadcast.num_lines; i++)
+	{
+		l = &broadcast.lines[i];
+		if ((l->local == local) && (l->taglen == taglen) &&
+		    ((taglen < 0) || !strncmp(l->buf + 1, mtags_str, taglen)))
+		{
+			if (c)
+				c->line = l;
+			return l;
+		}
+	}
+
+	/* Not found, create a new one (if possible) */
+	if ((broadcast.num_lines == MAXBROADCASTLINES) || (taglen >= 500))
+		return NULL; /* use the slow path, which also logs the oversized tags bug */
+
+	l = &broadcast.lines[broadcast.num_lines++];
+	l->local = local;
+	l->taglen = taglen;
+	l->shared = NULL;
+	bodylen = broadcast_body(local, from, pattern, vl);
+	if (taglen < 0)
+	{
+		memcpy(l->buf, broadcast.body[local], bodylen + 1);
+		l->len = bodylen;
+	} else {
+		/* "@" + tags + " " + body, guaranteed to fit (500 + 512 < 1024) */
+		l->buf[0] = '@';
+		memcpy(l->buf + 1, mtags_str, taglen);
+		l->buf[taglen + 1] = ' ';
+		memcpy(l->buf + taglen + 2, broadcast.body[local], bodylen + 1);
+		l->len = taglen + 2 + bodylen;
+	}
+	ircstats.is_bclines++;
+	if (c)
+		c->line = l;
+	return l;
+}
+
+/** Send a channel message to one recipient, used by sendto_channel().
+ * The line is formatted only once and then shared by all recipients
+ * with the same local/remote form and the same visible message tags.
+ */
+static void sendto_channel_one(Client *to, Client *from, MessageTag *mtags, int nested, const char *pattern, va_list vl)
+{
+	BroadcastLine *l = NULL;
+
+	if (!nested)
+		l = broadcast_line(to, from, mtags, pattern, vl);
+
+	if (!l)
+	{
+		vsendto_prefix_one(to, from, mtags, pattern, vl);
+		return;
+	}
+
+	ircstats.is_bcsent++;
+	sendbufto_one_shared(to, l->buf, l->len, &l->shared);
+}
+
+/** Release the shared sendQ segments of all broadcast lines */
+static void broadcast_done(void)
+{
+	int i;
+
+	for (i = 0; i < broadcast.num_lines; i++)
+	{
+		if (broadcast.lines[i].shared)
+		{
+			dbuf_shared_release(broadcast.lines[i].shared);
+			broadcast.lines[i].shared = NULL;
+		}
+	}
+	broadcast.in_use = 0;
+}
+
 /** A single function to send data to a channel.
  * Previously there were 6 different functions to send channel data,
  * now there is 1 single function. This also means that you most
@@ -437,6 +797,20 @@ void sendto_channel(Channel *channel, Client *from, Client *skip,
 	va_list vl;
 	Member *lp;
 	Client *acptr;
+	int nested;
+
+	/* In the (theoretical) case of recursion we use the slow path,
+	 * since the broadcast buffers are in use by the outer call.
+	 */
+	nested = broadcast.in_use;
+	if (!nested)
+	{
+		broadcast.in_use = 1;
+		broadcast.bodylen[0] = broadcast.bodylen[1] = 0;
+		broadcast.num_lines = 0;
+		broadcast.tags_resolved = 0;
+		broadcast.num_classes = 0;
+	}
 
 	++current_serial;
 	for (lp = channel->members; lp; lp = lp->next)
@@ -479,7 +853,7 @@ good:
 			if (sendflags & SEND_LOCAL)
 			{
 				va_start(vl, pattern);
-				vsendto_prefix_one(acptr, from, mtags, pattern, vl);
+				sendto_channel_one(acptr, from, mtags, nested, pattern, vl);
 				va_end(vl);
 			}
 		}
@@ -492,7 +866,7 @@ good:
 				if (acptr->direction->local->serial != current_serial)
 				{
 					va_start(vl, pattern);
-					vsendto_prefix_one(acptr, from, mtags, pattern, vl);
+					sendto_channel_one(acptr, from, mtags, nested, pattern, vl);
 					va_end(vl);
 
 					acptr->direction->local->serial = current_serial;
@@ -519,7 +893,7 @@ good:
 				if (acptr->direction->local->serial != current_serial)
 				{
 					va_start(vl, pattern);
-					vsendto_prefix_one(acptr, from, mtags, pattern, vl);
+					sendto_channel_one(acptr, from, mtags, nested, pattern, vl);
 					va_end(vl);
 
 					acptr->direction->local->serial = current_serial;
@@ -527,6 +901,9 @@ good:
 			}
 		}
 	}
+
+	if (!nested)
+		broadcast_done();
 }
 
 /** Send a message to a server, taking into account server options if needed.
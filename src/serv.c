@@ -217,9 +217,14 @@ void send_proto(Client *client, ConfigItem_link *aconf)
 		me.id, (long long)TStime());
 
 	/* Third line */
-	sendto_one(client, NULL, "PROTOCTL NICKCHARS=%s CHANNELCHARS=%s",
+	sendto_one(client, NULL, "PROTOCTL NICKCHARS=%s CHANNELCHARS=%s%s",
 		charsys_get_current_languages(),
-		allowed_channelchars_valtostr(iConf.allowed_channelchars));
+		allowed_channelchars_valtostr(iConf.allowed_channelchars),
+#ifdef USE_ZLIB
+		(aconf && (aconf->options & CONNECT_COMPRESSED)) ? " ZIP" : "");
+#else
+		"");
+#endif
 }
 
 #ifndef IRCDTOTALVERSION
@@ -585,6 +585,7 @@ void completed_connection(int fd, int revents, void *data)
 	{
 		/* Due to delayed ircd_SSL_connect call */
 		start_server_handshake(client);
+		fd_edge_triggered(fd);
 		fd_setselect(fd, FD_SELECT_READ, read_packet, client);
 		return;
 	}
@@ -608,6 +609,7 @@ void completed_connection(int fd, int revents, void *data)
 	if (!IsDeadSocket(client))
 		consider_ident_lookup(client);
 
+	fd_edge_triggered(fd);
 	fd_setselect(fd, FD_SELECT_READ, read_packet, client);
 }
 
@@ -673,6 +675,14 @@ void close_connection(Client *client)
 		--OpenFiles;
 	}
 
+	if (tls_handshake_in_progress(client))
+	{
+		/* A TLS handshake thread is still using the socket, it gets closed later */
+		tls_handshake_orphan(client);
+		DBufClear(&client->local->sendQ);
+		DBufClear(&client->local->recvQ);
+	}
+
 	if (client->local->fd >= 0)
 	{
 		send_queued(client);
@@ -975,6 +985,10 @@ void start_of_normal_client_handshake(Client *client)
 	{
 		if (should_show_connect_info(client))
 			sendto_one(client, NULL, ":%s %s", me.name, REPORT_DO_DNS);
+		/* Set this before the lookup, since it may finish right away
+		 * (eg: a negative cache hit), which clears it again.
+		 */
+		SetDNSLookup(client);
 		dns_special_flag = 1;
 		he = unrealdns_doclient(client);
 		dns_special_flag = 0;
@@ -982,20 +996,20 @@ void start_of_normal_client_handshake(Client *client)
 		if (client->local->hostp)
 			goto doauth; /* Race condition detected, DNS has been done, continue with auth */
 
-		if (!he)
+		if (he)
 		{
-			/* Resolving in progress */
-			SetDNSLookup(client);
-		} else {
 			/* Host was in our cache */
+			ClearDNSLookup(client);
 			client->local->hostp = he;
 			if (should_show_connect_info(client))
 				sendto_one(client, NULL, ":%s %s", me.name, REPORT_FIN_DNSC);
 		}
+		/* Otherwise resolving is in progress, or was completed already */
 	}
 
 doauth:
 	consider_ident_lookup(client);
+	fd_edge_triggered(client->local->fd);
 	fd_setselect(client->local->fd, FD_SELECT_READ, read_packet, client);
 }
 
@@ -1041,9 +1055,13 @@ void read_packet(int fd, int revents, void *data)
 	/* Restore handling of writes towards send_queued_cb(), since
 	 * it may be overwritten in an earlier call to read_packet(),
 	 * to handle (SSL) writes by read_packet(), see below under
-	 * SSL_ERROR_WANT_WRITE.
+	 * SSL_ERROR_WANT_WRITE. With edge-triggered I/O we only do
+	 * that if it was overwritten, since setting the write callback
+	 * there queues a write event, and mark_data_to_send() takes
+	 * care of it when there is data.
 	 */
-	fd_setselect(fd, FD_SELECT_WRITE, send_queued_cb, client);
+	if (!fd_table[fd].edge_triggered || (fd_table[fd].write_callback == read_packet))
+		fd_setselect(fd, FD_SELECT_WRITE, send_queued_cb, client);
 
 	while (1)
 	{
@@ -1115,19 +1133,36 @@ void read_packet(int fd, int revents, void *data)
 				return; /* if hook tells client is dead, return now */
 		}
 
-		if (processdata && !process_packet(client, readbuf, length, 0))
-			return;
+		if (processdata)
+		{
+			if (client->local->zipin)
+			{
+				if (!zip_process_packet(client, readbuf, length))
+					return;
+			} else
+			if (!process_packet(client, readbuf, length, 0))
+				return;
+		}
 
-		/* bail on short read! */
-		if (length < sizeof(readbuf))
+		/* bail on short read! (but with edge-triggered I/O we
+		 * must continue reading until we hit EAGAIN)
+		 */
+		if ((length < sizeof(readbuf)) && !fd_table[fd].edge_triggered)
 			return;
 	}
 }
 
+/** Set to 1 if there may be client data in a recvQ that still needs to be
+ * processed by process_clients(), eg due to fake lag or handshake delay.
+ */
+MODVAR int client_input_queued = 0;
+
 /** Process input from clients that may have been deliberately delayed due to fake lag */
 void process_clients(void)
 {
 	Client *client;
+
+	client_input_queued = 0;
         
 	/* Problem:
 	 * When processing a client, that current client may exit due to eg QUIT.
@@ -1157,6 +1192,8 @@ void process_clients(void)
 				parse_client_queued(client);
 				if (IsDead(client))
 					break;
+				if (DBufLength(&client->local->recvQ))
+					client_input_queued = 1;
 			}
 		}
 	} while(&client->lclient_node != &lclient_list);
@@ -1169,6 +1206,8 @@ void process_clients(void)
 				parse_client_queued(client);
 				if (IsDead(client) || (client->status > CLIENT_STATUS_UNKNOWN))
 					break;
+				if (DBufLength(&client->local->recvQ))
+					client_input_queued = 1;
 			}
 		}
 	} while(&client->lclient_node != &unknown_list);
@@ -1394,6 +1433,26 @@ int ipv6_capable(void)
  *             decide what to do with those unwritten bytes...
  */
 int deliver_it(Client *client, char *str, int len, int *want_read)
+{
+	struct iovec iov;
+
+	iov.iov_base = str;
+	iov.iov_len = len;
+	return deliver_it_iov(client, &iov, 1, want_read);
+}
+
+/** Deliver multiple buffers to a client in a single call.
+ * For plaintext connections this is a single writev().
+ * For TLS connections the buffers are coalesced (up to the maximum
+ * size of one TLS record) so they go out with a single SSL_write().
+ * @param client	The client
+ * @param iov		The buffers to write
+ * @param iovcnt	Number of entries in iov (at least 1)
+ * @param want_read	Set to 1 if TLS needs to read before it can write
+ * @returns Number of bytes written (which can be less than the total
+ *          of all buffers, or even 0), or -1 on a fatal error.
+ */
+int deliver_it_iov(Client *client, struct iovec *iov, int iovcnt, int *want_read)
 {
 	int  retval;
 
@@ -1405,15 +1464,37 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
  
 	    && !IsUnknown(client)))
 	{
-		str[len] = '\0';
+		char buf[512];
+
+		*buf = '\0';
+		strlncat(buf, iov[0].iov_base, sizeof(buf), iov[0].iov_len);
 		sendto_ops
 		    ("* * * DEBUG ERROR * * * !!! Calling deliver_it() for %s, status %d %s, with message: %s",
-		    client->name, client->status, IsDeadSocket(client) ? "DEAD" : "", str);
+		    client->name, client->status, IsDeadSocket(client) ? "DEAD" : "", buf);
 		return -1;
 	}
 
+	client->local->sendcalls++;
+
 	if (IsTLS(client) && client->local->ssl != NULL)
 	{
+		static char tlsbuf[16384]; /* maximum size of a TLS record (send_queued() never asks for more) */
+		char *str = iov[0].iov_base;
+		int len = iov[0].iov_len;
+
+		if (iovcnt > 1)
+		{
+			int i, n;
+
+			for (i = 0, len = 0; (i < iovcnt) && (len < sizeof(tlsbuf)); i++)
+			{
+				n = MIN(iov[i].iov_len, sizeof(tlsbuf) - len);
+				memcpy(tlsbuf + len, iov[i].iov_base, n);
+				len += n;
+			}
+			str = tlsbuf;
+		}
+
 		retval = SSL_write(client->local->ssl, str, len);
 
 		if (retval < 0)
@@ -1439,7 +1520,14 @@ int deliver_it(Client *client, char *str, int len, int *want_read)
 		}
 	}
 	else
-		retval = send(client->local->fd, str, len, 0);
+	{
+#ifndef _WIN32
+		if (iovcnt > 1)
+			retval = writev(client->local->fd, iov, iovcnt);
+		else
+#endif
+			retval = send(client->local->fd, iov[0].iov_base, iov[0].iov_len, 0);
+	}
 	/*
 	   ** Convert WOULDBLOCK to a return of "0 bytes moved". This
 	   ** should occur only if socket was non-blocking. Note, that
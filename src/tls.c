@@ -36,8 +36,19 @@ extern HWND hwIRCDWnd;
 #define SAFE_SSL_ACCEPT 3
 #define SAFE_SSL_CONNECT 4
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+/* Run (expensive) TLS accept handshake steps in worker threads, see set::tls-handshake-threads */
+#define USE_TLS_HANDSHAKE_POOL
+#endif
+
 /* Forward declarations */
 static int fatal_ssl_error(int ssl_error, int where, int my_errno, Client *client);
+static int fatal_ssl_error_ex(int ssl_error, int where, int my_errno, unsigned long additional_errno, Client *client);
+static int ircd_SSL_accept_done(Client *client, int fd, int ret, int ssl_err, int my_errno, unsigned long additional_errno);
+#ifdef USE_TLS_HANDSHAKE_POOL
+static int tls_handshake_submit(Client *client, int fd);
+#endif
 int cipher_check(SSL_CTX *ctx, char **errstr);
 int certificate_quality_check(SSL_CTX *ctx, char **errstr);
 
@@ -315,6 +326,10 @@ SSL_CTX *init_ctx(TLSOptions *tlsoptions, int server)
 	}
 	disable_ssl_protocols(ctx, tlsoptions);
 	SSL_CTX_set_default_passwd_cb(ctx, ssl_pem_passwd_cb);
+	/* send_queued() may retry a write from a different buffer
+	 * (eg. a single sendQ block first, and coalesced blocks later).
+	 */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 	if (server && !(tlsoptions->options & TLSFLAG_DISABLECLIENTCERT))
 	{
@@ -538,6 +553,9 @@ void reinit_tls(void)
 	ConfigItem_sni *sni;
 	ConfigItem_link *link;
 
+	/* The SNI callback of a TLS handshake thread may be using sni->ssl_ctx */
+	tls_handshake_pool_drain();
+
 	tmp = init_ctx(iConf.tls_options, 1);
 	if (!tmp)
 	{
@@ -724,7 +742,7 @@ static void ircd_SSL_accept_retry(int fd, int revents, void *data)
 /** Accept an SSL/TLS connection - that is: do the TLS handshake */
 int ircd_SSL_accept(Client *client, int fd)
 {
-	int ssl_err;
+	int ret, ssl_err;
 
 #ifdef MSG_PEEK
 	if (!IsNextCall(client))
@@ -762,16 +780,45 @@ int ircd_SSL_accept(Client *client, int fd)
 			SetNextCall(client);
 	}
 #endif
-	if ((ssl_err = SSL_accept(client->local->ssl)) <= 0)
+#ifdef USE_TLS_HANDSHAKE_POOL
+	if (tls_handshake_submit(client, fd))
+		return 1;
+#endif
+	ret = SSL_accept(client->local->ssl);
+	if (ret <= 0)
 	{
-		switch (ssl_err = SSL_get_error(client->local->ssl, ssl_err))
+		int my_errno = ERRNO;
+		ssl_err = SSL_get_error(client->local->ssl, ret);
+		return ircd_SSL_accept_done(client, fd, ret, ssl_err, my_errno, ERR_get_error());
+	}
+	return ircd_SSL_accept_done(client, fd, ret, SSL_ERROR_NONE, 0, 0);
+}
+
+/** Act on the result of a SSL_accept() call, either done by ircd_SSL_accept()
+ * directly or by a TLS handshake worker thread.
+ * @param client		The client
+ * @param fd			The file descriptor of the client
+ * @param ret			Return value of SSL_accept()
+ * @param ssl_err		Return value of SSL_get_error(), if ret <= 0
+ * @param my_errno		Value of errno directly after SSL_accept()
+ * @param additional_errno	First error from the OpenSSL error queue (see ERR_get_error)
+ * @returns 1 if the handshake is done or still in progress, -1 on a fatal error.
+ */
+static int ircd_SSL_accept_done(Client *client, int fd, int ret, int ssl_err, int my_errno, unsigned long additional_errno)
+{
+	if (ret <= 0)
+	{
+		switch (ssl_err)
 		{
 			case SSL_ERROR_SYSCALL:
-				if (ERRNO == P_EINTR || ERRNO == P_EWOULDBLOCK || ERRNO == P_EAGAIN)
+				if (my_errno == P_EINTR || my_errno == P_EWOULDBLOCK || my_errno == P_EAGAIN)
 				{
+					/* Make sure we get called again if nothing is waiting for I/O yet */
+					if (!fd_table[fd].read_callback && !fd_table[fd].write_callback)
+						fd_setselect(fd, FD_SELECT_READ, ircd_SSL_accept_retry, client);
 					return 1;
 				}
-				return fatal_ssl_error(ssl_err, SAFE_SSL_ACCEPT, ERRNO, client);
+				return fatal_ssl_error_ex(ssl_err, SAFE_SSL_ACCEPT, my_errno, additional_errno, client);
 			case SSL_ERROR_WANT_READ:
 				fd_setselect(fd, FD_SELECT_READ, ircd_SSL_accept_retry, client);
 				fd_setselect(fd, FD_SELECT_WRITE, NULL, client);
@@ -781,7 +828,7 @@ int ircd_SSL_accept(Client *client, int fd)
 				fd_setselect(fd, FD_SELECT_WRITE, ircd_SSL_accept_retry, client);
 				return 1;
 			default:
-				return fatal_ssl_error(ssl_err, SAFE_SSL_ACCEPT, ERRNO, client);
+				return fatal_ssl_error_ex(ssl_err, SAFE_SSL_ACCEPT, my_errno, additional_errno, client);
 		}
 		/* NOTREACHED */
 		return -1;
@@ -792,6 +839,239 @@ int ircd_SSL_accept(Client *client, int fd)
 	return 1;
 }
 
+#ifdef USE_TLS_HANDSHAKE_POOL
+/** A TLS accept handshake step (one SSL_accept call) for a worker thread.
+ * While the job is in progress the worker owns the SSL object, so the
+ * main thread must not use it and must not close the file descriptor.
+ */
+struct TLSHandshakeJob {
+	TLSHandshakeJob *next;
+	Client *client;			/**< The client, or NULL if it exited while the job was in progress */
+	SSL *ssl;			/**< SSL object of the client */
+	int fd;				/**< File descriptor of the client */
+	int ret;			/**< Return value of SSL_accept() */
+	int ssl_err;			/**< Return value of SSL_get_error() */
+	int my_errno;			/**< Value of errno after SSL_accept() */
+	unsigned long additional_errno;	/**< First error from the error queue of the worker */
+};
+
+static pthread_mutex_t tls_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tls_pool_work = PTHREAD_COND_INITIALIZER;	/* signalled when a job is queued */
+static pthread_cond_t tls_pool_idle = PTHREAD_COND_INITIALIZER;	/* signalled when tls_pool_busy drops to zero */
+static TLSHandshakeJob *tls_pool_queue = NULL, *tls_pool_queue_tail = NULL;	/* jobs waiting for a worker */
+static TLSHandshakeJob *tls_pool_done = NULL;	/* jobs waiting for the main thread */
+static int tls_pool_busy = 0;			/* jobs queued or running */
+static int tls_pool_threads = 0;		/* worker threads started */
+static int tls_pool_pipe[2] = { -1, -1 };	/* used by the workers to wake up the main thread */
+
+/** TLS handshake worker thread.
+ * This only calls OpenSSL functions, it must not touch anything else.
+ */
+static void *tls_handshake_worker(void *arg)
+{
+	TLSHandshakeJob *job;
+
+	while (1)
+	{
+		pthread_mutex_lock(&tls_pool_lock);
+		while (!tls_pool_queue)
+			pthread_cond_wait(&tls_pool_work, &tls_pool_lock);
+		job = tls_pool_queue;
+		tls_pool_queue = job->next;
+		if (!tls_pool_queue)
+			tls_pool_queue_tail = NULL;
+		pthread_mutex_unlock(&tls_pool_lock);
+
+		job->ret = SSL_accept(job->ssl);
+		if (job->ret <= 0)
+		{
+			job->my_errno = errno;
+			job->ssl_err = SSL_get_error(job->ssl, job->ret);
+			job->additional_errno = ERR_get_error();
+			ERR_clear_error();
+		}
+
+		pthread_mutex_lock(&tls_pool_lock);
+		job->next = tls_pool_done;
+		tls_pool_done = job;
+		if (--tls_pool_busy == 0)
+			pthread_cond_broadcast(&tls_pool_idle);
+		pthread_mutex_unlock(&tls_pool_lock);
+
+		if (write(tls_pool_pipe[1], "x", 1) < 0)
+		{
+			/* Pipe is full, so the main thread will wake up anyway */
+		}
+	}
+	return NULL;
+}
+
+/** Finish a job in the main thread: act on the SSL_accept() result */
+static void tls_handshake_finish(TLSHandshakeJob *job)
+{
+	Client *client = job->client;
+	char *name;
+
+	if (!client)
+	{
+		/* Client exited while the worker was busy, see tls_handshake_orphan() */
+		SSL_free(job->ssl);
+		fd_close(job->fd);
+		--OpenFiles;
+		safe_free(job);
+		return;
+	}
+
+	client->local->tls_job = NULL;
+	SSL_set_ex_data(job->ssl, ssl_client_index, client);
+	if ((job->ret > 0) && (name = (char *)SSL_get_servername(job->ssl, TLSEXT_NAMETYPE_host_name)) && find_sni(name))
+		set_client_sni_name(job->ssl, name);
+
+	SET_ERRNO(job->my_errno);
+	ircd_SSL_accept_done(client, job->fd, job->ret, job->ssl_err, job->my_errno, job->additional_errno);
+	safe_free(job);
+}
+
+/** Called by the I/O engine when one or more TLS handshake jobs are done */
+static void tls_handshake_pool_wakeup(int fd, int revents, void *data)
+{
+	char buf[128];
+	TLSHandshakeJob *job, *next;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&tls_pool_lock);
+	job = tls_pool_done;
+	tls_pool_done = NULL;
+	pthread_mutex_unlock(&tls_pool_lock);
+
+	for (; job; job = next)
+	{
+		next = job->next;
+		tls_handshake_finish(job);
+	}
+}
+
+/** Start the wakeup pipe and the worker threads, as far as needed.
+ * This is done on first use, so it happens after we fork to the background.
+ * @returns 1 if there is at least one worker thread, 0 if not.
+ */
+static int tls_handshake_pool_start(void)
+{
+	pthread_t thread;
+	sigset_t newset, oldset;
+	int i, err;
+
+	if (tls_pool_threads >= iConf.tls_handshake_threads)
+		return 1;
+
+	if (tls_pool_pipe[0] == -1)
+	{
+		if (pipe(tls_pool_pipe) < 0)
+		{
+			ircd_log(LOG_ERROR, "Could not create pipe for TLS handshake threads: %s", strerror(errno));
+			return (tls_pool_threads > 0);
+		}
+		for (i = 0; i < 2; i++)
+			fcntl(tls_pool_pipe[i], F_SETFL, fcntl(tls_pool_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+		fd_open(tls_pool_pipe[0], "TLS handshake threads (read)", FDCLOSE_FILE);
+		fd_open(tls_pool_pipe[1], "TLS handshake threads (write)", FDCLOSE_FILE);
+		fd_setselect(tls_pool_pipe[0], FD_SELECT_READ, tls_handshake_pool_wakeup, NULL);
+	}
+
+	/* Signals are for the main thread only */
+	sigfillset(&newset);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	while (tls_pool_threads < iConf.tls_handshake_threads)
+	{
+		if ((err = pthread_create(&thread, NULL, tls_handshake_worker, NULL)))
+		{
+			ircd_log(LOG_ERROR, "Could not create TLS handshake thread: %s", strerror(err));
+			break;
+		}
+		pthread_detach(thread);
+		tls_pool_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return (tls_pool_threads > 0);
+}
+
+/** Hand the next SSL_accept() call of this client to a worker thread.
+ * @returns 1 if the job was queued, 0 if the caller should do it (no threads).
+ */
+static int tls_handshake_submit(Client *client, int fd)
+{
+	TLSHandshakeJob *job;
+
+	if ((iConf.tls_handshake_threads <= 0) || !tls_handshake_pool_start())
+		return 0;
+
+	job = safe_alloc(sizeof(TLSHandshakeJob));
+	job->client = client;
+	job->ssl = client->local->ssl;
+	job->fd = fd;
+	client->local->tls_job = job;
+
+	/* No I/O events until the worker is done, and no SNI callback
+	 * poking in the client struct from the worker thread.
+	 */
+	fd_setselect(fd, FD_SELECT_READ|FD_SELECT_WRITE, NULL, client);
+	SSL_set_ex_data(job->ssl, ssl_client_index, NULL);
+	ircstats.is_tlspool++;
+
+	pthread_mutex_lock(&tls_pool_lock);
+	if (tls_pool_queue_tail)
+		tls_pool_queue_tail->next = job;
+	else
+		tls_pool_queue = job;
+	tls_pool_queue_tail = job;
+	tls_pool_busy++;
+	pthread_cond_signal(&tls_pool_work);
+	pthread_mutex_unlock(&tls_pool_lock);
+
+	return 1;
+}
+#endif
+
+/** Is a TLS handshake worker thread busy with the socket of this client?
+ * If so, nothing may be read from or written to the client.
+ */
+int tls_handshake_in_progress(Client *client)
+{
+	return client->local && client->local->tls_job;
+}
+
+/** Called by close_connection() for a client that has a TLS handshake
+ * job in progress. The socket and SSL object are freed once the worker
+ * is done with them.
+ */
+void tls_handshake_orphan(Client *client)
+{
+#ifdef USE_TLS_HANDSHAKE_POOL
+	/* No locking needed, the worker never looks at job->client */
+	client->local->tls_job->client = NULL;
+	client->local->tls_job = NULL;
+	client->local->ssl = NULL;
+	client->local->fd = -2;
+#endif
+}
+
+/** Wait until all TLS handshake worker threads are idle.
+ * This is called on REHASH, before the configuration (and thus any
+ * sni { } blocks the SNI callback may look at) is freed.
+ */
+void tls_handshake_pool_drain(void)
+{
+#ifdef USE_TLS_HANDSHAKE_POOL
+	pthread_mutex_lock(&tls_pool_lock);
+	while (tls_pool_busy > 0)
+		pthread_cond_wait(&tls_pool_idle, &tls_pool_lock);
+	pthread_mutex_unlock(&tls_pool_lock);
+#endif
+}
+
 /** Called by the I/O engine to (re)try to connect to a remote host */
 static void ircd_SSL_connect_retry(int fd, int revents, void *data)
 {
@@ -863,11 +1143,20 @@ int SSL_smart_shutdown(SSL *ssl)
  * @param client The client the error is associated with.
  */
 static int fatal_ssl_error(int ssl_error, int where, int my_errno, Client *client)
+{
+	return fatal_ssl_error_ex(ssl_error, where, my_errno, ERR_get_error(), client);
+}
+
+/** Report a fatal SSL error and disconnect the associated client.
+ * Same as fatal_ssl_error() but the caller has already fetched the
+ * error from the OpenSSL error queue. This is needed when the error
+ * happened in another thread, since the error queue is per-thread.
+ */
+static int fatal_ssl_error_ex(int ssl_error, int where, int my_errno, unsigned long additional_errno, Client *client)
 {
 	/* don`t alter ERRNO */
 	int errtmp = ERRNO;
 	char *ssl_errstr, *ssl_func;
-	unsigned long additional_errno = ERR_get_error();
 	char additional_info[256];
 	const char *one, *two;
 
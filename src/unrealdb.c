@@ -69,8 +69,18 @@
 static SecretCache *find_secret_cache(Secret *secr, UnrealDBConfig *cfg);
 static void unrealdb_add_to_secret_cache(Secret *secr, UnrealDBConfig *cfg);
 
-UnrealDBError unrealdb_last_error_code;
-static char *unrealdb_last_error_string = NULL;
+/* The last error is per thread, so a file that is written to from
+ * another thread (such as by the history backend) does not mess with
+ * the error state of the main thread. Note that unrealdb_open() must
+ * still be called from the main thread, due to the secret cache.
+ */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define UNREALDB_THREAD_LOCAL __thread
+#else
+#define UNREALDB_THREAD_LOCAL
+#endif
+UNREALDB_THREAD_LOCAL UnrealDBError unrealdb_last_error_code;
+static UNREALDB_THREAD_LOCAL char *unrealdb_last_error_string = NULL;
 
 /** Set error condition on unrealdb 'c' (internal function).
  * @param c		The unrealdb file handle
@@ -712,6 +712,7 @@ void make_cloakedhost(Client *client, char *curr, char *buf, size_t buflen)
 /** Called after a user is logged in (or out) of a services account */
 void user_account_login(MessageTag *recv_mtags, Client *client)
 {
+	user_identity_changed(client);
 	if (MyConnect(client))
 	{
 		find_shun(client);
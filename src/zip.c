@@ -0,0 +1,331 @@
+/************************************************************************
+ *   UnrealIRCd - Unreal Internet Relay Chat Daemon - src/zip.c
+ *   (c) 2021- Bram Matthys and The UnrealIRCd Team
+ *
+ *   See file AUTHORS in IRC package for additional names of
+ *   the programmers.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 1, or (at your option)
+ *   any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/** @file
+ * @brief Compressed server links (zlib), see link::options::compressed.
+ *
+ * Each direction is compressed independently. A server that wants to
+ * compress what it sends, and whose peer announced PROTOCTL ZIP, sends
+ * "PROTOCTL ZIPSTART" and everything after that line is one zlib stream.
+ * The sendQ keeps holding plain text, it is only compressed when it
+ * is written to the socket (or TLS), see zip_send_queued().
+ */
+
+#include "unrealircd.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+
+/** Size of the compressed output buffer, this is also the
+ * maximum size of a TLS record so it is written in one go.
+ */
+#define ZIP_BUFSIZE	16384
+
+/** Compression level, higher levels cost a lot more CPU for little gain */
+#define ZIP_LEVEL	6
+
+struct ZipStream {
+	z_stream stream;
+	unsigned long plain_left;	/**< Output: bytes of the sendQ that are still sent uncompressed */
+	int flush_pending;		/**< Output: a Z_SYNC_FLUSH did not fit in the buffer */
+	int outpos;			/**< Output: first byte of 'buf' that is not written yet */
+	int outlen;			/**< Output: number of bytes in 'buf' */
+	unsigned long long plain;	/**< Plain text bytes (before compression or after decompression) */
+	unsigned long long compressed;	/**< Compressed bytes */
+	char buf[ZIP_BUFSIZE];
+};
+
+/** Start compressing everything that is sent to 'client' from now on,
+ * that is: after what is in the sendQ now.
+ */
+void zip_start_out(Client *client)
+{
+	ZipStream *z;
+
+	if (client->local->zipout)
+		return;
+	z = safe_alloc(sizeof(ZipStream));
+	if (deflateInit(&z->stream, ZIP_LEVEL) != Z_OK)
+	{
+		safe_free(z);
+		dead_socket(client, "Unable to start compression");
+		return;
+	}
+	z->plain_left = DBufLength(&client->local->sendQ);
+	client->local->zipout = z;
+}
+
+/** Decompress 'len' bytes of 'data' from 'client' and add it to the recvQ.
+ * @returns 1 on success, 0 on error (the client is killed).
+ */
+static int zip_inflate(Client *client, char *data, int len, int process)
+{
+	ZipStream *z = client->local->zipin;
+	char out[ZIP_BUFSIZE];
+	int ret, n;
+
+	z->compressed += len;
+	z->stream.next_in = (Bytef *)data;
+	z->stream.avail_in = len;
+	do {
+		z->stream.next_out = (Bytef *)out;
+		z->stream.avail_out = sizeof(out);
+		ret = inflate(&z->stream, Z_SYNC_FLUSH);
+		if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+		{
+			dead_socket(client, (ret == Z_STREAM_END) ? "Compressed stream ended" : "Decompression error");
+			return 0;
+		}
+		n = sizeof(out) - z->stream.avail_out;
+		z->plain += n;
+		if (n > 0)
+		{
+			if (process)
+			{
+				if (!process_packet(client, out, n, 0))
+					return 0;
+			} else {
+				dbuf_put(&client->local->recvQ, out, n);
+			}
+		}
+	} while ((z->stream.avail_in > 0) || (z->stream.avail_out == 0));
+	return 1;
+}
+
+/** The data from 'client' is compressed from now on.
+ * This is called when "PROTOCTL ZIPSTART" is received, anything
+ * that is still in the recvQ after it is already compressed.
+ * @returns 1 on success, 0 on error (the client is killed).
+ */
+int zip_start_in(Client *client)
+{
+	ZipStream *z;
+	dbufbuf *block;
+	char *data;
+	int len;
+
+	if (client->local->zipin)
+		return 1;
+	z = safe_alloc(sizeof(ZipStream));
+	if (inflateInit(&z->stream) != Z_OK)
+	{
+		safe_free(z);
+		dead_socket(client, "Unable to start decompression");
+		return 0;
+	}
+	client->local->zipin = z;
+
+	/* Take out the rest of the recvQ and put it back decompressed */
+	len = DBufLength(&client->local->recvQ);
+	if (len == 0)
+		return 1;
+	data = safe_alloc(len);
+	len = 0;
+	list_for_each_entry(block, &client->local->recvQ.dbuf_list, dbuf_node)
+	{
+		memcpy(data + len, block->data, block->size);
+		len += block->size;
+	}
+	DBufClear(&client->local->recvQ);
+	if (!zip_inflate(client, data, len, 0))
+	{
+		safe_free(data);
+		return 0;
+	}
+	safe_free(data);
+	return 1;
+}
+
+/** Decompress data that was read from 'client' and process it.
+ * This is the equivalent of process_packet() for compressed links.
+ * @returns 1 in normal circumstances, 0 if client was killed.
+ */
+int zip_process_packet(Client *client, char *readbuf, int length)
+{
+	return zip_inflate(client, readbuf, length, 1);
+}
+
+/** Fill the output buffer from the sendQ.
+ * @returns 1 if there is something to write, 0 if not.
+ */
+static int zip_fill(Client *to)
+{
+	ZipStream *z = to->local->zipout;
+	dbufbuf *block;
+	int flush, consumed, n;
+
+	z->outpos = z->outlen = 0;
+
+	/* What was queued before "PROTOCTL ZIPSTART" (inclusive) goes out as-is */
+	while ((z->plain_left > 0) && (z->outlen < ZIP_BUFSIZE))
+	{
+		block = list_first_entry(&to->local->sendQ.dbuf_list, dbufbuf, dbuf_node);
+		n = MIN(MIN(block->size, z->plain_left), ZIP_BUFSIZE - z->outlen);
+		memcpy(z->buf + z->outlen, block->data, n);
+		z->outlen += n;
+		z->plain_left -= n;
+		to->local->sendblocks += dbuf_delete(&to->local->sendQ, n);
+	}
+	if (z->outlen > 0)
+		return 1;
+
+	z->stream.next_out = (Bytef *)z->buf;
+	z->stream.avail_out = ZIP_BUFSIZE;
+	while (z->stream.avail_out > 0)
+	{
+		if (DBufLength(&to->local->sendQ) > 0)
+		{
+			block = list_first_entry(&to->local->sendQ.dbuf_list, dbufbuf, dbuf_node);
+			/* Flush at the end of the sendQ, so the other side gets complete lines */
+			flush = (z->flush_pending || (block->size == DBufLength(&to->local->sendQ))) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+			z->stream.next_in = (Bytef *)block->data;
+			z->stream.avail_in = block->size;
+			deflate(&z->stream, flush);
+			consumed = block->size - z->stream.avail_in;
+			z->plain += consumed;
+			to->local->sendblocks += dbuf_delete(&to->local->sendQ, consumed);
+			if (flush == Z_SYNC_FLUSH)
+				z->flush_pending = (z->stream.avail_out == 0);
+		} else
+		if (z->flush_pending)
+		{
+			z->stream.next_in = NULL;
+			z->stream.avail_in = 0;
+			deflate(&z->stream, Z_SYNC_FLUSH);
+			z->flush_pending = (z->stream.avail_out == 0);
+		} else
+			break;
+	}
+	z->outlen = ZIP_BUFSIZE - z->stream.avail_out;
+	z->compressed += z->outlen;
+	return z->outlen > 0;
+}
+
+/** Write queued data to a compressed link, this is the equivalent
+ * of send_queued() for such links.
+ */
+int zip_send_queued(Client *to)
+{
+	ZipStream *z = to->local->zipout;
+	int rlen, want_read;
+
+	while ((z->outpos < z->outlen) || zip_fill(to))
+	{
+		if ((rlen = deliver_it(to, z->buf + z->outpos, z->outlen - z->outpos, &want_read)) < 0)
+		{
+			char buf[256];
+			snprintf(buf, 256, "Write error: %s", STRERROR(ERRNO));
+			return dead_socket(to, buf);
+		}
+		z->outpos += rlen;
+		to->local->lastsq = DBufLength(&to->local->sendQ) / 1024;
+
+		if (want_read)
+		{
+			/* See send_queued() */
+			fd_setselect(to->local->fd, FD_SELECT_READ, send_queued_cb, to);
+			fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
+			return 0;
+		}
+		fd_setselect(to->local->fd, FD_SELECT_READ, read_packet, to);
+		if (z->outpos < z->outlen)
+		{
+			/* incomplete write due to EWOULDBLOCK, reschedule */
+			fd_setselect(to->local->fd, FD_SELECT_WRITE, send_queued_cb, to);
+			return 0;
+		}
+	}
+
+	/* Nothing left to write, stop asking for write-ready notification. */
+	if (to->local->fd >= 0)
+		fd_setselect(to->local->fd, FD_SELECT_WRITE, NULL, to);
+
+	return (IsDeadSocket(to)) ? -1 : 0;
+}
+
+/** Get the compression statistics of a link.
+ * @returns 1 if the link is compressed (in any direction), 0 if not.
+ */
+int zip_link_stats(Client *client, ZipLinkStats *stats)
+{
+	memset(stats, 0, sizeof(ZipLinkStats));
+	if (!MyConnect(client) || (!client->local->zipout && !client->local->zipin))
+		return 0;
+	if (client->local->zipout)
+	{
+		stats->out_plain = client->local->zipout->plain;
+		stats->out_compressed = client->local->zipout->compressed;
+	}
+	if (client->local->zipin)
+	{
+		stats->in_plain = client->local->zipin->plain;
+		stats->in_compressed = client->local->zipin->compressed;
+	}
+	return 1;
+}
+
+/** Free the compression state of a client, called by free_client() */
+void zip_free(Client *client)
+{
+	if (client->local->zipout)
+	{
+		deflateEnd(&client->local->zipout->stream);
+		safe_free(client->local->zipout);
+	}
+	if (client->local->zipin)
+	{
+		inflateEnd(&client->local->zipin->stream);
+		safe_free(client->local->zipin);
+	}
+}
+#else
+/* Compiled without zlib: we never announce PROTOCTL ZIP so these are not used */
+void zip_start_out(Client *client)
+{
+}
+
+int zip_start_in(Client *client)
+{
+	dead_socket(client, "Compressed links are not supported");
+	return 0;
+}
+
+int zip_process_packet(Client *client, char *readbuf, int length)
+{
+	return process_packet(client, readbuf, length, 0);
+}
+
+int zip_send_queued(Client *to)
+{
+	return 0;
+}
+
+int zip_link_stats(Client *client, ZipLinkStats *stats)
+{
+	memset(stats, 0, sizeof(ZipLinkStats));
+	return 0;
+}
+
+void zip_free(Client *client)
+{
+}
+#endif